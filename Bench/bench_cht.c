@@ -0,0 +1,186 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+//
+// Measures how CHashTable throughput scales with the number of threads.
+//
+// usage: BenchCHT [max_threads] [num_keys] [ops_per_thread] [write_percent]
+//
+// The table is filled with @num_keys keys, then for 1, 2, 4, ... up to
+// @max_threads threads, every thread does @ops_per_thread operations on
+// random keys, @write_percent percent of which are inserts or removes
+// (the rest being lookups). The single threaded lookup throughput of a
+// plain HashTable is printed first for comparison.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../DataStructs/ConcurrentHashTable.h"
+#include "../DataStructs/HashTable.h"
+
+#define DEFAULT_NUM_KEYS 1000000
+#define DEFAULT_OPS_PER_THREAD 4000000
+#define DEFAULT_WRITE_PERCENT 0
+
+typedef struct bench_thread {
+  CHashTable         table;
+  pthread_barrier_t *start;
+  uint64_t           seed;
+  uint64_t           num_keys;
+  uint64_t           num_ops;
+  uint32_t           write_percent;
+  uint64_t           found;  // keeps the lookups from being optimized out
+} BenchThread;
+
+// Values are never looked at, so they are not allocated.
+static void NullFree(HashTabVal_t value) { }
+
+// A xorshift generator, so threads don't share the state of rand().
+static uint64_t NextRandom(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+static double Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *RunThread(void *arg) {
+  BenchThread *bt = arg;
+  CHTThread thread;
+  HashTabKV kv;
+
+  if (CHTRegisterThread(bt->table, &thread) != 1) {
+    fprintf(stderr, "could not register thread\n");
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_barrier_wait(bt->start);
+  for (uint64_t i = 0; i < bt->num_ops; i++) {
+    uint64_t r = NextRandom(&bt->seed);
+    HashTabKey_t key = r % bt->num_keys;
+    if ((r >> 32) % 100 < bt->write_percent) {
+      if (r & (1ULL << 31)) {
+        kv.key = key;
+        kv.value = (HashTabVal_t)key;
+        CHTInsert(bt->table, thread, kv);
+      } else {
+        CHTRemove(bt->table, thread, key);
+      }
+    } else {
+      bt->found += CHTLookup(bt->table, thread, key, &kv);
+    }
+  }
+  return NULL;
+}
+
+// Runs one round with @num_threads threads on a freshly filled table.
+//
+// Returns the throughput in millions of operations per second.
+static double RunRound(uint32_t num_threads,
+                       uint64_t num_keys,
+                       uint64_t num_ops,
+                       uint32_t write_percent) {
+  CHashTable table = MakeCHashTable(num_keys / 3 + 1, num_threads + 1, &NullFree);
+  CHTThread filler;
+  HashTabKV kv;
+  pthread_t threads[num_threads];
+  BenchThread args[num_threads];
+  pthread_barrier_t start;
+
+  if (table == NULL || CHTRegisterThread(table, &filler) != 1) {
+    fprintf(stderr, "could not make table\n");
+    exit(EXIT_FAILURE);
+  }
+  for (uint64_t i = 0; i < num_keys; i++) {
+    kv.key = i;
+    kv.value = (HashTabVal_t)i;
+    CHTInsert(table, filler, kv);
+  }
+
+  pthread_barrier_init(&start, NULL, num_threads + 1);
+  for (uint32_t i = 0; i < num_threads; i++) {
+    args[i] = (BenchThread){ table, &start, 0x9e3779b97f4a7c15ULL * (i + 1),
+                             num_keys, num_ops, write_percent, 0 };
+    pthread_create(&threads[i], NULL, &RunThread, &args[i]);
+  }
+  pthread_barrier_wait(&start);
+  double begin = Now();
+  for (uint32_t i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  double elapsed = Now() - begin;
+
+  pthread_barrier_destroy(&start);
+  FreeCHashTable(table);
+  return (num_ops * num_threads) / elapsed / 1e6;
+}
+
+// The single threaded lookup throughput of a HashTable, in millions of
+// operations per second.
+static double RunHashTable(uint64_t num_keys, uint64_t num_ops) {
+  HashTable table = MakeHashTable(num_keys / 3 + 1);
+  HashTabKV kv;
+  uint64_t seed = 0x9e3779b97f4a7c15ULL, found = 0;
+
+  for (uint64_t i = 0; i < num_keys; i++) {
+    kv.key = i;
+    kv.value = (HashTabVal_t)i;
+    HTInsert(table, kv, &kv);
+  }
+
+  double begin = Now();
+  for (uint64_t i = 0; i < num_ops; i++) {
+    found += HTLookup(table, NextRandom(&seed) % num_keys, &kv);
+  }
+  double elapsed = Now() - begin;
+
+  FreeHashTable(table, &NullFree);
+  return found == 0 ? 0 : num_ops / elapsed / 1e6;
+}
+
+int main(int argc, char **argv) {
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t max_threads = argc > 1 ? atoi(argv[1]) : (num_cpus > 0 ? num_cpus : 1);
+  uint64_t num_keys = argc > 2 ? strtoull(argv[2], NULL, 10) : DEFAULT_NUM_KEYS;
+  uint64_t num_ops = argc > 3 ? strtoull(argv[3], NULL, 10)
+                              : DEFAULT_OPS_PER_THREAD;
+  uint32_t write_percent = argc > 4 ? atoi(argv[4]) : DEFAULT_WRITE_PERCENT;
+
+  if (max_threads == 0 || num_keys == 0 || write_percent > 100) {
+    fprintf(stderr, "usage: %s [max_threads] [num_keys] [ops_per_thread] "
+                    "[write_percent]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  printf("%lu keys, %lu ops per thread, %u%% writes, %ld cpus\n",
+         num_keys, num_ops, write_percent, num_cpus);
+  printf("HashTable, 1 thread: %.2f Mops/s\n\n",
+         RunHashTable(num_keys, num_ops));
+
+  printf("%8s %12s %10s %12s\n", "threads", "Mops/s", "speedup", "efficiency");
+  double base = 0;
+  for (uint32_t t = 1; ; t = (t * 2 > max_threads && t < max_threads)
+                              ? max_threads : t * 2) {
+    double mops = RunRound(t, num_keys, num_ops, write_percent);
+    if (t == 1) {
+      base = mops;
+    }
+    printf("%8u %12.2f %9.2fx %11.0f%%\n",
+           t, mops, mops / base, 100 * mops / base / t);
+    if (t >= max_threads) {
+      break;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
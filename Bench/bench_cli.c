@@ -0,0 +1,455 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+//
+// Measures how the commands of Checkpoint scale with the number of files
+// tracked and with the size and shape of their checkpoint trees.
+//
+// usage: BenchCLI <path to Checkpoint> [--full] [--json] [--reps <n>]
+//
+// For each scenario, a working dir is generated in a scratch dir under
+// /tmp: the log is built in memory and written with WriteCheckPointLog,
+// so even a history of a million checkpoints takes seconds to set up.
+// Only the checkpoint files the commands read are written (those of the
+// current checkpoint of the first file, its parent, and the root).
+// Then, @reps times, the first file is given a new checkpoint (create),
+// sent back to its parent (back), swapped to the root and back to where
+// it was (swapto), and everything is listed (list), after which it is
+// deleted (delete) once.
+//
+// Each run of Checkpoint records the time it spent reading the log
+// (setup), running the command, and writing the log back (write), see
+// checkpoint_stats.h. The median of each, and of the wall time of the
+// whole run, is printed for every command of every scenario, as CSV (or
+// JSON with --json). --full adds the scenarios of a million checkpoints.
+
+#define _XOPEN_SOURCE 700
+
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "../checkpoint_filehandler.h"
+#include "../checkpoint_stats.h"
+
+#define DEFAULT_REPS 3
+
+// Each run appends its phase times here (in the scratch dir).
+#define PHASE_TIMES_FILE "phase_times"
+
+// The lines of every generated source and checkpoint file.
+#define SRC_LINES 20
+
+#define MAX_NAME_LEN 64
+
+typedef struct bench_scenario {
+  const char *name;
+  uint32_t    num_files;
+  uint32_t    cpts_per_file;
+  // The number of children each checkpoint is given before the next one
+  // is (1 makes a chain).
+  uint32_t    fanout;
+  bool        full_only;  // only run with --full
+} BenchScenario;
+
+static const BenchScenario scenarios[] = {
+  { "files_1",    1,      8,       1,  false },
+  { "files_100",  100,    8,       1,  false },
+  { "files_10k",  10000,  8,       1,  false },
+  { "files_100k", 100000, 8,       1,  false },
+  { "chain_1k",   1,      1000,    1,  false },
+  { "chain_100k", 1,      100000,  1,  false },
+  { "chain_1M",   1,      1000000, 1,  true  },
+  { "bushy_100k", 1,      100000,  16, false },
+  { "bushy_1M",   1,      1000000, 16, true  },
+};
+
+#define NUM_SCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+// The commands run on each scenario, in the order they are run. The
+// first five are run @reps times, delete only once.
+#define CMD_CREATE      0
+#define CMD_BACK        1
+#define CMD_SWAPTO_ROOT 2
+#define CMD_SWAPTO_LEAF 3
+#define CMD_LIST        4
+#define CMD_DELETE      5
+#define NUM_CMDS        6
+
+static const char *cmd_names[NUM_CMDS] = {
+  "create", "back", "swapto_root", "swapto_leaf", "list", "delete"
+};
+
+// The times of every run of one command, in seconds.
+typedef struct bench_samples {
+  double   *phases[STATS_NUM_PHASES];
+  double   *wall;
+  uint32_t  num;
+} BenchSamples;
+
+static double Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Names checkpoint @n of file @file.
+static void CptName(uint32_t file, uint32_t n, char *name) {
+  snprintf(name, MAX_NAME_LEN, "f%u_%u", file, n);
+}
+
+static void SrcName(uint32_t file, char *name) {
+  snprintf(name, MAX_NAME_LEN, "f%u.txt", file);
+}
+
+static int32_t WriteLines(const char *path, const char *tag) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    return -1;
+  }
+  for (uint32_t i = 0; i < SRC_LINES; i++) {
+    fprintf(f, "%s line %u\n", tag, i);
+  }
+  return fclose(f) == 0 ? 0 : -1;
+}
+
+static int32_t WriteCptFile(const char *cpt_name) {
+  char path[sizeof(WORKING_DIR) + MAX_NAME_LEN + 1];
+  snprintf(path, sizeof(path), "%s/%s", WORKING_DIR, cpt_name);
+  return WriteLines(path, cpt_name);
+}
+
+static int32_t InsertCopy(HashTable table, const char *key, const char *value) {
+  HashTabKV old;
+  char *copy = CopyLogString(value);
+  if (copy == NULL) {
+    return MEM_ERR;
+  }
+  if (HTInsertStr(table, key, copy, &old) != 1) {
+    FreeLogString(copy);
+    return MEM_ERR;
+  }
+  return 0;
+}
+
+// Generates the working dir of @sc in the current dir. The name of the
+// checkpoint the first file is at, and the depth of it, are returned
+// through @leaf and @depth.
+static int32_t Generate(const BenchScenario *sc, char *leaf, uint32_t *depth) {
+  CheckPointLog log;
+  CpTreePtr tree;
+  CpTreeHandle *handles;
+  char src[MAX_NAME_LEN], name[MAX_NAME_LEN];
+  int64_t start = time(NULL) - sc->cpts_per_file;
+  int32_t res = 0;
+
+  if (mkdir(WORKING_DIR, S_IRWXU) != 0 ||
+      ReadCheckPointLog(&log) != READ_SUCCESS) {
+    return -1;
+  }
+  if ((handles = malloc(sizeof(CpTreeHandle) * sc->cpts_per_file)) == NULL) {
+    return MEM_ERR;
+  }
+
+  for (uint32_t f = 0; f < sc->num_files && res == 0; f++) {
+    SrcName(f, src);
+    CptName(f, 0, name);
+    if (CreateCpTree(name, &tree) != CREATE_TREE_SUCCESS) {
+      res = MEM_ERR;
+      break;
+    }
+    handles[0] = CPT_ROOT_HANDLE;
+    SetCpTreeNodeStamp(tree, CPT_ROOT_HANDLE, start, SRC_LINES);
+    res = InsertCopy(log.cpt_namehash_to_cptfilename, name, name);
+    for (uint32_t n = 1; n < sc->cpts_per_file && res == 0; n++) {
+      CptName(f, n, name);
+      if (InsertCpTreeNode(tree, handles[(n - 1) / sc->fanout], name,
+                           &handles[n]) != INSERT_NODE_SUCCESS) {
+        res = MEM_ERR;
+        break;
+      }
+      SetCpTreeNodeStamp(tree, handles[n], start + n, SRC_LINES);
+      res = InsertCopy(log.cpt_namehash_to_cptfilename, name, name);
+    }
+
+    HashTabKV old;
+    if (HTInsertStr(log.dir_tree, src, tree, &old) != 1) {
+      FreeCpTree(tree);
+      res = MEM_ERR;
+    }
+    if (res == 0) {
+      res = InsertCopy(log.src_filehash_to_filename, src, src);
+    }
+    if (res == 0) {
+      res = InsertCopy(log.src_filehash_to_cptname, src, name);
+    }
+  }
+  free(handles);
+
+  // Only the first file is ever touched.
+  uint32_t last = sc->cpts_per_file - 1;
+  CptName(0, last, leaf);
+  *depth = 0;
+  for (uint32_t n = last; n != 0; n = (n - 1) / sc->fanout) {
+    (*depth)++;
+  }
+  if (res == 0) {
+    SrcName(0, src);
+    res = WriteLines(src, leaf);
+  }
+  if (res == 0) {
+    CptName(0, 0, name);
+    res = WriteCptFile(name);
+  }
+  if (res == 0 && last != 0) {
+    CptName(0, (last - 1) / sc->fanout, name);
+    res = WriteCptFile(name) || WriteCptFile(leaf);
+  }
+  if (res == 0 && WriteCheckPointLog(&log) < 0) {
+    res = -1;
+  }
+
+  FreeHashTable(log.src_filehash_to_filename, &FreeLogString);
+  FreeHashTable(log.src_filehash_to_cptname, &FreeLogString);
+  FreeHashTable(log.cpt_namehash_to_cptfilename, &FreeLogString);
+  FreeHashTable(log.dir_tree, &FreeCpTree);
+  return res;
+}
+
+// Runs @exe with the arguments @args (@args[0] being the command), with
+// its output thrown away. The time of each phase of the run, then its
+// wall time, are added to @samples.
+static int32_t Run(const char *exe, char **args, BenchSamples *samples) {
+  double phases[STATS_NUM_PHASES], start;
+  FILE *f;
+  pid_t pid;
+  int status, null_fd;
+
+  // Only the line of this run is to be read back.
+  if (truncate(PHASE_TIMES_FILE, 0) != 0 &&
+      access(PHASE_TIMES_FILE, F_OK) == 0) {
+    return -1;
+  }
+
+  start = Now();
+  if ((pid = fork()) < 0) {
+    return -1;
+  } else if (pid == 0) {
+    char *argv[8] = { (char *)exe };
+    for (uint32_t i = 0; args[i] != NULL && i < 6; i++) {
+      argv[i + 1] = args[i];
+    }
+    if ((null_fd = open("/dev/null", O_WRONLY)) >= 0) {
+      dup2(null_fd, STDOUT_FILENO);
+      dup2(null_fd, STDERR_FILENO);
+    }
+    execv(exe, argv);
+    _exit(127);
+  }
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    return -1;
+  }
+
+  uint32_t n = samples->num;
+  samples->wall[n] = Now() - start;
+  if ((f = fopen(PHASE_TIMES_FILE, "r")) == NULL) {
+    return -1;
+  }
+  status = fscanf(f, "%*[^,],%lf,%lf,%lf",
+                  &phases[STATS_PHASE_SETUP],
+                  &phases[STATS_PHASE_COMMAND],
+                  &phases[STATS_PHASE_WRITE]);
+  fclose(f);
+  if (status != STATS_NUM_PHASES) {
+    return -1;
+  }
+  for (int32_t i = 0; i < STATS_NUM_PHASES; i++) {
+    samples->phases[i][n] = phases[i];
+  }
+  samples->num++;
+  return 0;
+}
+
+static int CompareDoubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double Median(double *values, uint32_t num) {
+  qsort(values, num, sizeof(double), &CompareDoubles);
+  if (num % 2) {
+    return values[num / 2];
+  }
+  return (values[num / 2 - 1] + values[num / 2]) / 2;
+}
+
+static void PrintResult(const BenchScenario *sc,
+                        uint32_t depth,
+                        uint32_t cmd,
+                        BenchSamples *samples,
+                        bool json,
+                        bool *first) {
+  double phases[STATS_NUM_PHASES], wall;
+  for (int32_t i = 0; i < STATS_NUM_PHASES; i++) {
+    phases[i] = Median(samples->phases[i], samples->num);
+  }
+  wall = Median(samples->wall, samples->num);
+
+  if (json) {
+    printf("%s  {\"scenario\": \"%s\", \"files\": %u, \"checkpoints\": %llu, "
+           "\"depth\": %u, \"command\": \"%s\", \"runs\": %u, "
+           "\"setup_s\": %.6f, \"command_s\": %.6f, \"write_s\": %.6f, "
+           "\"wall_s\": %.6f}",
+           *first ? "" : ",\n", sc->name, sc->num_files,
+           (unsigned long long)sc->num_files * sc->cpts_per_file, depth,
+           cmd_names[cmd], samples->num, phases[STATS_PHASE_SETUP],
+           phases[STATS_PHASE_COMMAND], phases[STATS_PHASE_WRITE], wall);
+  } else {
+    printf("%s,%u,%llu,%u,%s,%u,%.6f,%.6f,%.6f,%.6f\n",
+           sc->name, sc->num_files,
+           (unsigned long long)sc->num_files * sc->cpts_per_file, depth,
+           cmd_names[cmd], samples->num, phases[STATS_PHASE_SETUP],
+           phases[STATS_PHASE_COMMAND], phases[STATS_PHASE_WRITE], wall);
+  }
+  *first = false;
+  fflush(stdout);
+}
+
+static int RemoveEntry(const char *path,
+                       const struct stat *sb,
+                       int flag,
+                       struct FTW *ftw) {
+  return remove(path);
+}
+
+// Runs every command on @sc, in a scratch dir of its own.
+static int32_t RunScenario(const char *exe,
+                           const BenchScenario *sc,
+                           uint32_t reps,
+                           bool json,
+                           bool *first) {
+  BenchSamples samples[NUM_CMDS];
+  char dir[] = "/tmp/cpt_bench_XXXXXX";
+  char src[MAX_NAME_LEN], root[MAX_NAME_LEN], leaf[MAX_NAME_LEN];
+  char new_cpt[MAX_NAME_LEN];
+  uint32_t depth;
+  int32_t res = 0;
+  double start;
+
+  if (mkdtemp(dir) == NULL || chdir(dir) != 0) {
+    fprintf(stderr, "could not make a scratch dir\n");
+    return -1;
+  }
+  memset(samples, 0, sizeof(samples));
+  for (uint32_t c = 0; c < NUM_CMDS; c++) {
+    for (int32_t i = 0; i < STATS_NUM_PHASES; i++) {
+      samples[c].phases[i] = malloc(sizeof(double) * reps);
+    }
+    samples[c].wall = malloc(sizeof(double) * reps);
+  }
+
+  start = Now();
+  if (Generate(sc, leaf, &depth) != 0) {
+    fprintf(stderr, "%s: could not generate the working dir\n", sc->name);
+    res = -1;
+  } else {
+    fprintf(stderr, "%s: generated in %.2fs\n", sc->name, Now() - start);
+  }
+  SrcName(0, src);
+  CptName(0, 0, root);
+
+  for (uint32_t r = 0; r < reps && res == 0; r++) {
+    snprintf(new_cpt, MAX_NAME_LEN, "bench_%u", r);
+    char *runs[][4] = {
+      { "create", src, new_cpt, NULL },
+      { "back", src, NULL },
+      { "swapto", src, root, NULL },
+      { "swapto", src, leaf, NULL },
+      { "list", NULL },
+    };
+    for (uint32_t c = 0; c < CMD_DELETE && res == 0; c++) {
+      if ((res = Run(exe, runs[c], &samples[c])) != 0) {
+        fprintf(stderr, "%s: %s failed\n", sc->name, cmd_names[c]);
+      }
+    }
+  }
+  if (res == 0) {
+    char *run[] = { "delete", src, NULL };
+    if ((res = Run(exe, run, &samples[CMD_DELETE])) != 0) {
+      fprintf(stderr, "%s: delete failed\n", sc->name);
+    }
+  }
+
+  for (uint32_t c = 0; c < NUM_CMDS; c++) {
+    if (res == 0) {
+      PrintResult(sc, depth, c, &samples[c], json, first);
+    }
+    for (int32_t i = 0; i < STATS_NUM_PHASES; i++) {
+      free(samples[c].phases[i]);
+    }
+    free(samples[c].wall);
+  }
+
+  if (chdir("/") != 0 ||
+      nftw(dir, &RemoveEntry, 16, FTW_DEPTH | FTW_PHYS) != 0) {
+    fprintf(stderr, "could not remove %s\n", dir);
+  }
+  return res;
+}
+
+int main(int argc, char *argv[]) {
+  char *exe;
+  uint32_t reps = DEFAULT_REPS;
+  bool full = false, json = false, first = true;
+  int32_t failed = 0;
+
+  if (argc < 2) {
+    fprintf(stderr,
+            "usage: BenchCLI <path to Checkpoint> [--full] [--json] "
+            "[--reps <n>]\n");
+    return EXIT_FAILURE;
+  }
+  for (int32_t i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--full") == 0) {
+      full = true;
+    } else if (strcmp(argv[i], "--json") == 0) {
+      json = true;
+    } else if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc &&
+               atoi(argv[i + 1]) > 0) {
+      reps = atoi(argv[++i]);
+    } else {
+      fprintf(stderr, "unknown option %s\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+  // The scenarios are run from scratch dirs.
+  if ((exe = realpath(argv[1], NULL)) == NULL) {
+    fprintf(stderr, "could not find %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  setenv(STATS_PHASE_TIMES_ENV, PHASE_TIMES_FILE, 1);
+
+  if (json) {
+    printf("[\n");
+  } else {
+    printf("scenario,files,checkpoints,depth,command,runs,"
+           "setup_s,command_s,write_s,wall_s\n");
+  }
+  for (uint32_t s = 0; s < NUM_SCENARIOS; s++) {
+    if (!scenarios[s].full_only || full) {
+      failed |= RunScenario(exe, &scenarios[s], reps, json, &first);
+    }
+  }
+  if (json) {
+    printf("\n]\n");
+  }
+
+  free(exe);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
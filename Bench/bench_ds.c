@@ -0,0 +1,519 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+//
+// Measures the throughput, latency and allocations of each operation of
+// HashTable and LinkedList, for 10 up to @max_keys elements.
+//
+// usage: BenchDS [max_keys] [--str] [--arena]
+//
+// The HashTable is measured presized for a load factor of 0.5, 1 and 2
+// elements per bucket (below the 3 at which it grows), and grown from
+// GROW_BUCKETS buckets, which is how the checkpoint log's tables are
+// filled. With --str its keys are strings rather than numbers. Only the
+// API of HashTable.h is used, so another implementation of it can be
+// measured the same way by building with `make bench_ds HT_IMPL=<file>`.
+//
+// Every operation is run twice: once without timers, for its throughput
+// and the number of mallocs and frees per operation, and once with each
+// call timed, for the percentiles of its latency (which include around
+// the timer overhead printed at the start). Small sizes are run over
+// and over until at least MIN_OPS calls have been made. Calls to malloc
+// are counted by having the linker wrap them (-Wl,--wrap=malloc, etc.,
+// see the Makefile), and the bytes allocated by counting allocators
+// (see DataStructs/Allocator.h), which only see the allocations of an
+// implementation which goes through CPMalloc.
+//
+// With --arena, both structures allocate from an arena instead of with
+// malloc. An arena only frees everything at once, so whenever the table
+// or the list is made anew, both are thrown away and the arena is reset.
+//
+// A line of CSV is printed for each operation, size and load factor.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "../DataStructs/Allocator.h"
+#include "../DataStructs/HashTable.h"
+#include "../DataStructs/LinkedList.h"
+
+#define DEFAULT_MAX_KEYS 1000000
+
+// The fewest calls made to measure an operation.
+#define MIN_OPS 1000000
+
+// The number of buckets a grown table starts with (INITIAL_BUCKET_COUNT,
+// as the checkpoint log's tables do).
+#define GROW_BUCKETS 10
+
+// The room given to each string key (16 hex digits and a null).
+#define STR_KEY_LEN 24
+
+// The size of the chunks of the arena, with --arena.
+#define ARENA_CHUNK_SIZE (1 << 20)
+
+// Everything an operation works on.
+typedef struct bench_state {
+  HashTable   table;
+  HTIter      ht_iter;
+  LinkedList  list;
+  LLIter      ll_iter;
+  CPSize_t    buckets;     // what new tables are made with
+  uint64_t    num_keys;
+  uint64_t   *keys;        // in the table once it is full
+  uint64_t   *miss_keys;   // never in the table
+  char       *str_keys;    // keys[i] as a string, if str is true
+  char       *str_misses;
+  bool        str;
+  CPArena     arena;       // what both structures allocate from, or NULL
+  uint64_t    sink;        // keeps results from being optimized out
+} BenchState;
+
+// An operation: @setup gets @state ready for calls 0 to num_keys - 1 of
+// @run, which are then made in order.
+typedef struct bench_op {
+  const char *name;
+  void      (*setup)(BenchState *state);
+  void      (*run)(BenchState *state, uint64_t i);
+} BenchOp;
+
+static uint64_t num_mallocs, num_frees;
+
+// Count the bytes the list and the table allocate.
+static CPCountingAllocator list_counter, table_counter;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t num, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size) {
+  num_mallocs++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t num, size_t size) {
+  num_mallocs++;
+  return __real_calloc(num, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  num_mallocs++;
+  return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr) {
+  if (ptr != NULL) {
+    num_frees++;
+  }
+  __real_free(ptr);
+}
+
+// Values are never allocated.
+static void NullFree(void *value) { }
+
+// Returns the bytes the list and table have allocated so far.
+static uint64_t AllocatedBytes() {
+  CPAllocCounts list, table;
+  CountingAllocatorCounts(list_counter, &list);
+  CountingAllocatorCounts(table_counter, &table);
+  return list.bytes + table.bytes;
+}
+
+// With --arena, throws away the table and the list (and their
+// iterators), and empties the arena. Returns false without --arena.
+static bool ResetBenchArena(BenchState *state) {
+  if (state->arena == NULL) {
+    return false;
+  }
+  state->table = NULL;
+  state->ht_iter = NULL;
+  state->list = NULL;
+  state->ll_iter = NULL;
+  ResetArena(state->arena);
+  return true;
+}
+
+static uint64_t NextRandom(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+static double Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *StrKey(const char *keys, uint64_t i) {
+  return keys + i * STR_KEY_LEN;
+}
+
+static void Insert(BenchState *state, uint64_t i) {
+  HashTabKV kv = { state->keys[i], (HashTabVal_t)i }, old;
+  if (state->str) {
+    HTInsertStr(state->table, StrKey(state->str_keys, i), kv.value, &old);
+  } else {
+    HTInsert(state->table, kv, &old);
+  }
+}
+
+static void Lookup(BenchState *state, uint64_t i) {
+  HashTabKV kv;
+  if (state->str) {
+    state->sink += HTLookupStr(state->table, StrKey(state->str_keys, i), &kv);
+  } else {
+    state->sink += HTLookup(state->table, state->keys[i], &kv);
+  }
+}
+
+static void LookupMiss(BenchState *state, uint64_t i) {
+  HashTabKV kv;
+  if (state->str) {
+    state->sink += HTLookupStr(state->table,
+                               StrKey(state->str_misses, i), &kv);
+  } else {
+    state->sink += HTLookup(state->table, state->miss_keys[i], &kv);
+  }
+}
+
+static void Remove(BenchState *state, uint64_t i) {
+  HashTabKV kv;
+  if (state->str) {
+    state->sink += HTRemoveStr(state->table, StrKey(state->str_keys, i), &kv);
+  } else {
+    state->sink += HTRemove(state->table, state->keys[i], &kv);
+  }
+}
+
+static void IterateTable(BenchState *state, uint64_t i) {
+  HashTabKV kv;
+  HTIterKV(state->ht_iter, &kv);
+  state->sink += kv.key;
+  HTIncrementIter(state->ht_iter);
+}
+
+static void ResetTable(BenchState *state) {
+  if (!ResetBenchArena(state)) {
+    if (state->ht_iter != NULL) {
+      DiscardHTIter(state->ht_iter);
+      state->ht_iter = NULL;
+    }
+    if (state->table != NULL) {
+      FreeHashTable(state->table, &NullFree);
+    }
+  }
+  state->table = state->str ? MakeStrHashTable(state->buckets)
+                            : MakeHashTable(state->buckets);
+  if (state->table == NULL) {
+    fprintf(stderr, "could not make table\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void SetupEmptyTable(BenchState *state) {
+  ResetTable(state);
+}
+
+// Lookups leave the table as it is, so it is only filled if it isn't
+// already full.
+static void SetupFullTable(BenchState *state) {
+  if (state->table == NULL || HTSize(state->table) != state->num_keys) {
+    ResetTable(state);
+    for (uint64_t i = 0; i < state->num_keys; i++) {
+      Insert(state, i);
+    }
+  }
+}
+
+static void SetupIterTable(BenchState *state) {
+  SetupFullTable(state);
+  if (state->ht_iter != NULL) {
+    DiscardHTIter(state->ht_iter);
+  }
+  state->ht_iter = MakeHTIter(state->table);
+}
+
+static void Push(BenchState *state, uint64_t i) {
+  LLPush(state->list, (LinkedListPayload)i);
+}
+
+static void Append(BenchState *state, uint64_t i) {
+  LLAppend(state->list, (LinkedListPayload)i);
+}
+
+static void Pop(BenchState *state, uint64_t i) {
+  LinkedListPayload payload;
+  state->sink += LLPop(state->list, &payload);
+}
+
+static void IterateList(BenchState *state, uint64_t i) {
+  LinkedListPayload payload;
+  LLIterPayload(state->ll_iter, &payload);
+  state->sink += (uint64_t)payload;
+  LLIterAdvance(state->ll_iter);
+}
+
+static void ResetList(BenchState *state) {
+  if (!ResetBenchArena(state)) {
+    if (state->ll_iter != NULL) {
+      LLIterFree(state->ll_iter);
+      state->ll_iter = NULL;
+    }
+    if (state->list != NULL) {
+      FreeLinkedList(state->list, &NullFree);
+    }
+  }
+  if ((state->list = MakeLinkedList()) == NULL) {
+    fprintf(stderr, "could not make list\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void SetupEmptyList(BenchState *state) {
+  ResetList(state);
+}
+
+static void SetupFullList(BenchState *state) {
+  ResetList(state);
+  for (uint64_t i = 0; i < state->num_keys; i++) {
+    LLAppend(state->list, (LinkedListPayload)i);
+  }
+}
+
+static void SetupIterList(BenchState *state) {
+  SetupFullList(state);
+  state->ll_iter = LLGetIter(state->list, 0);
+}
+
+static const BenchOp table_ops[] = {
+  { "insert",      &SetupEmptyTable, &Insert       },
+  { "lookup_hit",  &SetupFullTable,  &Lookup       },
+  { "lookup_miss", &SetupFullTable,  &LookupMiss   },
+  { "iterate",     &SetupIterTable,  &IterateTable },
+  { "remove",      &SetupFullTable,  &Remove       },
+};
+
+static const BenchOp list_ops[] = {
+  { "push",    &SetupEmptyList, &Push        },
+  { "append",  &SetupEmptyList, &Append      },
+  { "pop",     &SetupFullList,  &Pop         },
+  { "iterate", &SetupIterList,  &IterateList },
+};
+
+#define NUM_TABLE_OPS (sizeof(table_ops) / sizeof(table_ops[0]))
+#define NUM_LIST_OPS (sizeof(list_ops) / sizeof(list_ops[0]))
+
+static int CompareLatencies(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Returns the @p-th quantile of the sorted @latencies.
+static uint32_t Quantile(uint32_t *latencies, uint64_t num, double p) {
+  return latencies[(uint64_t)(p * (num - 1))];
+}
+
+// Measures @op on @state, and prints the results as a line of CSV.
+static void Measure(BenchState *state,
+                    const char *structure,
+                    const char *load,
+                    const BenchOp *op) {
+  uint64_t n = state->num_keys;
+  uint64_t rounds = n >= MIN_OPS ? 1 : (MIN_OPS + n - 1) / n;
+  uint64_t mallocs = 0, frees = 0, bytes = 0;
+  uint32_t *latencies = malloc(sizeof(uint32_t) * n * rounds);
+  double elapsed = 0, start;
+
+  if (latencies == NULL) {
+    fprintf(stderr, "could not allocate latencies\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (uint64_t r = 0; r < rounds; r++) {
+    op->setup(state);
+    uint64_t m = num_mallocs, f = num_frees, b = AllocatedBytes();
+    start = Now();
+    for (uint64_t i = 0; i < n; i++) {
+      op->run(state, i);
+    }
+    elapsed += Now() - start;
+    mallocs += num_mallocs - m;
+    frees += num_frees - f;
+    bytes += AllocatedBytes() - b;
+  }
+
+  for (uint64_t r = 0; r < rounds; r++) {
+    op->setup(state);
+    for (uint64_t i = 0; i < n; i++) {
+      start = Now();
+      op->run(state, i);
+      latencies[r * n + i] = (Now() - start) * 1e9;
+    }
+  }
+  qsort(latencies, n * rounds, sizeof(uint32_t), &CompareLatencies);
+
+  printf("%s,%lu,%s,%s,%lu,%.2f,%u,%u,%u,%u,%u,%.3f,%.3f,%.1f\n",
+         structure, n, load, op->name, n * rounds,
+         n * rounds / elapsed / 1e6,
+         Quantile(latencies, n * rounds, 0.5),
+         Quantile(latencies, n * rounds, 0.9),
+         Quantile(latencies, n * rounds, 0.99),
+         Quantile(latencies, n * rounds, 0.999),
+         latencies[n * rounds - 1],
+         (double)mallocs / (n * rounds), (double)frees / (n * rounds),
+         (double)bytes / (n * rounds));
+  fflush(stdout);
+  free(latencies);
+}
+
+// Measures how long HTReserve takes to make room in a full table for
+// four times as many elements (which moves every element), and prints
+// the elements moved per second as a line of CSV.
+static void MeasureReserve(BenchState *state, const char *load) {
+  uint64_t m, f, b;
+  double start, elapsed;
+
+  ResetTable(state);
+  for (uint64_t i = 0; i < state->num_keys; i++) {
+    Insert(state, i);
+  }
+  m = num_mallocs;
+  f = num_frees;
+  b = AllocatedBytes();
+  start = Now();
+  HTReserve(state->table, state->num_keys * 4);
+  elapsed = Now() - start;
+  printf("hashtable%s,%lu,%s,reserve_4x,%lu,%.2f,,,,,%.0f,%.3f,%.3f,%.1f\n",
+         state->str ? "_str" : "", state->num_keys, load, state->num_keys,
+         state->num_keys / elapsed / 1e6, elapsed * 1e9,
+         (double)(num_mallocs - m) / state->num_keys,
+         (double)(num_frees - f) / state->num_keys,
+         (double)(AllocatedBytes() - b) / state->num_keys);
+  fflush(stdout);
+}
+
+static void MakeKeys(BenchState *state, uint64_t max_keys) {
+  uint64_t seed = 0x9e3779b97f4a7c15ULL;
+
+  state->keys = malloc(sizeof(uint64_t) * max_keys);
+  state->miss_keys = malloc(sizeof(uint64_t) * max_keys);
+  if (state->keys == NULL || state->miss_keys == NULL) {
+    fprintf(stderr, "could not allocate keys\n");
+    exit(EXIT_FAILURE);
+  }
+  // Odd keys are in the table and even ones aren't, so misses never hit.
+  for (uint64_t i = 0; i < max_keys; i++) {
+    state->keys[i] = NextRandom(&seed) | 1;
+    state->miss_keys[i] = NextRandom(&seed) & ~1ULL;
+  }
+  if (!state->str) {
+    return;
+  }
+
+  state->str_keys = malloc(STR_KEY_LEN * max_keys);
+  state->str_misses = malloc(STR_KEY_LEN * max_keys);
+  if (state->str_keys == NULL || state->str_misses == NULL) {
+    fprintf(stderr, "could not allocate keys\n");
+    exit(EXIT_FAILURE);
+  }
+  for (uint64_t i = 0; i < max_keys; i++) {
+    snprintf(state->str_keys + i * STR_KEY_LEN, STR_KEY_LEN, "%016lx",
+             state->keys[i]);
+    snprintf(state->str_misses + i * STR_KEY_LEN, STR_KEY_LEN, "%016lx",
+             state->miss_keys[i]);
+  }
+}
+
+static double TimerOverhead() {
+  double start = Now(), end = start;
+  uint64_t calls = 0;
+  while (end - start < 0.01) {
+    end = Now();
+    calls++;
+  }
+  return (end - start) / calls * 1e9;
+}
+
+int main(int argc, char **argv) {
+  BenchState state = { 0 };
+  uint64_t max_keys = DEFAULT_MAX_KEYS;
+  CPAllocator *parent;
+  const char *structure;
+  char load[16];
+
+  for (int32_t i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--str") == 0) {
+      state.str = true;
+    } else if (strcmp(argv[i], "--arena") == 0) {
+      if ((state.arena = MakeArena(ARENA_CHUNK_SIZE)) == NULL) {
+        fprintf(stderr, "could not make arena\n");
+        return EXIT_FAILURE;
+      }
+    } else if ((max_keys = strtoull(argv[i], NULL, 10)) < 10) {
+      fprintf(stderr, "usage: %s [max_keys] [--str] [--arena]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  parent = state.arena == NULL ? NULL : ArenaBase(state.arena);
+  list_counter = MakeCountingAllocator(parent);
+  table_counter = MakeCountingAllocator(parent);
+  if (list_counter == NULL || table_counter == NULL) {
+    fprintf(stderr, "could not make allocators\n");
+    return EXIT_FAILURE;
+  }
+  CPSetAllocator(CP_ALLOC_LIST, CountingAllocatorBase(list_counter));
+  CPSetAllocator(CP_ALLOC_HASHTABLE, CountingAllocatorBase(table_counter));
+  MakeKeys(&state, max_keys);
+  structure = state.str ? "hashtable_str" : "hashtable";
+
+  fprintf(stderr, "timer overhead: about %.0f ns per call\n", TimerOverhead());
+  printf("structure,keys,load_factor,op,ops,mops_per_s,"
+         "p50_ns,p90_ns,p99_ns,p999_ns,max_ns,mallocs_per_op,frees_per_op,"
+         "bytes_per_op\n");
+
+  for (uint64_t n = 10; n <= max_keys; n *= 10) {
+    state.num_keys = n;
+
+    // Presized, so the table never grows.
+    static const double loads[] = { 0.5, 1, 2 };
+    for (uint32_t l = 0; l < sizeof(loads) / sizeof(loads[0]); l++) {
+      state.buckets = n / loads[l] > 0 ? n / loads[l] : 1;
+      snprintf(load, sizeof(load), "%g", loads[l]);
+      for (uint32_t o = 0; o < NUM_TABLE_OPS; o++) {
+        Measure(&state, structure, load, &table_ops[o]);
+      }
+    }
+
+    // Grown as it fills, so inserts pay for moving the table.
+    state.buckets = GROW_BUCKETS;
+    Measure(&state, structure, "grow", &table_ops[0]);
+    MeasureReserve(&state, "grow");
+
+    for (uint32_t o = 0; o < NUM_LIST_OPS; o++) {
+      Measure(&state, "linkedlist", "", &list_ops[o]);
+    }
+  }
+
+  ResetTable(&state);
+  FreeHashTable(state.table, &NullFree);
+  ResetList(&state);
+  FreeLinkedList(state.list, &NullFree);
+  if (state.arena != NULL) {
+    FreeArena(state.arena);
+  }
+  FreeCountingAllocator(list_counter);
+  FreeCountingAllocator(table_counter);
+  free(state.keys);
+  free(state.miss_keys);
+  free(state.str_keys);
+  free(state.str_misses);
+  return state.sink == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,534 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+//
+// Measures how fast files of each size can be copied the ways the
+// checkpoint code could copy them, on the filesystem of @dir.
+//
+// usage: BenchIO [dir] [--max <size>] [--fsync]
+//
+// Checkpoint copies a source file into a new checkpoint file (create)
+// and a checkpoint file back over the source file (restore) with
+// WriteAToB, which moves 1 KB at a time through stdio. Each engine
+// below does the same two copies, for files of 1 KB up to @max (256M
+// by default, and at most 50G; sizes may end in K, M or G). Each copy
+// is timed with the source already in the page cache (warm) and with it
+// dropped first (cold): through /proc/sys/vm/drop_caches if that can be
+// written (i.e. as root), or else with posix_fadvise, which only drops
+// the pages of the source file. With --fsync, each copy includes
+// flushing the new file to disk (which the checkpoint code doesn't do).
+//
+// An engine the filesystem doesn't support (reflinks need btrfs or xfs,
+// O_DIRECT doesn't work on tmpfs) is reported as unsupported. Sizes
+// which don't fit twice in the free space of @dir are skipped.
+//
+// A line of CSV is printed for every copy, size, engine and cache, and
+// then, as comments, the engine which is fastest for each size, which is
+// the one the checkpoint code should use for files of that size.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/fs.h>
+
+#define DEFAULT_MAX_SIZE (256ULL << 20)
+#define MAX_SIZE (50ULL << 30)
+
+// The size each engine which reads into a buffer uses.
+#define BIG_BUFFER (1 << 20)
+
+// O_DIRECT needs buffers (and offsets) aligned to the block size.
+#define DIRECT_ALIGN 4096
+
+// Each copy is repeated until about this many bytes have been copied,
+// but at least MIN_RUNS and at most MAX_RUNS times.
+#define BYTES_PER_SIZE (256ULL << 20)
+#define MIN_RUNS 3
+#define MAX_RUNS 200
+
+#define COPY_OK 0
+#define COPY_ERR -1
+#define COPY_UNSUPPORTED 1
+
+#define OP_CREATE  0
+#define OP_RESTORE 1
+#define NUM_OPS    2
+
+#define CACHE_WARM 0
+#define CACHE_COLD 1
+#define NUM_CACHES 2
+
+typedef int32_t (*copy_fn)(const char *from, const char *to, uint64_t size);
+
+typedef struct copy_engine {
+  const char *name;
+  copy_fn     copy;
+} CopyEngine;
+
+static const char *op_names[NUM_OPS] = { "create", "restore" };
+static const char *cache_names[NUM_CACHES] = { "warm", "cold" };
+
+static const uint64_t sizes[] = {
+  1ULL << 10, 64ULL << 10, 1ULL << 20, 16ULL << 20, 256ULL << 20,
+  1ULL << 30, 4ULL << 30, 16ULL << 30, 50ULL << 30
+};
+
+#define NUM_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+static bool do_fsync = false;
+
+static double Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Opens the file a copy goes to, truncated, as fopen(to, "wb") does.
+static int OpenDest(const char *to, int flags) {
+  return open(to, O_WRONLY | O_CREAT | O_TRUNC | flags, 0644);
+}
+
+// Closes @fd (flushing it first if --fsync was given).
+static int32_t CloseDest(int fd, int32_t res) {
+  if (res == COPY_OK && do_fsync && fsync(fd) != 0) {
+    res = COPY_ERR;
+  }
+  if (close(fd) != 0) {
+    res = COPY_ERR;
+  }
+  return res;
+}
+
+// Writes all @len bytes of @buf to @fd.
+static int32_t WriteAll(int fd, const char *buf, size_t len) {
+  ssize_t n;
+  while (len > 0) {
+    if ((n = write(fd, buf, len)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return COPY_ERR;
+    }
+    buf += n;
+    len -= n;
+  }
+  return COPY_OK;
+}
+
+// What WriteAToB does.
+static int32_t CopyStdio(const char *from, const char *to, uint64_t size) {
+  char buffer[1024];
+  size_t bytes;
+  FILE *a, *b;
+  int32_t res = COPY_OK;
+
+  if ((a = fopen(from, "r")) == NULL) {
+    return COPY_ERR;
+  }
+  if ((b = fopen(to, "wb")) == NULL) {
+    fclose(a);
+    return COPY_ERR;
+  }
+  while (0 < (bytes = fread(buffer, 1, sizeof(buffer), a))) {
+    if (fwrite(buffer, 1, bytes, b) != bytes) {
+      res = COPY_ERR;
+      break;
+    }
+  }
+  fclose(a);
+  if (res == COPY_OK && do_fsync &&
+      (fflush(b) != 0 || fsync(fileno(b)) != 0)) {
+    res = COPY_ERR;
+  }
+  return fclose(b) == 0 ? res : COPY_ERR;
+}
+
+static int32_t CopyReadWrite(const char *from, const char *to, uint64_t size) {
+  char *buffer = malloc(BIG_BUFFER);
+  ssize_t n;
+  int a, b;
+  int32_t res = COPY_OK;
+
+  if (buffer == NULL || (a = open(from, O_RDONLY)) < 0) {
+    free(buffer);
+    return COPY_ERR;
+  }
+  if ((b = OpenDest(to, 0)) < 0) {
+    close(a);
+    free(buffer);
+    return COPY_ERR;
+  }
+  while ((n = read(a, buffer, BIG_BUFFER)) > 0) {
+    if ((res = WriteAll(b, buffer, n)) != COPY_OK) {
+      break;
+    }
+  }
+  if (n < 0) {
+    res = COPY_ERR;
+  }
+  close(a);
+  free(buffer);
+  return CloseDest(b, res);
+}
+
+// Maps the source and writes it out from the mapping.
+static int32_t CopyMmap(const char *from, const char *to, uint64_t size) {
+  char *data = NULL;
+  int a, b;
+  int32_t res;
+
+  if ((a = open(from, O_RDONLY)) < 0) {
+    return COPY_ERR;
+  }
+  if (size > 0 &&
+      (data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, a, 0)) == MAP_FAILED) {
+    close(a);
+    return COPY_ERR;
+  }
+  close(a);
+  if ((b = OpenDest(to, 0)) < 0) {
+    munmap(data, size);
+    return COPY_ERR;
+  }
+  if (size > 0) {
+    madvise(data, size, MADV_SEQUENTIAL);
+  }
+  res = WriteAll(b, data, size);
+  if (size > 0) {
+    munmap(data, size);
+  }
+  return CloseDest(b, res);
+}
+
+// Copies with sendfile if @use_sendfile, else with copy_file_range,
+// either of which moves the data within the kernel.
+static int32_t CopyInKernel(const char *from,
+                            const char *to,
+                            uint64_t size,
+                            bool use_sendfile) {
+  uint64_t left = size;
+  ssize_t n = 0;
+  int a, b;
+  int32_t res = COPY_OK;
+
+  if ((a = open(from, O_RDONLY)) < 0) {
+    return COPY_ERR;
+  }
+  if ((b = OpenDest(to, 0)) < 0) {
+    close(a);
+    return COPY_ERR;
+  }
+  while (left > 0) {
+    size_t chunk = left > (1ULL << 30) ? (1ULL << 30) : left;
+    n = use_sendfile ? sendfile(b, a, NULL, chunk)
+                     : copy_file_range(a, NULL, b, NULL, chunk, 0);
+    if (n <= 0) {
+      break;
+    }
+    left -= n;
+  }
+  if (n < 0) {
+    res = (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+           errno == EOPNOTSUPP) && left == size ? COPY_UNSUPPORTED : COPY_ERR;
+  }
+  close(a);
+  return CloseDest(b, res);
+}
+
+static int32_t CopyFileRange(const char *from, const char *to, uint64_t size) {
+  return CopyInKernel(from, to, size, false);
+}
+
+static int32_t CopySendfile(const char *from, const char *to, uint64_t size) {
+  return CopyInKernel(from, to, size, true);
+}
+
+// Makes the copy share the blocks of the source, which is only possible
+// on filesystems with copy on write.
+static int32_t CopyReflink(const char *from, const char *to, uint64_t size) {
+  int a, b;
+  int32_t res = COPY_OK;
+
+  if ((a = open(from, O_RDONLY)) < 0) {
+    return COPY_ERR;
+  }
+  if ((b = OpenDest(to, 0)) < 0) {
+    close(a);
+    return COPY_ERR;
+  }
+  if (ioctl(b, FICLONE, a) != 0) {
+    res = (errno == EOPNOTSUPP || errno == EXDEV || errno == EINVAL ||
+           errno == ENOTTY) ? COPY_UNSUPPORTED : COPY_ERR;
+  }
+  close(a);
+  return CloseDest(b, res);
+}
+
+// Reads and writes past the page cache. The tail which isn't a whole
+// block is written with O_DIRECT turned off.
+static int32_t CopyDirect(const char *from, const char *to, uint64_t size) {
+  char *buffer;
+  ssize_t n;
+  int a, b;
+  int32_t res = COPY_OK;
+
+  if (posix_memalign((void **)&buffer, DIRECT_ALIGN, BIG_BUFFER) != 0) {
+    return COPY_ERR;
+  }
+  if ((a = open(from, O_RDONLY | O_DIRECT)) < 0) {
+    free(buffer);
+    return errno == EINVAL ? COPY_UNSUPPORTED : COPY_ERR;
+  }
+  if ((b = OpenDest(to, O_DIRECT)) < 0) {
+    close(a);
+    free(buffer);
+    return errno == EINVAL ? COPY_UNSUPPORTED : COPY_ERR;
+  }
+  while ((n = read(a, buffer, BIG_BUFFER)) > 0) {
+    size_t whole = n - n % DIRECT_ALIGN;
+    if (whole > 0 && (res = WriteAll(b, buffer, whole)) != COPY_OK) {
+      break;
+    }
+    if (whole < (size_t)n) {
+      fcntl(b, F_SETFL, fcntl(b, F_GETFL) & ~O_DIRECT);
+      res = WriteAll(b, buffer + whole, n - whole);
+    }
+  }
+  if (n < 0) {
+    res = errno == EINVAL ? COPY_UNSUPPORTED : COPY_ERR;
+  }
+  close(a);
+  free(buffer);
+  return CloseDest(b, res);
+}
+
+static const CopyEngine engines[] = {
+  { "stdio_1k",        &CopyStdio     },
+  { "read_write_1m",   &CopyReadWrite },
+  { "mmap",            &CopyMmap      },
+  { "copy_file_range", &CopyFileRange },
+  { "sendfile",        &CopySendfile  },
+  { "reflink",         &CopyReflink   },
+  { "o_direct",        &CopyDirect    },
+};
+
+#define NUM_ENGINES (sizeof(engines) / sizeof(engines[0]))
+
+// Drops @path from the page cache, system wide if allowed.
+static void DropCache(const char *path) {
+  int fd, proc;
+
+  sync();
+  if ((proc = open("/proc/sys/vm/drop_caches", O_WRONLY)) >= 0) {
+    bool dropped = write(proc, "1", 1) == 1;
+    close(proc);
+    if (dropped) {
+      return;
+    }
+  }
+  if ((fd = open(path, O_RDONLY)) >= 0) {
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+}
+
+// Writes @size bytes of pseudo random data (so no filesystem can
+// compress it) to @path.
+static int32_t MakeFile(const char *path, uint64_t size) {
+  uint64_t *buffer = malloc(BIG_BUFFER), seed = 0x9e3779b97f4a7c15ULL;
+  int fd;
+  int32_t res = COPY_OK;
+
+  if (buffer == NULL || (fd = OpenDest(path, 0)) < 0) {
+    free(buffer);
+    return COPY_ERR;
+  }
+  for (uint64_t left = size; left > 0 && res == COPY_OK; ) {
+    size_t chunk = left > BIG_BUFFER ? BIG_BUFFER : left;
+    for (size_t i = 0; i < BIG_BUFFER / sizeof(uint64_t); i++) {
+      seed ^= seed << 13;
+      seed ^= seed >> 7;
+      seed ^= seed << 17;
+      buffer[i] = seed;
+    }
+    res = WriteAll(fd, (char *)buffer, chunk);
+    left -= chunk;
+  }
+  free(buffer);
+  return close(fd) == 0 ? res : COPY_ERR;
+}
+
+static int CompareDoubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Parses a size like 64K, 16M or 4G.
+static uint64_t ParseSize(const char *arg) {
+  char *end;
+  uint64_t size = strtoull(arg, &end, 10);
+  switch (*end) {
+    case 'G': case 'g': return size << 30;
+    case 'M': case 'm': return size << 20;
+    case 'K': case 'k': return size << 10;
+    case '\0':          return size;
+    default:            return 0;
+  }
+}
+
+static void FormatSize(uint64_t size, char *str) {
+  if (size >= (1ULL << 30)) {
+    sprintf(str, "%luG", size >> 30);
+  } else if (size >= (1ULL << 20)) {
+    sprintf(str, "%luM", size >> 20);
+  } else {
+    sprintf(str, "%luK", size >> 10);
+  }
+}
+
+// Times @engine copying @size bytes, for @op and @cache. The median
+// time of a copy is returned through @median, or -1 if the engine is
+// unsupported.
+static int32_t RunEngine(const CopyEngine *engine,
+                         const char *src,
+                         const char *cpt,
+                         uint64_t size,
+                         int32_t op,
+                         int32_t cache,
+                         double *median) {
+  uint64_t runs = BYTES_PER_SIZE / size;
+  const char *from = op == OP_CREATE ? src : cpt;
+  const char *to = op == OP_CREATE ? cpt : src;
+  double times[MAX_RUNS], start;
+  char size_str[16];
+  int32_t res = COPY_OK;
+
+  runs = runs < MIN_RUNS ? MIN_RUNS : (runs > MAX_RUNS ? MAX_RUNS : runs);
+  // Restore overwrites the source, and create makes a new checkpoint.
+  if (op == OP_RESTORE && (res = engine->copy(src, cpt, size)) != COPY_OK) {
+    runs = 0;
+  }
+  for (uint64_t r = 0; r < runs; r++) {
+    if (op == OP_CREATE) {
+      unlink(to);
+    }
+    if (cache == CACHE_COLD) {
+      DropCache(from);
+    }
+    start = Now();
+    res = engine->copy(from, to, size);
+    times[r] = Now() - start;
+    if (res != COPY_OK) {
+      runs = 0;
+    }
+  }
+
+  FormatSize(size, size_str);
+  if (res != COPY_OK) {
+    printf("%s,%s,%s,%s,%s,,,,\n", op_names[op], size_str, engine->name,
+           cache_names[cache],
+           res == COPY_UNSUPPORTED ? "unsupported" : "error");
+    *median = -1;
+    fflush(stdout);
+    return res;
+  }
+
+  qsort(times, runs, sizeof(double), &CompareDoubles);
+  *median = times[runs / 2];
+  printf("%s,%s,%s,%s,%lu,%.1f,%.1f,%.1f,%.1f\n",
+         op_names[op], size_str, engine->name, cache_names[cache], runs,
+         size / *median / 1e6, times[0] * 1e6, *median * 1e6,
+         times[runs - 1] * 1e6);
+  fflush(stdout);
+  return res;
+}
+
+int main(int argc, char **argv) {
+  const char *dir = ".";
+  uint64_t max_size = DEFAULT_MAX_SIZE;
+  // The median time of every engine, for the sizes measured.
+  double medians[NUM_SIZES][NUM_OPS][NUM_CACHES][NUM_ENGINES];
+  uint32_t num_sizes = 0;
+  struct statvfs vfs;
+  char src[4096], cpt[4096], size_str[16];
+
+  for (int32_t i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--fsync") == 0) {
+      do_fsync = true;
+    } else if (strcmp(argv[i], "--max") == 0 && i + 1 < argc) {
+      max_size = ParseSize(argv[++i]);
+    } else if (argv[i][0] != '-') {
+      dir = argv[i];
+    } else {
+      max_size = 0;
+    }
+  }
+  if (max_size == 0 || max_size > MAX_SIZE) {
+    fprintf(stderr, "usage: %s [dir] [--max <size, at most 50G>] [--fsync]\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+  snprintf(src, sizeof(src), "%s/.bench_io_src", dir);
+  snprintf(cpt, sizeof(cpt), "%s/.bench_io_cpt", dir);
+
+  printf("op,size,engine,cache,runs,mb_per_s,min_us,p50_us,max_us\n");
+  for (uint32_t s = 0; s < NUM_SIZES && sizes[s] <= max_size; s++) {
+    if (statvfs(dir, &vfs) != 0 ||
+        (uint64_t)vfs.f_bavail * vfs.f_frsize < 2 * sizes[s] + (64 << 20)) {
+      FormatSize(sizes[s], size_str);
+      fprintf(stderr, "skipping %s: not enough space in %s\n", size_str, dir);
+      break;
+    }
+    if (MakeFile(src, sizes[s]) != COPY_OK) {
+      fprintf(stderr, "could not write %s\n", src);
+      unlink(src);
+      return EXIT_FAILURE;
+    }
+    for (int32_t op = 0; op < NUM_OPS; op++) {
+      for (int32_t cache = 0; cache < NUM_CACHES; cache++) {
+        for (uint32_t e = 0; e < NUM_ENGINES; e++) {
+          RunEngine(&engines[e], src, cpt, sizes[s], op, cache,
+                    &medians[s][op][cache][e]);
+        }
+      }
+    }
+    num_sizes++;
+  }
+  unlink(src);
+  unlink(cpt);
+
+  printf("# The fastest engine for each size (WriteAToB is stdio_1k):\n");
+  for (uint32_t s = 0; s < num_sizes; s++) {
+    FormatSize(sizes[s], size_str);
+    printf("# %5s:", size_str);
+    for (int32_t op = 0; op < NUM_OPS; op++) {
+      for (int32_t cache = 0; cache < NUM_CACHES; cache++) {
+        double *times = medians[s][op][cache];
+        uint32_t best = 0;
+        for (uint32_t e = 1; e < NUM_ENGINES; e++) {
+          if (times[e] >= 0 && (times[best] < 0 || times[e] < times[best])) {
+            best = e;
+          }
+        }
+        printf(" %s %s %s (%.1fx stdio_1k)%s", op_names[op],
+               cache_names[cache], engines[best].name,
+               times[0] > 0 && times[best] > 0 ? times[0] / times[best] : 0,
+               op == NUM_OPS - 1 && cache == NUM_CACHES - 1 ? "" : ",");
+      }
+    }
+    printf("\n");
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,549 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+//
+// Replays a trace of the commands run in a directory, as recorded with
+// CPT_RECORD (see checkpoint_record.h), in scratch dirs, so that a slow
+// mix of commands can be reproduced and measured somewhere else.
+//
+// usage: BenchReplay <path to Checkpoint> <trace> [--jobs <n>]
+//                    [--speed <x>] [--json] [--keep]
+//
+// The commands of the trace are split between @jobs workers, each of
+// which runs its share in the order they were recorded, in a scratch
+// dir of its own under /tmp. Every command on a source file goes to the
+// same worker (the one the hash of the file's token picks), and those
+// on no file (list, index) are dealt out in turn. Nothing locks a log,
+// so two runs of Checkpoint must never write the same one at once, and
+// the workers can't share a dir. Before a create, its source file is
+// written with the size it was recorded with, and lines made from its
+// token and the position of the command in the trace, so every replay
+// of a trace does the same work. list is replayed without its options
+// (which may have been anonymized), and swapto --at is skipped (its
+// time was).
+//
+// By default every worker runs its commands as fast as it can. With
+// --speed, each waits until the time the command was recorded at, after
+// the first command of the trace, divided by @x (so 2 replays the trace
+// twice as fast as it was recorded).
+//
+// Printed are the runs, failures (runs which didn't exit with 0) and
+// latencies (the 50th, 90th, 99th and 99.9th percentiles and the most
+// of the wall time of a run) of each command and of all of them, as CSV
+// (or JSON with --json), then how many runs a second the replay made,
+// and how big the working dirs of the workers were at the end. --keep
+// keeps the scratch dirs to look at.
+
+#define _XOPEN_SOURCE 700
+
+#include <ftw.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "../checkpoint_record.h"
+
+#define DEFAULT_JOBS 1
+#define MAX_JOBS     256
+
+// The most arguments of a command replayed (the rest are left out).
+#define MAX_ARGS 6
+
+// The most distinct commands a trace may have.
+#define MAX_CMDS 32
+
+// The bytes of each line of a generated source file (but the last).
+#define SRC_LINE_LEN 64
+
+// The file each worker writes the result of each run to (in the scratch
+// dir, with the number of the worker after it).
+#define RESULTS_FILE "results_"
+
+// One command of the trace.
+typedef struct replay_cmd {
+  double   time;                  // seconds after the first command
+  int64_t  size;                  // of its source file, or -1
+  uint32_t cmd;                   // its index in ReplayTrace.cmd_names
+  uint32_t worker;                // which worker runs it
+  char    *args[MAX_ARGS + 2];    // the command and its arguments, then
+                                  // NULL
+} ReplayCmd;
+
+typedef struct replay_trace {
+  ReplayCmd *cmds;
+  uint32_t   num_cmds;
+  uint32_t   capacity;
+  uint32_t   num_skipped;         // commands which can't be replayed
+  char      *cmd_names[MAX_CMDS];
+  uint32_t   num_cmd_names;
+} ReplayTrace;
+
+// The wall times of every run of one command, and how many failed.
+typedef struct replay_samples {
+  double   *wall;
+  uint32_t  num;
+  uint32_t  capacity;
+  uint32_t  failed;
+} ReplaySamples;
+
+// What SizeEntry adds up.
+static uint64_t cpt_bytes, cpt_files;
+
+static double Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// FNV-1a, to pick the worker of a token.
+static uint32_t HashToken(const char *token) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (; *token != '\0'; token++) {
+    hash = (hash ^ (unsigned char)*token) * 1099511628211ULL;
+  }
+  return hash ^ (hash >> 32);
+}
+
+// Returns the index of the command @name in @trace, adding it if it isn't
+// there yet, or -1 if there are too many already.
+static int32_t CmdIndex(ReplayTrace *trace, const char *name) {
+  for (uint32_t i = 0; i < trace->num_cmd_names; i++) {
+    if (strcmp(trace->cmd_names[i], name) == 0) {
+      return i;
+    }
+  }
+  if (trace->num_cmd_names == MAX_CMDS ||
+      (trace->cmd_names[trace->num_cmd_names] = strdup(name)) == NULL) {
+    return -1;
+  }
+  return trace->num_cmd_names++;
+}
+
+// Adds the command of the recorded @line to @trace, unless it can't be
+// replayed, and deals it out to one of @jobs workers.
+static int32_t AddCmd(ReplayTrace *trace,
+                      char *line,
+                      uint32_t jobs,
+                      double *first_time) {
+  char *fields[MAX_ARGS + 3], *save;
+  uint32_t num_fields = 0, num_args;
+  int32_t cmd;
+  ReplayCmd *rc;
+
+  line[strcspn(line, "\n")] = '\0';
+  for (char *field = strtok_r(line, ",", &save);
+       field != NULL && num_fields < MAX_ARGS + 3;
+       field = strtok_r(NULL, ",", &save)) {
+    fields[num_fields++] = field;
+  }
+  if (num_fields < 3) {
+    return -1;
+  }
+  num_args = num_fields - 3;
+  if (strcmp(fields[1], "swapto") == 0 && num_args > 1 &&
+      strcmp(fields[4], "--at") == 0) {
+    trace->num_skipped++;
+    return 0;
+  }
+  if (strcmp(fields[1], "list") == 0) {
+    num_args = 0;
+  }
+  if ((cmd = CmdIndex(trace, fields[1])) < 0) {
+    return -1;
+  }
+
+  if (trace->num_cmds == trace->capacity) {
+    uint32_t capacity = trace->capacity == 0 ? 1024 : trace->capacity * 2;
+    rc = realloc(trace->cmds, sizeof(ReplayCmd) * capacity);
+    if (rc == NULL) {
+      return -1;
+    }
+    trace->cmds = rc;
+    trace->capacity = capacity;
+  }
+
+  rc = &trace->cmds[trace->num_cmds];
+  if (trace->num_cmds == 0) {
+    *first_time = atof(fields[0]);
+  }
+  rc->time = atof(fields[0]) - *first_time;
+  rc->size = atoll(fields[2]);
+  rc->cmd = cmd;
+  rc->worker = num_args > 0 ? HashToken(fields[3]) % jobs :
+                              trace->num_cmds % jobs;
+  rc->args[0] = trace->cmd_names[cmd];
+  for (uint32_t i = 0; i < num_args; i++) {
+    if ((rc->args[i + 1] = strdup(fields[i + 3])) == NULL) {
+      while (i-- > 0) {
+        free(rc->args[i + 1]);
+      }
+      return -1;
+    }
+  }
+  rc->args[num_args + 1] = NULL;
+  trace->num_cmds++;
+  return 0;
+}
+
+static int32_t ReadTrace(const char *path, uint32_t jobs, ReplayTrace *trace) {
+  char *line = NULL;
+  size_t line_cap = 0;
+  double first_time = 0;
+  uint32_t line_num = 0;
+  int32_t res = 0;
+  FILE *f;
+
+  if ((f = fopen(path, "r")) == NULL) {
+    fprintf(stderr, "could not open %s\n", path);
+    return -1;
+  }
+  while (res == 0 && getline(&line, &line_cap, f) > 0) {
+    line_num++;
+    if ((res = AddCmd(trace, line, jobs, &first_time)) != 0) {
+      fprintf(stderr, "%s:%u: not a recorded command\n", path, line_num);
+    }
+  }
+  free(line);
+  fclose(f);
+  return res;
+}
+
+static void FreeTrace(ReplayTrace *trace) {
+  for (uint32_t i = 0; i < trace->num_cmds; i++) {
+    for (uint32_t a = 1; trace->cmds[i].args[a] != NULL; a++) {
+      free(trace->cmds[i].args[a]);
+    }
+  }
+  for (uint32_t i = 0; i < trace->num_cmd_names; i++) {
+    free(trace->cmd_names[i]);
+  }
+  free(trace->cmds);
+}
+
+// Writes the source file @name, of @size bytes (or one line, if it is
+// negative), with lines which only depend on @name and @rev.
+static int32_t WriteSource(const char *name, int64_t size, uint32_t rev) {
+  char line[SRC_LINE_LEN + 1];
+  int64_t written = 0;
+  FILE *f = fopen(name, "w");
+
+  if (f == NULL) {
+    return -1;
+  }
+  for (uint32_t n = 0; written < size || n == 0; n++) {
+    int len = snprintf(line, sizeof(line), "%s rev %u line %u", name, rev, n);
+    len = len < SRC_LINE_LEN - 1 ? len : SRC_LINE_LEN - 1;
+    memset(line + len, ' ', SRC_LINE_LEN - 1 - len);
+    line[SRC_LINE_LEN - 1] = '\n';
+    len = size >= 0 && size - written < SRC_LINE_LEN ?
+          size - written : SRC_LINE_LEN;
+    if (fwrite(line, 1, len, f) != (size_t)len) {
+      fclose(f);
+      return -1;
+    }
+    written += len;
+  }
+  return fclose(f) == 0 ? 0 : -1;
+}
+
+// Runs @exe with the arguments @args (@args[0] being the command), with
+// its output thrown away.
+//
+// Returns: the wall time of the run, negated if it failed.
+static double Run(const char *exe, char **args) {
+  double start = Now();
+  pid_t pid;
+  int status, null_fd;
+
+  if ((pid = fork()) < 0) {
+    return -(Now() - start);
+  } else if (pid == 0) {
+    char *argv[MAX_ARGS + 3] = { (char *)exe };
+    for (uint32_t i = 0; args[i] != NULL; i++) {
+      argv[i + 1] = args[i];
+    }
+    if ((null_fd = open("/dev/null", O_WRONLY)) >= 0) {
+      dup2(null_fd, STDOUT_FILENO);
+      dup2(null_fd, STDERR_FILENO);
+    }
+    execv(exe, argv);
+    _exit(127);
+  }
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    return -(Now() - start);
+  }
+  return Now() - start;
+}
+
+// Runs the commands of worker @w, in the dir @dir/w<w>, and writes the
+// command, wall time and result of each run to @dir/RESULTS_FILE<w>.
+// Runs in a process of its own.
+static int32_t RunWorker(const char *exe,
+                         ReplayTrace *trace,
+                         uint32_t w,
+                         double speed,
+                         const char *dir) {
+  char path[PATH_MAX];
+  double start, wall, wait;
+  ReplayCmd *rc;
+  FILE *results;
+
+  snprintf(path, sizeof(path), "%s/%s%u", dir, RESULTS_FILE, w);
+  if ((results = fopen(path, "w")) == NULL) {
+    return -1;
+  }
+  snprintf(path, sizeof(path), "%s/w%u", dir, w);
+  if (mkdir(path, S_IRWXU) != 0 || chdir(path) != 0) {
+    fclose(results);
+    return -1;
+  }
+
+  start = Now();
+  for (uint32_t i = 0; i < trace->num_cmds; i++) {
+    rc = &trace->cmds[i];
+    if (rc->worker != w) {
+      continue;
+    }
+    if (speed > 0 && (wait = start + rc->time / speed - Now()) > 0) {
+      struct timespec ts = { (time_t)wait, (wait - (time_t)wait) * 1e9 };
+      nanosleep(&ts, NULL);
+    }
+    if (strcmp(rc->args[0], "create") == 0 && rc->args[1] != NULL &&
+        WriteSource(rc->args[1], rc->size, i) != 0) {
+      fprintf(stderr, "worker %u: could not write %s\n", w, rc->args[1]);
+    }
+    wall = Run(exe, rc->args);
+    fprintf(results, "%u %d %.9f\n", rc->cmd, wall >= 0,
+            wall < 0 ? -wall : wall);
+  }
+  return fclose(results) == 0 ? 0 : -1;
+}
+
+static int32_t AddSample(ReplaySamples *samples, double wall, bool ok) {
+  if (samples->num == samples->capacity) {
+    uint32_t capacity = samples->capacity == 0 ? 64 : samples->capacity * 2;
+    double *grown = realloc(samples->wall, sizeof(double) * capacity);
+    if (grown == NULL) {
+      return -1;
+    }
+    samples->wall = grown;
+    samples->capacity = capacity;
+  }
+  samples->wall[samples->num++] = wall;
+  samples->failed += !ok;
+  return 0;
+}
+
+// Adds the results of the @jobs workers, in @dir, to @samples (by command)
+// and @all.
+static int32_t ReadResults(const char *dir,
+                           uint32_t jobs,
+                           uint32_t num_cmds,
+                           ReplaySamples *samples,
+                           ReplaySamples *all) {
+  char path[PATH_MAX];
+  unsigned cmd;
+  int ok;
+  double wall;
+  int32_t res = 0;
+  FILE *f;
+
+  for (uint32_t w = 0; w < jobs && res == 0; w++) {
+    snprintf(path, sizeof(path), "%s/%s%u", dir, RESULTS_FILE, w);
+    if ((f = fopen(path, "r")) == NULL) {
+      return -1;
+    }
+    while (res == 0 && fscanf(f, "%u %d %lf", &cmd, &ok, &wall) == 3) {
+      if (cmd >= num_cmds || AddSample(&samples[cmd], wall, ok) != 0 ||
+          AddSample(all, wall, ok) != 0) {
+        res = -1;
+      }
+    }
+    fclose(f);
+  }
+  return res;
+}
+
+static int CompareDoubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Returns the @per_mille'th per mille of @values (by nearest rank), which
+// must be sorted.
+static double Percentile(const double *values, uint32_t num, uint32_t per_mille) {
+  uint64_t rank = ((uint64_t)per_mille * num + 999) / 1000;
+  return num == 0 ? 0 : values[rank > 0 ? rank - 1 : 0];
+}
+
+static void PrintSamples(const char *name,
+                         ReplaySamples *samples,
+                         bool json,
+                         bool *first) {
+  double p50, p90, p99, p999, max;
+
+  qsort(samples->wall, samples->num, sizeof(double), &CompareDoubles);
+  p50 = Percentile(samples->wall, samples->num, 500);
+  p90 = Percentile(samples->wall, samples->num, 900);
+  p99 = Percentile(samples->wall, samples->num, 990);
+  p999 = Percentile(samples->wall, samples->num, 999);
+  max = samples->num > 0 ? samples->wall[samples->num - 1] : 0;
+
+  if (json) {
+    printf("%s    {\"command\": \"%s\", \"runs\": %u, \"failed\": %u, "
+           "\"p50_s\": %.6f, \"p90_s\": %.6f, \"p99_s\": %.6f, "
+           "\"p999_s\": %.6f, \"max_s\": %.6f}",
+           *first ? "" : ",\n", name, samples->num, samples->failed,
+           p50, p90, p99, p999, max);
+  } else {
+    printf("%s,%u,%u,%.6f,%.6f,%.6f,%.6f,%.6f\n", name, samples->num,
+           samples->failed, p50, p90, p99, p999, max);
+  }
+  *first = false;
+}
+
+static int SizeEntry(const char *path,
+                     const struct stat *sb,
+                     int flag,
+                     struct FTW *ftw) {
+  if (flag == FTW_F) {
+    cpt_bytes += sb->st_size;
+    cpt_files++;
+  }
+  return 0;
+}
+
+static int RemoveEntry(const char *path,
+                       const struct stat *sb,
+                       int flag,
+                       struct FTW *ftw) {
+  return remove(path);
+}
+
+int main(int argc, char *argv[]) {
+  ReplayTrace trace;
+  ReplaySamples samples[MAX_CMDS], all;
+  char dir[] = "/tmp/cpt_replay_XXXXXX", path[PATH_MAX], *exe;
+  uint32_t jobs = DEFAULT_JOBS;
+  double speed = 0, start, wall;
+  bool json = false, keep = false, first = true;
+  int32_t res = 0;
+  pid_t pid;
+  int status;
+
+  if (argc < 3) {
+    fprintf(stderr,
+            "usage: BenchReplay <path to Checkpoint> <trace> [--jobs <n>] "
+            "[--speed <x>] [--json] [--keep]\n");
+    return EXIT_FAILURE;
+  }
+  for (int32_t i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc &&
+        atoi(argv[i + 1]) > 0 && atoi(argv[i + 1]) <= MAX_JOBS) {
+      jobs = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc &&
+               atof(argv[i + 1]) > 0) {
+      speed = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--json") == 0) {
+      json = true;
+    } else if (strcmp(argv[i], "--keep") == 0) {
+      keep = true;
+    } else {
+      fprintf(stderr, "unknown option %s\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+  // The workers run from scratch dirs.
+  if ((exe = realpath(argv[1], NULL)) == NULL) {
+    fprintf(stderr, "could not find %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  // The replay mustn't be recorded on top of the trace.
+  unsetenv(RECORD_ENV);
+
+  memset(&trace, 0, sizeof(trace));
+  if (ReadTrace(argv[2], jobs, &trace) != 0 || mkdtemp(dir) == NULL) {
+    fprintf(stderr, "could not set up the replay\n");
+    FreeTrace(&trace);
+    free(exe);
+    return EXIT_FAILURE;
+  }
+  fprintf(stderr, "replaying %u commands (%u skipped) with %u worker(s) "
+          "in %s\n", trace.num_cmds, trace.num_skipped, jobs, dir);
+
+  fflush(stdout);
+  start = Now();
+  for (uint32_t w = 0; w < jobs; w++) {
+    if ((pid = fork()) < 0) {
+      res = -1;
+    } else if (pid == 0) {
+      _exit(RunWorker(exe, &trace, w, speed, dir) == 0 ?
+            EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
+  while ((pid = wait(&status)) > 0) {
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      res = -1;
+    }
+  }
+  wall = Now() - start;
+
+  memset(samples, 0, sizeof(samples));
+  memset(&all, 0, sizeof(all));
+  if (res == 0 &&
+      ReadResults(dir, jobs, trace.num_cmd_names, samples, &all) != 0) {
+    res = -1;
+  }
+  for (uint32_t w = 0; w < jobs && res == 0; w++) {
+    snprintf(path, sizeof(path), "%s/w%u/%s", dir, w, WORKING_DIR);
+    if (access(path, F_OK) == 0 &&
+        nftw(path, &SizeEntry, 16, FTW_PHYS) != 0) {
+      res = -1;
+    }
+  }
+
+  if (res != 0) {
+    fprintf(stderr, "the replay failed\n");
+  } else {
+    if (json) {
+      printf("{\n  \"commands\": [\n");
+    } else {
+      printf("command,runs,failed,p50_s,p90_s,p99_s,p999_s,max_s\n");
+    }
+    for (uint32_t c = 0; c < trace.num_cmd_names; c++) {
+      PrintSamples(trace.cmd_names[c], &samples[c], json, &first);
+    }
+    PrintSamples("all", &all, json, &first);
+    if (json) {
+      printf("\n  ],\n  \"jobs\": %u, \"skipped\": %u, \"wall_s\": %.6f, "
+             "\"runs_per_s\": %.3f, \"cpt_bytes\": %lu, \"cpt_files\": %lu\n"
+             "}\n", jobs, trace.num_skipped, wall, all.num / wall, cpt_bytes,
+             cpt_files);
+    } else {
+      printf("# %u runs (%u skipped) by %u worker(s) in %.3fs: "
+             "%.1f runs/s\n", all.num, trace.num_skipped, jobs, wall,
+             all.num / wall);
+      printf("# %s at the end: %lu bytes in %lu files\n", WORKING_DIR,
+             cpt_bytes, cpt_files);
+    }
+  }
+
+  for (uint32_t c = 0; c < trace.num_cmd_names; c++) {
+    free(samples[c].wall);
+  }
+  free(all.wall);
+  FreeTrace(&trace);
+  free(exe);
+  if (keep) {
+    fprintf(stderr, "kept %s\n", dir);
+  } else if (nftw(dir, &RemoveEntry, 16, FTW_DEPTH | FTW_PHYS) != 0) {
+    fprintf(stderr, "could not remove %s\n", dir);
+  }
+  return res == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
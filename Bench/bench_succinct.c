@@ -0,0 +1,242 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+//
+// Checks SuccinctCpTree against the CpTree it packs, and measures how
+// much smaller and slower it is, for trees of 1 up to @max_nodes nodes.
+//
+// usage: BenchSuccinct [max_nodes]
+//
+// Each tree is grown by inserting every node under a random live one,
+// pruning a random leaf or squashing a random node every so often, so
+// that the packed form also sees the gaps they leave. The tree is then
+// packed, and for every live node the parent, first child, next sibling,
+// depth and name of the packed one are checked against the CpTree (the
+// packed nodes are numbered in preorder, which CpTreePreorder gives), as
+// is finding it by name, and that a name which isn't there isn't found.
+// Each query is timed over every node.
+//
+// A line of CSV is printed for each size. If anything doesn't match, the
+// first mismatch is printed and the program exits with a failure.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "../checkpoint_succinct.h"
+#include "../checkpoint_tree.h"
+
+#define DEFAULT_MAX_NODES 2000000
+
+// One in PRUNE_EVERY inserts is followed by pruning a random leaf, and
+// one in SQUASH_EVERY by squashing a random node.
+#define PRUNE_EVERY  50
+#define SQUASH_EVERY 100
+
+// The room given to a generated name.
+#define NAME_LEN 32
+
+// The packed id of every live handle of a tree, and back.
+typedef struct bench_ids {
+  uint32_t     *of_handle;  // SUCCINCT_NULL for pruned handles
+  CpTreeHandle *handles;
+  uint32_t      num_live;
+} BenchIds;
+
+// A xorshift generator, so the trees are the same from run to run.
+static uint64_t NextRandom(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+static double Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The CpTreeVisitor which numbers the live nodes in preorder.
+static int32_t NumberNode(CpTreePtr tree, CpTreeHandle node, void *arg) {
+  BenchIds *ids = arg;
+  ids->of_handle[node] = ids->num_live;
+  ids->handles[ids->num_live++] = node;
+  return CPT_VISIT_CONTINUE;
+}
+
+// Grows a tree of @num_nodes inserts, returned through @ret.
+static int32_t GrowTree(uint32_t num_nodes, uint64_t *seed, CpTreePtr *ret) {
+  char name[NAME_LEN];
+  CpTreeHandle parent, node;
+  CpTreePtr tree;
+
+  if (CreateCpTree("root", &tree) != CREATE_TREE_SUCCESS) {
+    return MEM_ERR;
+  }
+  for (uint32_t i = 1; i < num_nodes; i++) {
+    parent = NextRandom(seed) % tree->num_nodes;
+    if (CPT_IS_PRUNED(tree, parent)) {
+      parent = CPT_ROOT_HANDLE;
+    }
+    // Names which share prefixes, like most checkpoint names do.
+    snprintf(name, sizeof(name), "release-%u.%u-fix%u",
+             i / 1000, i % 1000 / 10, i % 10);
+    if (InsertCpTreeNode(tree, parent, name, &node) != INSERT_NODE_SUCCESS) {
+      FreeCpTree(tree);
+      return MEM_ERR;
+    }
+
+    node = 1 + NextRandom(seed) % (tree->num_nodes - 1);
+    if (i % PRUNE_EVERY == 0 && !CPT_IS_PRUNED(tree, node) &&
+        CpTreeNumChildren(tree, node) == 0) {
+      PruneCpTreeNode(tree, node);
+    } else if (i % SQUASH_EVERY == 0 && !CPT_IS_PRUNED(tree, node)) {
+      SquashCpTreeNode(tree, node);
+    }
+  }
+  *ret = tree;
+  return 0;
+}
+
+// Returns the packed id of @handle, or SUCCINCT_NULL if it is none.
+static uint32_t IdOf(BenchIds *ids, CpTreeHandle handle) {
+  return handle == CPT_NULL_HANDLE ? SUCCINCT_NULL : ids->of_handle[handle];
+}
+
+// Checks every query of @packed against @tree.
+//
+// Returns: true if they all match.
+static bool CheckTree(CpTreePtr tree, SuccinctCpTreePtr packed, BenchIds *ids) {
+  char name[packed->max_name_len + 1];
+  uint32_t found;
+
+  if (packed->num_nodes != ids->num_live) {
+    printf("packed %u nodes, but %u are live\n", packed->num_nodes,
+           ids->num_live);
+    return false;
+  }
+  for (uint32_t id = 0; id < ids->num_live; id++) {
+    CpTreeNode *node = &tree->nodes[ids->handles[id]];
+    uint32_t expected[3] = { IdOf(ids, node->parent),
+                             IdOf(ids, node->first_child),
+                             IdOf(ids, node->next_sibling) };
+    uint32_t got[3] = { SuccinctParent(packed, id),
+                        SuccinctFirstChild(packed, id),
+                        SuccinctNextSibling(packed, id) };
+    const char *what[3] = { "parent", "first child", "next sibling" };
+
+    for (int32_t q = 0; q < 3; q++) {
+      if (got[q] != expected[q]) {
+        printf("node %u: %s is %u, not %u\n", id, what[q], got[q], expected[q]);
+        return false;
+      }
+    }
+    if (SuccinctDepth(packed, id) != node->depth) {
+      printf("node %u: depth is %u, not %u\n", id,
+             SuccinctDepth(packed, id), node->depth);
+      return false;
+    }
+    SuccinctCptName(packed, id, name);
+    if (strcmp(name, CPT_NAME(tree, ids->handles[id])) != 0) {
+      printf("node %u: name is %s, not %s\n", id, name,
+             CPT_NAME(tree, ids->handles[id]));
+      return false;
+    }
+    if (SuccinctFindCpt(packed, name, &found) != FIND_CPT_SUCCESS ||
+        found != id) {
+      printf("node %u: finding %s gives another node\n", id, name);
+      return false;
+    }
+  }
+  if (SuccinctFindCpt(packed, "release-missing", &found) != FIND_CPT_ABSENT) {
+    printf("a name which isn't there was found\n");
+    return false;
+  }
+  return true;
+}
+
+// Returns the nanoseconds each query of @packed takes, on average over
+// every node.
+static double TimeQueries(SuccinctCpTreePtr packed) {
+  char name[packed->max_name_len + 1];
+  uint64_t sink = 0;
+  uint32_t found;
+  double start = Now();
+
+  for (uint32_t id = 0; id < packed->num_nodes; id++) {
+    sink += SuccinctParent(packed, id) + SuccinctFirstChild(packed, id) +
+            SuccinctNextSibling(packed, id) + SuccinctDepth(packed, id);
+    SuccinctCptName(packed, id, name);
+    SuccinctFindCpt(packed, name, &found);
+    sink += found;
+  }
+  double elapsed = Now() - start;
+  if (sink == 1) {  // keeps the queries from being optimized out
+    printf(" ");
+  }
+  return packed->num_nodes == 0 ? 0 : elapsed * 1e9 / packed->num_nodes / 6;
+}
+
+int main(int argc, char **argv) {
+  uint32_t max_nodes = argc > 1 ? strtoul(argv[1], NULL, 10)
+                                : DEFAULT_MAX_NODES;
+  uint64_t seed = 0x5EED5EED5EED5EEDULL;
+
+  if (max_nodes == 0) {
+    fprintf(stderr, "usage: %s [max_nodes]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  printf("inserts,live_nodes,cptree_bytes_per_node,succinct_bytes_per_node,"
+         "build_s,query_ns\n");
+  for (uint32_t n = 1; ; n = (n * 10 > max_nodes && n < max_nodes)
+                              ? max_nodes : n * 10) {
+    CpTreePtr tree;
+    SuccinctCpTreePtr packed;
+    BenchIds ids = { NULL, NULL, 0 };
+    bool ok;
+
+    if (GrowTree(n, &seed, &tree) != 0 ||
+        (ids.of_handle = malloc(sizeof(uint32_t) * tree->num_nodes)) == NULL ||
+        (ids.handles = malloc(sizeof(CpTreeHandle) * tree->num_nodes)) == NULL) {
+      fprintf(stderr, "out of memory\n");
+      return EXIT_FAILURE;
+    }
+    for (CpTreeHandle h = 0; h < tree->num_nodes; h++) {
+      ids.of_handle[h] = SUCCINCT_NULL;
+    }
+    CpTreePreorder(tree, CPT_ROOT_HANDLE, &NumberNode, &ids);
+
+    double start = Now();
+    if (CreateSuccinctCpTree(tree, &packed) != CREATE_TREE_SUCCESS) {
+      fprintf(stderr, "out of memory\n");
+      return EXIT_FAILURE;
+    }
+    double build = Now() - start;
+
+    ok = CheckTree(tree, packed, &ids);
+    if (ok) {
+      printf("%u,%u,%.1f,%.1f,%.3f,%.0f\n", n, ids.num_live,
+             (double)(tree->num_nodes * sizeof(CpTreeNode) + tree->names_len) /
+             ids.num_live,
+             (double)SuccinctCpTreeBytes(packed) / ids.num_live,
+             build, TimeQueries(packed));
+    }
+    FreeSuccinctCpTree(packed);
+    FreeCpTree(tree);
+    free(ids.of_handle);
+    free(ids.handles);
+    if (!ok) {
+      return EXIT_FAILURE;
+    }
+    if (n >= max_nodes) {
+      break;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "CP.h"
+#include "Allocator.h"
+#include "Allocator_priv.h"
+
+// Allocate, resize and release through @allocator, or through malloc
+// and friends if it is NULL.
+static void *AllocWith(CPAllocator *allocator, size_t size, bool zero);
+static void *ResizeWith(CPAllocator *allocator,
+                        void *ptr,
+                        size_t old_size,
+                        size_t new_size);
+static void ReleaseWith(CPAllocator *allocator, void *ptr, size_t size);
+
+// The functions of a counting allocator.
+static void *CountingAlloc(CPAllocator *self, size_t size, bool zero);
+static void *CountingResize(CPAllocator *self,
+                            void *ptr,
+                            size_t old_size,
+                            size_t new_size);
+static void CountingRelease(CPAllocator *self, void *ptr, size_t size);
+
+// Adds @size bytes to the live bytes of @counter, and raises its peak
+// if need be.
+static void AddLiveBytes(CountingAllocatorRecord *counter, uint64_t size);
+
+// The functions of an arena.
+static void *ArenaAlloc(CPAllocator *self, size_t size, bool zero);
+static void *ArenaResize(CPAllocator *self,
+                         void *ptr,
+                         size_t old_size,
+                         size_t new_size);
+static void ArenaRelease(CPAllocator *self, void *ptr, size_t size);
+
+// The allocator of each site, or NULL for malloc and friends.
+static CPAllocator *allocators[CP_ALLOC_NUM_SITES] = { NULL };
+
+void CPSetAllocator(int32_t site, CPAllocator *allocator) {
+  assert(site >= 0 && site < CP_ALLOC_NUM_SITES);
+  allocators[site] = allocator;
+}
+
+CPAllocator *CPGetAllocator(int32_t site) {
+  assert(site >= 0 && site < CP_ALLOC_NUM_SITES);
+  return allocators[site];
+}
+
+void *CPMalloc(int32_t site, size_t size) {
+  return AllocWith(allocators[site], size, false);
+}
+
+void *CPCalloc(int32_t site, size_t num, size_t size) {
+  if (size != 0 && num > SIZE_MAX / size) {
+    return NULL;
+  }
+  return AllocWith(allocators[site], num * size, true);
+}
+
+void *CPRealloc(int32_t site, void *ptr, size_t old_size, size_t new_size) {
+  return ResizeWith(allocators[site], ptr, old_size, new_size);
+}
+
+void CPFree(int32_t site, void *ptr, size_t size) {
+  ReleaseWith(allocators[site], ptr, size);
+}
+
+static void *AllocWith(CPAllocator *allocator, size_t size, bool zero) {
+  if (allocator == NULL) {
+    return zero ? calloc(1, size) : malloc(size);
+  }
+  return allocator->alloc(allocator, size, zero);
+}
+
+static void *ResizeWith(CPAllocator *allocator,
+                        void *ptr,
+                        size_t old_size,
+                        size_t new_size) {
+  if (allocator == NULL) {
+    return realloc(ptr, new_size);
+  }
+  return allocator->resize(allocator, ptr, old_size, new_size);
+}
+
+static void ReleaseWith(CPAllocator *allocator, void *ptr, size_t size) {
+  if (ptr == NULL) {
+    return;
+  }
+  if (allocator == NULL) {
+    free(ptr);
+  } else {
+    allocator->release(allocator, ptr, size);
+  }
+}
+
+CPCountingAllocator MakeCountingAllocator(CPAllocator *parent) {
+  CountingAllocatorRecord *counter = malloc(sizeof(CountingAllocatorRecord));
+  if (counter == NULL) {
+    return NULL;
+  }
+
+  counter->base.alloc = &CountingAlloc;
+  counter->base.resize = &CountingResize;
+  counter->base.release = &CountingRelease;
+  counter->parent = parent;
+  atomic_init(&counter->allocs, 0);
+  atomic_init(&counter->resizes, 0);
+  atomic_init(&counter->frees, 0);
+  atomic_init(&counter->bytes, 0);
+  atomic_init(&counter->live_bytes, 0);
+  atomic_init(&counter->peak_bytes, 0);
+  return counter;
+}
+
+void FreeCountingAllocator(CPCountingAllocator counter) {
+  assert(counter != NULL);
+  free(counter);
+}
+
+CPAllocator *CountingAllocatorBase(CPCountingAllocator counter) {
+  assert(counter != NULL);
+  return &counter->base;
+}
+
+void CountingAllocatorCounts(CPCountingAllocator counter, CPAllocCounts *ret) {
+  assert(counter != NULL);
+  ret->allocs = atomic_load_explicit(&counter->allocs, memory_order_relaxed);
+  ret->resizes = atomic_load_explicit(&counter->resizes, memory_order_relaxed);
+  ret->frees = atomic_load_explicit(&counter->frees, memory_order_relaxed);
+  ret->bytes = atomic_load_explicit(&counter->bytes, memory_order_relaxed);
+  ret->live_bytes = atomic_load_explicit(&counter->live_bytes,
+                                         memory_order_relaxed);
+  ret->peak_bytes = atomic_load_explicit(&counter->peak_bytes,
+                                         memory_order_relaxed);
+}
+
+static void *CountingAlloc(CPAllocator *self, size_t size, bool zero) {
+  CountingAllocatorRecord *counter = (CountingAllocatorRecord *)self;
+  void *ptr = AllocWith(counter->parent, size, zero);
+
+  if (ptr != NULL) {
+    atomic_fetch_add_explicit(&counter->allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counter->bytes, size, memory_order_relaxed);
+    AddLiveBytes(counter, size);
+  }
+  return ptr;
+}
+
+static void *CountingResize(CPAllocator *self,
+                            void *ptr,
+                            size_t old_size,
+                            size_t new_size) {
+  CountingAllocatorRecord *counter = (CountingAllocatorRecord *)self;
+  void *new_ptr;
+
+  if (ptr == NULL) {
+    return CountingAlloc(self, new_size, false);
+  }
+  new_ptr = ResizeWith(counter->parent, ptr, old_size, new_size);
+  if (new_ptr == NULL) {
+    return NULL;
+  }
+
+  atomic_fetch_add_explicit(&counter->resizes, 1, memory_order_relaxed);
+  if (new_size >= old_size) {
+    atomic_fetch_add_explicit(&counter->bytes, new_size - old_size,
+                              memory_order_relaxed);
+    AddLiveBytes(counter, new_size - old_size);
+  } else {
+    atomic_fetch_sub_explicit(&counter->live_bytes, old_size - new_size,
+                              memory_order_relaxed);
+  }
+  return new_ptr;
+}
+
+static void CountingRelease(CPAllocator *self, void *ptr, size_t size) {
+  CountingAllocatorRecord *counter = (CountingAllocatorRecord *)self;
+
+  ReleaseWith(counter->parent, ptr, size);
+  atomic_fetch_add_explicit(&counter->frees, 1, memory_order_relaxed);
+  atomic_fetch_sub_explicit(&counter->live_bytes, size, memory_order_relaxed);
+}
+
+static void AddLiveBytes(CountingAllocatorRecord *counter, uint64_t size) {
+  uint64_t live = atomic_fetch_add_explicit(&counter->live_bytes, size,
+                                            memory_order_relaxed) + size;
+  uint64_t peak = atomic_load_explicit(&counter->peak_bytes,
+                                       memory_order_relaxed);
+
+  while (live > peak &&
+         !atomic_compare_exchange_weak_explicit(&counter->peak_bytes, &peak,
+                                                live, memory_order_relaxed,
+                                                memory_order_relaxed)) { }
+}
+
+CPArena MakeArena(size_t chunk_size) {
+  ArenaRecord *arena = malloc(sizeof(ArenaRecord));
+  if (arena == NULL) {
+    return NULL;
+  }
+
+  arena->chunk_size = CP_ALLOC_ROUND(chunk_size);
+  arena->chunks = malloc(CP_ARENA_HEADER + arena->chunk_size);
+  if (arena->chunks == NULL) {
+    free(arena);
+    return NULL;
+  }
+
+  arena->base.alloc = &ArenaAlloc;
+  arena->base.resize = &ArenaResize;
+  arena->base.release = &ArenaRelease;
+  arena->chunks->next = NULL;
+  arena->chunks->size = arena->chunk_size;
+  ResetArena(arena);
+  return arena;
+}
+
+void FreeArena(CPArena arena) {
+  assert(arena != NULL);
+  ResetArena(arena);
+  free(arena->chunks);
+  free(arena);
+}
+
+void ResetArena(CPArena arena) {
+  ArenaChunk *first, *chunk, *next;
+
+  assert(arena != NULL);
+  first = arena->chunks;
+  for (chunk = first->next; chunk != NULL; chunk = next) {
+    next = chunk->next;
+    free(chunk);
+  }
+  first->next = NULL;
+  arena->pos = (char *)first + CP_ARENA_HEADER;
+  arena->end = arena->pos + first->size;
+  arena->last = NULL;
+}
+
+CPAllocator *ArenaBase(CPArena arena) {
+  assert(arena != NULL);
+  return &arena->base;
+}
+
+static void *ArenaAlloc(CPAllocator *self, size_t size, bool zero) {
+  ArenaRecord *arena = (ArenaRecord *)self;
+  ArenaChunk *chunk;
+  char *block;
+
+  size = CP_ALLOC_ROUND(size);
+
+  // A big block gets a chunk of its own, behind the first chunk, so the
+  // rest of the first chunk isn't thrown away to make room for it.
+  if (size > arena->chunk_size / 4) {
+    if ((chunk = malloc(CP_ARENA_HEADER + size)) == NULL) {
+      return NULL;
+    }
+    chunk->size = size;
+    chunk->next = arena->chunks->next;
+    arena->chunks->next = chunk;
+    block = (char *)chunk + CP_ARENA_HEADER;
+    return zero ? memset(block, 0, size) : block;
+  }
+
+  if (size > (size_t)(arena->end - arena->pos)) {
+    if ((chunk = malloc(CP_ARENA_HEADER + arena->chunk_size)) == NULL) {
+      return NULL;
+    }
+    chunk->size = arena->chunk_size;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->pos = (char *)chunk + CP_ARENA_HEADER;
+    arena->end = arena->pos + chunk->size;
+  }
+
+  block = arena->pos;
+  arena->pos += size;
+  arena->last = block;
+  return zero ? memset(block, 0, size) : block;
+}
+
+static void *ArenaResize(CPAllocator *self,
+                         void *ptr,
+                         size_t old_size,
+                         size_t new_size) {
+  ArenaRecord *arena = (ArenaRecord *)self;
+  void *new_ptr;
+
+  // The last block allocated can grow (or shrink) where it is, if there
+  // is room for it in the chunk.
+  if (ptr != NULL && ptr == arena->last &&
+      CP_ALLOC_ROUND(new_size) <= (size_t)(arena->end - arena->last)) {
+    arena->pos = arena->last + CP_ALLOC_ROUND(new_size);
+    return ptr;
+  }
+
+  if ((new_ptr = ArenaAlloc(self, new_size, false)) == NULL) {
+    return NULL;
+  }
+  if (ptr != NULL) {
+    memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+  }
+  return new_ptr;
+}
+
+static void ArenaRelease(CPAllocator *self, void *ptr, size_t size) {
+  ArenaRecord *arena = (ArenaRecord *)self;
+
+  // Only the last block allocated can be given back before the arena
+  // is reset.
+  if (ptr == arena->last) {
+    arena->pos = arena->last;
+    arena->last = NULL;
+  }
+}
@@ -0,0 +1,127 @@
+#ifndef _ALLOCATOR_H_
+#define _ALLOCATOR_H_
+
+#include <stdbool.h>  // for bool type (true, false)
+#include <stddef.h>   // for size_t
+#include <stdint.h>   // for uint64_t, etc.
+
+#include "CP.h"
+
+// Every part of the program listed below allocates its memory through
+// CPMalloc and friends rather than malloc and friends, naming itself as
+// the site of the allocation. Each site can be given an allocator of
+// its own with CPSetAllocator, e.g. to count what it allocates (see
+// MakeCountingAllocator), or to allocate from an arena (see MakeArena).
+// A site which hasn't been given one uses malloc, calloc, realloc and
+// free, so that it costs next to nothing to go through this interface.
+//
+// Unlike free, CPFree (and CPRealloc) is told how big the block being
+// freed is, so an allocator doesn't have to keep the size of each block
+// next to it. Memory allocated for a site must only be freed (or
+// reallocated) for the same site. An allocator should be set before
+// its site allocates anything, and before any other thread is started.
+
+// The sites.
+#define CP_ALLOC_LIST        0  // LinkedList
+#define CP_ALLOC_HASHTABLE   1  // HashTable (but for the LinkedLists of it)
+#define CP_ALLOC_TREE        2  // checkpoint_tree
+#define CP_ALLOC_FILEHANDLER 3  // checkpoint_filehandler, and the strings
+                                // of the tables of the log
+#define CP_ALLOC_NUM_SITES   4
+
+// The most an allocator's blocks have to be aligned to.
+#define CP_ALLOC_ALIGN 16
+
+// An allocator. An allocator with state of its own starts with a
+// CPAllocator, so that it can be used anywhere a CPAllocator * is
+// expected, and its functions are passed that pointer as @self.
+typedef struct cp_allocator {
+  // Returns a block of @size bytes (which are zero if @zero is true),
+  // or NULL if out of memory.
+  void *(*alloc)(struct cp_allocator *self, size_t size, bool zero);
+  // Returns a block of @new_size bytes, which starts with the first
+  // @old_size (or @new_size, if fewer) bytes of the block @ptr, and
+  // frees @ptr. Returns NULL if out of memory, in which case @ptr is
+  // left as it was.
+  void *(*resize)(struct cp_allocator *self,
+                  void *ptr,
+                  size_t old_size,
+                  size_t new_size);
+  // Frees the block @ptr, of @size bytes.
+  void  (*release)(struct cp_allocator *self, void *ptr, size_t size);
+} CPAllocator;
+
+// What a counting allocator has counted.
+typedef struct cp_alloc_counts {
+  uint64_t allocs;      // # of blocks allocated
+  uint64_t resizes;     // # of blocks reallocated
+  uint64_t frees;       // # of blocks freed
+  uint64_t bytes;       // # of bytes allocated (a block which grows
+                        // counts the bytes it grew by)
+  uint64_t live_bytes;  // # of bytes allocated and not yet freed
+  uint64_t peak_bytes;  // the most live_bytes has been
+} CPAllocCounts;
+
+struct cp_counting_allocator;
+typedef struct cp_counting_allocator *CPCountingAllocator;
+
+struct cp_arena;
+typedef struct cp_arena *CPArena;
+
+// Makes @allocator the allocator of @site, or if it is NULL, makes the
+// site use malloc and friends again.
+void CPSetAllocator(int32_t site, CPAllocator *allocator);
+
+// Returns the allocator of @site, or NULL if it uses malloc and friends.
+CPAllocator *CPGetAllocator(int32_t site);
+
+// malloc, calloc, realloc and free, through the allocator of @site.
+// CPRealloc and CPFree have to be given the size @ptr was allocated
+// with. CPFree does nothing if @ptr is NULL, and CPRealloc allocates a
+// new block.
+void *CPMalloc(int32_t site, size_t size);
+void *CPCalloc(int32_t site, size_t num, size_t size);
+void *CPRealloc(int32_t site, void *ptr, size_t old_size, size_t new_size);
+void CPFree(int32_t site, void *ptr, size_t size);
+
+// Makes an allocator which counts what it allocates and frees, and
+// leaves the allocating and freeing to @parent (or to malloc and
+// friends, if it is NULL). The counts are kept with atomic operations,
+// so it can be used by more than one thread at once (if @parent can).
+//
+// Returns NULL on ERROR, non-NULL on success.
+CPCountingAllocator MakeCountingAllocator(CPAllocator *parent);
+
+// Frees @counter (but not its parent). Nothing may be allocated or
+// freed through it anymore.
+void FreeCountingAllocator(CPCountingAllocator counter);
+
+// Returns the CPAllocator of @counter, to be passed to CPSetAllocator.
+CPAllocator *CountingAllocatorBase(CPCountingAllocator counter);
+
+// Copies what @counter has counted so far into @ret.
+void CountingAllocatorCounts(CPCountingAllocator counter, CPAllocCounts *ret);
+
+// Makes an allocator which hands out blocks from big chunks of memory,
+// @chunk_size bytes each (blocks bigger than a quarter of that get a
+// chunk of their own). Freeing a block does nothing: the memory is only
+// given back all at once, by ResetArena or FreeArena. That makes
+// allocating a block little more than adding to a pointer, but an arena
+// only suits a site which is done with everything it allocated at once,
+// and is only used by one thread at a time.
+//
+// Returns NULL on ERROR, non-NULL on success.
+CPArena MakeArena(size_t chunk_size);
+
+// Frees @arena and every block allocated from it.
+void FreeArena(CPArena arena);
+
+// Frees every block allocated from @arena, which can be used again.
+// The first chunk is kept, so filling the arena again up to the same
+// size doesn't have to allocate as much.
+void ResetArena(CPArena arena);
+
+// Returns the CPAllocator of @arena, to be passed to CPSetAllocator.
+CPAllocator *ArenaBase(CPArena arena);
+
+#endif  // _ALLOCATOR_H_
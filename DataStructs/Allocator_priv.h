@@ -0,0 +1,48 @@
+#ifndef _ALLOCATOR_PRIV_H_
+#define _ALLOCATOR_PRIV_H_
+
+#include <stdatomic.h>
+
+#include "./CP.h"
+#include "./Allocator.h"
+
+// Define the internal, private structs associated with the allocators.
+
+// Rounds @size up to a multiple of CP_ALLOC_ALIGN.
+#define CP_ALLOC_ROUND(size) \
+  (((size) + CP_ALLOC_ALIGN - 1) & ~(size_t)(CP_ALLOC_ALIGN - 1))
+
+// A counting allocator. Starts with its CPAllocator, so that a pointer
+// to one is a pointer to the other.
+typedef struct cp_counting_allocator {
+  CPAllocator       base;
+  CPAllocator      *parent;  // what allocates, or NULL for malloc
+  _Atomic uint64_t  allocs;  // see CPAllocCounts
+  _Atomic uint64_t  resizes;
+  _Atomic uint64_t  frees;
+  _Atomic uint64_t  bytes;
+  _Atomic uint64_t  live_bytes;
+  _Atomic uint64_t  peak_bytes;
+} CountingAllocatorRecord;
+
+// One chunk of an arena. Its blocks start CP_ARENA_HEADER bytes in.
+typedef struct arena_chunk {
+  struct arena_chunk *next;  // the chunk made before this one, or NULL
+  size_t              size;  // # of bytes for blocks
+} ArenaChunk;
+
+#define CP_ARENA_HEADER CP_ALLOC_ROUND(sizeof(ArenaChunk))
+
+// An arena. Blocks are handed out from the first of its chunks, which
+// is always one of chunk_size bytes (a block which gets a chunk of its
+// own is put after it).
+typedef struct cp_arena {
+  CPAllocator  base;
+  size_t       chunk_size;
+  ArenaChunk  *chunks;  // never NULL
+  char        *pos;     // where the next block of the first chunk starts
+  char        *end;     // the end of the first chunk
+  char        *last;    // the block which ends at pos, or NULL
+} ArenaRecord;
+
+#endif  // _ALLOCATOR_PRIV_H_
@@ -0,0 +1,626 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "CP.h"
+#include "ConcurrentHashTable.h"
+#include "ConcurrentHashTable_priv.h"
+
+// Allocates an array of @bucket_count (a power of two) empty chains.
+//
+// Returns NULL on a memory error.
+static CHTBuckets *MakeBuckets(CPSize_t bucket_count);
+
+// Returns the stripe which guards the key whose mixed hash is @hash.
+static CHTStripe *StripeFor(CHashTable table, uint64_t hash);
+
+// Returns the chain in @buckets which the key whose mixed hash is
+// @hash belongs in.
+static _Atomic(CHTNode*) *ChainFor(CHTBuckets *buckets, uint64_t hash);
+
+// Looks for @key in the chain @chain, and if it is there, returns a copy
+// of its key/value through @keyvalue.
+//
+// Returns 1 if the key was found, and 0 otherwise.
+static int32_t FindInChain(_Atomic(CHTNode*) *chain,
+                           HashTabKey_t key,
+                           HashTabKV *keyvalue);
+
+// Returns the array of buckets of @table in which a writer is to look for
+// the key whose mixed hash is @hash. If the table is growing, the key's
+// old bucket is moved first (see MigrateBucket), with the moved nodes
+// returned through @moved. The caller must hold the key's writer lock.
+static CHTBuckets *WriterBuckets(CHashTable table,
+                                 CHTThread thread,
+                                 uint64_t hash,
+                                 CHTNode **moved);
+
+// Starts doubling the number of buckets of @table if it is over its load
+// factor, and then moves some of the old buckets over (see
+// MigrateBuckets). Only swapping in the new array takes every writer lock,
+// so the caller must hold none of them. If memory runs out the table
+// simply keeps its current buckets.
+static void MaybeGrow(CHashTable table, CHTThread thread);
+
+// If @table is growing, moves up to CHT_MIGRATE_BUCKETS_PER_OP more of
+// its old buckets into the new array, and retires the old array once
+// they all are. Takes the writer lock of each bucket it moves, so the
+// caller must hold none of them.
+static void MigrateBuckets(CHashTable table, CHTThread thread);
+
+// Moves the chain of the bucket @index of @old_buckets into @buckets, the
+// array which replaced it. Readers may be walking the chain, so its nodes
+// are copied, and the copies linked in before the old chain is emptied.
+// Moving a bucket which was moved already does nothing. The caller must
+// hold the bucket's writer lock.
+//
+// Returns:
+//
+//  - 0 if memory ran out, in which case nothing was moved.
+//
+//  - +1 on success, in which case the old nodes (still chained together,
+//    and no longer owning their values) are returned through @moved, to
+//    be retired once the lock is let go of (see RetireChain).
+static int32_t MigrateBucket(CHTBuckets *old_buckets,
+                             CHTBuckets *buckets,
+                             CPSize_t index,
+                             CHTNode **moved);
+
+// Retires every node of @chain.
+static void RetireChain(CHashTable table, CHTThread thread, CHTNode *chain);
+
+// Hands @retired to @thread's list of retired things, to be freed once
+// no reader can still see it. Every so often, tries to free what has been
+// retired so far.
+static void Retire(CHashTable table, CHTThread thread, CHTRetired *retired);
+
+// Advances the global epoch if every thread in a critical section has
+// seen the current one, then frees everything @thread retired at least
+// two epochs ago.
+static void Reclaim(CHashTable table, CHTThread thread);
+
+// The free functions of retired nodes and bucket arrays.
+static void FreeRetiredNode(CHashTable table, CHTRetired *retired);
+static void FreeRetiredBuckets(CHashTable table, CHTRetired *retired);
+
+CHashTable MakeCHashTable(CPSize_t bucket_count,
+                          CPSize_t max_threads,
+                          ValueFreeFnPtr free_func) {
+  CHashTable table;
+  CPSize_t i, rounded;
+
+  // defensive programming
+  if (bucket_count == 0 || max_threads == 0 || free_func == NULL) {
+    return NULL;
+  }
+
+  // Buckets are picked by masking a hash, so there must be a power of two
+  // (and no fewer than there are stripes, see CHT_STRIPE_BITS).
+  rounded = CHT_NUM_STRIPES;
+  while (rounded < bucket_count) {
+    rounded <<= 1;
+  }
+
+  // The record and the thread slots are cache line aligned (see
+  // CHT_CACHE_LINE), which malloc doesn't guarantee.
+  table = aligned_alloc(CHT_CACHE_LINE, sizeof(CHashTableRecord));
+  if (table == NULL) {
+    return NULL;
+  }
+  table->threads = aligned_alloc(CHT_CACHE_LINE,
+                                 sizeof(CHTThreadRecord) * max_threads);
+  CHTBuckets *buckets = MakeBuckets(rounded);
+  if (table->threads == NULL || buckets == NULL) {
+    // make sure we don't leak!
+    free(table->threads);
+    free(buckets);
+    free(table);
+    return NULL;
+  }
+
+  for (i = 0; i < max_threads; i++) {
+    atomic_init(&table->threads[i].epoch, CHT_QUIESCENT);
+    table->threads[i].nesting = 0;
+    table->threads[i].retired = NULL;
+    table->threads[i].num_retired = 0;
+  }
+  for (i = 0; i < CHT_NUM_STRIPES; i++) {
+    pthread_mutex_init(&table->stripes[i].lock, NULL);
+    atomic_init(&table->stripes[i].size, 0);
+  }
+  atomic_init(&table->buckets, buckets);
+  atomic_init(&table->old_buckets, NULL);
+  atomic_init(&table->num_threads, 0);
+  atomic_init(&table->global_epoch, CHT_FIRST_EPOCH);
+  table->free_func = free_func;
+  table->max_threads = max_threads;
+
+  return table;
+}
+
+static CHTBuckets *MakeBuckets(CPSize_t bucket_count) {
+  CHTBuckets *buckets = malloc(sizeof(CHTBuckets)
+                               + sizeof(_Atomic(CHTNode*)) * bucket_count);
+  if (buckets == NULL) {
+    return NULL;
+  }
+
+  buckets->bucket_count = bucket_count;
+  buckets->retired.free_fn = &FreeRetiredBuckets;
+  atomic_init(&buckets->migrate_pos, 0);
+  for (CPSize_t i = 0; i < bucket_count; i++) {
+    atomic_init(&buckets->chains[i], NULL);
+  }
+  return buckets;
+}
+
+void FreeCHashTable(CHashTable table) {
+  assert(table != NULL);  // be defensive
+
+  // Nobody else is using the table, so everything retired can go...
+  CPSize_t num_threads = atomic_load(&table->num_threads);
+  for (CPSize_t i = 0; i < num_threads; i++) {
+    CHTRetired *retired = table->threads[i].retired, *next;
+    while (retired != NULL) {
+      next = retired->next;
+      retired->free_fn(table, retired);
+      retired = next;
+    }
+  }
+
+  // ...along with every element still in the table, values included
+  // (including those which weren't moved out of the old buckets yet).
+  CHTBuckets *arrays[2] = { atomic_load(&table->buckets),
+                            atomic_load(&table->old_buckets) };
+  for (int32_t a = 0; a < 2 && arrays[a] != NULL; a++) {
+    for (CPSize_t i = 0; i < arrays[a]->bucket_count; i++) {
+      CHTNode *node = atomic_load(&arrays[a]->chains[i]), *next;
+      while (node != NULL) {
+        next = atomic_load(&node->next);
+        table->free_func(node->kv.value);
+        free(node);
+        node = next;
+      }
+    }
+    free(arrays[a]);
+  }
+
+  for (CPSize_t i = 0; i < CHT_NUM_STRIPES; i++) {
+    pthread_mutex_destroy(&table->stripes[i].lock);
+  }
+  free(table->threads);
+  free(table);
+}
+
+CPSize_t CHTSize(CHashTable table) {
+  assert(table != NULL);
+  CPSize_t size = 0;
+  for (CPSize_t i = 0; i < CHT_NUM_STRIPES; i++) {
+    size += atomic_load_explicit(&table->stripes[i].size, memory_order_relaxed);
+  }
+  return size;
+}
+
+int32_t CHTRegisterThread(CHashTable table, CHTThread *ret) {
+  assert(table != NULL);
+
+  CPSize_t slot = atomic_fetch_add(&table->num_threads, 1);
+  if (slot >= table->max_threads) {
+    atomic_fetch_sub(&table->num_threads, 1);
+    return 0;
+  }
+
+  *ret = &table->threads[slot];
+  return 1;
+}
+
+void CHTEnter(CHashTable table, CHTThread thread) {
+  if (thread->nesting++ > 0) {
+    return;
+  }
+
+  // Announce the epoch we are reading in. The fence keeps any of the
+  // loads made inside the critical section from happening before the
+  // announcement is visible to a thread trying to advance the epoch.
+  atomic_store_explicit(&thread->epoch,
+                        atomic_load(&table->global_epoch),
+                        memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+void CHTExit(CHashTable table, CHTThread thread) {
+  assert(thread->nesting > 0);
+  if (--thread->nesting > 0) {
+    return;
+  }
+
+  // Everything read inside the critical section must be done with
+  // before anyone can see we've left it.
+  atomic_store_explicit(&thread->epoch, CHT_QUIESCENT, memory_order_release);
+}
+
+int32_t CHTLookup(CHashTable table,
+                  CHTThread thread,
+                  HashTabKey_t key,
+                  HashTabKV *keyvalue) {
+  assert(table != NULL);
+  uint64_t hash = CHTMixKey(key);
+  CHTBuckets *buckets, *old_buckets;
+  int32_t found;
+
+  CHTEnter(table, thread);
+  do {
+    buckets = atomic_load_explicit(&table->buckets, memory_order_acquire);
+    old_buckets = atomic_load_explicit(&table->old_buckets,
+                                       memory_order_acquire);
+    // A chain is copied into the new buckets before it is emptied, so
+    // the old buckets have to be looked in first.
+    found = (old_buckets != NULL &&
+             FindInChain(ChainFor(old_buckets, hash), key, keyvalue)) ||
+            FindInChain(ChainFor(buckets, hash), key, keyvalue);
+    // If the table started growing since, the key may have been moved
+    // out of the buckets we looked in.
+  } while (!found &&
+           atomic_load_explicit(&table->buckets, memory_order_acquire)
+           != buckets);
+  CHTExit(table, thread);
+
+  return found;
+}
+
+static int32_t FindInChain(_Atomic(CHTNode*) *chain,
+                           HashTabKey_t key,
+                           HashTabKV *keyvalue) {
+  CHTNode *node = atomic_load_explicit(chain, memory_order_acquire);
+  while (node != NULL) {
+    if (node->kv.key == key) {
+      *keyvalue = node->kv;
+      return 1;
+    }
+    node = atomic_load_explicit(&node->next, memory_order_acquire);
+  }
+  return 0;
+}
+
+int32_t CHTInsert(CHashTable table, CHTThread thread, HashTabKV kv_to_insert) {
+  assert(table != NULL);
+  uint64_t hash = CHTMixKey(kv_to_insert.key);
+  CHTStripe *stripe = StripeFor(table, hash);
+  int32_t res = 1;
+
+  // The new node is filled in before it is linked in, so a reader which
+  // finds it always sees all of it.
+  CHTNode *new_node = malloc(sizeof(CHTNode));
+  if (new_node == NULL) {
+    return 0;
+  }
+  new_node->retired.free_fn = &FreeRetiredNode;
+  new_node->kv = kv_to_insert;
+  new_node->owns_value = true;
+
+  pthread_mutex_lock(&stripe->lock);
+  CHTNode *moved;
+  CHTBuckets *buckets = WriterBuckets(table, thread, hash, &moved);
+  _Atomic(CHTNode*) *link = ChainFor(buckets, hash);
+  CHTNode *node = atomic_load_explicit(link, memory_order_relaxed);
+  while (node != NULL && node->kv.key != kv_to_insert.key) {
+    link = &node->next;
+    node = atomic_load_explicit(link, memory_order_relaxed);
+  }
+
+  if (node != NULL) {
+    // Replace the old node in place, so readers see either the old
+    // value or the new one, and never neither.
+    atomic_init(&new_node->next,
+                atomic_load_explicit(&node->next, memory_order_relaxed));
+    atomic_store_explicit(link, new_node, memory_order_release);
+    res = 2;
+  } else {
+    atomic_init(&new_node->next, atomic_load_explicit(
+                        ChainFor(buckets, hash), memory_order_relaxed));
+    atomic_store_explicit(ChainFor(buckets, hash),
+                          new_node,
+                          memory_order_release);
+    atomic_fetch_add_explicit(&stripe->size, 1, memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&stripe->lock);
+
+  RetireChain(table, thread, moved);
+  if (res == 2) {
+    Retire(table, thread, &node->retired);
+    MigrateBuckets(table, thread);
+  } else {
+    MaybeGrow(table, thread);
+  }
+  return res;
+}
+
+int32_t CHTRemove(CHashTable table, CHTThread thread, HashTabKey_t key) {
+  assert(table != NULL);
+  uint64_t hash = CHTMixKey(key);
+  CHTStripe *stripe = StripeFor(table, hash);
+
+  pthread_mutex_lock(&stripe->lock);
+  CHTNode *moved;
+  CHTBuckets *buckets = WriterBuckets(table, thread, hash, &moved);
+  _Atomic(CHTNode*) *link = ChainFor(buckets, hash);
+  CHTNode *node = atomic_load_explicit(link, memory_order_relaxed);
+  while (node != NULL && node->kv.key != key) {
+    link = &node->next;
+    node = atomic_load_explicit(link, memory_order_relaxed);
+  }
+
+  if (node == NULL) {
+    pthread_mutex_unlock(&stripe->lock);
+    RetireChain(table, thread, moved);
+    MigrateBuckets(table, thread);
+    return 0;
+  }
+
+  // A reader standing on the node can still follow its next pointer,
+  // which is left untouched.
+  atomic_store_explicit(link,
+                        atomic_load_explicit(&node->next, memory_order_relaxed),
+                        memory_order_release);
+  atomic_fetch_sub_explicit(&stripe->size, 1, memory_order_relaxed);
+  pthread_mutex_unlock(&stripe->lock);
+
+  RetireChain(table, thread, moved);
+  Retire(table, thread, &node->retired);
+  MigrateBuckets(table, thread);
+  return 1;
+}
+
+uint64_t CHTMixKey(HashTabKey_t key) {
+  // The finalizer of MurmurHash3, which spreads every bit of the key
+  // over the bottom bits (the stripe and bucket).
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+  return key;
+}
+
+static CHTStripe *StripeFor(CHashTable table, uint64_t hash) {
+  return &table->stripes[hash & (CHT_NUM_STRIPES - 1)];
+}
+
+static _Atomic(CHTNode*) *ChainFor(CHTBuckets *buckets, uint64_t hash) {
+  return &buckets->chains[hash & (buckets->bucket_count - 1)];
+}
+
+static CHTBuckets *WriterBuckets(CHashTable table,
+                                 CHTThread thread,
+                                 uint64_t hash,
+                                 CHTNode **moved) {
+  // The buckets can't be swapped while we hold a writer lock, so the
+  // table can't start growing either.
+  CHTBuckets *buckets = atomic_load_explicit(&table->buckets,
+                                             memory_order_relaxed);
+  CHTBuckets *old_buckets;
+  int32_t res = 1;
+
+  *moved = NULL;
+  if (atomic_load_explicit(&table->old_buckets, memory_order_relaxed) == NULL) {
+    return buckets;
+  }
+
+  // It may stop growing though, and the old array be retired, so it is
+  // only looked at inside a critical section.
+  CHTEnter(table, thread);
+  old_buckets = atomic_load_explicit(&table->old_buckets, memory_order_acquire);
+  if (old_buckets != NULL) {
+    res = MigrateBucket(old_buckets, buckets,
+                        hash & (old_buckets->bucket_count - 1), moved);
+  }
+  CHTExit(table, thread);
+
+  // Out of memory: the key's chain stays in the old buckets (where readers
+  // look too), and is written there instead. The old array can't be
+  // retired before the chain is moved, which takes the lock we hold.
+  return res == 0 ? old_buckets : buckets;
+}
+
+static void MaybeGrow(CHashTable table, CHTThread thread) {
+  CHTBuckets *buckets = atomic_load_explicit(&table->buckets,
+                                             memory_order_acquire);
+  CHTBuckets *new_buckets;
+  CPSize_t i;
+
+  // Without the locks this is only a hint, and another thread may grow
+  // the table first, which is checked for below.
+  if (atomic_load_explicit(&table->old_buckets, memory_order_acquire) == NULL &&
+      CHTSize(table) > buckets->bucket_count * CHT_LOAD_FACTOR &&
+      (new_buckets = MakeBuckets(buckets->bucket_count * 2)) != NULL) {
+    // Always lock the stripes in the same order, so two threads growing
+    // at once can't deadlock. The locks are only held while the arrays
+    // are swapped, and the chains are moved over afterwards.
+    for (i = 0; i < CHT_NUM_STRIPES; i++) {
+      pthread_mutex_lock(&table->stripes[i].lock);
+    }
+    if (atomic_load_explicit(&table->buckets, memory_order_relaxed) == buckets &&
+        atomic_load_explicit(&table->old_buckets, memory_order_relaxed) == NULL) {
+      // Readers which see the new array must also see the old one.
+      atomic_store_explicit(&table->old_buckets, buckets, memory_order_release);
+      atomic_store_explicit(&table->buckets, new_buckets, memory_order_release);
+      new_buckets = NULL;
+    }
+    for (i = CHT_NUM_STRIPES; i > 0; i--) {
+      pthread_mutex_unlock(&table->stripes[i - 1].lock);
+    }
+    free(new_buckets);  // NULL unless another thread grew the table first
+  }
+
+  MigrateBuckets(table, thread);
+}
+
+static void MigrateBuckets(CHashTable table, CHTThread thread) {
+  CHTBuckets *old_buckets, *buckets;
+  CHTNode *moved;
+  CPSize_t index;
+  int32_t res;
+
+  if (atomic_load_explicit(&table->old_buckets, memory_order_relaxed) == NULL) {
+    return;
+  }
+
+  // The old array is retired by whoever moves its last bucket, so it is
+  // only looked at inside a critical section.
+  CHTEnter(table, thread);
+  old_buckets = atomic_load_explicit(&table->old_buckets, memory_order_acquire);
+  for (CPSize_t i = 0; old_buckets != NULL && i < CHT_MIGRATE_BUCKETS_PER_OP; i++) {
+    index = atomic_load(&old_buckets->migrate_pos);
+    if (index >= old_buckets->bucket_count) {
+      break;
+    }
+
+    CHTStripe *stripe = StripeFor(table, index);
+    pthread_mutex_lock(&stripe->lock);
+    buckets = atomic_load_explicit(&table->buckets, memory_order_relaxed);
+    res = MigrateBucket(old_buckets, buckets, index, &moved);
+    pthread_mutex_unlock(&stripe->lock);
+    if (res == 0) {
+      break;  // out of memory, so leave the bucket for a later write
+    }
+    RetireChain(table, thread, moved);
+
+    // Several threads may have moved the same bucket, but only one of
+    // them moves the position on, and the one which moves it past the
+    // last bucket retires the array.
+    if (atomic_compare_exchange_strong(&old_buckets->migrate_pos,
+                                       &index, index + 1) &&
+        index + 1 == old_buckets->bucket_count) {
+      atomic_store_explicit(&table->old_buckets, NULL, memory_order_release);
+      Retire(table, thread, &old_buckets->retired);
+      break;
+    }
+  }
+  CHTExit(table, thread);
+}
+
+static int32_t MigrateBucket(CHTBuckets *old_buckets,
+                             CHTBuckets *buckets,
+                             CPSize_t index,
+                             CHTNode **moved) {
+  _Atomic(CHTNode*) *old_chain = &old_buckets->chains[index];
+  CHTNode *head = atomic_load_explicit(old_chain, memory_order_relaxed);
+  CHTNode *node, *copy, *copies = NULL, *next;
+
+  *moved = NULL;
+  if (head == NULL) {  // empty, or moved already
+    return 1;
+  }
+
+  // Copy every node before linking any in, so running out of memory
+  // leaves both arrays as they were.
+  for (node = head; node != NULL;
+       node = atomic_load_explicit(&node->next, memory_order_relaxed)) {
+    if ((copy = malloc(sizeof(CHTNode))) == NULL) {
+      for (; copies != NULL; copies = next) {
+        next = atomic_load_explicit(&copies->next, memory_order_relaxed);
+        free(copies);
+      }
+      return 0;
+    }
+    *copy = (CHTNode){ .retired = { .free_fn = &FreeRetiredNode },
+                       .kv = node->kv,
+                       .owns_value = true };
+    atomic_init(&copy->next, copies);
+    copies = copy;
+  }
+
+  // The old chain splits between the two new buckets which share its
+  // bottom bits, and so its writer lock.
+  for (copy = copies; copy != NULL; copy = next) {
+    next = atomic_load_explicit(&copy->next, memory_order_relaxed);
+    _Atomic(CHTNode*) *chain = ChainFor(buckets, CHTMixKey(copy->kv.key));
+    atomic_store_explicit(&copy->next,
+                          atomic_load_explicit(chain, memory_order_relaxed),
+                          memory_order_relaxed);
+    atomic_store_explicit(chain, copy, memory_order_release);
+  }
+
+  // From here on, the copies own the values.
+  for (node = head; node != NULL;
+       node = atomic_load_explicit(&node->next, memory_order_relaxed)) {
+    node->owns_value = false;
+  }
+  atomic_store_explicit(old_chain, NULL, memory_order_release);
+  *moved = head;
+  return 1;
+}
+
+static void RetireChain(CHashTable table, CHTThread thread, CHTNode *chain) {
+  CHTNode *next;
+
+  // Retiring a node doesn't touch its next pointer, which readers may
+  // still follow.
+  for (; chain != NULL; chain = next) {
+    next = atomic_load_explicit(&chain->next, memory_order_relaxed);
+    Retire(table, thread, &chain->retired);
+  }
+}
+
+static void Retire(CHashTable table, CHTThread thread, CHTRetired *retired) {
+  // The unlink must be visible to everyone before we read the epoch, or
+  // a reader entering after this could still find the retired thing.
+  atomic_thread_fence(memory_order_seq_cst);
+  retired->epoch = atomic_load(&table->global_epoch);
+  retired->next = thread->retired;
+  thread->retired = retired;
+
+  if (++thread->num_retired >= CHT_RECLAIM_THRESHOLD) {
+    Reclaim(table, thread);
+  }
+}
+
+static void Reclaim(CHashTable table, CHTThread thread) {
+  uint64_t epoch = atomic_load(&table->global_epoch);
+  CPSize_t num_threads = atomic_load(&table->num_threads);
+  bool can_advance = true;
+
+  thread->num_retired = 0;
+
+  // The epoch can only move on once every thread in a critical section
+  // has entered it in the current epoch.
+  for (CPSize_t i = 0; i < num_threads && can_advance; i++) {
+    uint64_t seen = atomic_load(&table->threads[i].epoch);
+    can_advance = (seen == CHT_QUIESCENT || seen == epoch);
+  }
+  if (can_advance) {
+    atomic_compare_exchange_strong(&table->global_epoch, &epoch, epoch + 1);
+  }
+
+  // A reader can be at most one epoch behind the global epoch, so a
+  // thing retired two epochs ago was unlinked before any current
+  // reader entered. The list is newest first, so once one thing is
+  // old enough to free, so is everything after it.
+  epoch = atomic_load(&table->global_epoch);
+  CHTRetired **link = &thread->retired;
+  while (*link != NULL && (*link)->epoch + 2 > epoch) {
+    link = &(*link)->next;
+  }
+  CHTRetired *to_free = *link, *next;
+  *link = NULL;
+  for (; to_free != NULL; to_free = next) {
+    next = to_free->next;
+    to_free->free_fn(table, to_free);
+  }
+}
+
+static void FreeRetiredNode(CHashTable table, CHTRetired *retired) {
+  CHTNode *node = (CHTNode *)retired;
+  if (node->owns_value) {
+    table->free_func(node->kv.value);
+  }
+  free(node);
+}
+
+static void FreeRetiredBuckets(CHashTable table, CHTRetired *retired) {
+  // An array is only retired once every chain was moved out of it, and
+  // the moved nodes are retired on their own.
+  free((CHTBuckets *)retired);
+}
@@ -0,0 +1,111 @@
+#ifndef _CONCURRENTHASHTABLE_H_
+#define _CONCURRENTHASHTABLE_H_
+
+#include <stdint.h>     // so we can use uint64_t, etc.
+#include "./CP.h"     // for CPSize_t
+#include "./HashTable.h"  // for HashTabKey_t, HashTabKV, ValueFreeFnPtr
+
+// A CHashTable is a HashTable which can be shared by several threads.
+//
+// Writers (CHTInsert and CHTRemove) take one of a fixed number of locks,
+// chosen by the key, so writers of different keys rarely wait on each
+// other. Readers (CHTLookup) take no lock at all, and never write to
+// memory shared with other threads, so lookups scale with the number of
+// threads doing them.
+//
+// Since a reader may still be looking at an element which a writer has
+// just removed, removed elements are not freed straight away. They are
+// freed once every thread has been seen outside of the table since the
+// element was removed (epoch-based reclamation). For that to work, every
+// thread has to register with the table before using it.
+//
+// Like a HashTable, a CHashTable doesn't rehash every element at once
+// when it grows. It swaps in an array twice as big, and then every write
+// moves a few buckets of the old array over, so no write has to wait for
+// the whole table to be copied. Until an element is moved, readers look
+// for it in both arrays.
+//
+// Unlike a HashTable, a CHashTable owns its values: a value which is
+// replaced or removed is passed to the table's free function once no
+// reader can still see it.
+struct chashtablerecord;
+typedef struct chashtablerecord *CHashTable;
+
+// The per-thread state of a thread registered with a CHashTable.
+struct cht_threadrec;
+typedef struct cht_threadrec *CHTThread;
+
+// Makes a CHashTable which starts with (at least) @bucket_count buckets,
+// and can be used by up to @max_threads threads. Replaced and removed
+// values are freed with @free_func.
+//
+// Returns NULL on ERROR, non-NULL on success.
+CHashTable MakeCHashTable(CPSize_t bucket_count,
+                          CPSize_t max_threads,
+                          ValueFreeFnPtr free_func);
+
+// Frees the CHashTable table, and invokes its free function on every
+// value still in it. No other thread may be using the table.
+void FreeCHashTable(CHashTable table);
+
+// Returns the number of elements in the table. While other threads are
+// writing to the table, this is only an estimate.
+CPSize_t CHTSize(CHashTable table);
+
+// Registers the calling thread with @table. The returned CHTThread must
+// only be used by the thread which registered it.
+//
+// Returns:
+//
+// - 0 if @max_threads threads have already registered.
+//
+// - +1 on success, in which case the thread is returned through @ret.
+int32_t CHTRegisterThread(CHashTable table, CHTThread *ret);
+
+// Marks the start and end of a read-side critical section. A value
+// returned by CHTLookup is only guaranteed to stay alive until the
+// end of the critical section it was looked up in, so a thread which
+// needs to use a value after looking it up must wrap both in
+// CHTEnter/CHTExit. Critical sections may be nested. A thread should
+// not stay inside one for long, since nothing removed in the meantime
+// can be freed until it leaves.
+void CHTEnter(CHashTable table, CHTThread thread);
+void CHTExit(CHashTable table, CHTThread thread);
+
+// Inserts a key,value pair into the table. If the key is already in
+// the table, its old value is replaced (and freed later on).
+//
+// Returns:
+//
+//  - 0 on failure (e.g., out of memory)
+//
+//  - +1 if the key was not in the table before
+//
+//  - +2 if the key's old value was replaced
+int32_t CHTInsert(CHashTable table, CHTThread thread, HashTabKV kv_to_insert);
+
+// Looks up a key in the table, and if it is present, returns a copy
+// of the key/value through @keyvalue. The table keeps ownership of
+// keyvalue->value (see CHTEnter).
+//
+// Returns:
+//
+//  - 0 if the key wasn't found in the table
+//
+//  - +1 if the key was found
+int32_t CHTLookup(CHashTable table,
+                  CHTThread thread,
+                  HashTabKey_t key,
+                  HashTabKV *keyvalue);
+
+// Removes a key and its value from the table. The value is freed once
+// no reader can still see it.
+//
+// Returns:
+//
+//  - 0 if the key wasn't found in the table
+//
+//  - +1 if the key was found and removed
+int32_t CHTRemove(CHashTable table, CHTThread thread, HashTabKey_t key);
+
+#endif  // _CONCURRENTHASHTABLE_H_
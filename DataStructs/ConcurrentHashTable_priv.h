@@ -0,0 +1,111 @@
+#ifndef _CONCURRENTHASHTABLE_PRIV_H_
+#define _CONCURRENTHASHTABLE_PRIV_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "./CP.h"
+#include "./ConcurrentHashTable.h"
+
+// Define the internal, private structs and helper functions associated with a
+// CHashTable.
+
+// The size of a cache line. Anything written by one thread and read by
+// the others is kept on a line of its own, so that threads don't slow
+// each other down by writing to different parts of the same line.
+#define CHT_CACHE_LINE 64
+
+// The writer lock of a key is chosen by the bottom CHT_STRIPE_BITS bits
+// of its hash. A table never has fewer than CHT_NUM_STRIPES buckets, so
+// those bits are also the bottom bits of the key's bucket number, and
+// every chain is guarded by exactly one lock, however big the table gets.
+#define CHT_STRIPE_BITS 6
+#define CHT_NUM_STRIPES (1 << CHT_STRIPE_BITS)
+
+// The table grows (doubling its buckets) once it holds more than this
+// many elements per bucket, the same load factor as a HashTable.
+#define CHT_LOAD_FACTOR 3
+
+// While the table grows, every write moves this many buckets of the old
+// array into the new one (as a HashTable does, see
+// HT_MIGRATE_BUCKETS_PER_OP).
+#define CHT_MIGRATE_BUCKETS_PER_OP 8
+
+// A thread tries to free what it has removed after every this many removals.
+#define CHT_RECLAIM_THRESHOLD 64
+
+// The epoch a thread is in while it is not in a critical section. The
+// global epoch starts above it and only ever goes up.
+#define CHT_QUIESCENT 0
+#define CHT_FIRST_EPOCH 1
+
+// Something which has been unlinked from the table, but which readers
+// may still be looking at. Embedded at the start of everything that
+// can be retired, and chained into the retiring thread's list.
+typedef struct cht_retired {
+  struct cht_retired *next;   // the next (older) retired thing
+  uint64_t            epoch;  // the global epoch when this was retired
+  // frees this, and whatever it is embedded in.
+  void              (*free_fn)(CHashTable table, struct cht_retired *retired);
+} CHTRetired;
+
+// An element of the table. The key never changes once a node is in the
+// table; replacing a value replaces the whole node, so readers can never
+// see a key paired with the wrong value.
+typedef struct cht_node {
+  CHTRetired                retired;     // used once the node is unlinked
+  HashTabKV                 kv;
+  _Atomic(struct cht_node*) next;        // the next node in the chain
+  bool                      owns_value;  // free kv.value along with the node?
+} CHTNode;
+
+// An array of bucket chains. The table swaps in a bigger one when it grows,
+// and then moves the chains of the old one over, a bucket at a time. Once
+// every chain of the old one is empty, it is retired.
+typedef struct cht_buckets {
+  CHTRetired          retired;
+  CPSize_t            bucket_count;  // always a power of two
+  // While this is the array being grown out of, the buckets below this
+  // have been moved.
+  _Atomic CPSize_t    migrate_pos;
+  _Atomic(CHTNode*)   chains[];
+} CHTBuckets;
+
+// A writer lock, along with the number of elements in the buckets it
+// guards, so writers don't all have to update the same counter.
+typedef struct cht_stripe {
+  _Alignas(CHT_CACHE_LINE) pthread_mutex_t lock;
+  _Atomic CPSize_t                         size;
+} CHTStripe;
+
+// The per-thread state of a registered thread.
+typedef struct cht_threadrec {
+  // The global epoch this thread saw when it last entered a critical
+  // section, or CHT_QUIESCENT if it is not in one. Only this field is
+  // read by other threads.
+  _Alignas(CHT_CACHE_LINE) _Atomic uint64_t epoch;
+  uint32_t    nesting;      // how deeply nested the critical section is
+  CHTRetired *retired;      // what this thread has retired, newest first
+  CPSize_t    num_retired;  // # of retired things since the last reclaim
+} CHTThreadRecord;
+
+// This is the struct that we use to represent a concurrent hash table.
+typedef struct chashtablerecord {
+  _Atomic(CHTBuckets*)  buckets;      // the current array of buckets
+  _Atomic(CHTBuckets*)  old_buckets;  // the array being migrated, or NULL
+  ValueFreeFnPtr        free_func;    // frees replaced/removed values
+  CPSize_t              max_threads;  // # of slots in threads
+  _Atomic CPSize_t      num_threads;  // # of slots handed out so far
+  CHTThreadRecord      *threads;      // one slot per registered thread
+  CHTStripe             stripes[CHT_NUM_STRIPES];
+  // Written rarely but read by every critical section, so it gets a line
+  // of its own.
+  _Alignas(CHT_CACHE_LINE) _Atomic uint64_t global_epoch;
+} CHashTableRecord;
+
+// Mixes @key, which the caller may not have hashed well, into the hash
+// that picks its stripe and bucket.
+uint64_t CHTMixKey(HashTabKey_t key);
+
+#endif  // _CONCURRENTHASHTABLE_PRIV_H_
@@ -1,19 +1,65 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <assert.h>
 
 #include "CP.h"
+#include "Allocator.h"
 #include "HashTable.h"
 #include "HashTable_priv.h"
 
 // A private utility function to grow the hashtable (increase
 // the number of buckets) if its load factor has become too high.
+// Growing only allocates the new array of buckets; the elements
+// are moved over by MigrateBuckets, a few buckets per call.
 static void ResizeHashtable(HashTable ht);
 
+// Starts growing @ht to @bucket_count buckets. The current buckets
+// become the old buckets, to be moved over by MigrateBuckets.
+//
+// Returns false on a memory error (the table is unchanged), true otherwise.
+static bool StartMigration(HashTable ht, CPSize_t bucket_count);
+
+// Moves up to @num_buckets of the old buckets of @ht (if it is growing)
+// into its new buckets. Neither the HashTabKVs nor the linked list nodes
+// holding them are reallocated.
+//
+// Returns false on a memory error, true otherwise.
+static bool MigrateBuckets(HashTable ht, CPSize_t num_buckets);
+
+// Returns a pointer to the slot of the bucket in which @key is stored,
+// which is one of the old buckets if that bucket has not been moved yet.
+// The slot holds NULL if nothing has been inserted into that bucket yet.
+static LinkedList *ChainFor(HashTable ht, HashTabKey_t key);
+
 // a free function that does nothing
 static void LLNullFree(LinkedListPayload freeme) { }
-static void HTNullFree(HashTabVal_t freeme) { }
+
+// Returns the # of bytes allocated for the element @p of @ht (which
+// includes the key, if it is a string).
+static inline size_t KVSize(HashTable ht, HashTabKVPtr p) {
+  return ht->str_keys ? sizeof(HTStrKV) + ((HTStrKVPtr)p)->key_len + 1
+                      : sizeof(HashTabKV);
+}
+
+// The hooks set by HTSetTraceHooks, or NULL.
+static HTTraceBeginFnPtr trace_begin = NULL;
+static HTTraceEndFnPtr   trace_end = NULL;
+
+// Calls the begin hook, if there is one, for @op.
+//
+// Returns: what it returned, or 0 if there is none.
+static inline uint64_t TraceOpBegin(int32_t op) {
+  return trace_begin != NULL ? trace_begin(op) : 0;
+}
+
+// Calls the end hook, if there is one, for @op which began at @begin.
+static inline void TraceOpEnd(int32_t op, uint64_t begin) {
+  if (trace_end != NULL) {
+    trace_end(op, begin);
+  }
+}
 
 // Helper method which searches through a LL fora specific key.
 //
@@ -21,6 +67,11 @@ static void HTNullFree(HashTabVal_t freeme) { }
 //
 // - key: The key to search for (using == equality).
 //
+// - str_key: For a string keyed table, the string whose hash is @key.
+//   Only an element with an identical string matches. NULL otherwise.
+//
+// - str_len: The length of str_key.
+//
 // - iter_ptr: A pointer to a (assumed not null) Linked List Iterator.
 //
 // Returns:
@@ -30,8 +81,29 @@ static void HTNullFree(HashTabVal_t freeme) { }
 //
 // - NULL otherwise.
 static HashTabKVPtr search(HashTabKey_t key,
+                            const char *str_key,
+                            CPSize_t str_len,
                             LLIter *iter_ptr);
 
+// The implementations of HTInsert/HTLookup/HTRemove, which are shared with
+// their string keyed counterparts. For a numeric keyed table @str_key is
+// NULL, for a string keyed table @key is HashStr(@str_key, @str_len).
+static int32_t Insert(HashTable table,
+                      HashTabKV kv_to_insert,
+                      const char *str_key,
+                      CPSize_t str_len,
+                      HashTabKV *old_kv_storage);
+static int32_t Lookup(HashTable table,
+                      HashTabKey_t key,
+                      const char *str_key,
+                      CPSize_t str_len,
+                      HashTabKV *keyvalue);
+static int32_t Remove(HashTable table,
+                      HashTabKey_t key,
+                      const char *str_key,
+                      CPSize_t str_len,
+                      HashTabKV *keyvalue);
+
 
 // Inserts a HashTabKV into the specified Linked List.
 //
@@ -39,7 +111,13 @@ static HashTabKVPtr search(HashTabKey_t key,
 //
 // - kv_to_insert: The HashTabKV to insert.
 //
-// - insertchain_ptr: A pointer to the LL to insert the HashTabKV into.
+// - str_key: For a string keyed table, the string to copy in next to
+//   kv_to_insert (making the element an HTStrKV). NULL otherwise.
+//
+// - str_len: The length of str_key.
+//
+// - insertchain_ptr: A pointer to the LL to insert the HashTabKV into. If
+//   it points to NULL, a LL is allocated and stored there.
 //
 // Returns:
 //
@@ -47,11 +125,12 @@ static HashTabKVPtr search(HashTabKey_t key,
 //
 // - 1: If insertion was successful.
 static int32_t InsertHTKVNodeIntoLL(HashTabKV kv_to_insert,
+                                const char *str_key,
+                                CPSize_t str_len,
                                 LinkedList *insertchain_ptr);
 
 HashTable MakeHashTable(CPSize_t bucket_count) {
   HashTable ht;
-  CPSize_t  i;
 
   // defensive programming
   if (bucket_count == 0) {
@@ -59,69 +138,83 @@ HashTable MakeHashTable(CPSize_t bucket_count) {
   }
 
   // allocate the hash table record
-  ht = (HashTable) malloc(sizeof(HashTableRecord));
+  ht = (HashTable) CPMalloc(CP_ALLOC_HASHTABLE, sizeof(HashTableRecord));
   if (ht == NULL) {
     return NULL;
   }
 
-  // initialize the record
+  // initialize the record. Bucket chains are allocated the first
+  // time something is inserted into them.
+  ht->str_keys = false;
   ht->bucket_count = bucket_count;
   ht->ht_size = 0;
-  ht->buckets =
-    (LinkedList *) malloc(bucket_count * sizeof(LinkedList));
+  ht->old_bucket_count = 0;
+  ht->migrate_pos = 0;
+  ht->old_buckets = NULL;
+  ht->resizes = 0;
+  ht->buckets = (LinkedList *) CPCalloc(CP_ALLOC_HASHTABLE, bucket_count,
+                                        sizeof(LinkedList));
   if (ht->buckets == NULL) {
     // make sure we don't leak!
-    free(ht);
+    CPFree(CP_ALLOC_HASHTABLE, ht, sizeof(HashTableRecord));
     return NULL;
   }
-  for (i = 0; i < bucket_count; i++) {
-    ht->buckets[i] = MakeLinkedList();
-    if (ht->buckets[i] == NULL) {
-      // allocating one of our bucket chain lists failed,
-      // so we need to free everything we allocated so far
-      // before returning NULL to indicate failure.  Since
-      // we know the chains are empty, we'll pass in a
-      // free function pointer that does nothing; it should
-      // never be called.
-      CPSize_t j;
-      for (j = 0; j < i; j++) {
-        FreeLinkedList(ht->buckets[j], LLNullFree);
-      }
-      free(ht->buckets);
-      free(ht);
-      return NULL;
-    }
-  }
 
   return (HashTable) ht;
 }
 
-void FreeHashTable(HashTable table,
-                   ValueFreeFnPtr free_func) {
-  CPSize_t i;
+HashTable MakeStrHashTable(CPSize_t bucket_count) {
+  HashTable ht = MakeHashTable(bucket_count);
+  if (ht != NULL) {
+    ht->str_keys = true;
+  }
+  return ht;
+}
 
-  assert(table != NULL);  // be defensive
+// Frees every chain in @buckets (of @table), invoking free_func on
+// each value.
+static void FreeBuckets(HashTable table,
+                        LinkedList *buckets,
+                        CPSize_t bucket_count,
+                        ValueFreeFnPtr free_func) {
+  CPSize_t i;
 
   // loop through and free the chains on each bucket
-  for (i = 0; i < table->bucket_count; i++) {
-    LinkedList  bl = table->buckets[i];
+  for (i = 0; i < bucket_count; i++) {
+    LinkedList  bl = buckets[i];
     HashTabKV *nextKV;
 
+    if (bl == NULL) {
+      continue;
+    }
+
     // pop elements off the the chain list, then free the list
     while (LLSize(bl) > 0) {
       assert(LLPop(bl, (LinkedListPayload*)&nextKV));
       free_func(nextKV->value);
-      free(nextKV);
+      CPFree(CP_ALLOC_HASHTABLE, nextKV, KVSize(table, nextKV));
     }
     // the chain list is empty, so we can pass in the
     // null free function to FreeLinkedList.
     FreeLinkedList(bl, LLNullFree);
   }
 
-  // free the bucket array within the table record,
-  // then free the table record itself.
-  free(table->buckets);
-  free(table);
+  CPFree(CP_ALLOC_HASHTABLE, buckets, sizeof(LinkedList) * bucket_count);
+}
+
+void FreeHashTable(HashTable table,
+                   ValueFreeFnPtr free_func) {
+  assert(table != NULL);  // be defensive
+
+  // free the bucket arrays within the table record (the old
+  // buckets which were moved already are NULL), then free the
+  // table record itself.
+  if (table->old_buckets != NULL) {
+    FreeBuckets(table, table->old_buckets, table->old_bucket_count,
+                free_func);
+  }
+  FreeBuckets(table, table->buckets, table->bucket_count, free_func);
+  CPFree(CP_ALLOC_HASHTABLE, table, sizeof(HashTableRecord));
 }
 
 CPSize_t HTSize(HashTable table) {
@@ -129,6 +222,40 @@ CPSize_t HTSize(HashTable table) {
   return table->ht_size;
 }
 
+CPSize_t HTResizeCount(HashTable table) {
+  assert(table != NULL);
+  return table->resizes;
+}
+
+void HTGetStats(HashTable table, HTStats *ret) {
+  double probes = 0;
+
+  assert(table != NULL);
+  assert(ret != NULL);
+
+  memset(ret, 0, sizeof(HTStats));
+  ret->size = table->ht_size;
+  ret->bucket_count = table->bucket_count;
+  ret->resizes = table->resizes;
+  if (table->old_buckets != NULL) {
+    ret->old_bucket_count = table->old_bucket_count - table->migrate_pos;
+  }
+
+  // A lookup of the i'th element of a chain compares i elements, so
+  // looking up each of a chain of length len compares len(len + 1)/2.
+  for (CPSize_t i = 0; i < table->bucket_count + ret->old_bucket_count; i++) {
+    LinkedList chain = i < table->bucket_count ? table->buckets[i] :
+        table->old_buckets[table->migrate_pos + i - table->bucket_count];
+    CPSize_t len = chain == NULL ? 0 : LLSize(chain);
+    ret->chains[len < HT_STATS_MAX_CHAIN ? len : HT_STATS_MAX_CHAIN - 1]++;
+    if (len > ret->longest_chain) {
+      ret->longest_chain = len;
+    }
+    probes += (double)len * (len + 1) / 2;
+  }
+  ret->mean_probe = ret->size == 0 ? 0 : probes / ret->size;
+}
+
 HashTabKey_t HashFunc(unsigned char *buffer, CPSize_t len) {
   // This code is adapted from code by Landon Curt Noll
   // and Bonelli Nicola:
@@ -153,6 +280,86 @@ HashTabKey_t HashFunc(unsigned char *buffer, CPSize_t len) {
   return hval;
 }
 
+// Helpers for HashStr. Loads are done through memcpy, so the
+// buffer does not need to be aligned.
+static inline uint64_t HashStrRead8(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t HashStrRead4(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// Multiplies a and b into a 128 bit product, and folds the
+// two halves of the product back into 64 bits.
+static inline uint64_t HashStrMix(uint64_t a, uint64_t b) {
+  __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+HashTabKey_t HashStr(const char *buffer, CPSize_t len) {
+  // The constants and structure follow wyhash by Wang Yi:
+  //
+  // https://github.com/wangyi-fudan/wyhash
+  static const uint64_t SECRET[4] = {0x2d358dccaa6c78a5ULL,
+                                     0x8bb84b93962eacc9ULL,
+                                     0x4b33a62ed433d4a3ULL,
+                                     0x4d5a2da51de1aa47ULL};
+  const unsigned char *p = (const unsigned char *) buffer;
+  uint64_t seed = HashStrMix(SECRET[0], SECRET[1]);
+  uint64_t a, b;
+
+  if (len <= 16) {
+    if (len >= 4) {
+      // Two (possibly overlapping) pairs of 4 byte reads cover the buffer.
+      CPSize_t mid = (len >> 3) << 2;
+      a = (HashStrRead4(p) << 32) | HashStrRead4(p + mid);
+      b = (HashStrRead4(p + len - 4) << 32) | HashStrRead4(p + len - 4 - mid);
+    } else if (len > 0) {
+      a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    CPSize_t i = len;
+    if (i > 48) {
+      // Three independent lanes of 16 bytes each.
+      uint64_t seed1 = seed, seed2 = seed;
+      do {
+        seed = HashStrMix(HashStrRead8(p) ^ SECRET[1],
+                          HashStrRead8(p + 8) ^ seed);
+        seed1 = HashStrMix(HashStrRead8(p + 16) ^ SECRET[2],
+                           HashStrRead8(p + 24) ^ seed1);
+        seed2 = HashStrMix(HashStrRead8(p + 32) ^ SECRET[3],
+                           HashStrRead8(p + 40) ^ seed2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= seed1 ^ seed2;
+    }
+    while (i > 16) {
+      seed = HashStrMix(HashStrRead8(p) ^ SECRET[1], HashStrRead8(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+    // The last 16 bytes of the buffer (overlapping what came before).
+    a = HashStrRead8(p + i - 16);
+    b = HashStrRead8(p + i - 8);
+  }
+
+  a ^= SECRET[1];
+  b ^= seed;
+  __uint128_t r = (__uint128_t)a * b;
+  a = (uint64_t)r;
+  b = (uint64_t)(r >> 64);
+  return HashStrMix(a ^ SECRET[0] ^ len, b ^ SECRET[1]);
+}
+
 HashTabKey_t HashInt64(HashTabVal_t hashval) {
   unsigned char buf[8];
   int32_t i;
@@ -165,16 +372,68 @@ HashTabKey_t HashInt64(HashTabVal_t hashval) {
   return HashFunc(buf, 8);
 }
 
+int32_t HTReserve(HashTable table, CPSize_t num_elements) {
+  assert(table != NULL);
+
+  // Enough buckets to stay below the load factor which triggers a resize.
+  CPSize_t bucket_count = num_elements / 3 + 1;
+  if (bucket_count <= table->bucket_count) {
+    return 1;
+  }
+
+  // Since the caller asked for it, the whole table
+  // is moved right away rather than incrementally.
+  if (!MigrateBuckets(table, table->old_bucket_count)) {
+    return 0;
+  }
+  if (!StartMigration(table, bucket_count)) {
+    return 0;
+  }
+  return MigrateBuckets(table, table->old_bucket_count) ? 1 : 0;
+}
+
 CPSize_t HTKeyToBucket(HashTable ht, HashTabKey_t key) {
   return key % ht->bucket_count;
 }
 
+static LinkedList *ChainFor(HashTable ht, HashTabKey_t key) {
+  if (ht->old_buckets != NULL) {
+    CPSize_t old_bucket = key % ht->old_bucket_count;
+    if (old_bucket >= ht->migrate_pos) {  // Not moved yet.
+      return &ht->old_buckets[old_bucket];
+    }
+  }
+  return &ht->buckets[HTKeyToBucket(ht, key)];
+}
+
 static int32_t InsertHTKVNodeIntoLL(HashTabKV kv_to_insert,
+                                const char *str_key,
+                                CPSize_t str_len,
                                 LinkedList *insertchain_ptr) {
-  LinkedList insertchain = *insertchain_ptr;
   HashTabKVPtr kv_to_insert_heap;
 
-  kv_to_insert_heap = (HashTabKVPtr)(malloc(sizeof(HashTabKV)));
+  if (*insertchain_ptr == NULL) {  // First elem in this bucket.
+    *insertchain_ptr = MakeLinkedList();
+    if (*insertchain_ptr == NULL) {
+      return 0;
+    }
+  }
+  LinkedList insertchain = *insertchain_ptr;
+
+  if (str_key == NULL) {
+    kv_to_insert_heap =
+      (HashTabKVPtr)(CPMalloc(CP_ALLOC_HASHTABLE, sizeof(HashTabKV)));
+  } else {
+    // The key is stored in the same allocation as the element.
+    HTStrKVPtr str_kv = (HTStrKVPtr)(CPMalloc(CP_ALLOC_HASHTABLE,
+                                              sizeof(HTStrKV) + str_len + 1));
+    if (str_kv != NULL) {
+      str_kv->key_len = str_len;
+      memcpy(str_kv->key, str_key, str_len);
+      str_kv->key[str_len] = '\0';
+    }
+    kv_to_insert_heap = (HashTabKVPtr)str_kv;
+  }
   if (kv_to_insert_heap == NULL) {
     return 0;
   }
@@ -182,10 +441,34 @@ static int32_t InsertHTKVNodeIntoLL(HashTabKV kv_to_insert,
   kv_to_insert_heap->key  = kv_to_insert.key;
   kv_to_insert_heap->value = kv_to_insert.value;
 
-  return LLPush(insertchain, (LinkedListPayload *)kv_to_insert_heap) ? 1 : 0;
+  if (!LLPush(insertchain, (LinkedListPayload *)kv_to_insert_heap)) {
+    CPFree(CP_ALLOC_HASHTABLE, kv_to_insert_heap,
+           str_key == NULL ? sizeof(HashTabKV)
+                           : sizeof(HTStrKV) + str_len + 1);
+    return 0;
+  }
+  return 1;
+}
+
+// Does the element @p match the key (and string, if there is one)?
+static inline bool KeyMatches(HashTabKVPtr p,
+                              HashTabKey_t key,
+                              const char *str_key,
+                              CPSize_t str_len) {
+  if (p->key != key) {
+    return false;
+  }
+  if (str_key == NULL) {
+    return true;
+  }
+  // Equal hashes are not enough, the strings themselves have to match.
+  HTStrKVPtr str_kv = (HTStrKVPtr)p;
+  return str_kv->key_len == str_len && memcmp(str_kv->key, str_key, str_len) == 0;
 }
 
 static HashTabKVPtr search(HashTabKey_t key,
+                            const char *str_key,
+                            CPSize_t str_len,
                             LLIter *iter_ptr) {
   HashTabKVPtr p;
   LLIter iter = *iter_ptr;
@@ -194,7 +477,7 @@ static HashTabKVPtr search(HashTabKey_t key,
     // *p = iter->node->payload;
     LLIterPayload(iter, (LinkedListPayload *)&p);
 
-    if (p->key == key) {
+    if (KeyMatches(p, key, str_key, str_len)) {
       return p;
     }
     LLIterAdvance(iter);
@@ -202,7 +485,7 @@ static HashTabKVPtr search(HashTabKey_t key,
 
   // Edge case: last element.
   LLIterPayload(iter, (LinkedListPayload *)&p);
-  if (p->key == key) {
+  if (KeyMatches(p, key, str_key, str_len)) {
     return p;
   }
 
@@ -212,38 +495,68 @@ static HashTabKVPtr search(HashTabKey_t key,
 int32_t HTInsert(HashTable table,
                     HashTabKV kv_to_insert,
                     HashTabKV *old_kv_storage) {
-  CPSize_t insertbucket;
-  LinkedList insertchain;
+  assert(table != NULL);
+  assert(!table->str_keys);
+  uint64_t begin = TraceOpBegin(HT_OP_INSERT);
+  int32_t res = Insert(table, kv_to_insert, NULL, 0, old_kv_storage);
+  TraceOpEnd(HT_OP_INSERT, begin);
+  return res;
+}
+
+int32_t HTInsertStr(HashTable table,
+                    const char *key,
+                    HashTabVal_t value,
+                    HashTabKV *old_kv_storage) {
+  assert(table != NULL);
+  assert(table->str_keys);
+  uint64_t begin = TraceOpBegin(HT_OP_INSERT);
+  CPSize_t len = strlen(key);
+  HashTabKV kv_to_insert = {HashStr(key, len), value};
+  int32_t res = Insert(table, kv_to_insert, key, len, old_kv_storage);
+  TraceOpEnd(HT_OP_INSERT, begin);
+  return res;
+}
+
+static int32_t Insert(HashTable table,
+                      HashTabKV kv_to_insert,
+                      const char *str_key,
+                      CPSize_t str_len,
+                      HashTabKV *old_kv_storage) {
+  LinkedList *insertchain;
   HashTabKVPtr p;
   int32_t insert_status;
 
-  assert(table != NULL);
   ResizeHashtable(table);
 
-  // calculate which bucket we're inserting into,
+  // find the bucket we're inserting into,
   // grab its linked list chain
-  insertbucket = HTKeyToBucket(table, kv_to_insert.key);
-  insertchain = table->buckets[insertbucket];
+  insertchain = ChainFor(table, kv_to_insert.key);
 
-  if (LLSize(insertchain) == 0) {  // No elems in list.
-    insert_status = (int)InsertHTKVNodeIntoLL(kv_to_insert, &insertchain);
+  if (*insertchain == NULL || LLSize(*insertchain) == 0) {  // No elems in list.
+    insert_status = (int)InsertHTKVNodeIntoLL(kv_to_insert,
+                                              str_key,
+                                              str_len,
+                                              insertchain);
     if (insert_status == 1) {
       table->ht_size = table->ht_size + 1;
     }
     return insert_status;
   }
 
-  LLIter iter = LLGetIter(insertchain, 0);
+  LLIter iter = LLGetIter(*insertchain, 0);
 
   if (iter == NULL) {  // Out of memory
     return 0;
   }
 
-  p = search(kv_to_insert.key, &iter);
+  p = search(kv_to_insert.key, str_key, str_len, &iter);
 
   if (p == NULL) {  // Elems in list, but none with the key we have.
-    free(iter);
-    insert_status = (int)InsertHTKVNodeIntoLL(kv_to_insert, &insertchain);
+    LLIterFree(iter);
+    insert_status = (int)InsertHTKVNodeIntoLL(kv_to_insert,
+                                              str_key,
+                                              str_len,
+                                              insertchain);
     if (insert_status == 1) {
       table->ht_size = table->ht_size + 1;
     }
@@ -253,7 +566,7 @@ int32_t HTInsert(HashTable table,
   // There were values in the list, and the list had our desired key.
   *old_kv_storage = *p;
   p->value = kv_to_insert.value;
-  free(iter);
+  LLIterFree(iter);
   return 2;
 }
 
@@ -261,19 +574,39 @@ int32_t HTLookup(HashTable table,
                     HashTabKey_t key,
                     HashTabKV *keyvalue) {
   assert(table != NULL);
+  assert(!table->str_keys);
+  uint64_t begin = TraceOpBegin(HT_OP_LOOKUP);
+  int32_t res = Lookup(table, key, NULL, 0, keyvalue);
+  TraceOpEnd(HT_OP_LOOKUP, begin);
+  return res;
+}
+
+int32_t HTLookupStr(HashTable table,
+                    const char *key,
+                    HashTabKV *keyvalue) {
+  assert(table != NULL);
+  assert(table->str_keys);
+  uint64_t begin = TraceOpBegin(HT_OP_LOOKUP);
+  CPSize_t len = strlen(key);
+  int32_t res = Lookup(table, HashStr(key, len), key, len, keyvalue);
+  TraceOpEnd(HT_OP_LOOKUP, begin);
+  return res;
+}
+
+static int32_t Lookup(HashTable table,
+                      HashTabKey_t key,
+                      const char *str_key,
+                      CPSize_t str_len,
+                      HashTabKV *keyvalue) {
   HashTabKVPtr p;
 
-  CPSize_t insertbucket;
   LinkedList insertchain;
 
-  assert(table != NULL);
-
-  // calculate which bucket we're inserting into,
-  // grab its linked list chain
-  insertbucket = HTKeyToBucket(table, key);
-  insertchain = table->buckets[insertbucket];
+  // find the bucket the key would be in
+  // (in either set of buckets), grab its linked list chain
+  insertchain = *ChainFor(table, key);
 
-  if (LLSize(insertchain) == 0) {
+  if (insertchain == NULL || LLSize(insertchain) == 0) {
     return 0;
   }
 
@@ -283,16 +616,16 @@ int32_t HTLookup(HashTable table,
     return -1;
   }
 
-  p = search(key, &iter);
+  p = search(key, str_key, str_len, &iter);
 
   if (p == NULL) {
-    free(iter);
+    LLIterFree(iter);
     return 0;
   }
 
   *keyvalue = *p;
 
-  free(iter);
+  LLIterFree(iter);
   return 1;
 }
 
@@ -300,20 +633,42 @@ int32_t HTRemove(HashTable table,
                         HashTabKey_t key,
                         HashTabKV *keyvalue) {
   assert(table != NULL);
-  HashTabKVPtr p;
+  assert(!table->str_keys);
+  uint64_t begin = TraceOpBegin(HT_OP_REMOVE);
+  int32_t res = Remove(table, key, NULL, 0, keyvalue);
+  TraceOpEnd(HT_OP_REMOVE, begin);
+  return res;
+}
 
+int32_t HTRemoveStr(HashTable table,
+                    const char *key,
+                    HashTabKV *keyvalue) {
+  assert(table != NULL);
+  assert(table->str_keys);
+  uint64_t begin = TraceOpBegin(HT_OP_REMOVE);
+  CPSize_t len = strlen(key);
+  int32_t res = Remove(table, HashStr(key, len), key, len, keyvalue);
+  TraceOpEnd(HT_OP_REMOVE, begin);
+  return res;
+}
+
+static int32_t Remove(HashTable table,
+                      HashTabKey_t key,
+                      const char *str_key,
+                      CPSize_t str_len,
+                      HashTabKV *keyvalue) {
+  HashTabKVPtr p;
 
-  CPSize_t insertbucket;
   LinkedList insertchain;
 
-  assert(table != NULL);
+  // Removals help move the table along too, if it is growing.
+  MigrateBuckets(table, HT_MIGRATE_BUCKETS_PER_OP);
 
-  // calculate which bucket we're inserting into,
+  // find the bucket the key would be in,
   // grab its linked list chain
-  insertbucket = HTKeyToBucket(table, key);
-  insertchain = table->buckets[insertbucket];
+  insertchain = *ChainFor(table, key);
 
-  if (LLSize(insertchain) == 0) {
+  if (insertchain == NULL || LLSize(insertchain) == 0) {
     return 0;
   }
 
@@ -323,18 +678,18 @@ int32_t HTRemove(HashTable table,
     return -1;
   }
 
-  p = search(key, &iter);
+  p = search(key, str_key, str_len, &iter);
 
   if (p == NULL) {
-    free(iter);
+    LLIterFree(iter);
     return 0;
   }
 
   *keyvalue = *p;
   LLiterDel(iter, LLNullFree);
   table->ht_size = table->ht_size - 1;
-  free(p);
-  free(iter);
+  CPFree(CP_ALLOC_HASHTABLE, p, KVSize(table, p));
+  LLIterFree(iter);
   return 1;
 }
 
@@ -344,8 +699,14 @@ HTIter MakeHTIter(HashTable table) {
 
   assert(table != NULL);  // be defensive
 
+  // An iterator only walks one set of buckets, so
+  // every element has to be in the new buckets.
+  if (!MigrateBuckets(table, table->old_bucket_count)) {
+    return NULL;
+  }
+
   // malloc the iterator
-  iter = (HTIterRecord *) malloc(sizeof(HTIterRecord));
+  iter = (HTIterRecord *) CPMalloc(CP_ALLOC_HASHTABLE, sizeof(HTIterRecord));
   if (iter == NULL) {
     return NULL;
   }
@@ -364,7 +725,7 @@ HTIter MakeHTIter(HashTable table) {
   iter->valid = true;
   iter->ht = table;
   for (i = 0; i < table->bucket_count; i++) {
-    if (LLSize(table->buckets[i]) > 0) {
+    if (table->buckets[i] != NULL && LLSize(table->buckets[i]) > 0) {
       iter->bucket = i;
       break;
     }
@@ -373,7 +734,7 @@ HTIter MakeHTIter(HashTable table) {
   iter->bucket_iter = LLGetIter(table->buckets[iter->bucket], 0UL);
   if (iter->bucket_iter == NULL) {
     // out of memory!
-    free(iter);
+    CPFree(CP_ALLOC_HASHTABLE, iter, sizeof(HTIterRecord));
     return NULL;
   }
   return iter;
@@ -386,7 +747,7 @@ void DiscardHTIter(HTIter iter) {
     iter->bucket_iter = NULL;
   }
   iter->valid = false;
-  free(iter);
+  CPFree(CP_ALLOC_HASHTABLE, iter, sizeof(HTIterRecord));
 }
 
 int32_t HTIncrementIter(HTIter iter) {
@@ -412,8 +773,8 @@ int32_t HTIncrementIter(HTIter iter) {
 
   // Case 2/3
   for (int32_t i = iter->bucket + 1; i < iter->ht->bucket_count; i++) {
-    if (LLSize(iter->ht->buckets[i]) > 0) {
-      free(iter->bucket_iter);
+    if (iter->ht->buckets[i] != NULL && LLSize(iter->ht->buckets[i]) > 0) {
+      LLIterFree(iter->bucket_iter);
       iter->bucket_iter = LLGetIter(iter->ht->buckets[i], 0UL);
 
       assert(iter->bucket_iter != NULL);
@@ -448,8 +809,24 @@ int32_t HTIterKV(HTIter iter, HashTabKV *keyvalue) {
   return 1;
 }
 
+int32_t HTIterStrKey(HTIter iter, const char **key) {
+  assert(iter != NULL);
+
+  HTStrKVPtr p;
+
+  if (!(iter->valid) | (HTSize(iter->ht) == 0) | !(iter->ht->str_keys)) {
+    return 0;
+  }
+
+  LLIterPayload(iter->bucket_iter, (LinkedListPayload *)&p);
+  *key = p->key;
+
+  return 1;
+}
+
 int32_t HTIterDel(HTIter iter, HashTabKV *keyvalue) {
   HashTabKV kv;
+  HTStrKVPtr p = NULL;
   int32_t res, retval;
 
   assert(iter != NULL);
@@ -458,6 +835,9 @@ int32_t HTIterDel(HTIter iter, HashTabKV *keyvalue) {
   res = HTIterKV(iter, &kv);
   if (res == 0)
     return 0;
+  if (iter->ht->str_keys) {
+    LLIterPayload(iter->bucket_iter, (LinkedListPayload *)&p);
+  }
 
   // Advance the iterator.
   res = HTIncrementIter(iter);
@@ -466,7 +846,13 @@ int32_t HTIterDel(HTIter iter, HashTabKV *keyvalue) {
   } else {
     retval = 1;
   }
-  res = HTRemove(iter->ht, kv.key, keyvalue);
+  // Removing the element that was pointed at doesn't
+  // disturb the element the iterator points at now.
+  res = Remove(iter->ht,
+               kv.key,
+               p == NULL ? NULL : p->key,
+               p == NULL ? 0 : p->key_len,
+               keyvalue);
   assert(res == 1);
   assert(kv.key == keyvalue->key);
   assert(kv.value == keyvalue->value);
@@ -475,54 +861,107 @@ int32_t HTIterDel(HTIter iter, HashTabKV *keyvalue) {
 }
 
 static void ResizeHashtable(HashTable ht) {
+  // If we are already growing, keep moving buckets over.
+  if (ht->old_buckets != NULL) {
+    MigrateBuckets(ht, HT_MIGRATE_BUCKETS_PER_OP);
+    return;
+  }
+
   // Resize if the load factor is > 3.
   if (ht->ht_size < 3 * ht->bucket_count)
     return;
 
-  // This is the resize case.  Allocate a new hashtable,
-  // iterate over the old hashtable, do the surgery on
-  // the old hashtable record and free up the new hashtable
-  // record.
-  HashTable newht = MakeHashTable(ht->bucket_count * 9);
-
-  // Give up if out of memory.
-  if (newht == NULL)
-    return;
-  // Loop through the old ht with an iterator,
-  // inserting into the new HT.
-  HTIter it = MakeHTIter(ht);
-  if (it == NULL) {
-    // Give up if out of memory.
-    FreeHashTable(newht, &HTNullFree);
+  // This is the resize case. Rather than moving every element at once
+  // (which makes this one insert as slow as the whole table is big),
+  // we only allocate the new buckets here. Every insert and remove
+  // moves a few more of the old buckets over, and the old buckets are
+  // gone well before the new ones fill up. Give up if out of memory.
+  if (!StartMigration(ht, ht->bucket_count * 9))
     return;
+
+  MigrateBuckets(ht, HT_MIGRATE_BUCKETS_PER_OP);
+}
+
+static bool StartMigration(HashTable ht, CPSize_t bucket_count) {
+  LinkedList *new_buckets;
+  uint64_t begin = TraceOpBegin(HT_OP_RESIZE);
+
+  assert(ht->old_buckets == NULL);
+  new_buckets = (LinkedList *) CPCalloc(CP_ALLOC_HASHTABLE, bucket_count,
+                                        sizeof(LinkedList));
+  TraceOpEnd(HT_OP_RESIZE, begin);
+  if (new_buckets == NULL) {
+    return false;
   }
 
-  while (!HTIterValid(it)) {
-    HashTabKV item, dummy;
+  ht->resizes++;
+  ht->old_buckets = ht->buckets;
+  ht->old_bucket_count = ht->bucket_count;
+  ht->migrate_pos = 0;
+  ht->buckets = new_buckets;
+  ht->bucket_count = bucket_count;
+  return true;
+}
 
-    assert(HTIterKV(it, &item) == 1);
-    if (HTInsert(newht, item, &dummy) != 1) {
-      // failure, free up everything, return.
-      DiscardHTIter(it);
-      FreeHashTable(newht, &HTNullFree);
-      return;
-    }
-    HTIncrementIter(it);
+static bool MigrateBuckets(HashTable ht, CPSize_t num_buckets) {
+  if (ht->old_buckets == NULL) {  // Not growing.
+    return true;
   }
 
-  // Worked!  Free the iterator.
-  DiscardHTIter(it);
+  while (num_buckets > 0 && ht->migrate_pos < ht->old_bucket_count) {
+    LinkedList old_chain = ht->old_buckets[ht->migrate_pos];
 
-  // Sneaky: swap the structures, then free the new table,
-  // and we're done.
-  {
-    HashTableRecord tmp;
+    if (old_chain != NULL && LLSize(old_chain) > 0) {
+      HashTabKVPtr p;
+      LinkedList *new_chain;
+      LLIter iter = LLGetIter(old_chain, 0);
+      if (iter == NULL) {  // Out of memory
+        return false;
+      }
+
+      // A bucket is moved all at once or not at all, since lookups
+      // only look in the old bucket until it has been moved. So first
+      // make sure every chain the elements are headed to exists.
+      do {
+        LLIterPayload(iter, (LinkedListPayload *)&p);
+        new_chain = &ht->buckets[HTKeyToBucket(ht, p->key)];
+        if (*new_chain == NULL) {
+          *new_chain = MakeLinkedList();
+          if (*new_chain == NULL) {  // Out of memory, try again next time.
+            LLIterFree(iter);
+            return false;
+          }
+        }
+      } while (LLIterAdvance(iter));
+      LLIterFree(iter);
+
+      // Then relink every node of the old chain into its new chain.
+      while (LLPeek(old_chain, (LinkedListPayload *)&p)) {
+        LLMoveHead(old_chain, ht->buckets[HTKeyToBucket(ht, p->key)]);
+      }
+    }
+    if (old_chain != NULL) {
+      FreeLinkedList(old_chain, LLNullFree);
+      ht->old_buckets[ht->migrate_pos] = NULL;
+    }
 
-    tmp = *ht;
-    *ht = *newht;
-    *newht = tmp;
-    FreeHashTable(newht, &HTNullFree);
+    ht->migrate_pos++;
+    num_buckets--;
   }
 
-  return;
+  // Every old bucket has been moved.
+  if (ht->migrate_pos == ht->old_bucket_count) {
+    CPFree(CP_ALLOC_HASHTABLE, ht->old_buckets,
+           sizeof(LinkedList) * ht->old_bucket_count);
+    ht->old_buckets = NULL;
+    ht->old_bucket_count = 0;
+    ht->migrate_pos = 0;
+  }
+
+  return true;
+}
+
+void HTSetTraceHooks(HTTraceBeginFnPtr begin, HTTraceEndFnPtr end) {
+  trace_begin = begin;
+  trace_end = end;
 }
@@ -18,6 +18,16 @@ typedef void(*ValueFreeFnPtr)(HashTabVal_t value);
 // Returns NULL on ERROR, non-NULL on success.
 HashTable MakeHashTable(CPSize_t bucket_count);
 
+// Makes a HashTable whose keys are null terminated strings rather than
+// 64-bit numbers. Such a table keeps its own copy of every key next to
+// the key's hash, and a lookup only matches a key of the same length and
+// bytes, so two keys with the same hash never alias each other. A string
+// keyed table must be used through the *Str functions below (HTIterKV and
+// friends work on both kinds of table).
+//
+// Returns NULL on ERROR, non-NULL on success.
+HashTable MakeStrHashTable(CPSize_t bucket_count);
+
 // Frees the HashTable table, and invokes free_func on all
 // (HashTabVal_t)s in table.
 void FreeHashTable(HashTable table, ValueFreeFnPtr free_func);
@@ -25,6 +35,46 @@ void FreeHashTable(HashTable table, ValueFreeFnPtr free_func);
 // Returns the number of elements in the hash table.
 CPSize_t HTSize(HashTable table);
 
+// Returns the number of times the hash table has grown (whether on its
+// own or through HTReserve).
+CPSize_t HTResizeCount(HashTable table);
+
+// The number of chain lengths HTStats counts buckets of separately. The
+// last of them counts every chain at least that long less one.
+#define HT_STATS_MAX_CHAIN 16
+
+// How the elements of a hash table are spread over its buckets.
+typedef struct ht_stats {
+  CPSize_t size;              // # of elements
+  CPSize_t bucket_count;      // # of buckets
+  CPSize_t old_bucket_count;  // # of old buckets not yet moved (if growing)
+  CPSize_t resizes;           // see HTResizeCount
+  CPSize_t longest_chain;     // the most elements in any bucket
+  // The mean number of elements compared by a lookup of an element in the
+  // table (if every element is as likely to be looked up).
+  double   mean_probe;
+  // chains[i] is the # of buckets (old or new) holding i elements.
+  CPSize_t chains[HT_STATS_MAX_CHAIN];
+} HTStats;
+
+// Fills in @ret with how the elements of @table are spread over its
+// buckets. Both the buckets of the table and any old ones it hasn't
+// finished moving out of are counted. Takes O(# of buckets).
+void HTGetStats(HashTable table, HTStats *ret);
+
+// Grows the table so that at least @num_elements elements can be
+// inserted without it having to grow again. Intended to be called on a
+// table before filling it, when the number of elements is known ahead
+// of time.
+//
+// Returns:
+//
+// - 0 on failure (e.g., out of memory), in which case the table
+//   is unchanged.
+//
+// - +1 on success.
+int32_t HTReserve(HashTable table, CPSize_t num_elements);
+
 // HashTables store key/value pairs.  We'll define a key to be an
 // unsigned 64-bit integer; it's up to the customer to figure out how
 // to produce an appropriate hash key, but below we provide an
@@ -47,6 +97,16 @@ typedef struct {
 //   use in a HashTabKV
 HashTabKey_t HashFunc(unsigned char *buffer, CPSize_t len);
 
+// A hash in the style of wyhash, which consumes its input a word at a
+// time instead of a byte at a time. It is considerably faster than
+// HashFunc on long keys such as absolute paths, and is the hash used
+// by string keyed tables.
+//
+// Returns:
+//
+// - a nicely distributed 64-bit hash value
+HashTabKey_t HashStr(const char *buffer, CPSize_t len);
+
 // This is a convenience routine to produce a nice, evenly
 // distributed 64-bit hash key from a potentially poorly
 // distributed 64 bit number.  It uses HashFunc to get its
@@ -133,10 +193,30 @@ int32_t HTRemove(HashTable table,
                         HashTabKey_t key,
                         HashTabKV *keyvalue);
 
+// The string keyed versions of HTInsert, HTLookup and HTRemove. They
+// behave the same way, except that the key is the null terminated string
+// @key, which is copied into the table on insert. The key of any
+// HashTabKV returned is the hash of the string.
+//
+// Returns:
+//
+//  - the same values as their numeric keyed counterparts.
+int32_t HTInsertStr(HashTable table,
+                    const char *key,
+                    HashTabVal_t value,
+                    HashTabKV *old_kv_storage);
+int32_t HTLookupStr(HashTable table,
+                    const char *key,
+                    HashTabKV *keyvalue);
+int32_t HTRemoveStr(HashTable table,
+                    const char *key,
+                    HashTabKV *keyvalue);
+
 struct ht_itrec;
 typedef struct ht_itrec *HTIter;  // same trick to hide implementation.
 
-// Makes an iterator for the table.
+// Makes an iterator for the table. If the table is in the middle of
+// growing, this finishes moving its elements into the new buckets first.
 //
 // Arguments:
 //
@@ -202,6 +282,24 @@ int32_t HTIterValid(HTIter iter);
 // - +1 on success.
 int32_t HTIterKV(HTIter iter, HashTabKV *keyvalue);
 
+// Returns the string key of the element the iterator is currently
+// pointing at, for an iterator over a string keyed table. The string
+// is owned by the table, so DO NOT free it.
+//
+// Arguments:
+//
+// - iter: the iterator to fetch the key from
+//
+// - key: a return parameter through which the key is returned.
+//
+// Returns:
+//
+// - 0 if the iterator is not valid, the table is empty or
+//   the table is not string keyed.
+//
+// - +1 on success.
+int32_t HTIterStrKey(HTIter iter, const char **key);
+
 // Returns a copy of key/value that the iterator is currently
 // pointing at, and removes that key/value from the
 // hashtable.  The caller assumes ownership of any memory
@@ -225,4 +323,20 @@ int32_t HTIterKV(HTIter iter, HashTabKV *keyvalue);
 //   it has advanced past the end of the hash table.
 int32_t HTIterDel(HTIter iter, HashTabKV *keyvalue);
 
+// The operations reported to the hooks set by HTSetTraceHooks.
+#define HT_OP_INSERT 0
+#define HT_OP_LOOKUP 1
+#define HT_OP_REMOVE 2
+#define HT_OP_RESIZE 3  // allocating a bigger array of buckets
+
+typedef uint64_t(*HTTraceBeginFnPtr)(int32_t op);
+typedef void(*HTTraceEndFnPtr)(int32_t op, uint64_t begin);
+
+// Makes every HashTable call @begin, with the operation, before each
+// insert, lookup, remove and resize, and @end, with the operation and
+// what @begin returned, once it is done. Both may be NULL (as they are
+// to begin with), in which case nothing is called. Not safe to call
+// while another thread is using a HashTable.
+void HTSetTraceHooks(HTTraceBeginFnPtr begin, HTTraceEndFnPtr end);
+
 #endif  // _HASHTABLE_H_
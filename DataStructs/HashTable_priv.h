@@ -8,15 +8,38 @@
 // Define the internal, private structs and helper functions associated with a
 // HashTable.
 
+// The number of old buckets moved into the new bucket array by each
+// insert or remove while the table is growing.
+#define HT_MIGRATE_BUCKETS_PER_OP 8
+
 // This is the struct that we use to represent a hash table. Quite simply, a
 // hash table is just an array of buckets, where each bucket is a linked list
-// of HashTabKV structs.
+// of HashTabKV structs. A bucket's linked list is only allocated once
+// something is inserted into it, so empty buckets are NULL.
+//
+// When the table grows, the old array of buckets is kept around and its
+// buckets are moved into the new array a few at a time. Until an old bucket
+// has been moved, any key which maps to it is still found there.
 typedef struct hashtablerecord {
+  bool            str_keys;      // are the keys strings (HTStrKV)?
   CPSize_t        bucket_count;  // # of buckets in this HT?
   CPSize_t        ht_size;       // # of elements currently in this HT?
   LinkedList     *buckets;       // the array of buckets
+  CPSize_t        old_bucket_count;  // # of buckets in old_buckets
+  CPSize_t        migrate_pos;   // old buckets below this have been moved
+  LinkedList     *old_buckets;   // the array being migrated, or NULL
+  CPSize_t        resizes;       // # of times this HT has grown
 } HashTableRecord;
 
+// The elements of a string keyed table. Since an HTStrKV starts with
+// a HashTabKV (whose key is the hash of the string), it can be used
+// anywhere a HashTabKVPtr is expected.
+typedef struct ht_strkv {
+  HashTabKV  kv;         // kv.key is HashStr(key, key_len)
+  CPSize_t   key_len;    // strlen(key)
+  char       key[];      // the null terminated key itself
+} HTStrKV, *HTStrKVPtr;
+
 // This is the struct we use to represent an iterator.
 typedef struct ht_itrec {
   bool       valid;    // is this iterator valid?
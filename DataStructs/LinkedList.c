@@ -3,12 +3,14 @@
 #include <assert.h>
 
 #include "CP.h"
+#include "Allocator.h"
 #include "LinkedList.h"
 #include "LinkedList_priv.h"
 
 LinkedList MakeLinkedList(void) {
   // allocate the linked list record
-  LinkedList ll = (LinkedList) malloc(sizeof(LinkedListHead));
+  LinkedList ll =
+    (LinkedList) CPMalloc(CP_ALLOC_LIST, sizeof(LinkedListHead));
   if (ll == NULL) {
     // out of memory
     return (LinkedList) NULL;
@@ -33,11 +35,11 @@ void FreeLinkedList(LinkedList list,
     (*free_payload)(list->head->payload);  // free the payload
     old_node = list->head;
     list->head = list->head->next;
-    free(old_node);  // free the node
+    CPFree(CP_ALLOC_LIST, old_node, sizeof(LinkedListNode));  // free the node
   }
 
   // free the list record
-  free(list);
+  CPFree(CP_ALLOC_LIST, list, sizeof(LinkedListHead));
 }
 
 CPSize_t LLSize(LinkedList list) {
@@ -54,7 +56,7 @@ bool LLPush(LinkedList list, LinkedListPayload payload) {
 
   // allocate space for the new node.
   LinkedListNodePtr ln =
-    (LinkedListNodePtr) malloc(sizeof(LinkedListNode));
+    (LinkedListNodePtr) CPMalloc(CP_ALLOC_LIST, sizeof(LinkedListNode));
   if (ln == NULL) {
     // out of memory
     return false;
@@ -104,7 +106,53 @@ bool LLPop(LinkedList list, LinkedListPayload *payload_ptr) {
   }
 
   list->ht_size = list->ht_size - 1;
-  free(old_node);
+  CPFree(CP_ALLOC_LIST, old_node, sizeof(LinkedListNode));
+
+  return true;
+}
+
+bool LLPeek(LinkedList list, LinkedListPayload *payload_ptr) {
+  // defensive programming.
+  assert(payload_ptr != NULL);
+  assert(list != NULL);
+
+  if (list->ht_size == 0) {
+    return false;
+  }
+
+  *payload_ptr = list->head->payload;
+  return true;
+}
+
+bool LLMoveHead(LinkedList from, LinkedList to) {
+  // defensive programming.
+  assert(from != NULL);
+  assert(to != NULL);
+
+  if (from->ht_size == 0) {
+    return false;
+  }
+
+  // Unlink the head of from.
+  LinkedListNodePtr node = from->head;
+  from->head = node->next;
+  if (from->head == NULL) {
+    from->tail = NULL;
+  } else {
+    from->head->prev = NULL;
+  }
+  from->ht_size = from->ht_size - 1;
+
+  // Link it in as the head of to.
+  node->prev = NULL;
+  node->next = to->head;
+  if (to->head == NULL) {
+    to->tail = node;
+  } else {
+    to->head->prev = node;
+  }
+  to->head = node;
+  to->ht_size = to->ht_size + 1;
 
   return true;
 }
@@ -114,7 +162,7 @@ bool LLAppend(LinkedList list, LinkedListPayload payload) {
   assert(list != NULL);
 
   LinkedListNodePtr ln =
-    (LinkedListNodePtr) malloc(sizeof(LinkedListNode));
+    (LinkedListNodePtr) CPMalloc(CP_ALLOC_LIST, sizeof(LinkedListNode));
   if (ln == NULL) {
     // out of memory
     return false;
@@ -158,7 +206,7 @@ bool LLSlice(LinkedList list, LinkedListPayload *payload_ptr) {
     list->ht_size = list->ht_size - 1;
   }
 
-  free(old_node);
+  CPFree(CP_ALLOC_LIST, old_node, sizeof(LinkedListNode));
 
   return true;
 }
@@ -171,30 +219,72 @@ void LLSort(LinkedList list, unsigned int ascending,
     return;
   }
 
-  // we'll implement bubblesort! nice and easy, and nice and slow :)
-  int32_t swapped;
-  do {
-    LinkedListNodePtr curnode;
-
-    swapped = 0;
-    curnode = list->head;
-    while (curnode->next != NULL) {
-      int32_t compare_result = comparator_function(curnode->payload,
-                                               curnode->next->payload);
-      if (ascending) {
-        compare_result *= -1;
+  // A bottom up merge sort, which relinks the nodes rather than moving
+  // payloads around, so it needs no extra memory. Every pass merges
+  // each pair of neighbouring sorted runs of length @width into one
+  // run, until the whole list is one run. While sorting, only the next
+  // pointers are maintained; the prev pointers are fixed up at the end.
+  LinkedListNodePtr head = list->head;
+  CPSize_t width;
+  for (width = 1; width < list->ht_size; width *= 2) {
+    LinkedListNodePtr remaining = head, tail = NULL;
+    head = NULL;
+
+    while (remaining != NULL) {
+      // Split off the two runs to merge.
+      LinkedListNodePtr left = remaining, right = remaining;
+      CPSize_t left_len = 0, right_len = width;
+      while (right != NULL && left_len < width) {
+        right = right->next;
+        left_len++;
       }
-      if (compare_result < 0) {
-        // bubble-swap payloads
-        LinkedListPayload tmp;
-        tmp = curnode->payload;
-        curnode->payload = curnode->next->payload;
-        curnode->next->payload = tmp;
-        swapped = 1;
+
+      // Merge them. Taking from the left run on ties keeps the sort stable.
+      while (left_len > 0 || (right_len > 0 && right != NULL)) {
+        LinkedListNodePtr next;
+        bool take_left;
+        if (left_len == 0) {
+          take_left = false;
+        } else if (right_len == 0 || right == NULL) {
+          take_left = true;
+        } else {
+          int32_t compare_result = comparator_function(left->payload,
+                                                       right->payload);
+          if (!ascending) {
+            compare_result *= -1;
+          }
+          take_left = compare_result <= 0;
+        }
+
+        if (take_left) {
+          next = left;
+          left = left->next;
+          left_len--;
+        } else {
+          next = right;
+          right = right->next;
+          right_len--;
+        }
+        if (tail == NULL) {
+          head = next;
+        } else {
+          tail->next = next;
+        }
+        tail = next;
       }
-      curnode = curnode->next;
+      remaining = right;
     }
-  } while (swapped);
+    tail->next = NULL;
+  }
+
+  // Restore the prev pointers, and the tail.
+  LinkedListNodePtr prev = NULL, curnode;
+  for (curnode = head; curnode != NULL; curnode = curnode->next) {
+    curnode->prev = prev;
+    prev = curnode;
+  }
+  list->head = head;
+  list->tail = prev;
 }
 
 LLIter LLGetIter(LinkedList list, int32_t pos) {
@@ -206,7 +296,7 @@ LLIter LLGetIter(LinkedList list, int32_t pos) {
     return NULL;
 
   // OK, let's manufacture an iterator.
-  LLIter li = (LLIter) malloc(sizeof(LLIterSt));
+  LLIter li = (LLIter) CPMalloc(CP_ALLOC_LIST, sizeof(LLIterSt));
   if (li == NULL) {
     // out of memory!
     return NULL;
@@ -227,7 +317,7 @@ LLIter LLGetIter(LinkedList list, int32_t pos) {
 void LLIterFree(LLIter iter) {
   // defensive programming
   assert(iter != NULL);
-  free(iter);
+  CPFree(CP_ALLOC_LIST, iter, sizeof(LLIterSt));
 }
 
 bool LLiterHasNext(LLIter iter) {
@@ -328,7 +418,7 @@ bool LLiterDel(LLIter iter,
 
   list->ht_size = list->ht_size - 1;
 
-  free(old_node);
+  CPFree(CP_ALLOC_LIST, old_node, sizeof(LinkedListNode));
 
   return list->ht_size == 0 ? false : true;
 }
@@ -347,7 +437,7 @@ bool LLIteratorInsertBefore(LLIter iter, LinkedListPayload payload) {
 
   // General case: we have to do some splicing.
   LinkedListNodePtr newnode =
-    (LinkedListNodePtr) malloc(sizeof(LinkedListNode));
+    (LinkedListNodePtr) CPMalloc(CP_ALLOC_LIST, sizeof(LinkedListNode));
   if (newnode == NULL)
     return false;  // out of memory
 
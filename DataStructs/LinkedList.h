@@ -81,6 +81,32 @@ bool LLPush(LinkedList list, LinkedListPayload payload);
 // Returns false on failure, true on success.
 bool LLPop(LinkedList list, LinkedListPayload *payload_ptr);
 
+// Returns the payload at the head of the linked list, without
+// removing it.
+//
+// Arguments:
+//
+// - list: the LinkedList to peek at
+//
+// - payload_ptr: a return parameter that is set by the callee; on success,
+//   the payload is returned through this parameter.
+//
+// Returns false if the list is empty, true on success.
+bool LLPeek(LinkedList list, LinkedListPayload *payload_ptr);
+
+// Moves the head node of one linked list onto the head of another.
+// Unlike an LLPop followed by an LLPush, the node itself is relinked
+// rather than freed and reallocated, so this never allocates.
+//
+// Arguments:
+//
+// - from: the LinkedList to take the head node from
+//
+// - to: the LinkedList to push the node onto
+//
+// Returns false if @from is empty, true on success.
+bool LLMoveHead(LinkedList from, LinkedList to);
+
 // Adds a new element to the tail of the linked list.
 //
 // Arguments:
@@ -105,7 +131,9 @@ bool LLAppend(LinkedList list, LinkedListPayload payload);
 // Returns false on failure, true on success.
 bool LLSlice(LinkedList list, LinkedListPayload *payload_ptr);
 
-// Sorts a LinkedList in place.
+// Sorts a LinkedList in place. The sort is a merge sort, so it takes
+// O(n log n) comparisons, and it is stable: payloads which compare
+// equal keep their order.
 //
 // Arguments:
 //
@@ -115,7 +143,7 @@ bool LLSlice(LinkedList list, LinkedListPayload *payload_ptr);
 //
 // - comparator_function:  this argument is a pointer to a payload comparator
 //   function; see above.
-void LLSort(LinkedList list, unsigned int32_tascending,
+void LLSort(LinkedList list, unsigned int ascending,
                     LLPayloadCompareFn comparator_function);
 
 struct ll_iter;
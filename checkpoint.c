@@ -2,30 +2,37 @@
 
 #include "checkpoint.h"
 
-#define VALID_COMMAND_COUNT 5
+#include <fnmatch.h>
+#include <inttypes.h>
+
+#define VALID_COMMAND_COUNT 15
 #define BUFFSIZE 1024  // Hopefully larger than will ever be necessary
 
 // Adds a checkpoint  with the knowledge that this file has not yet had
 // a checkpoint  stored.
 static int32_t AddCheckpointNewFile(char *cpt_name,
                                     char *src_filename,
-                                    HashTabKey_t src_filename_hash,
                                     CheckPointLogPtr cpt_log);
 
 // Adds a checkpoint  with the knowledge that this file has had
-// a checkpoint  stored.
+// a checkpoint  stored. The new checkpoint  is a child of @parent_cpt,
+// or of the current one if @parent_cpt is NULL.
 static int32_t AddCheckpointExistingFile(char *cpt_name,
                                          char *src_filename,
-                                         HashTabKey_t src_filename_hash,
+                                         char *parent_cpt,
                                          CheckPointLogPtr cpt_log);
 
-// Mallocs a copy of @value_to_copy, and then updates the mapping for the
-// given table. Returns mem error if any occur, and the result of HTInsert
-// otherwise.
-static int32_t UpdateMapping(HashTabKey_t key,
+// Copies @value_to_copy (with CopyLogString), and then updates the mapping
+// for the given table, freeing the value it replaces. Returns mem error if
+// any occur, and the result of HTInsertStr otherwise.
+static int32_t UpdateMapping(char *key,
                              char *value_to_copy,
                              HashTable table);
 
+// a free function that does nothing, for lists whose payloads are
+// owned elsewhere.
+static void ListNullFree(LinkedListPayload freeme) { }
+
 static void CheckMacros() {
   assert(INVALID_COMMAND < 0);  // Must be neg. since an index is expected.
   assert(SETUP_SUCCESS != SETUP_DIR_ERROR);
@@ -37,8 +44,39 @@ static void CheckMacros() {
 
 int32_t main (int32_t argc, char *argv[]) {
   CheckPointLog cpt_log;
+  ListOptions list_options;
   int32_t res, setup;
-  if (argc > 4 || argc < 2) {  // check valid use
+  uint32_t num_steps;
+  int64_t at;
+  uint64_t trace_begin;
+  bool read_only, stats = false, progress = false;
+
+  // --stats and --progress may be given anywhere, and are taken out
+  // before the arguments of the command are looked at.
+  for (int32_t i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--stats") == 0) {
+      stats = true;
+    } else if (strcmp(argv[i], "--progress") == 0) {
+      progress = true;
+    } else {
+      continue;
+    }
+    memmove(&argv[i], &argv[i + 1], sizeof(char *) * (argc - i));
+    argc--;
+    i--;
+  }
+  if (stats && StatsPrintAtExit() == STATS_ERR) {
+    fprintf(stderr, "could not arrange for stats to be printed\n");
+  }
+  if (TraceSetup() == TRACE_ERR) {
+    fprintf(stderr, "could not start tracing to %s\n", getenv(TRACE_ENV));
+  }
+  if (ProgressSetup(progress) == PROGRESS_ERR) {
+    fprintf(stderr, "%s is not an open file descriptor\n",
+            getenv(PROGRESS_FD_ENV));
+  }
+
+  if (argc < 2) {  // check valid use (the arg count of each command is below)
     Usage();
   }
 
@@ -48,38 +86,82 @@ int32_t main (int32_t argc, char *argv[]) {
   // index in a switch statement to determine what to do.
   if ((res = DetermineCommand(argv[1])) == INVALID_COMMAND) {
     fprintf(stderr, "invalid command: %s\n", argv[1]);
-    fprintf(stderr, "Valid commands are %s, %s, %s, and %s.\n",
-            valid_commands[0], valid_commands[1], valid_commands[2],
-            valid_commands[3]);
+    fprintf(stderr, "Valid commands are");
+    for (int32_t i = 0; i < VALID_COMMAND_COUNT; i++) {
+      fprintf(stderr, "%s %s", i == VALID_COMMAND_COUNT - 1 ? " and" : "",
+              valid_commands[i]);
+    }
+    fprintf(stderr, ".\n");
     return EXIT_FAILURE;
   }
+  if (MetricsSetup(valid_commands[res]) == METRICS_ERR) {
+    fprintf(stderr, "could not arrange for metrics to be written to %s\n",
+            getenv(METRICS_ENV));
+  }
+  if (RecordCommand(valid_commands[res], argc - 2, argv + 2) == RECORD_ERR) {
+    fprintf(stderr, "could not record the command to %s\n",
+            getenv(RECORD_ENV));
+  }
 
+  // Commands which only look at the log (list, log, lca, diff, blame,
+  // grep, index and stats) don't need to write it back.
+  read_only = (res == 4 || res == 5 || res == 6 || res == 9 || res == 10 ||
+               res == 12 || res == 13 || res == 14);
+
+  StatsStartTimer(STATS_PHASE_SETUP);
+  trace_begin = TraceBegin(TRACE_SETUP);
   if ((setup = Setup(&cpt_log)) != SETUP_SUCCESS) {
     FreeCheckPointLog(&cpt_log);
     printf("ERROR[%d] in Setup, exiting now.\n", setup);
     return EXIT_FAILURE;
   }
+  StatsStopTimer(STATS_PHASE_SETUP);
+  TraceEnd(TRACE_SETUP, trace_begin);
+  MetricsObserve(METRICS_HIST_LOG_LOAD, StatsTimerSeconds(STATS_PHASE_SETUP));
+  if (stats) {
+    RecordLogStats(&cpt_log);
+  }
 
+  StatsStartTimer(STATS_PHASE_COMMAND);
+  trace_begin = TraceBegin(TRACE_COMMAND);
   switch (res) {
     case 0:  // create
       CHECK_ARG_COUNT(4)
-      CreateCheckpoint(argv[2], argv[3], &cpt_log);
+      CreateCheckpoint(argv[2], argv[3], NULL, NULL, 0, &cpt_log);
       break;
     case 1:  // back
-      CHECK_ARG_COUNT(3)
-      Back(argv[2], &cpt_log);
+      CHECK_ARG_RANGE(3, 4)
+      num_steps = 1;
+      if (argc == 4 && ParseNumSteps(argv[3], &num_steps) != 0) {
+        fprintf(stderr, "invalid number of checkpoints to go back: %s\n",
+                argv[3]);
+        return EXIT_FAILURE;
+      }
+      Back(argv[2], num_steps, &cpt_log);
       break;
     case 2:  // swapto
-      CHECK_ARG_COUNT(4)
-      SwapTo(argv[2], argv[3], &cpt_log);
+      CHECK_ARG_RANGE(4, 5)
+      if (argc == 4) {
+        SwapTo(argv[2], argv[3], &cpt_log);
+      } else if (strcmp(argv[3], "--at") != 0 || ParseTime(argv[4], &at) != 0) {
+        fprintf(stderr, "expected swapto <source file name> --at <time>, "\
+                        "where <time> is like \"2019-06-01 14:00\"\n");
+        FreeCheckPointLog(&cpt_log);
+        return EXIT_FAILURE;
+      } else {
+        SwapToTime(argv[2], at, &cpt_log);
+      }
       break;
     case 3:  // delete
       CHECK_ARG_COUNT(3)
       Delete(argv[2], &cpt_log);
       break;
     case 4:  // list
-      CHECK_ARG_COUNT(2)
-      res = List(&cpt_log);
+      if (ParseListOptions(argc - 2, argv + 2, &list_options) == LIST_ERR) {
+        FreeCheckPointLog(&cpt_log);
+        Usage();
+      }
+      res = List(&cpt_log, &list_options);
       if (res == MEM_ERR || res == LIST_ERR) {
         FreeCheckPointLog(&cpt_log);
         return EXIT_FAILURE;
@@ -88,18 +170,96 @@ int32_t main (int32_t argc, char *argv[]) {
         printf("There are no saved checkpoints for this dir.\n");
       }
       break;
+    case 5:  // log
+      CHECK_ARG_COUNT(3)
+      Log(argv[2], &cpt_log);
+      break;
+    case 6:  // lca
+      CHECK_ARG_COUNT(4)
+      Lca(argv[2], argv[3], &cpt_log);
+      break;
+    case 7:  // prune
+      CHECK_ARG_COUNT(4)
+      Prune(argv[2], argv[3], false, &cpt_log);
+      break;
+    case 8:  // squash
+      CHECK_ARG_COUNT(4)
+      Prune(argv[2], argv[3], true, &cpt_log);
+      break;
+    case 9:  // diff
+      CHECK_ARG_RANGE(4, 5)
+      if (Diff(argv[2], argv[3], argc == 5 ? argv[4] : DIFF_WORKING,
+               &cpt_log) != DIFF_SUCCESS) {
+        FreeCheckPointLog(&cpt_log);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 10:  // blame
+      CHECK_ARG_RANGE(3, 4)
+      if (BlameCpt(argv[2], argc == 4 ? argv[3] : NULL, &cpt_log) < 0) {
+        FreeCheckPointLog(&cpt_log);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 11:  // merge
+      CHECK_ARG_COUNT(6)
+      if (Merge(argv[2], argv[3], argv[4], argv[5], &cpt_log) < 0) {
+        FreeCheckPointLog(&cpt_log);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 12:  // grep
+      CHECK_ARG_RANGE(3, 4)
+      if (Grep(argv[2], argc == 4 ? argv[3] : NULL, &cpt_log) < 0) {
+        FreeCheckPointLog(&cpt_log);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 13:  // index
+      CHECK_ARG_COUNT(2)
+      if ((res = IndexCpts(&cpt_log)) < 0) {
+        FreeCheckPointLog(&cpt_log);
+        return EXIT_FAILURE;
+      }
+      printf("Indexed %d checkpoint(s).\n", res);
+      break;
+    case 14:  // stats
+      CHECK_ARG_RANGE(2, 3)
+      if (ShowStats(argc == 3 ? argv[2] : NULL, &cpt_log) < 0) {
+        FreeCheckPointLog(&cpt_log);
+        return EXIT_FAILURE;
+      }
+      break;
     default: 
       fprintf(stderr, "unknown result %d\n", res);
       return EXIT_FAILURE;
   }
 
-  if (WriteCheckPointLog(&cpt_log) == FILE_WRITE_ERR) {
+  StatsStopTimer(STATS_PHASE_COMMAND);
+  TraceEnd(TRACE_COMMAND, trace_begin);
+  MetricsObserve(METRICS_HIST_COMMAND, StatsTimerSeconds(STATS_PHASE_COMMAND));
+  if (stats || MetricsEnabled()) {
+    RecordLogStats(&cpt_log);
+  }
+
+  StatsStartTimer(STATS_PHASE_WRITE);
+  trace_begin = TraceBegin(TRACE_WRITE_LOG);
+  if (!read_only && WriteCheckPointLog(&cpt_log) == FILE_WRITE_ERR) {
     printf("Error writing tables. This dir is now considered corrupt.\n");
     FreeCheckPointLog(&cpt_log);
     return EXIT_FAILURE;
   }
+  StatsStopTimer(STATS_PHASE_WRITE);
+  TraceEnd(TRACE_WRITE_LOG, trace_begin);
+  if (!read_only) {
+    MetricsObserve(METRICS_HIST_LOG_SAVE, StatsTimerSeconds(STATS_PHASE_WRITE));
+  }
 
   FreeCheckPointLog(&cpt_log);
+  if (StatsAppendPhaseTimes(argv[1]) == STATS_ERR && DEBUG) {
+    printf("Could not append to %s.\n", getenv(STATS_PHASE_TIMES_ENV));
+  }
+  MetricsSucceeded();
   return EXIT_SUCCESS;
 }
 
@@ -145,33 +305,29 @@ static int32_t Setup(CheckPointLogPtr cpt_log) {
 
 static int32_t CreateCheckpoint(char *src_filename,
                                 char *cpt_name,
+                                char *parent_cpt,
+                                const char *contents,
+                                size_t len,
                                 CheckPointLogPtr cpt_log) {
-  HashTabKey_t src_filename_hash = HashFunc((unsigned char *)src_filename,
-                                            strlen(src_filename));
-  HashTabKV kv, storage;
+  HashTabKV storage;
   int32_t res;
   uint32_t num_attempts = NUMBER_ATTEMPTS;
 
 
-  // Update mapping from cpt_name_hash to cpt_file,
-  // and update the mapping from src_filename to cpt_name.
-  HashTabKey_t cpt_filename_hash = HashFunc((unsigned char *)cpt_name,
-                                            strlen(cpt_name));
   if (DEBUG) {
     printf("\tcreating checkpoint  %s for %s\n", cpt_name, src_filename);
   }
   
-  // Is there a mapping from hash(src_filename)? If there is not,
-  // we will also assume there is no mapping from the hash to a
-  // LinkedList of checkpoints.
-  ATTEMPT((res = HTLookup(cpt_log->src_filehash_to_filename,
-                          src_filename_hash,
-                          &storage)), -1, num_attempts)
+  // Is there a mapping from src_filename? If there is not,
+  // we will also assume there is no mapping from it to a
+  // tree of checkpoints.
+  ATTEMPT((res = HTLookupStr(cpt_log->src_filehash_to_filename,
+                             src_filename,
+                             &storage)), -1, num_attempts)
 
   if (res == 0) {  // This filename has not yet had a checkpoint  created!
     if (AddCheckpointNewFile(cpt_name,
                              src_filename,
-                             src_filename_hash,
                              cpt_log) != CREATE_CPT_SUCCESS) {
       return CREATE_CPT_ERROR;
     }
@@ -182,27 +338,40 @@ static int32_t CreateCheckpoint(char *src_filename,
     // checkpoint  for src_filename.
     if (AddCheckpointExistingFile(cpt_name,
                                   src_filename,
-                                  src_filename_hash,
+                                  parent_cpt,
                                   cpt_log) != CREATE_CPT_SUCCESS) {
       return CREATE_CPT_ERROR;
     }
   }
 
-  ATTEMPT((res = HTLookup(cpt_log->cpt_namehash_to_cptfilename,
-                          cpt_filename_hash,
-                          &storage)), -1, num_attempts)
+  // Update mapping from cpt_name to cpt_file,
+  // and update the mapping from src_filename to cpt_name.
+  ATTEMPT((res = HTLookupStr(cpt_log->cpt_namehash_to_cptfilename,
+                             cpt_name,
+                             &storage)), -1, num_attempts)
   if (res == 0) {  // No checkpoint  filename mapping exists for the checkpoint!
-    if (WriteSrcCheckpoint(src_filename, cpt_name, true) != 0) {  // I/O error
+    res = contents == NULL ? WriteSrcCheckpoint(src_filename, cpt_name, true)
+                           : WriteCheckpoint(cpt_name, contents, len);
+    if (res != FILE_WRITE_SUCCESS) {  // I/O error
+      return CREATE_CPT_ERROR;
+    }
+
+    if (StampCpt(src_filename, cpt_name, cpt_log) != CREATE_CPT_SUCCESS) {
       return CREATE_CPT_ERROR;
     }
 
+    // Not being able to index the checkpoint only makes grep slower.
+    if (AddToIndex(&cpt_name, 1, INDEX_CREATE_MERGE_BYTES) != 0 && DEBUG) {
+      printf("could not index checkpoint %s\n", cpt_name);
+    }
+
     // No I/O error - we can now update our mappings
-    if (UpdateMapping(src_filename_hash,
+    if (UpdateMapping(src_filename,
                       cpt_name,
                       cpt_log->src_filehash_to_cptname) == MEM_ERR) {
         return MEM_ERR;
     }
-    if (UpdateMapping(cpt_filename_hash,
+    if (UpdateMapping(cpt_name,
                       cpt_name,
                       cpt_log->cpt_namehash_to_cptfilename) == MEM_ERR) {
         return MEM_ERR;
@@ -217,224 +386,401 @@ static int32_t CreateCheckpoint(char *src_filename,
   return CREATE_CPT_SUCCESS;
 }
 
-static int32_t UpdateMapping(HashTabKey_t key,
+static int32_t UpdateMapping(char *key,
                              char *value_to_copy,
                              HashTable table) {
-  HashTabKV kv, storage;
+  HashTabKV storage;
   char *value_copy;
   int32_t num_attempts = NUMBER_ATTEMPTS;
 
-  ATTEMPT((value_copy = malloc(sizeof(char) * (strlen(value_to_copy) + 1))),
-          NULL,
-          num_attempts)
-  strcpy(value_copy, value_to_copy);
-  kv.key = key;
-  kv.value = value_copy;
-  return HTInsert(table, kv, &storage);
+  ATTEMPT((value_copy = CopyLogString(value_to_copy)), NULL, num_attempts)
+  int32_t res = HTInsertStr(table, key, value_copy, &storage);
+  if (res == 0) {
+    FreeLogString(value_copy);
+  } else if (res == 2) {  // The old value was replaced, and is ours to free.
+    FreeLogString(storage.value);
+  }
+  return res;
 }
 
 static int32_t AddCheckpointExistingFile(char *cpt_name,
                                          char *src_filename,
-                                         HashTabKey_t src_filename_hash,
+                                         char *parent_cpt,
                                          CheckPointLogPtr cpt_log) {
   // Here, we are going to need to lookup a lot. We want to
   // add the new cpt_name as a child of the src_filename's
   // current checkpoint.
   HashTabKV storage;
-  CpTreeNodePtr root_node, parent_node, new_node;
+  CpTreePtr tree;
+  CpTreeHandle parent_node, new_node;
   uint32_t num_attempts = NUMBER_ATTEMPTS;
   int32_t res;
 
   if (DEBUG) { printf("adding cp %s to tree for %s\n", cpt_name, src_filename); }
-  // Here we are getting the root node for src_filename
-  ATTEMPT((res = HTLookup(cpt_log->dir_tree, src_filename_hash, &storage)),
+  // Here we are getting the tree for src_filename
+  ATTEMPT((res = HTLookupStr(cpt_log->dir_tree, src_filename, &storage)),
           -1,
           num_attempts)
   if (res == 0) {
     if (DEBUG) {
-      printf("STATE ERROR: no mapping from filename hash to root node\n");
+      printf("STATE ERROR: no mapping from filename to tree\n");
     }
     return CREATE_CPT_ERROR;
   }
-  root_node = (CpTreeNodePtr)storage.value;
+  tree = (CpTreePtr)storage.value;
 
-  // Now we need to lookup the current checkpoint  for the src file
-  num_attempts = NUMBER_ATTEMPTS;
-  ATTEMPT((res = HTLookup(cpt_log->src_filehash_to_cptname,
-                          src_filename_hash,
-                          &storage)),
-          -1,
-          num_attempts)
-  if (res == 0) {
-    if (DEBUG) {
-      printf("STATE ERROR: no mapping from filename hash to curr checkpoint\n");
+  // Now we need to lookup the current checkpoint  for the src file,
+  // unless we were given another parent.
+  if (parent_cpt == NULL) {
+    num_attempts = NUMBER_ATTEMPTS;
+    ATTEMPT((res = HTLookupStr(cpt_log->src_filehash_to_cptname,
+                               src_filename,
+                               &storage)),
+            -1,
+            num_attempts)
+    if (res == 0) {
+      if (DEBUG) {
+        printf("STATE ERROR: no mapping from filename to curr checkpoint\n");
+      }
+      return CREATE_CPT_ERROR;
     }
-    return CREATE_CPT_ERROR;
+    parent_cpt = storage.value;
   }
 
-  if (DEBUG) { printf("looking for cpt %s\n", storage.value); }
-  // Now, starting from the root node, we need to go down until we find the
-  // node with the same checkpoint  name that the src file was last saved at.
-  if (FindCpt(root_node, storage.value, &parent_node) != FIND_CPT_SUCCESS) {
+  if (DEBUG) { printf("looking for cpt %s\n", parent_cpt); }
+  // Now we need to find the node with the same checkpoint  name
+  // that the src file was last saved at.
+  if (FindCpt(tree, parent_cpt, &parent_node) != FIND_CPT_SUCCESS) {
     if (DEBUG) {
       printf("could not find parent node %s for checkpoint  %s, file %s\n",
-             storage.value,
+             parent_cpt,
              cpt_name,
              src_filename);
     }
     return CREATE_CPT_ERROR;
   }
 
-  // Let's make space for the new node
-  CreateCpTreeNode(cpt_name, parent_node, &new_node);
-
-  return InsertCpTreeNode(parent_node, new_node) == INSERT_NODE_SUCCESS ?
-                                          CREATE_CPT_SUCCESS : CREATE_CPT_ERROR;
+  return InsertCpTreeNode(tree, parent_node, cpt_name, &new_node)
+                       == INSERT_NODE_SUCCESS ? CREATE_CPT_SUCCESS : CREATE_CPT_ERROR;
 }
 
 static int32_t AddCheckpointNewFile(char *cpt_name,
                                     char *src_filename,
-                                    HashTabKey_t src_filename_hash,
                                     CheckPointLogPtr cpt_log) {
-  HashTabKV keyval, storage;
+  HashTabKV storage;
   int32_t res;
   uint32_t num_attempts = NUMBER_ATTEMPTS;                                
   if (DEBUG) {
     printf("Storing new file %s with cp %s\n", src_filename, cpt_name);
   }
-  keyval.key = (HashTabKey_t)(src_filename_hash);
-  // Add the mapping from source filename hash to source filename
+  // Add the mapping from source filename to source filename
   char *src_name_copy;
-  ATTEMPT((src_name_copy = malloc(sizeof(char) * (strlen(src_filename) + 1))),
-            NULL, num_attempts)
-  strcpy(src_name_copy, src_filename);
-  keyval.value = (HashTabVal_t)(src_name_copy);
-  ATTEMPT((res = HTInsert(cpt_log->src_filehash_to_filename,
-                          keyval,
-                          &storage)), -1, num_attempts)
+  ATTEMPT((src_name_copy = CopyLogString(src_filename)), NULL, num_attempts)
+  ATTEMPT((res = HTInsertStr(cpt_log->src_filehash_to_filename,
+                             src_filename,
+                             src_name_copy,
+                             &storage)), 0, num_attempts)
   // Hashtable returns 2 if a key already has a mapping
   PREEXISTING("\ta file name", src_filename, res, 2)
 
 
-  // Now add the mapping from the source file hash to the checkpoint
+  // Now add the mapping from the source file to the checkpoint
   // tree for that file.
   
-  // Make space for a CpTreeNode
-  CpTreeNodePtr new_tree;
-  num_attempts = NUMBER_ATTEMPTS;
-  ATTEMPT((new_tree = (CpTreeNodePtr)malloc(sizeof(CpTreeNode))),
-          NULL,
-          num_attempts)
-  new_tree->parent_node = NULL;
-
-  // Now attempt to make space on the heap for a checkpoint  name.
-  new_tree->cpt_name = malloc(sizeof(char) * (strlen(cpt_name) + 1));
-  if (new_tree->cpt_name == NULL) {
-    if (DEBUG) {
-      printf("Ran out of memory to hold %s\n", cpt_name);
-    }
-    free(new_tree);
-    return MEM_ERR;
-  }
-  strcpy(new_tree->cpt_name, cpt_name);
-
-  // now allocate a linked list to keep track of the children
-  new_tree->children = MakeLinkedList();
-  if (new_tree->children == NULL) {
+  // Make space for a tree whose root is the new checkpoint.
+  CpTreePtr new_tree;
+  if (CreateCpTree(cpt_name, &new_tree) != CREATE_TREE_SUCCESS) {
     if (DEBUG) {
-      printf("Ran out of memory for a linkedlist\n");
+      printf("Ran out of memory for a tree holding %s\n", cpt_name);
     }
-    free(new_tree);
-    free(src_name_copy);
     return MEM_ERR;
   }
 
-  keyval.value = (HashTabVal_t)(new_tree);
-
   // Attempt to add the new mapping from src_filename to the new
-  // LinkedList which contains
-  ATTEMPT((res = HTInsert(cpt_log->dir_tree,
-                          keyval,
-                          &storage)), -1, num_attempts)
+  // tree which contains its checkpoints.
+  ATTEMPT((res = HTInsertStr(cpt_log->dir_tree,
+                             src_filename,
+                             new_tree,
+                             &storage)), 0, num_attempts)
   // Hashtable returns two if there was already a mapping
-  PREEXISTING("\ta LL of cpts", src_filename, res, 2)
+  PREEXISTING("\ta tree of cpts", src_filename, res, 2)
   
   // Store the recorded cpt for the source file
-  keyval.value = (char *)malloc(sizeof(char) * (strlen(cpt_name) + 1));
-  if (keyval.value == NULL) {
+  char *cpt_name_copy = CopyLogString(cpt_name);
+  if (cpt_name_copy == NULL) {
     if (DEBUG) {
       printf("Ran out of memory to hold %s\n", cpt_name);
     }
     return MEM_ERR;
   }
-  strcpy(keyval.value, cpt_name);
 
   num_attempts = NUMBER_ATTEMPTS;
-  ATTEMPT((HTInsert(cpt_log->src_filehash_to_cptname, keyval, &storage)), 
+  ATTEMPT((HTInsertStr(cpt_log->src_filehash_to_cptname,
+                       src_filename,
+                       cpt_name_copy,
+                       &storage)), 
                     0,
                     num_attempts)
   return CREATE_CPT_SUCCESS;
 }
 
-static int32_t Back(char *src_filename, CheckPointLogPtr cpt_log) {
-  HashTabKey_t key = HashFunc(src_filename, strlen(src_filename));
+static int32_t StampCpt(char *src_filename,
+                        char *cpt_name,
+                        CheckPointLogPtr cpt_log) {
   HashTabKV storage;
-  if (HTLookup(cpt_log->src_filehash_to_filename, key, &storage) == 0) {
-    printf("Sorry, %s is not currently being tracked.\n", src_filename);
-    return BACK_ERROR;
+  CpTreePtr tree;
+  CpTreeHandle node;
+  time_t cpt_time;
+  off_t cpt_size;
+
+  if (HTLookupStr(cpt_log->dir_tree, src_filename, &storage) != 1) {
+    return CREATE_CPT_ERROR;
+  }
+  tree = storage.value;
+  if (FindCpt(tree, cpt_name, &node) != FIND_CPT_SUCCESS) {
+    return CREATE_CPT_ERROR;
+  }
+
+  // The checkpoint file was only just written, so it is as old as the
+  // checkpoint.
+  if (StatCheckpoint(cpt_name, &cpt_time, &cpt_size) != READ_SUCCESS) {
+    cpt_time = time(NULL);
+    cpt_size = 0;
+  }
+  SetCpTreeNodeStamp(tree, node, cpt_time, cpt_size);
+  return CREATE_CPT_SUCCESS;
+}
+
+static int32_t ParseTime(char *arg, int64_t *time) {
+  struct tm tm;
+  int32_t year, month, day, hour = 0, minute = 0, second = 0, len;
+  char *end;
+  time_t local;
+
+  if (arg[0] == '@') {
+    if (!isdigit((unsigned char)arg[1]) && arg[1] != '-') {
+      return -1;
+    }
+    *time = strtoll(arg + 1, &end, 10);
+    return *end == '\0' ? 0 : -1;
+  }
+
+  // The date, then optionally the time of day (with or without seconds).
+  if (sscanf(arg, "%4d-%2d-%2d%n", &year, &month, &day, &len) != 3) {
+    return -1;
+  }
+  arg += len;
+  if (*arg == ' ' || *arg == 'T') {
+    if (sscanf(arg + 1, "%2d:%2d%n", &hour, &minute, &len) != 2) {
+      return -1;
+    }
+    arg += len + 1;
+    if (*arg == ':') {
+      if (sscanf(arg + 1, "%2d%n", &second, &len) != 1) {
+        return -1;
+      }
+      arg += len + 1;
+    }
+  }
+  if (*arg != '\0' || month < 1 || month > 12 || day < 1 || day > 31 ||
+      hour > 23 || minute > 59 || second > 60) {
+    return -1;
+  }
+
+  memset(&tm, 0, sizeof(struct tm));
+  tm.tm_year = year - 1900;
+  tm.tm_mon = month - 1;
+  tm.tm_mday = day;
+  tm.tm_hour = hour;
+  tm.tm_min = minute;
+  tm.tm_sec = second;
+  tm.tm_isdst = -1;  // let mktime work out whether DST was in effect
+  if ((local = mktime(&tm)) == (time_t)-1) {
+    return -1;
+  }
+  *time = local;
+  return 0;
+}
+
+static void FormatTime(int64_t time, char *str) {
+  time_t t = time;
+  struct tm *tm = localtime(&t);
+
+  if (tm == NULL || strftime(str, TIME_STR_LEN, TIME_FORMAT, tm) == 0) {
+    snprintf(str, TIME_STR_LEN, "@%lld", (long long)time);
+  }
+}
+
+static int32_t ParseNumSteps(char *arg, uint32_t *num_steps) {
+  char *end;
+  unsigned long n;
+
+  if (!isdigit((unsigned char)arg[0])) {
+    return -1;
+  }
+  n = strtoul(arg, &end, 10);
+  if (*end != '\0' || n > UINT32_MAX) {
+    return -1;
+  }
+  *num_steps = n;
+  return 0;
+}
+
+static int32_t FindCurrentCpt(char *src_filename,
+                              CheckPointLogPtr cpt_log,
+                              CpTreePtr *tree,
+                              CpTreeHandle *current) {
+  HashTabKV storage;
+  if (HTLookupStr(cpt_log->src_filehash_to_filename, src_filename, &storage) != 1) {
+    return FIND_CPT_ABSENT;
   }
 
   // Get the current cp name
   char *cpt_name;
   storage.value = NULL;
-  HTLookup(cpt_log->src_filehash_to_cptname, key, &storage);
-  if (storage.value == NULL) { return BACK_ERROR; }
+  HTLookupStr(cpt_log->src_filehash_to_cptname, src_filename, &storage);
+  if (storage.value == NULL) { return FIND_CPT_ERROR; }
 
   cpt_name = storage.value;
 
   storage.value = NULL;
-  HTLookup(cpt_log->dir_tree, key, &storage);
-  if (storage.value == NULL) { return BACK_ERROR; }
+  HTLookupStr(cpt_log->dir_tree, src_filename, &storage);
+  if (storage.value == NULL) { return FIND_CPT_ERROR; }
 
-  CpTreeNodePtr target_node;
-  if(FindCpt(storage.value, cpt_name, &target_node) != FIND_CPT_SUCCESS) {
+  *tree = storage.value;
+  if (FindCpt(*tree, cpt_name, current) != FIND_CPT_SUCCESS) {
+    return FIND_CPT_ERROR;
+  }
+  return FIND_CPT_SUCCESS;
+}
+
+static int32_t Back(char *src_filename,
+                    uint32_t num_steps,
+                    CheckPointLogPtr cpt_log) {
+  CpTreePtr tree;
+  CpTreeHandle target_node;
+  int32_t res = FindCurrentCpt(src_filename, cpt_log, &tree, &target_node);
+  if (res == FIND_CPT_ABSENT) {
+    printf("Sorry, %s is not currently being tracked.\n", src_filename);
+    return BACK_ERROR;
+  } else if (res != FIND_CPT_SUCCESS) {
     return BACK_ERROR;
   }
 
-  if (target_node->parent_node == NULL) {
-    printf("%s is the root checkpoint. Cannot go further back\n", cpt_name);
+  uint32_t depth = tree->nodes[target_node].depth;
+  if (depth == 0) {
+    printf("%s is the root checkpoint. Cannot go further back\n",
+           CPT_NAME(tree, target_node));
     return BACK_SUCCESS;
   }
+  if (num_steps > depth) {
+    printf("%s is only %u checkpoint(s) after the root checkpoint. "\
+           "Going back to the root.\n", CPT_NAME(tree, target_node), depth);
+    num_steps = depth;
+  }
 
-  char *cpt_name_copy;
-  int32_t num_attempts = NUMBER_ATTEMPTS;
-  ATTEMPT((cpt_name_copy = malloc(sizeof(char) * (strlen(cpt_name) + 1))), NULL, num_attempts)  
-  strcpy(cpt_name_copy, target_node->parent_node->cpt_name);
-  
-  HashTabKV kv = {key, cpt_name_copy};
-  num_attempts = 20;
-  HTInsert(cpt_log->src_filehash_to_cptname, kv, &storage);
-  WriteSrcCheckpoint(src_filename, cpt_name_copy, false);
+  // However far back we go, only the checkpoint we end up at is copied
+  // into the source file.
+  CpTreeHandle ancestor = CpTreeAncestor(tree, target_node, num_steps);
+  char *ancestor_name = CPT_NAME(tree, ancestor);
+  if (UpdateMapping(src_filename,
+                    ancestor_name,
+                    cpt_log->src_filehash_to_cptname) == MEM_ERR) {
+    return MEM_ERR;
+  }
+  WriteSrcCheckpoint(src_filename, ancestor_name, false);
   return BACK_SUCCESS;
 }
 
+static int32_t Log(char *src_filename, CheckPointLogPtr cpt_log) {
+  CpTreePtr tree;
+  CpTreeHandle current, node, *path;
+  int32_t res = FindCurrentCpt(src_filename, cpt_log, &tree, &current);
+  if (res == FIND_CPT_ABSENT) {
+    printf("Sorry, %s is not currently being tracked.\n", src_filename);
+    return LOG_ERR;
+  } else if (res != FIND_CPT_SUCCESS) {
+    return LOG_ERR;
+  }
+
+  // The path is found from the current checkpoint up, but printed from
+  // the root down.
+  uint32_t depth = tree->nodes[current].depth;
+  int32_t num_attempts = NUMBER_ATTEMPTS;
+  ATTEMPT((path = malloc(sizeof(CpTreeHandle) * (depth + 1))), NULL, num_attempts)
+  for (node = current; node != CPT_NULL_HANDLE; node = tree->nodes[node].parent) {
+    path[tree->nodes[node].depth] = node;
+  }
+
+  printf("%s (curr cp: %s)\n", src_filename, CPT_NAME(tree, current));
+  for (uint32_t i = 0; i <= depth; i++) {
+    printf("\t%u: %s\n", i, CPT_NAME(tree, path[i]));
+  }
+
+  free(path);
+  return depth + 1;
+}
+
+static int32_t Lca(char *cpt_a, char *cpt_b, CheckPointLogPtr cpt_log) {
+  HTIter it;
+  HashTabKV kv;
+  CpTreePtr tree = NULL;
+  CpTreeHandle a, b;
+  const char *src_filename = NULL;
+  int32_t num_attempts = NUMBER_ATTEMPTS;
+
+  // Checkpoint names are unique across files, so the first tree
+  // which has @cpt_a is the only one.
+  ATTEMPT((it = MakeHTIter(cpt_log->dir_tree)), NULL, num_attempts)
+  while (!HTIterValid(it)) {
+    HTIterKV(it, &kv);
+    if (FindCpt(kv.value, cpt_a, &a) == FIND_CPT_SUCCESS) {
+      HTIterStrKey(it, &src_filename);
+      tree = kv.value;
+      break;
+    }
+    HTIncrementIter(it);
+  }
+  DiscardHTIter(it);
+
+  if (tree == NULL) {
+    printf("Sorry, %s isn't a valid checkpoint name.\n", cpt_a);
+    return LCA_ERR;
+  }
+  if (FindCpt(tree, cpt_b, &b) != FIND_CPT_SUCCESS) {
+    printf("Sorry, %s isn't a checkpoint of %s.\n", cpt_b, src_filename);
+    return LCA_ERR;
+  }
+
+  CpTreeHandle lca = CpTreeLCA(tree, a, b);
+  printf("%s\n", CPT_NAME(tree, lca));
+  printf("\t%s: %u back\n", cpt_a,
+         tree->nodes[a].depth - tree->nodes[lca].depth);
+  printf("\t%s: %u back\n", cpt_b,
+         tree->nodes[b].depth - tree->nodes[lca].depth);
+  return 0;
+}
+
 static int32_t SwapTo(char *src_filename, char *cpt_name, CheckPointLogPtr cpt_log) {
   if (DEBUG) {
     printf("swapping to %s\n", cpt_name);
   }
 
-  HashTabKV kv, storage;
-  HashTabKey_t key = HashFunc(cpt_name, strlen(cpt_name));
+  HashTabKV storage;
+  int32_t res;
 
-  if (HTLookup(cpt_log->cpt_namehash_to_cptfilename, key, &storage) == 0) {
+  if (HTLookupStr(cpt_log->cpt_namehash_to_cptfilename, cpt_name, &storage) == 0) {
     printf("Sorry, %s isn't a valid checkpoint name.\n", cpt_name);
     return SWAPTO_SUCCESS;  // This is a success as far as SwapTo is concerned.
   }
 
-  kv.key = HashFunc(src_filename, strlen(src_filename));
-  kv.value = malloc(sizeof(char) *(strlen(storage.value) + 1));
-  strcpy(kv.value, storage.value);
-  if (HTInsert(cpt_log->src_filehash_to_cptname, kv, &storage) != 2) {
+  // The checkpoint it was at before is freed as it is replaced.
+  res = UpdateMapping(src_filename,
+                      storage.value,
+                      cpt_log->src_filehash_to_cptname);
+  if (res == MEM_ERR) {
+    return MEM_ERR;
+  } else if (res != 2) {
     return SWAPTO_ERROR;
   }
 
@@ -445,123 +791,802 @@ static int32_t SwapTo(char *src_filename, char *cpt_name, CheckPointLogPtr cpt_l
   return SWAPTO_SUCCESS;
 }
 
+static int32_t SwapToTime(char *src_filename,
+                          int64_t time,
+                          CheckPointLogPtr cpt_log) {
+  HashTabKV storage;
+  CpTreePtr tree;
+  CpTreeHandle node;
+  char when[TIME_STR_LEN], made[TIME_STR_LEN];
+  int32_t res;
+
+  if (HTLookupStr(cpt_log->dir_tree, src_filename, &storage) != 1) {
+    printf("Sorry, %s has no checkpoints.\n", src_filename);
+    return SWAPTO_SUCCESS;  // This is a success as far as SwapTo is concerned.
+  }
+  tree = storage.value;
+
+  FormatTime(time, when);
+  if ((res = FindCptAtTime(tree, time, &node)) == MEM_ERR) {
+    return MEM_ERR;
+  }
+  if (res == FIND_CPT_ABSENT) {
+    printf("Sorry, no checkpoint of %s was made by %s.\n", src_filename, when);
+    return SWAPTO_SUCCESS;
+  }
+
+  if ((res = SwapTo(src_filename, CPT_NAME(tree, node), cpt_log)) != SWAPTO_SUCCESS) {
+    return res;
+  }
+  FormatTime(tree->nodes[node].time, made);
+  printf("%s is now at %s (made %s).\n", src_filename, CPT_NAME(tree, node), made);
+  return SWAPTO_SUCCESS;
+}
+
 static int32_t Delete(char *src_filename, CheckPointLogPtr cpt_log) {
   if (DEBUG) {
     printf("deleting %s\n", src_filename);
   }
 
-  int32_t res, num_attempts;
+  int32_t res;
   HashTabKV storage;
-  HashTabKey_t key = HashFunc(src_filename, strlen(src_filename));
-  if (HTLookup(cpt_log->src_filehash_to_filename, key, &storage) == 0) {
+  if (HTLookupStr(cpt_log->src_filehash_to_filename, src_filename, &storage) == 0) {
     printf("Sorry, %s is not currently being tracked.\n", src_filename);
     return DELETE_SUCCESS;
   }
 
   // Delete all the mappings.
   // The first two are easy, just remove the mappings.
-  HTRemove(cpt_log->src_filehash_to_filename, key, &storage);
-  HTRemove(cpt_log->src_filehash_to_cptname, key, &storage);
+  storage.value = NULL;
+  HTRemoveStr(cpt_log->src_filehash_to_filename, src_filename, &storage);
+  FreeLogString(storage.value);
+  storage.value = NULL;
+  HTRemoveStr(cpt_log->src_filehash_to_cptname, src_filename, &storage);
+  FreeLogString(storage.value);
 
-  // The last two are related - we must free all the mappings of cp name hashes
+  // The last two are related - we must free all the mappings of cp names
   // before we free the checkpoint tree, or else we will maintain information
   // we don't care about.
   storage.value = NULL;
-  HTRemove(cpt_log->dir_tree, key, &storage);
-  FreeTreeCpHash(cpt_log, storage.value);
-  FreeCpTreeNode(storage.value);
+  HTRemoveStr(cpt_log->dir_tree, src_filename, &storage);
+  res = FreeTreeCpHash(cpt_log, storage.value);
+  FreeCpTree(storage.value);
 
-  return DELETE_SUCCESS;
+  return res < 0 ? res : DELETE_SUCCESS;
 }
 
-static int32_t FreeTreeCpHash(CheckPointLogPtr cpt_log, CpTreeNodePtr curr_node) {
-  if (curr_node == NULL) {
-    return 0;
+static int32_t Prune(char *src_filename,
+                     char *cpt_name,
+                     bool squash,
+                     CheckPointLogPtr cpt_log) {
+  if (DEBUG) {
+    printf("%s %s from %s\n", squash ? "squashing" : "pruning",
+           cpt_name, src_filename);
   }
 
-  // Remove the mapping and free the string.
-  HashTabKey_t key = HashFunc(curr_node->cpt_name, strlen(curr_node->cpt_name));
-  HashTabKV storage;
-  storage.value = NULL;
-  HTRemove(cpt_log->cpt_namehash_to_cptfilename, key, &storage);
-  free(storage.value);
-  
-  // Do the same for all children.
-  if (curr_node->children != NULL) {
-    int32_t num_children = LLSize(curr_node->children);
-    int32_t num_attempts = NUMBER_ATTEMPTS;
-    if (num_children > 0) {
-      LLIter it;
-      CpTreeNodePtr curr_child;
-      ATTEMPT((it = LLGetIter(curr_node->children, 0)), NULL, num_attempts);
-
-      for (int32_t i = 0; i < num_children; i++) {
-        LLIterPayload(it, &curr_child);
-        FreeTreeCpHash(cpt_log, curr_child);
-        LLIterAdvance(it);
-      }
+  CpTreePtr tree;
+  CpTreeHandle current, target, parent;
+  ForgetState forget = { cpt_log, 0, NULL, 0 };
+  int32_t res = FindCurrentCpt(src_filename, cpt_log, &tree, &current);
+  if (res == FIND_CPT_ABSENT) {
+    printf("Sorry, %s is not currently being tracked.\n", src_filename);
+    return PRUNE_SUCCESS;
+  } else if (res != FIND_CPT_SUCCESS) {
+    return PRUNE_ERROR;
+  }
 
-      LLIterFree(it);
-    }
+  if (FindCpt(tree, cpt_name, &target) != FIND_CPT_SUCCESS) {
+    printf("Sorry, %s isn't a checkpoint of %s.\n", cpt_name, src_filename);
+    return PRUNE_SUCCESS;
+  }
+  if (target == CPT_ROOT_HANDLE) {
+    printf("%s is the root checkpoint of %s, use delete to remove them all.\n",
+           cpt_name, src_filename);
+    return PRUNE_SUCCESS;
   }
 
-  return 0;
-}
+  int32_t num_attempts = NUMBER_ATTEMPTS;
+  ATTEMPT((forget.cpt_filenames = malloc(sizeof(char *) * (tree->num_nodes + 1))),
+          NULL,
+          num_attempts)
 
-static int32_t List(CheckPointLogPtr cpt_log) {
-  int32_t num_cpts = 0, num_attempts, num_files, i, res;
-  HTIter it;
-  HashTabKV f_name, cpt_tree, cptname;
+  // If the current checkpoint is about to go, the parent of what goes
+  // becomes the current one. The source file itself is left as it is.
+  parent = tree->nodes[target].parent;
+  if (current == target ||
+      (!squash &&
+       tree->nodes[current].depth > tree->nodes[target].depth &&
+       CpTreeAncestor(tree, current, tree->nodes[current].depth -
+                                     tree->nodes[target].depth) == target)) {
+    if (UpdateMapping(src_filename,
+                      CPT_NAME(tree, parent),
+                      cpt_log->src_filehash_to_cptname) == MEM_ERR) {
+      free(forget.cpt_filenames);
+      return MEM_ERR;
+    }
+    printf("The current checkpoint of %s is now %s.\n",
+           src_filename, CPT_NAME(tree, parent));
+  }
 
-  // To achieve the above output, we'll only need one iterator. Since
-  // all hashtables should share the keyset, one iterator should be enough
-  // to get all the keys we need.
+  // Forget the checkpoints before they are unlinked from the tree (their
+  // names stay in the tree's pool either way).
+  if (squash) {
+    res = ForgetCpt(tree, target, &forget);
+  } else {
+    res = CpTreePostorder(tree, target, &ForgetCpt, &forget);
+  }
 
-  num_attempts = NUMBER_ATTEMPTS;
-  ATTEMPT((it = MakeHTIter(cpt_log->src_filehash_to_filename)),
-          NULL,
-          num_attempts)
+  // Not being able to drop them from the index only makes it bigger.
+  if (RemoveFromIndex(forget.cpt_filenames, forget.num_files) != 0 && DEBUG) {
+    printf("could not drop the pruned checkpoints from the index\n");
+  }
+  for (uint32_t i = 0; i < forget.num_files; i++) {
+    FreeLogString(forget.cpt_filenames[i]);
+  }
+  free(forget.cpt_filenames);
+  if (res < 0) {
+    return res;
+  }
 
-  num_files = HTSize(cpt_log->dir_tree);
-  if (num_files != HTSize(cpt_log->src_filehash_to_filename) ||
-      num_files != HTSize(cpt_log->src_filehash_to_cptname)) {
-      if (DEBUG) {
-        printf("ERROR: invalid state - not an equal keyset for all hashtables\n");
-      }
-      return LIST_ERR;
+  res = squash ? SquashCpTreeNode(tree, target) : PruneCpTreeNode(tree, target);
+  if (res != PRUNE_NODE_SUCCESS) {
+    return PRUNE_ERROR;
   }
 
-  if (DEBUG) { printf("printing the state of %d files\n", num_files); }
-  for (i = 0; i < num_files; i++) {
-    // Get current key.
-    if (HTIterKV(it, &f_name) == 0 && num_files > 1) {
-      if (DEBUG) {
-        printf("ERROR: could obtain HTKV List\n");
-      }
-      DiscardHTIter(it);
-      return LIST_ERR;
-    }
-    // Get other two values.
-    res = HTLookup(cpt_log->src_filehash_to_cptname, f_name.key, &cptname);
-    if (res == 0 || res == -1) {
-      DiscardHTIter(it);
-      return LIST_ERR;
+  printf("Removed %d checkpoint(s) of %s.\n", forget.num_cpts, src_filename);
+  return PRUNE_SUCCESS;
+}
+
+static int32_t Diff(char *src_filename,
+                    char *cpt_a,
+                    char *cpt_b,
+                    CheckPointLogPtr cpt_log) {
+  HashTabKV storage;
+  CpTreePtr tree;
+  CpTreeHandle handle;
+  char *cpt_names[2] = { cpt_a, cpt_b };
+  char *filenames[2];
+  MappedFile files[2] = { { NULL, 0 }, { NULL, 0 } };
+  int32_t res = DIFF_SUCCESS;
+
+  if (HTLookupStr(cpt_log->dir_tree, src_filename, &storage) != 1) {
+    printf("Sorry, %s is not currently being tracked.\n", src_filename);
+    return DIFF_SUCCESS;
+  }
+  tree = storage.value;
+
+  // Both have to be checkpoints of @src_filename, except that the source
+  // file itself can be given as DIFF_WORKING.
+  for (int32_t i = 0; i < 2; i++) {
+    if (FindCpt(tree, cpt_names[i], &handle) == FIND_CPT_SUCCESS &&
+        HTLookupStr(cpt_log->cpt_namehash_to_cptfilename,
+                    cpt_names[i],
+                    &storage) == 1) {
+      filenames[i] = storage.value;
+    } else if (strcmp(cpt_names[i], DIFF_WORKING) == 0) {
+      filenames[i] = NULL;
+    } else {
+      printf("Sorry, %s isn't a checkpoint of %s.\n", cpt_names[i], src_filename);
+      return DIFF_SUCCESS;
     }
-    res = HTLookup(cpt_log->dir_tree, f_name.key, &cpt_tree);
-    if (res == 0 || res == -1) {
-      DiscardHTIter(it);
-      return LIST_ERR;
+  }
+
+  for (int32_t i = 0; i < 2 && res == DIFF_SUCCESS; i++) {
+    if (MapFile(filenames[i] == NULL ? src_filename : filenames[i],
+                filenames[i] != NULL,
+                &files[i]) != READ_SUCCESS) {
+      res = DIFF_ERR;
     }
-  
-    // print output.
-    printf("%s (curr cp: %s)\n", f_name.value, cptname.value);
-    res = PrintTree(cpt_tree.value);
-    if (res == MEM_ERR || res == PRINT_ERR) {
+  }
+
+  if (res == DIFF_SUCCESS) {
+    // Checkpoints are shown as file@checkpoint, the source file as is.
+    size_t name_len = strlen(src_filename) + 1;
+    char name_a[name_len + strlen(cpt_a) + 1], name_b[name_len + strlen(cpt_b) + 1];
+    sprintf(name_a, filenames[0] == NULL ? "%s" : "%s@%s", src_filename, cpt_a);
+    sprintf(name_b, filenames[1] == NULL ? "%s" : "%s@%s", src_filename, cpt_b);
+
+    res = DiffFiles(name_a, files[0].data, files[0].len,
+                    name_b, files[1].data, files[1].len);
+    res = res < 0 ? res : DIFF_SUCCESS;
+  }
+
+  UnmapFile(&files[0]);
+  UnmapFile(&files[1]);
+  return res;
+}
+
+static int32_t Merge(char *src_filename,
+                     char *cpt_a,
+                     char *cpt_b,
+                     char *new_cpt,
+                     CheckPointLogPtr cpt_log) {
+  HashTabKV storage;
+  CpTreePtr tree;
+  CpTreeHandle handles[3];
+  char *cpt_names[3] = { cpt_a, cpt_b, NULL };
+  char *filenames[3];
+  MappedFile files[3] = { { NULL, 0 }, { NULL, 0 }, { NULL, 0 } };
+  MergeResult merged;
+  int32_t res = MERGE_SUCCESS;
+
+  if (HTLookupStr(cpt_log->dir_tree, src_filename, &storage) != 1) {
+    printf("Sorry, %s is not currently being tracked.\n", src_filename);
+    return MERGE_SUCCESS;
+  }
+  tree = storage.value;
+
+  for (int32_t i = 0; i < 2; i++) {
+    if (FindCpt(tree, cpt_names[i], &handles[i]) != FIND_CPT_SUCCESS) {
+      printf("Sorry, %s isn't a checkpoint of %s.\n", cpt_names[i], src_filename);
+      return MERGE_SUCCESS;
+    }
+  }
+  // Check the new name is free before anything is changed.
+  if (HTLookupStr(cpt_log->cpt_namehash_to_cptfilename, new_cpt, &storage) != 0) {
+    fprintf(stderr,
+           "\tSorry, checkpoint  name [%s] already exists. Try another.\n"\
+           "\t(maybe %s_2)\n", new_cpt, new_cpt);
+    return MERGE_SUCCESS;
+  }
+
+  handles[2] = CpTreeLCA(tree, handles[0], handles[1]);
+  cpt_names[2] = CPT_NAME(tree, handles[2]);
+  for (int32_t i = 0; i < 3; i++) {
+    if (HTLookupStr(cpt_log->cpt_namehash_to_cptfilename,
+                    cpt_names[i],
+                    &storage) != 1) {
+      return MERGE_ERR;
+    }
+    filenames[i] = storage.value;
+  }
+
+  for (int32_t i = 0; i < 3 && res == MERGE_SUCCESS; i++) {
+    if (MapFile(filenames[i], true, &files[i]) != READ_SUCCESS) {
+      res = MERGE_ERR;
+    }
+  }
+
+  if (res == MERGE_SUCCESS) {
+    // Conflicts are marked with file@checkpoint, as in diff.
+    size_t name_len = strlen(src_filename) + 1;
+    char name_a[name_len + strlen(cpt_a) + 1], name_b[name_len + strlen(cpt_b) + 1];
+    sprintf(name_a, "%s@%s", src_filename, cpt_a);
+    sprintf(name_b, "%s@%s", src_filename, cpt_b);
+
+    res = MergeFiles(files[2].data, files[2].len,
+                     name_a, files[0].data, files[0].len,
+                     name_b, files[1].data, files[1].len,
+                     &merged);
+  }
+  for (int32_t i = 0; i < 3; i++) {
+    UnmapFile(&files[i]);
+  }
+  if (res < 0) {
+    return res == DIFF_ERR ? MERGE_ERR : res;
+  }
+
+  // The merge is saved as a child of @cpt_a (its only recorded parent),
+  // and only then written over the source file.
+  if (CreateCheckpoint(src_filename, new_cpt, cpt_a,
+                       merged.data, merged.len, cpt_log) != CREATE_CPT_SUCCESS) {
+    FreeMergeResult(&merged);
+    return MERGE_ERR;
+  }
+  if (WriteSrcFile(src_filename, merged.data, merged.len) != FILE_WRITE_SUCCESS) {
+    fprintf(stderr,
+            "\tERROR: could not write %s. The merge is saved as %s,\n"\
+            "\tso swapto %s to try again.\n", src_filename, new_cpt, new_cpt);
+    FreeMergeResult(&merged);
+    return res;
+  }
+  FreeMergeResult(&merged);
+
+  printf("Merged %s and %s (from %s) into %s", cpt_a, cpt_b, cpt_names[2], new_cpt);
+  if (res > 0) {
+    printf(", with %d conflict(s) marked in %s", res, src_filename);
+  }
+  printf(".\n");
+  return res;
+}
+
+static int32_t Grep(char *pattern, char *src_filename, CheckPointLogPtr cpt_log) {
+  HTIter it;
+  HashTabKV kv;
+  const char *key;
+  GrepPattern compiled;
+  GrepState state = { NULL, NULL, 0, 0 };
+  TrigramIndex index;
+  MappedFile files[GREP_BATCH_SIZE];
+  Progress progress;
+  int32_t res, num_attempts = NUMBER_ATTEMPTS;
+
+  if ((res = CompileGrepPattern(pattern, &compiled)) < 0) {
+    return res;
+  }
+
+  if (src_filename != NULL) {
+    if (HTLookupStr(cpt_log->dir_tree, src_filename, &kv) != 1) {
+      printf("Sorry, %s is not currently being tracked.\n", src_filename);
+    } else {
+      res = AddGrepJobs(cpt_log, src_filename, kv.value, &state);
+    }
+  } else {
+    ATTEMPT((it = MakeHTIter(cpt_log->dir_tree)), NULL, num_attempts)
+    while (!HTIterValid(it) && res == 0) {
+      HTIterKV(it, &kv);
+      HTIterStrKey(it, &key);
+      res = AddGrepJobs(cpt_log, key, kv.value, &state);
+      HTIncrementIter(it);
+    }
+    DiscardHTIter(it);
+  }
+
+  // Leave out the checkpoint files the index says can't match.
+  if (res == 0 && compiled.literal_len >= INDEX_MIN_LITERAL &&
+      (res = OpenIndex(&index)) == 0) {
+    res = FindIndexCandidates(&index, compiled.literal, compiled.literal_len);
+    uint32_t num_jobs = 0;
+    for (uint32_t i = 0; i < state.num_jobs && res == 0; i++) {
+      if (IndexRulesOut(&index, state.cpt_filenames[i])) {
+        free((char *)state.jobs[i].label);
+      } else {
+        state.jobs[num_jobs] = state.jobs[i];
+        state.cpt_filenames[num_jobs++] = state.cpt_filenames[i];
+      }
+    }
+    state.num_jobs = res == 0 ? num_jobs : state.num_jobs;
+    CloseIndex(&index);
+  }
+
+  // Only so many files are mapped at once, but each batch is spread
+  // over every core.
+  ProgressBegin(&progress, "grep", pattern, NULL, PROGRESS_UNIT_FILES,
+                state.num_jobs);
+  for (uint32_t first = 0; first < state.num_jobs && res == 0;
+       first += GREP_BATCH_SIZE) {
+    uint32_t num_jobs = state.num_jobs - first < GREP_BATCH_SIZE ?
+                        state.num_jobs - first : GREP_BATCH_SIZE;
+    GrepJobPtr jobs = &state.jobs[first];
+
+    for (uint32_t i = 0; i < num_jobs; i++) {
+      // A checkpoint file which can't be read is searched as if empty.
+      if (MapFile(state.cpt_filenames[first + i], true, &files[i]) != READ_SUCCESS) {
+        files[i].data = NULL;
+        files[i].len = 0;
+      }
+      jobs[i].data = files[i].data;
+      jobs[i].len = files[i].len;
+    }
+
+    GrepFiles(&compiled, jobs, num_jobs);
+
+    for (uint32_t i = 0; i < num_jobs; i++) {
+      if (jobs[i].res < 0) {
+        res = jobs[i].res;
+      } else if (res == 0 && jobs[i].out_len > 0) {
+        fwrite(jobs[i].out, sizeof(char), jobs[i].out_len, stdout);
+      }
+      FreeGrepJob(&jobs[i]);
+      UnmapFile(&files[i]);
+    }
+    ProgressAdd(&progress, num_jobs);
+  }
+  ProgressEnd(&progress);
+
+  for (uint32_t i = 0; i < state.num_jobs; i++) {
+    free((char *)state.jobs[i].label);
+  }
+  free(state.jobs);
+  free(state.cpt_filenames);
+  FreeGrepPattern(&compiled);
+  return res;
+}
+
+static int32_t IndexCpts(CheckPointLogPtr cpt_log) {
+  HTIter it;
+  HashTabKV kv;
+  TrigramIndex index;
+  char **cpt_filenames;
+  uint32_t num_files = 0;
+  int32_t res, num_attempts = NUMBER_ATTEMPTS;
+
+  if ((res = OpenIndex(&index)) < 0) {
+    return res;
+  }
+  ATTEMPT((cpt_filenames = malloc(sizeof(char *) *
+                                  (HTSize(cpt_log->cpt_namehash_to_cptfilename) + 1))),
+          NULL,
+          num_attempts)
+
+  num_attempts = NUMBER_ATTEMPTS;
+  ATTEMPT((it = MakeHTIter(cpt_log->cpt_namehash_to_cptfilename)), NULL, num_attempts)
+  while (!HTIterValid(it)) {
+    HTIterKV(it, &kv);
+    if (!IndexCovers(&index, kv.value)) {
+      cpt_filenames[num_files++] = kv.value;
+    }
+    HTIncrementIter(it);
+  }
+  DiscardHTIter(it);
+  CloseIndex(&index);
+
+  if ((res = AddToIndex(cpt_filenames, num_files, UINT64_MAX)) == 0) {
+    res = CompactIndex();
+  }
+  free(cpt_filenames);
+  return res < 0 ? res : (int32_t)num_files;
+}
+
+static int32_t AddGrepJobs(CheckPointLogPtr cpt_log,
+                           const char *src_filename,
+                           CpTreePtr tree,
+                           GrepState *state) {
+  HashTabKV storage;
+  GrepJobPtr jobs;
+  char **cpt_filenames, *label;
+  size_t name_len = strlen(src_filename) + 1;
+
+  for (CpTreeHandle i = 0; i < tree->num_nodes; i++) {
+    if (CPT_IS_PRUNED(tree, i) ||
+        HTLookupStr(cpt_log->cpt_namehash_to_cptfilename,
+                    CPT_NAME(tree, i),
+                    &storage) != 1) {
+      continue;
+    }
+
+    if (state->num_jobs == state->capacity) {
+      uint32_t capacity = state->capacity == 0 ? GREP_BATCH_SIZE
+                                               : state->capacity * 2;
+      if ((jobs = realloc(state->jobs, sizeof(GrepJob) * capacity)) == NULL) {
+        return MEM_ERR;
+      }
+      state->jobs = jobs;
+      cpt_filenames = realloc(state->cpt_filenames, sizeof(char *) * capacity);
+      if (cpt_filenames == NULL) {
+        return MEM_ERR;
+      }
+      state->cpt_filenames = cpt_filenames;
+      state->capacity = capacity;
+    }
+
+    if ((label = malloc(name_len + strlen(CPT_NAME(tree, i)) + 1)) == NULL) {
+      return MEM_ERR;
+    }
+    sprintf(label, "%s@%s", src_filename, CPT_NAME(tree, i));
+    state->jobs[state->num_jobs].label = label;
+    state->cpt_filenames[state->num_jobs] = storage.value;
+    state->num_jobs++;
+  }
+  return 0;
+}
+
+static int32_t BlameCpt(char *src_filename,
+                        char *cpt_name,
+                        CheckPointLogPtr cpt_log) {
+  HashTabKV storage;
+  CpTreePtr tree;
+  CpTreeHandle target, node, *path;
+  char **cpt_filenames;
+  Blame blame = { NULL, 0, 0 }, next;
+  LineMap map;
+  MappedFile file;
+  int32_t res, num_attempts = NUMBER_ATTEMPTS;
+
+  if (cpt_name == NULL) {
+    res = FindCurrentCpt(src_filename, cpt_log, &tree, &target);
+  } else if (HTLookupStr(cpt_log->dir_tree, src_filename, &storage) == 1) {
+    tree = storage.value;
+    res = FindCpt(tree, cpt_name, &target) == FIND_CPT_SUCCESS ?
+                                    FIND_CPT_SUCCESS : FIND_CPT_ERROR;
+    if (res != FIND_CPT_SUCCESS) {
+      printf("Sorry, %s isn't a checkpoint of %s.\n", cpt_name, src_filename);
+      return BLAME_ERR;
+    }
+  } else {
+    res = FIND_CPT_ABSENT;
+  }
+  if (res == FIND_CPT_ABSENT) {
+    printf("Sorry, %s is not currently being tracked.\n", src_filename);
+    return BLAME_ERR;
+  } else if (res != FIND_CPT_SUCCESS) {
+    return BLAME_ERR;
+  }
+
+  // The path from the root to the target, and the checkpoint file of
+  // every node on it.
+  uint32_t depth = tree->nodes[target].depth;
+  ATTEMPT((path = malloc(sizeof(CpTreeHandle) * (depth + 1))), NULL, num_attempts)
+  if ((cpt_filenames = malloc(sizeof(char *) * (depth + 1))) == NULL) {
+    free(path);
+    return MEM_ERR;
+  }
+  for (node = target; node != CPT_NULL_HANDLE; node = tree->nodes[node].parent) {
+    path[tree->nodes[node].depth] = node;
+    if (HTLookupStr(cpt_log->cpt_namehash_to_cptfilename,
+                    CPT_NAME(tree, node),
+                    &storage) != 1) {
+      free(path);
+      free(cpt_filenames);
+      return BLAME_ERR;
+    }
+    cpt_filenames[tree->nodes[node].depth] = storage.value;
+  }
+
+  if (MapFile(cpt_filenames[depth], true, &file) != READ_SUCCESS) {
+    free(path);
+    free(cpt_filenames);
+    return BLAME_ERR;
+  }
+
+  // Follow the path down from the root, one edge at a time.
+  if (depth == 0) {
+    res = MakeRootBlame(CountLines(file.data, file.len), path[0], &blame);
+  }
+  for (uint32_t i = 1; i <= depth && res >= 0; i++) {
+    if ((res = GetLineMap(cpt_filenames[i - 1], cpt_filenames[i], &map)) < 0) {
+      break;
+    }
+    if (i == 1) {
+      res = MakeRootBlame(map.a_lines, path[0], &blame);
+    }
+    if (res >= 0 && (res = ApplyLineMap(&blame, &map, path[i], &next)) >= 0) {
+      FreeBlame(&blame);
+      blame = next;
+    }
+    FreeLineMap(&map);
+  }
+
+  if (res >= 0) {
+    if (blame.num_lines != CountLines(file.data, file.len)) {
+      res = BLAME_ERR;
+    } else {
+      PrintBlame(tree, &blame, &file);
+    }
+  }
+
+  UnmapFile(&file);
+  FreeBlame(&blame);
+  free(path);
+  free(cpt_filenames);
+  return res;
+}
+
+static int32_t GetLineMap(char *parent_cpt, char *child_cpt, LineMapPtr map) {
+  MappedFile parent, child;
+  int32_t res;
+
+  if ((res = ReadLineMap(parent_cpt, child_cpt, map)) != READ_ERROR) {
+    return res;  // found in the cache (or out of memory)
+  }
+
+  if (MapFile(parent_cpt, true, &parent) != READ_SUCCESS) {
+    return BLAME_ERR;
+  }
+  if (MapFile(child_cpt, true, &child) != READ_SUCCESS) {
+    UnmapFile(&parent);
+    return BLAME_ERR;
+  }
+
+  res = DiffLineMap(parent.data, parent.len, child.data, child.len, map);
+  if (res == 0) {
+    // Not being able to cache the map only makes the next blame slower.
+    WriteLineMap(parent_cpt, child_cpt, map);
+  }
+
+  UnmapFile(&parent);
+  UnmapFile(&child);
+  return res;
+}
+
+static void PrintBlame(CpTreePtr tree, BlamePtr blame, MappedFile *file) {
+  const char *line = file->data, *nl, *last = file->data + file->len;
+  int name_width = 0, line_width = 1;
+  uint32_t line_num = 0;
+
+  for (uint32_t r = 0; r < blame->num_runs; r++) {
+    int len = strlen(CPT_NAME(tree, blame->runs[r].cpt));
+    name_width = len > name_width ? len : name_width;
+  }
+  for (uint32_t n = blame->num_lines; n >= 10; n /= 10) {
+    line_width++;
+  }
+
+  for (uint32_t r = 0; r < blame->num_runs; r++) {
+    char *name = CPT_NAME(tree, blame->runs[r].cpt);
+    for (uint32_t i = 0; i < blame->runs[r].len; i++) {
+      if ((nl = memchr(line, '\n', last - line)) == NULL) {
+        nl = last - 1;  // the last line has no newline
+      }
+      printf("%-*s %*u) ", name_width, name, line_width, ++line_num);
+      fwrite(line, sizeof(char), nl + 1 - line, stdout);
+      if (*nl != '\n') {
+        putchar('\n');
+      }
+      line = nl + 1;
+    }
+  }
+}
+
+static int32_t ForgetCpt(CpTreePtr tree, CpTreeHandle node, void *state) {
+  ForgetState *forget = state;
+  HashTabKV storage;
+
+  storage.value = NULL;
+  if (HTRemoveStr(forget->cpt_log->cpt_namehash_to_cptfilename,
+                  CPT_NAME(tree, node),
+                  &storage) == 1) {
+    // A checkpoint file which is already gone is no reason to stop.
+    RemoveCheckpoint(storage.value);
+    RemoveLineMap(storage.value);
+    forget->cpt_filenames[forget->num_files++] = storage.value;
+  }
+  forget->num_cpts++;
+  return CPT_VISIT_CONTINUE;
+}
+
+static int32_t FreeTreeCpHash(CheckPointLogPtr cpt_log, CpTreePtr tree) {
+  if (tree == NULL) {
+    return 0;
+  }
+
+  // Every node of the tree is in its node array, so we can
+  // remove the mapping for each of them (and free the string)
+  // without walking the tree. Pruned nodes were already removed,
+  // and their names may since have been reused.
+  HashTabKV storage;
+  char **cpt_filenames;
+  uint32_t num_files = 0;
+  int32_t num_attempts = NUMBER_ATTEMPTS;
+  ATTEMPT((cpt_filenames = malloc(sizeof(char *) * (tree->num_nodes + 1))),
+          NULL,
+          num_attempts)
+  for (CpTreeHandle i = 0; i < tree->num_nodes; i++) {
+    if (CPT_IS_PRUNED(tree, i)) {
+      continue;
+    }
+    storage.value = NULL;
+    HTRemoveStr(cpt_log->cpt_namehash_to_cptfilename,
+                CPT_NAME(tree, i),
+                &storage);
+    if (storage.value != NULL) {
+      RemoveLineMap(storage.value);
+      cpt_filenames[num_files++] = storage.value;
+    }
+  }
+
+  // Not being able to drop them from the index only makes it bigger.
+  if (RemoveFromIndex(cpt_filenames, num_files) != 0 && DEBUG) {
+    printf("could not drop the deleted checkpoints from the index\n");
+  }
+  for (uint32_t i = 0; i < num_files; i++) {
+    FreeLogString(cpt_filenames[i]);
+  }
+  free(cpt_filenames);
+  return 0;
+}
+
+static int32_t ParseListOptions(int32_t argc,
+                                char *argv[],
+                                ListOptions *options) {
+  options->sort = LIST_SORT_NONE;
+  options->glob = NULL;
+  options->since = INT64_MIN;
+  options->until = INT64_MAX;
+
+  // Every option takes exactly one argument.
+  for (int32_t i = 0; i < argc; i += 2) {
+    if (i + 1 >= argc) {
+      fprintf(stderr, "option %s is missing its argument\n", argv[i]);
+      return LIST_ERR;
+    }
+
+    if (strcmp(argv[i], "--glob") == 0) {
+      options->glob = argv[i + 1];
+    } else if (strcmp(argv[i], "--since") == 0 ||
+               strcmp(argv[i], "--until") == 0) {
+      if (ParseTime(argv[i + 1], argv[i][2] == 's' ? &options->since
+                                                   : &options->until) != 0) {
+        fprintf(stderr, "%s is not a time: expected something like "\
+                        "\"2019-06-01 14:00\"\n", argv[i + 1]);
+        return LIST_ERR;
+      }
+    } else if (strcmp(argv[i], "--sort") == 0) {
+      if (strcmp(argv[i + 1], "name") == 0) {
+        options->sort = LIST_SORT_NAME;
+      } else if (strcmp(argv[i + 1], "time") == 0) {
+        options->sort = LIST_SORT_TIME;
+      } else if (strcmp(argv[i + 1], "size") == 0) {
+        options->sort = LIST_SORT_SIZE;
+      } else {
+        fprintf(stderr, "can't sort by %s: expected name, time or size\n",
+                argv[i + 1]);
+        return LIST_ERR;
+      }
+    } else {
+      fprintf(stderr, "unknown list option %s\n", argv[i]);
+      return LIST_ERR;
+    }
+  }
+
+  return 0;
+}
+
+static int32_t List(CheckPointLogPtr cpt_log, ListOptions *options) {
+  int32_t num_cpts = 0, num_attempts, num_files, i, res;
+  HTIter it;
+  HashTabKV f_name;
+  LinkedList files;
+  LLIter file_it;
+  ListFilePtr file;
+  LLPayloadCompareFn compare = NULL;
+
+  if (options->sort == LIST_SORT_NAME) {
+    compare = &CompareEntryNames;
+  } else if (options->sort == LIST_SORT_TIME) {
+    compare = &CompareEntryTimes;
+  } else if (options->sort == LIST_SORT_SIZE) {
+    compare = &CompareEntrySizes;
+  }
+
+  // To achieve the above output, we'll only need one iterator. Since
+  // all hashtables should share the keyset, one iterator should be enough
+  // to get all the keys we need.
+
+  num_attempts = NUMBER_ATTEMPTS;
+  ATTEMPT((it = MakeHTIter(cpt_log->src_filehash_to_filename)),
+          NULL,
+          num_attempts)
+
+  num_files = HTSize(cpt_log->dir_tree);
+  if (num_files != HTSize(cpt_log->src_filehash_to_filename) ||
+      num_files != HTSize(cpt_log->src_filehash_to_cptname)) {
+      if (DEBUG) {
+        printf("ERROR: invalid state - not an equal keyset for all hashtables\n");
+      }
+      DiscardHTIter(it);
+      return LIST_ERR;
+  }
+
+  // Gather every file to be listed first, so they can be sorted.
+  if ((files = MakeLinkedList()) == NULL) {
+    DiscardHTIter(it);
+    return MEM_ERR;
+  }
+
+  if (DEBUG) { printf("gathering the state of %d files\n", num_files); }
+  for (i = 0; i < num_files; i++) {
+    // Get current key.
+    if (HTIterKV(it, &f_name) == 0 && num_files > 1) {
+      if (DEBUG) {
+        printf("ERROR: could obtain HTKV List\n");
+      }
       DiscardHTIter(it);
+      FreeLinkedList(files, &FreeListFile);
       return LIST_ERR;
     }
-    num_cpts += res;
-    printf("\n");
+
+    if (options->glob == NULL || fnmatch(options->glob, f_name.value, 0) == 0) {
+      if ((file = malloc(sizeof(ListFile))) == NULL) {
+        DiscardHTIter(it);
+        FreeLinkedList(files, &FreeListFile);
+        return MEM_ERR;
+      }
+      res = MakeListFile(cpt_log, f_name.value, options, compare, file);
+      if (res == 0 && file->made != NULL && file->num_made == 0) {
+        FreeListFile(file);  // nothing was made in the span of time
+      } else if (res == 0 && !LLAppend(files, file)) {
+        FreeListFile(file);
+        res = MEM_ERR;
+      } else if (res != 0) {
+        FreeListFile(file);
+      }
+      if (res != 0) {
+        DiscardHTIter(it);
+        FreeLinkedList(files, &FreeListFile);
+        return res;
+      }
+    }
 
     // Advance iterator.
     if (i < num_files - 1) {
@@ -570,59 +1595,393 @@ static int32_t List(CheckPointLogPtr cpt_log) {
           printf("ERROR: could not advance iterator in List\n");
         }
         DiscardHTIter(it);
+        FreeLinkedList(files, &FreeListFile);
         return LIST_ERR;
       }
     }
   }
-
   DiscardHTIter(it);
+
+  if (compare != NULL) {
+    LLSort(files, 1, compare);
+  }
+
+  if (LLSize(files) == 0) {
+    FreeLinkedList(files, &FreeListFile);
+    return 0;
+  }
+  if ((file_it = LLGetIter(files, 0)) == NULL) {
+    FreeLinkedList(files, &FreeListFile);
+    return MEM_ERR;
+  }
+  do {
+    LLIterPayload(file_it, (LinkedListPayload *)&file);
+
+    // print output.
+    printf("%s (curr cp: %s)\n", file->entry.name, file->curr_cpt);
+    if (file->made != NULL) {
+      res = PrintCptsMade(file);
+    } else {
+      res = PrintTree(file->tree, CPT_ROOT_HANDLE);
+    }
+    if (res == MEM_ERR || res == PRINT_ERR) {
+      LLIterFree(file_it);
+      FreeLinkedList(files, &FreeListFile);
+      return LIST_ERR;
+    }
+    num_cpts += res;
+    printf("\n");
+  } while (LLIterAdvance(file_it));
+
+  LLIterFree(file_it);
+  FreeLinkedList(files, &FreeListFile);
   return num_cpts;
 }
 
-static int32_t PrintTree(CpTreeNodePtr tree) {
-  int32_t num_cps = 0, res;
+static int32_t MakeListFile(CheckPointLogPtr cpt_log,
+                            char *src_filename,
+                            ListOptions *options,
+                            LLPayloadCompareFn compare,
+                            ListFilePtr file) {
+  HashTabKV cptname, cpt_tree;
+  CPSize_t first, end;
+  int32_t res;
+
+  // Nothing needs freeing yet.
+  file->cpts = NULL;
+  file->tree = NULL;
+  file->made = NULL;
+  file->num_made = 0;
+
+  // Get other two values.
+  res = HTLookupStr(cpt_log->src_filehash_to_cptname, src_filename, &cptname);
+  if (res == 0 || res == -1) {
+    return LIST_ERR;
+  }
+  res = HTLookupStr(cpt_log->dir_tree, src_filename, &cpt_tree);
+  if (res == 0 || res == -1) {
+    return LIST_ERR;
+  }
+
+  file->entry.name = src_filename;
+  file->entry.time = 0;
+  file->entry.size = 0;
+  file->entry.order = 0;
+  file->curr_cpt = cptname.value;
+  file->tree = cpt_tree.value;
+  if (options->since != INT64_MIN || options->until != INT64_MAX) {
+    res = FindCptsInTimeRange(file->tree, options->since, options->until,
+                              &first, &end);
+    if (res == MEM_ERR) {
+      return MEM_ERR;
+    }
+    file->made = file->tree->by_time + first;
+    file->num_made = end - first;
+  }
+  if (options->sort == LIST_SORT_NONE) {
+    return 0;
+  }
+
+  CpTreePtr tree = file->tree;
+  if ((file->cpts = malloc(sizeof(ListEntry) * tree->num_nodes)) == NULL) {
+    return MEM_ERR;
+  }
+  for (CpTreeHandle h = 0; h < tree->num_nodes; h++) {
+    ListEntryPtr cpt = &file->cpts[h];
+    cpt->name = CPT_NAME(tree, h);
+    cpt->time = 0;
+    cpt->size = 0;
+    cpt->order = h;
+    if (CPT_IS_PRUNED(tree, h)) {
+      continue;
+    }
+
+    // A checkpoint whose time isn't known (its file had gone missing by
+    // the time its log was upgraded) is listed as empty and as old as
+    // can be, rather than not listed at all.
+    cpt->time = tree->nodes[h].time;
+    cpt->size = tree->nodes[h].size;
+    file->entry.size += cpt->size;
+  }
+  file->entry.time = file->cpts[CPT_ROOT_HANDLE].time;
+
+  return SortTreeView(file, compare);
+}
+
+static void FreeListFile(LinkedListPayload file) {
+  ListFilePtr to_free = (ListFilePtr)file;
+  // Everything else belongs to the tables.
+  free(to_free->cpts);
+  if (to_free->tree == &to_free->view) {
+    free(to_free->view.nodes);
+  }
+  free(to_free);
+}
+
+static int CompareEntryNames(LinkedListPayload a, LinkedListPayload b) {
+  int res = strcmp(((ListEntryPtr)a)->name, ((ListEntryPtr)b)->name);
+  return (res > 0) - (res < 0);
+}
+
+static int CompareEntryTimes(LinkedListPayload a, LinkedListPayload b) {
+  ListEntryPtr x = a, y = b;
+  if (x->time != y->time) {
+    return x->time < y->time ? -1 : 1;
+  }
+  // Checkpoints of the same tree made within a second of each other
+  // are ordered by handle, which is the order they were made in.
+  if (x->order != y->order) {
+    return x->order < y->order ? -1 : 1;
+  }
+  return CompareEntryNames(a, b);
+}
+
+static int CompareEntrySizes(LinkedListPayload a, LinkedListPayload b) {
+  ListEntryPtr x = a, y = b;
+  if (x->size != y->size) {
+    return x->size < y->size ? -1 : 1;
+  }
+  return CompareEntryNames(a, b);
+}
+
+static int32_t SortTreeView(ListFilePtr file, LLPayloadCompareFn compare) {
+  CpTreePtr tree = file->tree;
+  LinkedList children;
+  ListEntryPtr child_entry;
+  CpTreeHandle h, child, *link;
+
+  // The view shares the names of the tree, but has its own links (and
+  // no time index, which stays with the tree).
+  file->view = *tree;
+  file->view.by_time = NULL;
+  file->view.num_by_time = 0;
+  if ((file->view.nodes = malloc(sizeof(CpTreeNode) * tree->num_nodes)) == NULL) {
+    return MEM_ERR;
+  }
+  memcpy(file->view.nodes, tree->nodes, sizeof(CpTreeNode) * tree->num_nodes);
+  file->tree = &file->view;
+  if ((children = MakeLinkedList()) == NULL) {
+    return MEM_ERR;
+  }
+
+  // Relink the children of every node in sorted order.
+  for (h = 0; h < tree->num_nodes; h++) {
+    for (child = tree->nodes[h].first_child;
+         child != CPT_NULL_HANDLE;
+         child = tree->nodes[child].next_sibling) {
+      if (!LLAppend(children, &file->cpts[child])) {
+        FreeLinkedList(children, &ListNullFree);
+        return MEM_ERR;
+      }
+    }
+    LLSort(children, 1, compare);
+
+    link = &file->view.nodes[h].first_child;
+    while (LLPop(children, (LinkedListPayload *)&child_entry)) {
+      *link = child_entry - file->cpts;
+      link = &file->view.nodes[*link].next_sibling;
+    }
+    *link = CPT_NULL_HANDLE;
+  }
+
+  FreeLinkedList(children, &ListNullFree);
+  return 0;
+}
+
+static int32_t PrintCptsMade(ListFilePtr file) {
+  char when[TIME_STR_LEN];
+
+  for (CPSize_t i = 0; i < file->num_made; i++) {
+    CpTreeHandle node = file->made[i].handle;
+    FormatTime(file->tree->nodes[node].time, when);
+    printf("\t%s  %s (%llu bytes)\n", when, CPT_NAME(file->tree, node),
+           (unsigned long long)file->tree->nodes[node].size);
+  }
+  return file->num_made;
+}
+
+static int32_t PrintTree(CpTreePtr tree, CpTreeHandle curr_node) {
+  int32_t num_cps = 0;
   if (tree == NULL) {
     return num_cps;
   }
-  if (tree->cpt_name == NULL || tree->children == NULL) {
+  if (curr_node >= tree->num_nodes) {
     return PRINT_ERR;
   }
 
-  LLIter it;
-  CpTreeNodePtr curr_child;
-  int32_t i, num_children, num_attempts;
+  // Parents are printed before their children, so a preorder walk is
+  // all we need.
+  if (CpTreePreorder(tree, curr_node, &PrintTreeNode, &num_cps) != CPT_WALK_DONE) {
+    return PRINT_ERR;
+  }
+  return num_cps;
+}
 
-  printf("\t%s: ", tree->cpt_name);
-  num_children = LLSize(tree->children);
-  if (num_children > 0) {  // Print32_t current node + children
-    num_attempts = NUMBER_ATTEMPTS;
-    ATTEMPT((it = LLGetIter(tree->children, 0)), NULL, num_attempts)
-    for (i = 0; i < num_children; i++) {
-      LLIterPayload(it, &curr_child);
-      printf("%s%s", curr_child->cpt_name, i < num_children - 1 ? ", " : "");
-      LLIterAdvance(it);
-    }
-    LLIterFree(it);
+static int32_t PrintTreeNode(CpTreePtr tree, CpTreeHandle node, void *num_cps) {
+  CpTreeHandle curr_child;
+
+  printf("\t%s: ", CPT_NAME(tree, node));
+  // Print current node + children
+  for (curr_child = tree->nodes[node].first_child;
+       curr_child != CPT_NULL_HANDLE;
+       curr_child = tree->nodes[curr_child].next_sibling) {
+    printf("%s%s",
+           CPT_NAME(tree, curr_child),
+           tree->nodes[curr_child].next_sibling != CPT_NULL_HANDLE ? ", " : "");
   }
   printf("\n");
 
-  if (num_children > 0) {  // Recursively print children
-    num_attempts = NUMBER_ATTEMPTS;
-    ATTEMPT((it = LLGetIter(tree->children, 0)), NULL, num_attempts)
-    for (i = 0; i < num_children; i++) {
-      LLIterPayload(it, &curr_child);
-      res = PrintTree(curr_child);
-      if (res == PRINT_ERR) {
-        LLIterFree(it);
-        return PRINT_ERR;
+  (*(int32_t *)num_cps)++;
+  return CPT_VISIT_CONTINUE;
+}
+
+static void RecordLogStats(CheckPointLogPtr cpt_log) {
+  HashTable tables[] = { cpt_log->src_filehash_to_filename,
+                         cpt_log->src_filehash_to_cptname,
+                         cpt_log->cpt_namehash_to_cptfilename,
+                         cpt_log->dir_tree };
+  uint64_t resizes = 0, nodes = 0, live_nodes = 0;
+  HashTabKV kv;
+  CpTreePtr tree;
+  HTIter iter;
+
+  for (uint32_t i = 0; i < sizeof(tables) / sizeof(tables[0]); i++) {
+    resizes += HTResizeCount(tables[i]);
+  }
+  if ((iter = MakeHTIter(cpt_log->dir_tree)) != NULL) {
+    while (!HTIterValid(iter)) {
+      HTIterKV(iter, &kv);
+      tree = kv.value;
+      nodes += tree->num_nodes;
+      for (CpTreeHandle h = 0; h < tree->num_nodes; h++) {
+        live_nodes += !CPT_IS_PRUNED(tree, h);
       }
-      num_cps += res;
-      LLIterAdvance(it);
+      HTIncrementIter(iter);
     }
-    LLIterFree(it);
+    DiscardHTIter(iter);
   }
 
-  return 1 + num_cps;
+  StatsSetGauge(STATS_GAUGE_FILES, HTSize(cpt_log->src_filehash_to_filename));
+  StatsSetGauge(STATS_GAUGE_CPT_NAMES,
+                HTSize(cpt_log->cpt_namehash_to_cptfilename));
+  StatsSetGauge(STATS_GAUGE_RESIZES, resizes);
+  StatsSetGauge(STATS_GAUGE_NODES, nodes);
+  StatsSetGauge(STATS_GAUGE_LIVE_NODES, live_nodes);
+}
+
+static int32_t ShowStats(char *src_filename, CheckPointLogPtr cpt_log) {
+  HashTable tables[] = { cpt_log->src_filehash_to_filename,
+                         cpt_log->src_filehash_to_cptname,
+                         cpt_log->cpt_namehash_to_cptfilename,
+                         cpt_log->dir_tree };
+  const char *table_names[] = { "src_filehash_to_filename",
+                                "src_filehash_to_cptname",
+                                "cpt_namehash_to_cptfilename",
+                                "dir_tree" };
+  CpTreeStats stats, tree_stats;
+  HTStats ht_stats;
+  HashTabKV kv, storage;
+  HTIter iter;
+  const char *key;
+  int32_t num_attempts = NUMBER_ATTEMPTS;
+
+  if (src_filename != NULL &&
+      HTLookupStr(cpt_log->dir_tree, src_filename, &storage) != 1) {
+    printf("Sorry, %s is not currently being tracked.\n", src_filename);
+    return SHOW_STATS_ERR;
+  }
+
+  printf("Tables (each starts with %d buckets, and grows 9x):\n",
+         INITIAL_BUCKET_COUNT);
+  for (uint32_t i = 0; i < sizeof(tables) / sizeof(tables[0]); i++) {
+    HTGetStats(tables[i], &ht_stats);
+    printf("  %s: %u elements in %u buckets (load %.2f), %u resize(s)\n",
+           table_names[i], ht_stats.size, ht_stats.bucket_count,
+           ht_stats.bucket_count == 0 ? 0 :
+               (double)ht_stats.size / ht_stats.bucket_count,
+           ht_stats.resizes);
+    if (ht_stats.old_bucket_count > 0) {
+      printf("\t(%u old buckets not yet moved)\n", ht_stats.old_bucket_count);
+    }
+    printf("\tlongest chain %u, mean probe %.2f\n", ht_stats.longest_chain,
+           ht_stats.mean_probe);
+    PrintHistogram("chain length", ht_stats.chains, HT_STATS_MAX_CHAIN, false);
+  }
+
+  memset(&stats, 0, sizeof(stats));
+  if (src_filename != NULL) {
+    AddCpTreeStats(storage.value, &stats);
+    printf("Tree of %s:\n", src_filename);
+    PrintCpTreeStats(&stats);
+    return 1;
+  }
+
+  printf("Trees:\n");
+  ATTEMPT((iter = MakeHTIter(cpt_log->dir_tree)), NULL, num_attempts)
+  while (!HTIterValid(iter)) {
+    HTIterKV(iter, &kv);
+    HTIterStrKey(iter, &key);
+    memset(&tree_stats, 0, sizeof(tree_stats));
+    AddCpTreeStats(kv.value, &tree_stats);
+    AddCpTreeStats(kv.value, &stats);
+    printf("  %s: %u node(s) (%u live), %u leaves, depth %u\n", key,
+           tree_stats.num_nodes, tree_stats.live_nodes, tree_stats.leaves,
+           tree_stats.max_depth);
+    HTIncrementIter(iter);
+  }
+  DiscardHTIter(iter);
+  if (stats.num_trees > 0) {
+    printf("All %u tree(s):\n", stats.num_trees);
+    PrintCpTreeStats(&stats);
+  }
+  return stats.num_trees;
+}
+
+static void PrintCpTreeStats(CpTreeStats *stats) {
+  CPSize_t live = stats->live_nodes, inner = live - stats->leaves;
+
+  printf("\t%u node(s), %u live, %u leaves\n", stats->num_nodes, live,
+         stats->leaves);
+  if (live == 0) {
+    return;
+  }
+  printf("\tdepth: mean %.2f, max %u\n",
+         (double)stats->total_depth / live, stats->max_depth);
+  // Leaves are left out of the branching factor, or every tree which is
+  // a long chain would seem to branch less than once per node.
+  printf("\tchildren: mean %.2f (of nodes with any), max %u\n",
+         inner == 0 ? 0 : (double)stats->total_children / inner,
+         stats->max_children);
+  printf("\tname length: mean %.2f, max %u\n",
+         (double)stats->total_name_len / live, stats->max_name_len);
+  PrintHistogram("depth", stats->depths, CPT_STATS_BUCKETS, true);
+  PrintHistogram("children", stats->children, CPT_STATS_BUCKETS, true);
+  PrintHistogram("name length", stats->name_lens, CPT_STATS_BUCKETS, true);
+}
+
+static void PrintHistogram(const char *title,
+                           CPSize_t *counts,
+                           int32_t num_buckets,
+                           bool log2) {
+  char label[48];  // two 20 digit numbers, a dash and a null terminator
+  uint64_t lo, hi;
+
+  printf("\t%14s %10s\n", title, "count");
+  for (int32_t i = 0; i < num_buckets; i++) {
+    if (counts[i] == 0) {
+      continue;
+    }
+    lo = !log2 ? i : i == 0 ? 0 : 1ULL << (i - 1);
+    hi = !log2 ? i : i == 0 ? 0 : (1ULL << i) - 1;
+    if (i == num_buckets - 1) {
+      snprintf(label, sizeof(label), "%" PRIu64 "+", lo);
+    } else if (lo == hi) {
+      snprintf(label, sizeof(label), "%" PRIu64, lo);
+    } else {
+      snprintf(label, sizeof(label), "%" PRIu64 "-%" PRIu64, lo, hi);
+    }
+    printf("\t%14s %10" PRIu32 "\n", label, counts[i]);
+  }
 }
 
 static void FreeCheckPointLog(CheckPointLogPtr cpt_log) {
@@ -637,10 +1996,10 @@ static void FreeCheckPointLog(CheckPointLogPtr cpt_log) {
            HTSize(cpt_log->cpt_namehash_to_cptfilename),
            HTSize(cpt_log->dir_tree));
   }
-  FreeHashTable(cpt_log->src_filehash_to_filename, &free);
-  FreeHashTable(cpt_log->src_filehash_to_cptname, &free);
-  FreeHashTable(cpt_log->cpt_namehash_to_cptfilename, &free);
-  FreeHashTable(cpt_log->dir_tree, &FreeCpTreeNode);
+  FreeHashTable(cpt_log->src_filehash_to_filename, &FreeLogString);
+  FreeHashTable(cpt_log->src_filehash_to_cptname, &FreeLogString);
+  FreeHashTable(cpt_log->cpt_namehash_to_cptfilename, &FreeLogString);
+  FreeHashTable(cpt_log->dir_tree, &FreeCpTree);
 }
 
 static int32_t DetermineCommand(char *command) {
@@ -662,19 +2021,74 @@ static void Usage() {
                   "to the file you would like to checkpoint.\n\n"\
                   "options:\n"\
                   "\tcreate <source file name> <checkpoint name>\n"\
-                  "\tback   <source file name>\n"\
+                  "\tback   <source file name> [<number of checkpoints>]\n"\
                   "\tswapto <source file name> <checkpoint name>\n"\
+                  "\tswapto <source file name> --at <time>\n"\
+                  "\t\t(swaps to the newest checkpoint made by the time,\n"\
+                  "\t\t given like \"2019-06-01 14:00[:00]\" or @<seconds>)\n"\
+                  "\tlog    <source file name>\n"\
+                  "\t\t(lists the checkpoints from the root to the current one)\n"\
+                  "\tlca    <checkpoint name> <checkpoint name>\n"\
+                  "\t\t(finds the latest checkpoint both are descended from)\n"\
+                  "\tprune  <source file name> <checkpoint name>\n"\
+                  "\t\t(removes the checkpoint and all its descendants)\n"\
+                  "\tsquash <source file name> <checkpoint name>\n"\
+                  "\t\t(removes only the checkpoint, its children take its place)\n"\
+                  "\tdiff   <source file name> <checkpoint name> [<checkpoint name>]\n"\
+                  "\t\t(shows what changed from the first checkpoint to the\n"\
+                  "\t\t second, or to the source file if there is no second)\n"\
+                  "\tblame  <source file name> [<checkpoint name>]\n"\
+                  "\t\t(shows which checkpoint introduced each line of the\n"\
+                  "\t\t checkpoint, or of the current one if none is given)\n"\
+                  "\tmerge  <source file name> <checkpoint name> <checkpoint name>\n"\
+                  "\t       <new checkpoint name>\n"\
+                  "\t\t(merges the two checkpoints into the source file, and\n"\
+                  "\t\t saves it as a new child of the first one, which is\n"\
+                  "\t\t the only parent recorded for it)\n"\
+                  "\tgrep   <pattern> [<source file name>]\n"\
+                  "\t\t(prints the lines of every checkpoint, or of those of\n"\
+                  "\t\t the file, which match the extended regex)\n"\
+                  "\tindex\n"\
+                  "\t\t(indexes the checkpoints made before there was an\n"\
+                  "\t\t index, so grep can skip those which can't match)\n"\
                   "\tdelete <source file name>\n"\
                   "\t\tNOTE: \"delete\" does not remove your source file,\n"\
                   "\t\t      but will remove all trace of it from the\n"\
                   "\t\t      current checkpoint log for this directory.n"\
-                  "\tlist   (lists all Checkpoints for the current dir)\n\n"\
+                  "\tlist   [--sort name|time|size] [--glob <pattern>]\n"\
+                  "\t       [--since <time>] [--until <time>]\n"\
+                  "\t\t(lists all Checkpoints for the current dir, or only\n"\
+                  "\t\t those of files matching the pattern, or only those\n"\
+                  "\t\t made from since to until, with their times)\n"\
+                  "\tstats  [<source file name>]\n"\
+                  "\t\t(shows how full the log's tables are, and the shape\n"\
+                  "\t\t of every tree, or only of the file's)\n"\
+                  "\t--stats (with any command)\n"\
+                  "\t\t(prints where the time went, what was read and\n"\
+                  "\t\t written, and how big the log is, to stderr)\n"\
+                  "\t--progress (with any command)\n"\
+                  "\t\t(shows how far along long copies, indexing and\n"\
+                  "\t\t searches are, and how fast they go, on stderr)\n"\
+                  "\tCPT_TRACE=<file> (in the environment)\n"\
+                  "\t\t(writes a timeline of the run to <file>, to be\n"\
+                  "\t\t loaded at chrome://tracing)\n"\
+                  "\tCPT_PROGRESS_FD=<fd> (in the environment)\n"\
+                  "\t\t(also writes the progress of long tasks to <fd>,\n"\
+                  "\t\t as one JSON object per line)\n"\
+                  "\tCPT_METRICS=<file>|unix:<socket> (in the environment)\n"\
+                  "\t\t(adds the latencies, counts and log sizes of each\n"\
+                  "\t\t run to <file> in Prometheus's text format, or\n"\
+                  "\t\t writes them to <socket>)\n"\
+                  "\tCPT_RECORD=<file> (in the environment)\n"\
+                  "\t\t(appends each command run, with the names in it\n"\
+                  "\t\t anonymized, to <file>, to be replayed by\n"\
+                  "\t\t BenchReplay)\n\n"\
                   "PLEASE NOTE:"\
                   "\t- Checkpoints will be stored in files labeled with\n"\
                   "\t  the name of the checkpoint  you provide. If you\n"\
                   "\t  provide the name of a preexisting file (checkpoint),\n"\
                   "\t  it will NOT be overwritten.\n\n"
-                  "\t- Delete is irreversible.\n\n");  
+                  "\t- Delete, prune and squash are irreversible.\n\n");  
                   // TODO: make delete reversible
 
   exit(EXIT_FAILURE);
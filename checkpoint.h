@@ -3,7 +3,17 @@
 #ifndef _CHECKPOINT_H_
 #define _CHECKPOINT_H_
 
+#include "checkpoint_blame.h"
+#include "checkpoint_diff.h"
 #include "checkpoint_filehandler.h"
+#include "checkpoint_grep.h"
+#include "checkpoint_index.h"
+#include "checkpoint_merge.h"
+#include "checkpoint_metrics.h"
+#include "checkpoint_progress.h"
+#include "checkpoint_record.h"
+#include "checkpoint_stats.h"
+#include "checkpoint_trace.h"
 
 #define INVALID_COMMAND -1
 #define SETUP_SUCCESS 0
@@ -22,8 +32,40 @@
 #define BACK_SUCCESS 0
 #define BACK_ERROR -1
 
+#define PRUNE_SUCCESS 0
+#define PRUNE_ERROR -1
+
+#define DIFF_SUCCESS 0
+
+#define MERGE_SUCCESS 0
+
+#define GREP_SUCCESS 0
+
+// The most checkpoint files grep has mapped into memory at once.
+#define GREP_BATCH_SIZE 1024
+
+// What diff calls the source file, as opposed to one of its checkpoints.
+#define DIFF_WORKING "working"
+
+#define LOG_ERR -1
+
+#define LCA_ERR -1
+
 #define LIST_ERR -1
 
+#define SHOW_STATS_ERR -1
+
+// The orders List can print files and checkpoints in.
+#define LIST_SORT_NONE 0  // the order they are stored in
+#define LIST_SORT_NAME 1
+#define LIST_SORT_TIME 2  // oldest first
+#define LIST_SORT_SIZE 3  // smallest first
+
+// How times are read and printed: in local time, to the second. A time
+// can also be given as @ followed by the seconds since the epoch.
+#define TIME_FORMAT "%Y-%m-%d %H:%M:%S"
+#define TIME_STR_LEN 32
+
 #define PRINT_ERR -1
 
 // Different options require a different number of args.
@@ -33,7 +75,69 @@
     return EXIT_FAILURE;\
   }
 
-const char *valid_commands[] = {"create", "back", "swapto", "delete", "list"};
+// What Prune passes to ForgetCpt for every checkpoint it removes.
+typedef struct forget_state {
+  CheckPointLogPtr cpt_log;
+  int32_t          num_cpts;  // # of checkpoints forgotten so far
+  // The files of those which were mapped, to be dropped from the index
+  // (and freed) once they are all found.
+  char           **cpt_filenames;
+  uint32_t         num_files;
+} ForgetState;
+
+// The checkpoint files Grep searches, all gathered before any is searched.
+typedef struct grep_state {
+  GrepJobPtr  jobs;           // the label of each is file@checkpoint
+  char      **cpt_filenames;  // the checkpoint file of each job
+  uint32_t    num_jobs;
+  uint32_t    capacity;
+} GrepState;
+
+// How List should order and filter what it prints.
+typedef struct list_options {
+  int32_t  sort;   // one of LIST_SORT_*
+  char    *glob;   // only list files matching this pattern, or NULL for all
+  // Only list the checkpoints made from since to until (both included).
+  int64_t  since;  // INT64_MIN if there is no such bound
+  int64_t  until;  // INT64_MAX if there is no such bound
+} ListOptions;
+
+// A file or checkpoint to be listed, along with everything it can be
+// sorted by.
+typedef struct list_entry {
+  char      *name;
+  time_t     time;   // when the checkpoint (or the file's first one) was made
+  off_t      size;   // bytes stored for the checkpoint (or all of the file's)
+  uint32_t   order;  // breaks ties: the handle of a checkpoint, 0 for a file
+} ListEntry, *ListEntryPtr;
+
+// A file to be listed. Starts with its ListEntry, so that files and
+// checkpoints can share comparators.
+typedef struct list_file {
+  ListEntry     entry;     // entry.name is the source filename
+  char         *curr_cpt;  // the current checkpoint of the file
+  CpTreePtr     tree;      // the file's tree, or &view when sorting
+  ListEntryPtr  cpts;      // one entry per node of tree, or NULL if unsorted
+  // A copy of the file's tree whose children are linked in sorted
+  // order. It shares the names of the file's tree.
+  CpTree        view;
+  // If the list is limited to a span of time, the checkpoints made in
+  // it, oldest first (part of the time index of the file's tree).
+  CpTreeTime   *made;
+  CPSize_t      num_made;
+} ListFile, *ListFilePtr;
+
+// For options which take a varying number of args.
+#define CHECK_ARG_RANGE(lo, hi)\
+  if (argc < lo || argc > hi) {\
+    fprintf(stderr, "invalid # of commands: got %d, expected %d to %d\n",\
+            argc, lo, hi);\
+    return EXIT_FAILURE;\
+  }
+
+const char *valid_commands[] = {"create", "back", "swapto", "delete", "list",
+                                "log", "lca", "prune", "squash", "diff",
+                                "blame", "merge", "grep", "index", "stats"};
 
 // Entry point to the program. 1st elem of argv is not ever looked at (expected
 // to be the standard first elem of argv).
@@ -68,17 +172,22 @@ static int32_t DetermineCommand(char *command);
 // Creates the checkpoint  name @cpt for the file @filename, and
 // saves it in @cpt_log. This includes updating the mapping for
 // current cpt (which wich will be set to @cpt_name for @filename).
-//
+// The checkpoint is a child of @parent_cpt, or of the current one if
+// @parent_cpt is NULL. If @contents isn't NULL, the checkpoint holds
+// its @len bytes instead of what is in @filename (which is left as is).
 //
 // Returns:
 //
 //  - CREATE_CPT_SUCCESS - if all went well, and an error code otherwise.
-static int32_t CreateCheckpoint(char *cpt_name,
-                                char *filename,
+static int32_t CreateCheckpoint(char *filename,
+                                char *cpt_name,
+                                char *parent_cpt,
+                                const char *contents,
+                                size_t len,
                                 CheckPointLogPtr cpt_log);
 
 // Changes to the checkpoint  @cpt_name. Note that this will
-// overwrite/delete the current copy of the file for the
+// overwrite/delete the current copy of the file for the
 // given checkpoint  name, and replace it with the version
 // saved for the checkpoint.
 //
@@ -88,15 +197,100 @@ static int32_t SwapTo(char *src_filename,
                       char *cpt_name,
                       CheckPointLogPtr cpt_log);
 
-// Attempts to go backwards one step up the checkpoint tree stored for
-// @src_filename.
+// Changes to the newest checkpoint of @src_filename which was made at or
+// before @time, like SwapTo. Finding it is a binary search of the time
+// index of the file's tree.
+//
+// Returns:
+//  SWAPTO_SUCCESS if all went well, and SWAPTO_* error code otherwise.
+static int32_t SwapToTime(char *src_filename,
+                          int64_t time,
+                          CheckPointLogPtr cpt_log);
+
+// Records when the checkpoint @cpt_name of @src_filename was made, and
+// how big its file is, in the file's tree.
+//
+// Returns:
+//
+//  - CREATE_CPT_ERROR: if the tables have no such checkpoint.
+//
+//  - CREATE_CPT_SUCCESS: if all went well.
+static int32_t StampCpt(char *src_filename,
+                        char *cpt_name,
+                        CheckPointLogPtr cpt_log);
+
+// Reads the time @arg, as TIME_FORMAT (seconds, or minutes and seconds,
+// may be left off, and a T may stand in for the space) or as @ followed
+// by seconds since the epoch, into @time.
+//
+// Returns:
+//
+//  - -1: if @arg isn't a time.
+//
+//  - 0: if all went well.
+static int32_t ParseTime(char *arg, int64_t *time);
+
+// Writes @time into @str (which holds TIME_STR_LEN chars) as TIME_FORMAT.
+static void FormatTime(int64_t time, char *str);
+
+// Reads the number of checkpoints to go back from @arg into @num_steps.
+//
+// Returns:
+//
+//  - -1: if @arg isn't a (non negative) number.
+//
+//  - 0: if all went well.
+static int32_t ParseNumSteps(char *arg, uint32_t *num_steps);
+
+// Finds the tree of @src_filename, and the node of its current checkpoint.
+//
+// Returns:
+//
+//  - FIND_CPT_ABSENT: if @src_filename is not being tracked.
+//
+//  - FIND_CPT_ERROR: if the tables disagree about @src_filename.
+//
+//  - FIND_CPT_SUCCESS: if all went well, in which case the tree and node
+//    are returned through @tree and @current.
+static int32_t FindCurrentCpt(char *src_filename,
+                              CheckPointLogPtr cpt_log,
+                              CpTreePtr *tree,
+                              CpTreeHandle *current);
+
+// Attempts to go backwards @num_steps steps up the checkpoint tree stored
+// for @src_filename (or to the root, if it is fewer steps away). However
+// far back it goes, this only takes O(log depth) steps through the tree,
+// and one copy into @src_filename.
 //
 // Returns:
 //
 //  - BACK_ERROR: if anything goes wrong.
 //
 //  - BACK_SUCCESS: if all goes well.
-static int32_t Back(char *src_filename, CheckPointLogPtr cpt_log);
+static int32_t Back(char *src_filename,
+                    uint32_t num_steps,
+                    CheckPointLogPtr cpt_log);
+
+// Prints the path of checkpoints from the root of @src_filename's tree
+// to its current checkpoint, along with the depth of each.
+//
+// Returns:
+//
+//  - LOG_ERR: if anything goes wrong.
+//
+//  - The number of checkpoints printed otherwise.
+static int32_t Log(char *src_filename, CheckPointLogPtr cpt_log);
+
+// Prints the lowest common ancestor of the checkpoints @cpt_a and
+// @cpt_b (which must belong to the same file), and how many steps
+// back it is from each of them.
+//
+// Returns:
+//
+//  - LCA_ERR: if anything goes wrong.
+//
+//  - 0 otherwise.
+static int32_t Lca(char *cpt_a, char *cpt_b, CheckPointLogPtr cpt_log);
 
 // Deletes all traces of @src_filename from the current checkpoint system.
 //
@@ -104,19 +298,186 @@ static int32_t Back(char *src_filename, CheckPointLogPtr cpt_log);
 //  DELETE_SUCCESS if all went well, and DELETE_* error code otherwise.
 static int32_t Delete(char *src_filename, CheckPointLogPtr cpt_log);
 
+// Removes the checkpoint @cpt_name from the tree of @src_filename, along
+// with all of its descendants, or if @squash is true, only the checkpoint
+// itself (its children take its place under its parent). The mappings
+// and files of the removed checkpoints are removed too. If the current
+// checkpoint of @src_filename is removed, the parent of @cpt_name becomes
+// the current checkpoint. The root can't be removed (see Delete).
+//
+// Only the subtree of @cpt_name is walked, so this takes O(size of the
+// subtree) (plus the siblings of @cpt_name), however big the tree is.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - PRUNE_ERROR: if the tables disagree about @src_filename.
+//
+//  - PRUNE_SUCCESS: otherwise.
+static int32_t Prune(char *src_filename,
+                     char *cpt_name,
+                     bool squash,
+                     CheckPointLogPtr cpt_log);
+
+// Prints a unified diff of what changed from the checkpoint @cpt_a of
+// @src_filename to its checkpoint @cpt_b. Either can be DIFF_WORKING
+// (unless there is a checkpoint of that name) for the source file as it
+// is now. Both files are mapped into memory rather than read.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - DIFF_ERR: if either file can't be read, or is too big to diff.
+//
+//  - DIFF_SUCCESS: otherwise (even if there was nothing to diff).
+static int32_t Diff(char *src_filename,
+                    char *cpt_a,
+                    char *cpt_b,
+                    CheckPointLogPtr cpt_log);
+
+// Merges the checkpoints @cpt_a and @cpt_b of @src_filename, using their
+// lowest common ancestor as the base (see checkpoint_merge.h). The result,
+// conflict markers and all, is saved as the new checkpoint @new_cpt, which
+// becomes the current checkpoint, and only then written to @src_filename.
+// The tree only has room for one parent, so @new_cpt is recorded as a
+// child of @cpt_a alone. Nothing is changed unless both checkpoints exist
+// and @new_cpt is free.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - MERGE_ERR: if any of the files can't be read, @new_cpt can't be
+//    written, or they are too big to diff.
+//
+//  - The number of conflicts otherwise. If @src_filename couldn't be
+//    written, that is reported, and @new_cpt is kept to be swapped to.
+static int32_t Merge(char *src_filename,
+                     char *cpt_a,
+                     char *cpt_b,
+                     char *new_cpt,
+                     CheckPointLogPtr cpt_log);
+
+// Prints every line of every checkpoint (of every file, or only of
+// @src_filename if it isn't NULL) which matches @pattern, an extended
+// regex, as file@checkpoint:line number:line. The checkpoint files are
+// searched where they are stored, GREP_BATCH_SIZE at a time, each batch
+// spread over every core (see checkpoint_grep.h). Files which the index
+// says can't contain the literal part of @pattern are not searched at
+// all (see checkpoint_index.h).
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - GREP_ERR: if @pattern isn't a valid regex.
+//
+//  - GREP_SUCCESS: otherwise (whether or not anything matched).
+static int32_t Grep(char *pattern, char *src_filename, CheckPointLogPtr cpt_log);
+
+// Adds every checkpoint which isn't indexed yet (or has changed since it
+// was) to the index, and then merges the index into a single segment.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - INDEX_ERR: if the index could not be written.
+//
+//  - The number of checkpoints indexed otherwise.
+static int32_t IndexCpts(CheckPointLogPtr cpt_log);
+
+// Helper method to Grep. Adds a job to @state for every checkpoint in
+// @tree, the tree of @src_filename.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - 0: if all went well.
+static int32_t AddGrepJobs(CheckPointLogPtr cpt_log,
+                           const char *src_filename,
+                           CpTreePtr tree,
+                           GrepState *state);
+
+// Prints every line of the checkpoint @cpt_name of @src_filename (or of
+// its current checkpoint, if @cpt_name is NULL), along with the checkpoint
+// which introduced it: the checkpoint on the path down from the root at
+// which the line was last added or changed.
+//
+// The LineMap of every edge on the path is cached in LINE_MAP_DIR, so
+// only the edges which haven't been blamed before have to be diffed.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - BLAME_ERR: if there is no such checkpoint, or its files can't be read.
+//
+//  - 0: otherwise.
+static int32_t BlameCpt(char *src_filename,
+                        char *cpt_name,
+                        CheckPointLogPtr cpt_log);
+
+// Helper method to BlameCpt. Returns the LineMap from the checkpoint file
+// @parent_cpt to the checkpoint file @child_cpt through @map, reading it
+// from the cache if it is there, and diffing the two (and caching the
+// result) otherwise.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - BLAME_ERR or DIFF_ERR: if the files can't be read or diffed.
+//
+//  - 0: if all went well.
+static int32_t GetLineMap(char *parent_cpt, char *child_cpt, LineMapPtr map);
+
+// Helper method to BlameCpt. Prints each line of @file, prefixed by the
+// name of the checkpoint @blame blames it on, and its line number.
+static void PrintBlame(CpTreePtr tree, BlamePtr blame, MappedFile *file);
+
+// Helper method to Prune, and the CpTreeVisitor it walks the pruned
+// subtree with. Removes the mapping of the checkpoint @node to its file,
+// and the file itself, and counts it in @state (a ForgetState *), which
+// keeps the name of the file.
+static int32_t ForgetCpt(CpTreePtr tree, CpTreeHandle node, void *state);
+
 // Helper method to Delete. Removes all mappings from the names in the tree
-// stored inside cp_log->cpt_namehash_to_cptfilename.
+// stored inside cp_log->cpt_namehash_to_cptfilename, and drops their files
+// from the index.
 //
 // Returns:
 //
 //  - MEM_ERR: on a memory error.
 //
 //  - 0: upon successful completion.
-static int32_t FreeTreeCpHash(CheckPointLogPtr cpt_log, CpTreeNodePtr curr_node);
+static int32_t FreeTreeCpHash(CheckPointLogPtr cpt_log, CpTreePtr tree);
+
+// Reads the options of the list command (everything after "list" in
+// @argv) into @options.
+//
+// Returns:
+//
+//  - LIST_ERR: if an option is unknown or missing its argument.
+//
+//  - 0: if all went well.
+static int32_t ParseListOptions(int32_t argc,
+                                char *argv[],
+                                ListOptions *options);
 
 // Prints a list of all current checkpoints (and their corresponding
-// files) to stdout, in the order their keys are stored in the
-// dir_tree hashtable.
+// files) to stdout. Files whose name doesn't match @options->glob are
+// skipped. Unless @options->sort says otherwise, files are printed in
+// the order their keys are stored in the dir_tree hashtable, and the
+// children of a checkpoint newest first.
+//
+// If @options has a since or until, only the checkpoints made in that
+// span are listed, oldest first, along with when they were made and
+// their size, and files without any are skipped. Each tree's time index
+// finds them with a binary search, so no tree is walked.
 //
 // We'll be printing a list of the stored checkpoints on a per-file basis.
 // The format is as follows:
@@ -132,11 +493,51 @@ static int32_t FreeTreeCpHash(CheckPointLogPtr cpt_log, CpTreeNodePtr curr_node)
 // same children will be listed on a new line if they in turn have
 // children
 //
-// Returns: The number of checkpoints stored for this dir.
-static int32_t List(CheckPointLogPtr cpt_log);
+// Returns: The number of checkpoints listed.
+static int32_t List(CheckPointLogPtr cpt_log, ListOptions *options);
+
+// Helper method to List. Fills in @file for the file @src_filename.
+// Unless @options->sort is LIST_SORT_NONE, this includes an entry for
+// each of its checkpoints, and a view of its tree sorted by @compare.
+// If @options limits the list to a span of time, @file->made is set to
+// the checkpoints made in it.
+//
+// Returns:
+//
+// - MEM_ERR: on a memory error
+//
+// - LIST_ERR: if the tables are missing something for @src_filename.
+//
+// - 0: if all went well.
+static int32_t MakeListFile(CheckPointLogPtr cpt_log,
+                            char *src_filename,
+                            ListOptions *options,
+                            LLPayloadCompareFn compare,
+                            ListFilePtr file);
+
+// Helper method to MakeListFile. Points @file->tree at @file->view, a
+// copy of the file's tree in which the children of every node are
+// linked in the order @compare sorts their entries in @file->cpts into.
+//
+// Returns:
+//
+// - MEM_ERR: on a memory error
+//
+// - 0: if all went well.
+static int32_t SortTreeView(ListFilePtr file, LLPayloadCompareFn compare);
+
+// Frees a ListFile made by MakeListFile. Matches LLPayloadFreeFn.
+static void FreeListFile(LinkedListPayload file);
+
+// The comparators List sorts with (see LLPayloadCompareFn). Each is
+// given two ListEntryPtrs (or ListFilePtrs).
+static int CompareEntryNames(LinkedListPayload a, LinkedListPayload b);
+static int CompareEntryTimes(LinkedListPayload a, LinkedListPayload b);
+static int CompareEntrySizes(LinkedListPayload a, LinkedListPayload b);
 
 // Helper method to List. Prints all the parent/children
-// lists for a given tree.
+// lists for the subtree of @tree rooted at @curr_node, parents
+// before children.
 //
 // Returns:
 //
@@ -144,8 +545,51 @@ static int32_t List(CheckPointLogPtr cpt_log);
 //
 // - PRINT_ERR: if any other errors arise
 //
-// - The number of checkpoints in @tree otherwise.
-static int32_t PrintTree(CpTreeNodePtr tree);
+// - The number of checkpoints in the subtree otherwise.
+static int32_t PrintTree(CpTreePtr tree, CpTreeHandle curr_node);
+
+// Helper method to List. Prints the checkpoints of @file->made, one per
+// line, with when each was made and its size.
+//
+// Returns: The number of checkpoints printed.
+static int32_t PrintCptsMade(ListFilePtr file);
+
+// The CpTreeVisitor PrintTree walks the tree with. Prints the list of
+// children of @node, and counts it in @num_cps (an int32_t *).
+static int32_t PrintTreeNode(CpTreePtr tree, CpTreeHandle node, void *num_cps);
+
+// Sets the gauges of checkpoint_stats.h from @cpt_log: how many files and
+// checkpoint names it has, how often its tables have grown, and how many
+// nodes its trees have.
+static void RecordLogStats(CheckPointLogPtr cpt_log);
+
+// Prints how the elements of each of the tables of @cpt_log are spread
+// over its buckets, and the shape of the trees: of every tree (one line
+// each, and then all of them together), or only of the tree of
+// @src_filename if it isn't NULL. Meant for tuning the tables (see
+// INITIAL_BUCKET_COUNT) and the trees to how they are really used.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - SHOW_STATS_ERR: if @src_filename is not being tracked.
+//
+//  - The number of trees described otherwise.
+static int32_t ShowStats(char *src_filename, CheckPointLogPtr cpt_log);
+
+// Helper method to ShowStats. Prints the shape of the trees in @stats,
+// with the histograms of CpTreeStats (leaving out empty buckets).
+static void PrintCpTreeStats(CpTreeStats *stats);
+
+// Prints the histogram @counts, of @num_buckets buckets, under the
+// heading @title, leaving out empty buckets. If @log2 is true, the
+// buckets are those of CpTreeStats, and otherwise bucket i counts the
+// value i (and the last bucket anything bigger).
+static void PrintHistogram(const char *title,
+                           CPSize_t *counts,
+                           int32_t num_buckets,
+                           bool log2);
 
 // Handles freeing all the tables and their contents.
 static void FreeCheckPointLog(CheckPointLogPtr cpt_log);
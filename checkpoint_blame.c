@@ -0,0 +1,129 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+
+#include "checkpoint_blame.h"
+
+// Adds a run of @len lines from @start on, introduced by @cpt, to the
+// end of @blame (merging it into the last run if it carries on from it).
+// @blame must have room for it.
+static void AppendRun(BlamePtr blame,
+                      uint32_t start,
+                      uint32_t len,
+                      CpTreeHandle cpt);
+
+// Helper method to ApplyLineMap. Appends the blame of the lines
+// [@from, @from + @len) of @parent to @child, where they start at line
+// @to. @run is the index of the run of @parent to start looking from,
+// and is moved along to the run which holds the line @from + @len.
+static void CopyRuns(BlamePtr parent,
+                     uint32_t *run,
+                     uint32_t from,
+                     uint32_t len,
+                     uint32_t to,
+                     BlamePtr child);
+
+int32_t MakeRootBlame(uint32_t num_lines, CpTreeHandle root, BlamePtr ret) {
+  if ((ret->runs = malloc(sizeof(BlameRun))) == NULL) {
+    return MEM_ERR;
+  }
+  ret->num_runs = 0;
+  ret->num_lines = num_lines;
+  AppendRun(ret, 0, num_lines, root);
+  return 0;
+}
+
+int32_t ApplyLineMap(BlamePtr parent,
+                     LineMapPtr map,
+                     CpTreeHandle child,
+                     BlamePtr ret) {
+  uint32_t run = 0, from = 0, to = 0;
+  DiffChangePtr change;
+
+  if (map->a_lines != parent->num_lines) {
+    if (DEBUG) {
+      printf("Error, line map is for %u lines, not %u\n",
+             map->a_lines, parent->num_lines);
+    }
+    return BLAME_ERR;
+  }
+
+  // Each change can split a run of the parent in two, and add a run.
+  size_t max_runs = (size_t)parent->num_runs + 2 * (size_t)map->num_changes + 1;
+  if ((ret->runs = malloc(sizeof(BlameRun) * max_runs)) == NULL) {
+    return MEM_ERR;
+  }
+  ret->num_runs = 0;
+  ret->num_lines = map->b_lines;
+
+  // Between the changes, lines are carried over one for one.
+  for (uint32_t i = 0; i < map->num_changes; i++) {
+    change = &map->changes[i];
+    // A map read back from the cache could be anything.
+    if (change->a_start < from || change->a_start > parent->num_lines ||
+        change->a_len > parent->num_lines - change->a_start ||
+        change->b_start != to + (change->a_start - from) ||
+        change->b_start > map->b_lines ||
+        change->b_len > map->b_lines - change->b_start) {
+      FreeBlame(ret);
+      return BLAME_ERR;
+    }
+    CopyRuns(parent, &run, from, change->a_start - from, to, ret);
+    AppendRun(ret, change->b_start, change->b_len, child);
+    from = change->a_start + change->a_len;
+    to = change->b_start + change->b_len;
+  }
+  CopyRuns(parent, &run, from, parent->num_lines - from, to, ret);
+
+  if (to + (parent->num_lines - from) != map->b_lines) {
+    FreeBlame(ret);
+    return BLAME_ERR;
+  }
+  return 0;
+}
+
+static void CopyRuns(BlamePtr parent,
+                     uint32_t *run,
+                     uint32_t from,
+                     uint32_t len,
+                     uint32_t to,
+                     BlamePtr child) {
+  uint32_t end = from + len;
+  BlameRunPtr r;
+
+  while (from < end) {
+    // Skip the runs which end before @from.
+    while (parent->runs[*run].start + parent->runs[*run].len <= from) {
+      (*run)++;
+    }
+    r = &parent->runs[*run];
+
+    uint32_t run_end = r->start + r->len < end ? r->start + r->len : end;
+    AppendRun(child, to, run_end - from, r->cpt);
+    to += run_end - from;
+    from = run_end;
+  }
+}
+
+static void AppendRun(BlamePtr blame,
+                      uint32_t start,
+                      uint32_t len,
+                      CpTreeHandle cpt) {
+  if (len == 0) {
+    return;
+  }
+
+  BlameRunPtr last = blame->num_runs == 0 ? NULL : &blame->runs[blame->num_runs - 1];
+  if (last != NULL && last->cpt == cpt && last->start + last->len == start) {
+    last->len += len;
+  } else {
+    blame->runs[blame->num_runs].start = start;
+    blame->runs[blame->num_runs].len = len;
+    blame->runs[blame->num_runs].cpt = cpt;
+    blame->num_runs++;
+  }
+}
+
+void FreeBlame(BlamePtr blame) {
+  free(blame->runs);
+  blame->runs = NULL;
+  blame->num_runs = 0;
+}
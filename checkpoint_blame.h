@@ -0,0 +1,68 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+
+#ifndef _CHECKPOINT_BLAME_H_
+#define _CHECKPOINT_BLAME_H_
+// This module works out which checkpoint introduced each line of a
+// checkpoint. Every line of the root was introduced by the root. From
+// then on, going down the tree one edge at a time, each line of a child
+// was either carried over from its parent (and was introduced wherever
+// the parent's line was), or was added by the child itself. What was
+// carried over is given by the LineMap of the edge (see checkpoint_diff.h).
+//
+// Lines are not blamed one at a time: a blame is kept as runs of lines
+// which were all introduced by the same checkpoint, and a LineMap as the
+// runs of lines which changed. So following an edge costs O(runs +
+// changes), not O(lines), and once the LineMaps of a path have been
+// cached, blaming a checkpoint at the end of it doesn't need to look at
+// any checkpoint file but its own.
+
+#include "checkpoint_diff.h"
+#include "checkpoint_tree.h"
+
+#define BLAME_ERR -1
+
+// A run of lines which were all introduced by the same checkpoint.
+typedef struct blame_run {
+  uint32_t     start;  // the first line of the run (numbered from 0)
+  uint32_t     len;
+  CpTreeHandle cpt;    // the checkpoint which introduced them
+} BlameRun, *BlameRunPtr;
+
+// Which checkpoint introduced each line of a checkpoint. The runs are in
+// order, and cover every line.
+typedef struct blame {
+  BlameRunPtr runs;
+  uint32_t    num_runs;
+  uint32_t    num_lines;
+} Blame, *BlamePtr;
+
+// Blames every one of the @num_lines lines of a checkpoint on the
+// checkpoint @root (which is usually itself).
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - 0: if all went well.
+int32_t MakeRootBlame(uint32_t num_lines, CpTreeHandle root, BlamePtr ret);
+
+// Works out the blame of the checkpoint @child from the blame of its
+// parent, @parent, and the LineMap @map from the parent to the child.
+// Lines carried over keep their blame, and the rest are blamed on @child.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - BLAME_ERR: if @map doesn't fit @parent.
+//
+//  - 0: if all went well, in which case the blame is returned through @ret.
+int32_t ApplyLineMap(BlamePtr parent,
+                     LineMapPtr map,
+                     CpTreeHandle child,
+                     BlamePtr ret);
+
+// Frees the runs of @blame (but not @blame itself).
+void FreeBlame(BlamePtr blame);
+
+#endif  // _CHECKPOINT_BLAME_H_
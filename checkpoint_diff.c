@@ -0,0 +1,780 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+
+#include "checkpoint_diff.h"
+
+// The number of bytes CommonPrefix and CommonSuffix compare at once.
+#define DIFF_BLOCK_SIZE 4096
+
+// The most lines a window may have, so that every diagonal of the two
+// windows can be stored in an int32_t.
+#define DIFF_MAX_LINES ((INT32_MAX - 3) / 2)
+
+// The number of lines SplitLines makes room for to begin with.
+#define DIFF_INITIAL_LINES 1024
+
+// Finds the common start and end of @a and @b, in whole lines. The
+// window of each is what is left between them, plus DIFF_CONTEXT lines
+// either side: data[@start..@a_end) of @a, and data[@start..@b_end) of
+// @b. Also sets the first_line of both.
+static void FindWindow(DiffFilePtr a,
+                       DiffFilePtr b,
+                       size_t *start,
+                       size_t *a_end,
+                       size_t *b_end);
+
+// Returns the number of bytes the @len bytes at @a and @b start (or,
+// for CommonSuffix, end) with in common. Compares a block at a time,
+// and only looks at single bytes within the block which differs.
+static size_t CommonPrefix(const char *a, const char *b, size_t len);
+static size_t CommonSuffix(const char *a, const char *b, size_t len);
+
+// Does the work of DiffFiles and DiffLineMap: marks the lines of the
+// windows of @a and @b which changed.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - DIFF_ERR: if either file has too many lines.
+//
+//  - 0: if all went well.
+static int32_t CompareFiles(DiffFilePtr a, DiffFilePtr b);
+
+// Splits the window data[@start..@end) of @file into lines, and hashes
+// each of them.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - DIFF_ERR: if there are too many lines.
+//
+//  - 0: if all went well.
+static int32_t SplitLines(DiffFilePtr file, size_t start, size_t end);
+
+// Returns a hash of the @len bytes at @line. Reads a word at a time.
+static uint64_t HashLine(const char *line, size_t len);
+
+// Numbers the lines of both files in @ctx, so that two lines have the
+// same number if and only if they are the same, using a hash table of
+// the distinct lines of a. A line of either file which is nowhere in
+// the other can't be part of any common run of lines, so it is marked
+// as changed now. The rest are given to the search: a_ids, a_index and
+// a_len (and those of b) are set, and must be freed.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - 0: if all went well.
+static int32_t DiscardLines(DiffCtx *ctx);
+
+// Is line @i of @a the same as line @j of @b?
+static bool SameText(DiffFilePtr a, uint32_t i, DiffFilePtr b, uint32_t j);
+
+// Marks the lines of a[a_lo..a_hi) and b[b_lo..b_hi) which have to be
+// removed or added to turn one into the other. These are the lines the
+// search looks at, not those of the files. Each call splits the
+// remaining difference in half, so this only recurses O(log D) deep.
+static void CompareLines(DiffCtx *ctx,
+                         int32_t a_lo, int32_t a_hi,
+                         int32_t b_lo, int32_t b_hi);
+
+// Helper method to CompareLines. Searches forwards from (a_lo, b_lo) and
+// backwards from (a_hi, b_hi) at once, and returns where the two
+// searches meet, which is somewhere on a shortest diff, through
+// @a_split and @b_split.
+static void SplitDiff(DiffCtx *ctx,
+                      int32_t a_lo, int32_t a_hi,
+                      int32_t b_lo, int32_t b_hi,
+                      int32_t *a_split, int32_t *b_split);
+
+// Are line @i of a and line @j of b (of those the search looks at) the
+// same?
+static bool SameLine(DiffCtx *ctx, int32_t i, int32_t j);
+
+// Marks the lines from @lo to @hi of those the search looks at in @file,
+// which are found through @index, as changed.
+static void MarkChanged(DiffFilePtr file,
+                        uint32_t *index,
+                        int32_t lo,
+                        int32_t hi);
+
+// Finds the first run of changed lines from line @i of @a and @j of @b
+// on, which is returned through @change, and moves @i and @j past it.
+//
+// Returns false if there are no more changes.
+static bool NextChange(DiffFilePtr a,
+                       DiffFilePtr b,
+                       uint32_t *i,
+                       uint32_t *j,
+                       DiffChangePtr change);
+
+// Fills in @map from the marked lines of @a and @b.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - DIFF_ERR: if either file has more lines than a LineMap can number.
+//
+//  - 0: if all went well.
+static int32_t CollectChanges(DiffFilePtr a, DiffFilePtr b, LineMapPtr map);
+
+// Prints the marked lines of @a and @b as unified diff hunks.
+//
+// Returns the number of hunks printed.
+static int32_t PrintHunks(DiffFilePtr a, DiffFilePtr b);
+
+// Prints the line @i of @file, prefixed by @prefix.
+static void PrintLine(DiffFilePtr file, uint32_t i, char prefix);
+
+// Frees the lines of @file (but not its data).
+static void FreeDiffFile(DiffFilePtr file);
+
+int32_t DiffFiles(const char *a_name,
+                  const char *a,
+                  size_t a_len,
+                  const char *b_name,
+                  const char *b,
+                  size_t b_len) {
+  DiffFile file_a = { a_name, a, a_len };
+  DiffFile file_b = { b_name, b, b_len };
+  int32_t res;
+
+  // An empty file may not have any data to point to.
+  file_a.data = a_len == 0 ? "" : a;
+  file_b.data = b_len == 0 ? "" : b;
+  if (a_len == b_len && memcmp(file_a.data, file_b.data, a_len) == 0) {
+    return 0;
+  }
+
+  if ((res = CompareFiles(&file_a, &file_b)) == 0) {
+    res = PrintHunks(&file_a, &file_b);
+  }
+
+  FreeDiffFile(&file_a);
+  FreeDiffFile(&file_b);
+  return res;
+}
+
+int32_t DiffLineMap(const char *a,
+                    size_t a_len,
+                    const char *b,
+                    size_t b_len,
+                    LineMapPtr ret) {
+  DiffFile file_a = { NULL, a_len == 0 ? "" : a, a_len };
+  DiffFile file_b = { NULL, b_len == 0 ? "" : b, b_len };
+  int32_t res;
+
+  if ((res = CompareFiles(&file_a, &file_b)) == 0) {
+    res = CollectChanges(&file_a, &file_b, ret);
+  }
+
+  FreeDiffFile(&file_a);
+  FreeDiffFile(&file_b);
+  return res;
+}
+
+void FreeLineMap(LineMapPtr map) {
+  free(map->changes);
+  map->changes = NULL;
+  map->num_changes = 0;
+}
+
+static int32_t CompareFiles(DiffFilePtr a, DiffFilePtr b) {
+  DiffCtx ctx = { a, b };
+  size_t start, a_end, b_end;
+  int32_t res, *forward = NULL, *backward = NULL;
+
+  FindWindow(a, b, &start, &a_end, &b_end);
+  if ((res = SplitLines(a, start, a_end)) != 0 ||
+      (res = SplitLines(b, start, b_end)) != 0) {
+    return res;
+  }
+  ctx.max_cost = DIFF_MIN_MAX_COST;
+
+  if ((res = DiscardLines(&ctx)) == 0) {
+    // Diagonals go from -(# of lines of b) - 1 to (# of lines of a) + 1.
+    size_t num_diagonals = (size_t)ctx.a_len + ctx.b_len + 3;
+    forward = malloc(sizeof(int32_t) * num_diagonals);
+    backward = malloc(sizeof(int32_t) * num_diagonals);
+    if (forward == NULL || backward == NULL) {
+      res = MEM_ERR;
+    } else {
+      ctx.forward = forward + ctx.b_len + 1;
+      ctx.backward = backward + ctx.b_len + 1;
+      while ((int64_t)ctx.max_cost * ctx.max_cost < (int64_t)num_diagonals) {
+        ctx.max_cost *= 2;
+      }
+      CompareLines(&ctx, 0, ctx.a_len, 0, ctx.b_len);
+    }
+  }
+
+  free(forward);
+  free(backward);
+  free(ctx.a_ids);
+  free(ctx.a_index);
+  free(ctx.b_ids);
+  free(ctx.b_index);
+  return res;
+}
+
+static size_t CommonPrefix(const char *a, const char *b, size_t len) {
+  size_t i = 0;
+  while (i + DIFF_BLOCK_SIZE <= len && memcmp(a + i, b + i, DIFF_BLOCK_SIZE) == 0) {
+    i += DIFF_BLOCK_SIZE;
+  }
+  while (i < len && a[i] == b[i]) {
+    i++;
+  }
+  return i;
+}
+
+static size_t CommonSuffix(const char *a, const char *b, size_t len) {
+  // @a and @b point just past the ends of the bytes being compared.
+  size_t i = 0;
+  while (i + DIFF_BLOCK_SIZE <= len &&
+         memcmp(a - i - DIFF_BLOCK_SIZE, b - i - DIFF_BLOCK_SIZE, DIFF_BLOCK_SIZE) == 0) {
+    i += DIFF_BLOCK_SIZE;
+  }
+  while (i < len && *(a - i - 1) == *(b - i - 1)) {
+    i++;
+  }
+  return i;
+}
+
+static void FindWindow(DiffFilePtr a,
+                       DiffFilePtr b,
+                       size_t *start,
+                       size_t *a_end,
+                       size_t *b_end) {
+  size_t shorter = a->len < b->len ? a->len : b->len;
+  size_t prefix, suffix;
+  const char *nl;
+
+  // The common start ends after the last newline both files share.
+  prefix = shorter == 0 ? 0 : CommonPrefix(a->data, b->data, shorter);
+  while (prefix > 0 && a->data[prefix - 1] != '\n') {
+    prefix--;
+  }
+
+  // The common end must start at the start of a line in both files,
+  // and can't overlap the common start.
+  suffix = shorter == prefix ? 0 : CommonSuffix(a->data + a->len,
+                                                b->data + b->len,
+                                                shorter - prefix);
+  size_t a_pos = a->len - suffix, b_pos = b->len - suffix;
+  if (suffix > 0 &&
+      !((a_pos == 0 || a->data[a_pos - 1] == '\n') &&
+        (b_pos == 0 || b->data[b_pos - 1] == '\n'))) {
+    nl = memchr(a->data + a_pos, '\n', suffix);
+    suffix = nl == NULL ? 0 : a->len - (nl + 1 - a->data);
+  }
+
+  // Widen the window by a few lines either side, so there is context to
+  // print around the changes. Those lines are the same in both files.
+  *start = prefix;
+  for (int32_t i = 0; i < DIFF_CONTEXT && *start > 0; i++) {
+    (*start)--;
+    while (*start > 0 && a->data[*start - 1] != '\n') {
+      (*start)--;
+    }
+  }
+  *a_end = a->len - suffix;
+  for (int32_t i = 0; i < DIFF_CONTEXT && *a_end < a->len; i++) {
+    nl = memchr(a->data + *a_end, '\n', a->len - *a_end);
+    *a_end = nl == NULL ? a->len : (size_t)(nl + 1 - a->data);
+  }
+  *b_end = b->len - (a->len - *a_end);
+
+  a->first_line = CountLines(a->data, *start);
+  b->first_line = a->first_line;
+}
+
+uint64_t CountLines(const char *data, size_t len) {
+  const char *nl, *last = data + len;
+  uint64_t num_lines = 0;
+
+  // memchr is much faster than looking at every byte ourselves.
+  for (nl = data; nl < last; nl++) {
+    if ((nl = memchr(nl, '\n', last - nl)) == NULL) {
+      return num_lines + 1;  // the last line has no newline
+    }
+    num_lines++;
+  }
+  return num_lines;
+}
+
+static int32_t SplitLines(DiffFilePtr file, size_t start, size_t end) {
+  const char *pos, *nl, *last = file->data + end;
+  size_t num_lines = 0, capacity = DIFF_INITIAL_LINES;
+
+  file->starts = malloc(sizeof(size_t) * (capacity + 1));
+  file->hashes = malloc(sizeof(uint64_t) * capacity);
+  if (file->starts == NULL || file->hashes == NULL) {
+    return MEM_ERR;
+  }
+
+  for (pos = file->data + start; pos < last; pos = nl + 1) {
+    if ((nl = memchr(pos, '\n', last - pos)) == NULL) {
+      nl = last - 1;  // the last line has no newline
+    }
+
+    // Both arrays grow geometrically, like the arrays of a CpTree.
+    if (num_lines == capacity) {
+      size_t *new_starts;
+      uint64_t *new_hashes;
+      if (capacity > DIFF_MAX_LINES) {
+        fprintf(stderr, "%s has too many lines to diff.\n", file->name);
+        return DIFF_ERR;
+      }
+      capacity *= 2;
+      if ((new_starts = realloc(file->starts,
+                                sizeof(size_t) * (capacity + 1))) == NULL) {
+        return MEM_ERR;
+      }
+      file->starts = new_starts;
+      if ((new_hashes = realloc(file->hashes,
+                                sizeof(uint64_t) * capacity)) == NULL) {
+        return MEM_ERR;
+      }
+      file->hashes = new_hashes;
+    }
+
+    file->starts[num_lines] = pos - file->data;
+    file->hashes[num_lines] = HashLine(pos, nl + 1 - pos);
+    num_lines++;
+  }
+  if (num_lines > DIFF_MAX_LINES) {
+    fprintf(stderr, "%s has too many lines to diff.\n", file->name);
+    return DIFF_ERR;
+  }
+
+  file->starts[num_lines] = end;
+  file->num_lines = num_lines;
+  file->end = end;
+  if ((file->changed = calloc(num_lines + 1, sizeof(char))) == NULL) {
+    return MEM_ERR;
+  }
+  return 0;
+}
+
+static uint64_t HashLine(const char *line, size_t len) {
+  uint64_t hash = len * 0x9e3779b97f4a7c15ULL, word;
+
+  for (; len >= sizeof(word); line += sizeof(word), len -= sizeof(word)) {
+    memcpy(&word, line, sizeof(word));
+    hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 32;
+  }
+  if (len > 0) {
+    word = 0;
+    memcpy(&word, line, len);
+    hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+  }
+
+  hash ^= hash >> 29;
+  hash *= 0xbf58476d1ce4e5b9ULL;
+  return hash ^ (hash >> 32);
+}
+
+static int32_t DiscardLines(DiffCtx *ctx) {
+  DiffFilePtr a = ctx->a, b = ctx->b;
+  uint32_t *slots, *first, num_ids = 0, id, i, n;
+  size_t num_slots = 2, slot;
+  char *in_b;
+
+  // Keeping the table at most half full keeps probe sequences short.
+  while (num_slots < 2 * (size_t)a->num_lines) {
+    num_slots *= 2;
+  }
+  slots = calloc(num_slots, sizeof(uint32_t));  // 1 + an id, or 0 if free
+  first = malloc(sizeof(uint32_t) * (a->num_lines + 1));  // of each id
+  in_b = calloc(a->num_lines + 1, sizeof(char));  // is the id in b?
+  ctx->a_ids = malloc(sizeof(uint32_t) * (a->num_lines + 1));
+  ctx->a_index = malloc(sizeof(uint32_t) * (a->num_lines + 1));
+  ctx->b_ids = malloc(sizeof(uint32_t) * (b->num_lines + 1));
+  ctx->b_index = malloc(sizeof(uint32_t) * (b->num_lines + 1));
+  if (slots == NULL || first == NULL || in_b == NULL ||
+      ctx->a_ids == NULL || ctx->a_index == NULL ||
+      ctx->b_ids == NULL || ctx->b_index == NULL) {
+    free(slots);
+    free(first);
+    free(in_b);
+    return MEM_ERR;
+  }
+
+  for (i = 0; i < a->num_lines; i++) {
+    slot = a->hashes[i] & (num_slots - 1);
+    while (slots[slot] != 0 &&
+           !SameText(a, first[slots[slot] - 1], a, i)) {
+      slot = (slot + 1) & (num_slots - 1);
+    }
+    if (slots[slot] == 0) {
+      first[num_ids] = i;
+      slots[slot] = ++num_ids;
+    }
+    ctx->a_ids[i] = slots[slot] - 1;
+  }
+
+  // Lines of b are looked up, but never added.
+  n = 0;
+  for (i = 0; i < b->num_lines; i++) {
+    slot = b->hashes[i] & (num_slots - 1);
+    while (slots[slot] != 0 &&
+           !SameText(a, first[slots[slot] - 1], b, i)) {
+      slot = (slot + 1) & (num_slots - 1);
+    }
+    if (slots[slot] == 0) {
+      b->changed[i] = 1;
+      continue;
+    }
+    id = slots[slot] - 1;
+    in_b[id] = 1;
+    ctx->b_ids[n] = id;
+    ctx->b_index[n++] = i;
+  }
+  ctx->b_len = n;
+
+  // Now the lines of a which aren't in b are known. The ids of the rest
+  // are moved down in place.
+  n = 0;
+  for (i = 0; i < a->num_lines; i++) {
+    id = ctx->a_ids[i];
+    if (!in_b[id]) {
+      a->changed[i] = 1;
+      continue;
+    }
+    ctx->a_ids[n] = id;
+    ctx->a_index[n++] = i;
+  }
+  ctx->a_len = n;
+
+  free(slots);
+  free(first);
+  free(in_b);
+  return 0;
+}
+
+static bool SameText(DiffFilePtr a, uint32_t i, DiffFilePtr b, uint32_t j) {
+  size_t len = a->starts[i + 1] - a->starts[i];
+
+  // Lines with different hashes are different. Lines with the same hash
+  // are almost always the same, but that has to be checked.
+  return a->hashes[i] == b->hashes[j] &&
+         len == b->starts[j + 1] - b->starts[j] &&
+         memcmp(a->data + a->starts[i], b->data + b->starts[j], len) == 0;
+}
+
+static bool SameLine(DiffCtx *ctx, int32_t i, int32_t j) {
+  return ctx->a_ids[i] == ctx->b_ids[j];
+}
+
+static void MarkChanged(DiffFilePtr file,
+                        uint32_t *index,
+                        int32_t lo,
+                        int32_t hi) {
+  for (; lo < hi; lo++) {
+    file->changed[index[lo]] = 1;
+  }
+}
+
+static void CompareLines(DiffCtx *ctx,
+                         int32_t a_lo, int32_t a_hi,
+                         int32_t b_lo, int32_t b_hi) {
+  int32_t a_split, b_split;
+
+  // Lines the two have in common at either end are not part of the diff.
+  while (a_lo < a_hi && b_lo < b_hi && SameLine(ctx, a_lo, b_lo)) {
+    a_lo++;
+    b_lo++;
+  }
+  while (a_lo < a_hi && b_lo < b_hi && SameLine(ctx, a_hi - 1, b_hi - 1)) {
+    a_hi--;
+    b_hi--;
+  }
+
+  if (a_lo == a_hi) {
+    MarkChanged(ctx->b, ctx->b_index, b_lo, b_hi);
+  } else if (b_lo == b_hi) {
+    MarkChanged(ctx->a, ctx->a_index, a_lo, a_hi);
+  } else {
+    SplitDiff(ctx, a_lo, a_hi, b_lo, b_hi, &a_split, &b_split);
+    CompareLines(ctx, a_lo, a_split, b_lo, b_split);
+    CompareLines(ctx, a_split, a_hi, b_split, b_hi);
+  }
+}
+
+static void SplitDiff(DiffCtx *ctx,
+                      int32_t a_lo, int32_t a_hi,
+                      int32_t b_lo, int32_t b_hi,
+                      int32_t *a_split, int32_t *b_split) {
+  int32_t *forward = ctx->forward, *backward = ctx->backward;
+  int32_t k_min = a_lo - b_hi, k_max = a_hi - b_lo;
+  int32_t f_mid = a_lo - b_lo, b_mid = a_hi - b_hi;
+  int32_t f_min = f_mid, f_max = f_mid, b_min = b_mid, b_max = b_mid;
+  bool odd = (f_mid - b_mid) & 1;
+  int32_t i, j, k;
+
+  // forward[k] is the furthest line of a the forward search has reached
+  // on diagonal k, and backward[k] the nearest the backward one has.
+  forward[f_mid] = a_lo;
+  backward[b_mid] = a_hi;
+
+  for (int32_t cost = 1; ; cost++) {
+    // One more step forwards on every diagonal reached so far. The
+    // diagonals just outside the range are set so they are never chosen.
+    if (f_min > k_min) {
+      forward[--f_min - 1] = -1;
+    } else {
+      f_min++;
+    }
+    if (f_max < k_max) {
+      forward[++f_max + 1] = -1;
+    } else {
+      f_max--;
+    }
+    for (k = f_max; k >= f_min; k -= 2) {
+      if (forward[k - 1] >= forward[k + 1]) {
+        i = forward[k - 1] + 1;
+      } else {
+        i = forward[k + 1];
+      }
+      j = i - k;
+      while (i < a_hi && j < b_hi && SameLine(ctx, i, j)) {
+        i++;
+        j++;
+      }
+      forward[k] = i;
+      if (odd && b_min <= k && k <= b_max && backward[k] <= i) {
+        *a_split = i;
+        *b_split = j;
+        return;
+      }
+    }
+
+    // And one more step backwards.
+    if (b_min > k_min) {
+      backward[--b_min - 1] = INT32_MAX;
+    } else {
+      b_min++;
+    }
+    if (b_max < k_max) {
+      backward[++b_max + 1] = INT32_MAX;
+    } else {
+      b_max--;
+    }
+    for (k = b_max; k >= b_min; k -= 2) {
+      if (backward[k - 1] < backward[k + 1]) {
+        i = backward[k - 1];
+      } else {
+        i = backward[k + 1] - 1;
+      }
+      j = i - k;
+      while (i > a_lo && j > b_lo && SameLine(ctx, i - 1, j - 1)) {
+        i--;
+        j--;
+      }
+      backward[k] = i;
+      if (!odd && f_min <= k && k <= f_max && i <= forward[k]) {
+        *a_split = i;
+        *b_split = j;
+        return;
+      }
+    }
+
+    if (cost < ctx->max_cost) {
+      continue;
+    }
+
+    // This is taking too long. Split wherever one of the searches has
+    // got furthest from where it started instead.
+    int64_t f_best = -1, b_best = INT64_MAX;
+    int32_t f_best_i = a_lo, b_best_i = a_hi;
+    for (k = f_max; k >= f_min; k -= 2) {
+      i = forward[k] < a_hi ? forward[k] : a_hi;
+      j = i - k;
+      if (j > b_hi) {
+        i = b_hi + k;
+        j = b_hi;
+      }
+      if (f_best < (int64_t)i + j) {
+        f_best = (int64_t)i + j;
+        f_best_i = i;
+      }
+    }
+    for (k = b_max; k >= b_min; k -= 2) {
+      i = backward[k] > a_lo ? backward[k] : a_lo;
+      j = i - k;
+      if (j < b_lo) {
+        i = b_lo + k;
+        j = b_lo;
+      }
+      if ((int64_t)i + j < b_best) {
+        b_best = (int64_t)i + j;
+        b_best_i = i;
+      }
+    }
+    if ((int64_t)a_hi + b_hi - b_best < f_best - a_lo - b_lo) {
+      *a_split = f_best_i;
+      *b_split = f_best - f_best_i;
+    } else {
+      *a_split = b_best_i;
+      *b_split = b_best - b_best_i;
+    }
+    return;
+  }
+}
+
+static bool NextChange(DiffFilePtr a,
+                       DiffFilePtr b,
+                       uint32_t *i,
+                       uint32_t *j,
+                       DiffChangePtr change) {
+  // Lines which weren't changed pair up one to one, so skipping
+  // them moves through both files at the same pace.
+  while (*i < a->num_lines && *j < b->num_lines &&
+         !a->changed[*i] && !b->changed[*j]) {
+    (*i)++;
+    (*j)++;
+  }
+  if (*i == a->num_lines && *j == b->num_lines) {
+    return false;
+  }
+
+  change->a_start = a->first_line + *i;
+  change->b_start = b->first_line + *j;
+  while (*i < a->num_lines && a->changed[*i]) {
+    (*i)++;
+  }
+  while (*j < b->num_lines && b->changed[*j]) {
+    (*j)++;
+  }
+  change->a_len = a->first_line + *i - change->a_start;
+  change->b_len = b->first_line + *j - change->b_start;
+  return true;
+}
+
+static int32_t CollectChanges(DiffFilePtr a, DiffFilePtr b, LineMapPtr map) {
+  uint64_t a_lines = a->first_line + a->num_lines +
+                     CountLines(a->data + a->end, a->len - a->end);
+  uint64_t b_lines = b->first_line + b->num_lines +
+                     CountLines(b->data + b->end, b->len - b->end);
+  DiffChange change;
+  uint32_t i = 0, j = 0, num_changes = 0;
+
+  if (a_lines > UINT32_MAX || b_lines > UINT32_MAX) {
+    return DIFF_ERR;
+  }
+  map->a_lines = a_lines;
+  map->b_lines = b_lines;
+
+  // Count the changes first, so they can be stored in one array.
+  while (NextChange(a, b, &i, &j, &change)) {
+    num_changes++;
+  }
+  map->num_changes = num_changes;
+  if ((map->changes = malloc(sizeof(DiffChange) * (num_changes + 1))) == NULL) {
+    return MEM_ERR;
+  }
+
+  i = j = num_changes = 0;
+  while (NextChange(a, b, &i, &j, &map->changes[num_changes])) {
+    num_changes++;
+  }
+  return 0;
+}
+
+static int32_t PrintHunks(DiffFilePtr a, DiffFilePtr b) {
+  uint32_t i = 0, j = 0, a_start, b_start, a_end, b_end, gap, context;
+  int32_t num_hunks = 0;
+
+  while (true) {
+    // Lines which weren't changed pair up one to one, so skipping
+    // them moves through both files at the same pace.
+    while (i < a->num_lines && j < b->num_lines &&
+           !a->changed[i] && !b->changed[j]) {
+      i++;
+      j++;
+    }
+    if (i == a->num_lines && j == b->num_lines) {
+      break;
+    }
+
+    context = i < DIFF_CONTEXT ? i : DIFF_CONTEXT;
+    a_start = i - context;
+    b_start = j - context;
+
+    // Changes which are close enough for their context to touch are
+    // printed as one hunk.
+    while (true) {
+      while (i < a->num_lines && a->changed[i]) {
+        i++;
+      }
+      while (j < b->num_lines && b->changed[j]) {
+        j++;
+      }
+      for (gap = 0; i + gap < a->num_lines && j + gap < b->num_lines &&
+                    !a->changed[i + gap] && !b->changed[j + gap]; gap++) { }
+      if ((i + gap == a->num_lines && j + gap == b->num_lines) ||
+          gap > 2 * DIFF_CONTEXT) {
+        context = gap < DIFF_CONTEXT ? gap : DIFF_CONTEXT;
+        a_end = i + context;
+        b_end = j + context;
+        break;
+      }
+      i += gap;
+      j += gap;
+    }
+
+    if (num_hunks == 0) {
+      printf("--- %s\n+++ %s\n", a->name, b->name);
+    }
+    num_hunks++;
+
+    // An empty range is numbered by the line before it.
+    printf("@@ -%lu", a->first_line + a_start + (a_end > a_start));
+    if (a_end - a_start != 1) {
+      printf(",%u", a_end - a_start);
+    }
+    printf(" +%lu", b->first_line + b_start + (b_end > b_start));
+    if (b_end - b_start != 1) {
+      printf(",%u", b_end - b_start);
+    }
+    printf(" @@\n");
+
+    for (i = a_start, j = b_start; i < a_end || j < b_end; ) {
+      if (i < a_end && a->changed[i]) {
+        PrintLine(a, i++, '-');
+      } else if (j < b_end && b->changed[j]) {
+        PrintLine(b, j++, '+');
+      } else {
+        PrintLine(a, i++, ' ');
+        j++;
+      }
+    }
+  }
+
+  return num_hunks;
+}
+
+static void PrintLine(DiffFilePtr file, uint32_t i, char prefix) {
+  size_t len = file->starts[i + 1] - file->starts[i];
+  const char *line = file->data + file->starts[i];
+
+  putchar(prefix);
+  fwrite(line, sizeof(char), len, stdout);
+  if (len == 0 || line[len - 1] != '\n') {
+    printf("\n\\ No newline at end of file\n");
+  }
+}
+
+static void FreeDiffFile(DiffFilePtr file) {
+  free(file->starts);
+  free(file->hashes);
+  free(file->changed);
+  file->starts = NULL;
+  file->hashes = NULL;
+  file->changed = NULL;
+}
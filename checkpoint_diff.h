@@ -0,0 +1,139 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+
+#ifndef _CHECKPOINT_DIFF_H_
+#define _CHECKPOINT_DIFF_H_
+// This module finds the lines which differ between two versions of a
+// file, and prints them as a unified diff (the format of diff -u).
+//
+// Two versions of a checkpointed file are usually the same but for a
+// few lines, so before anything else, the common start and end of the
+// two are skipped by comparing them byte for byte. Only the lines in
+// between are split up and hashed. A line which is nowhere in the other
+// file can't be matched with anything, so it is marked as changed right
+// away, like GNU diff does. Only the lines left are compared using
+// Myers' O(ND) algorithm, in its linear space (divide and conquer)
+// form. So a diff costs one pass over the common parts of the files,
+// O(N + M) for the N and M lines which are not in common, plus
+// O((N + M) D) for the D of those lines that differ but are still found
+// somewhere in the other file (lines which moved, or lines like "}"
+// which are everywhere).
+
+#include "macros.h"
+
+#include <stdint.h>
+
+#define DIFF_ERR -1
+
+// The number of unchanged lines printed around each change.
+#define DIFF_CONTEXT 3
+
+// Unless a diff costs less than this many steps, it will not always be
+// the shortest one (see DiffCtx.max_cost).
+#define DIFF_MIN_MAX_COST 256
+
+// A version of a file to be diffed. Only a window of the file is split
+// into lines, since everything before and after it is the same in both
+// versions.
+typedef struct diff_file {
+  const char *name;       // what to call the file in the diff's header
+  const char *data;
+  size_t      len;
+  uint64_t    first_line; // the number of lines before the window
+  // The lines of the window: line i is data[starts[i]..starts[i + 1]),
+  // including its newline (if it has one).
+  size_t     *starts;
+  uint64_t   *hashes;     // a hash of each line
+  char       *changed;    // whether each line was removed (or added)
+  uint32_t    num_lines;
+  size_t      end;        // where the window ends
+} DiffFile, *DiffFilePtr;
+
+// A run of lines which differ between two files: the @a_len lines of a
+// from line @a_start on were replaced by the @b_len lines of b from line
+// @b_start on (lines are numbered from 0). Either length may be 0.
+typedef struct diff_change {
+  uint32_t a_start;
+  uint32_t a_len;
+  uint32_t b_start;
+  uint32_t b_len;
+} DiffChange, *DiffChangePtr;
+
+// Everything which changed from one file (a) to another (b). Any line
+// which isn't part of a change is the same in both, so this maps every
+// line of b to the line of a it came from (if any).
+typedef struct line_map {
+  uint32_t      a_lines;      // the # of lines of a
+  uint32_t      b_lines;      // the # of lines of b
+  uint32_t      num_changes;
+  DiffChangePtr changes;      // in order, and never next to each other
+} LineMap, *LineMapPtr;
+
+// What the search for a diff needs, along with the two files.
+typedef struct diff_ctx {
+  DiffFilePtr a;
+  DiffFilePtr b;
+  // The lines the search looks at: those of each file which are also
+  // somewhere in the other. Each has a number, which is the same for two
+  // lines if and only if they are the same, and is found in its file at
+  // a_index (or b_index).
+  uint32_t   *a_ids;
+  uint32_t   *a_index;
+  int32_t     a_len;
+  uint32_t   *b_ids;
+  uint32_t   *b_index;
+  int32_t     b_len;
+  // For each diagonal k (line i of a against line i - k of b), how far
+  // along it the forward and backward searches have got. Both point
+  // into the middle of their arrays, since k may be negative.
+  int32_t    *forward;
+  int32_t    *backward;
+  // Once a search has taken this many steps without meeting in the
+  // middle, it gives up on finding the shortest diff, and splits the
+  // files where it has got furthest. This keeps diffing two files which
+  // have next to nothing in common from taking O(N^2).
+  int32_t     max_cost;
+} DiffCtx;
+
+// Prints a unified diff which turns the @a_len bytes at @a (called
+// @a_name) into the @b_len bytes at @b (called @b_name) to stdout.
+// Nothing is printed if the two are the same.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - DIFF_ERR: if either file has more lines than can be diffed.
+//
+//  - The number of hunks printed otherwise.
+int32_t DiffFiles(const char *a_name,
+                  const char *a,
+                  size_t a_len,
+                  const char *b_name,
+                  const char *b,
+                  size_t b_len);
+
+// Finds what changed from the @a_len bytes at @a to the @b_len bytes at
+// @b, the same way DiffFiles does, but returns it through @ret rather
+// than printing it. The changes must be freed with FreeLineMap.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - DIFF_ERR: if either file has more lines than can be diffed.
+//
+//  - 0: if all went well.
+int32_t DiffLineMap(const char *a,
+                    size_t a_len,
+                    const char *b,
+                    size_t b_len,
+                    LineMapPtr ret);
+
+// Frees the changes of @map (but not @map itself).
+void FreeLineMap(LineMapPtr map);
+
+// Returns the number of lines in the @len bytes at @data, counting a
+// last line without a newline.
+uint64_t CountLines(const char *data, size_t len);
+
+#endif  // _CHECKPOINT_DIFF_H_
@@ -1,10 +1,242 @@
 // Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
 
+#include "DataStructs/Allocator.h"
 #include "DataStructs/HashTable_priv.h"
 #include "checkpoint_filehandler.h"
+#include "checkpoint_metrics.h"
+#include "checkpoint_stats.h"
+#include "checkpoint_trace.h"
+
+#include <fcntl.h>
+
+// Reads a HashTable in from file @f, starting at offstet @f, into the
+// string keyed table @table, using function @fn to read the value of
+// each bucket in. @version is the version of the log being read.
+//
+// Version 1 logs only stored hashes, so the keys have to be recovered.
+// If @legacy_keys is NULL, the value of each bucket (a string) is its
+// own key. Otherwise, @legacy_keys maps each stored hash to its key.
+//
+// Returns:
+//
+//  - The number of bytes read, and READ_ERROR if any errors occured.
+static int32_t ReadHashTable(FILE *f,
+                             uint32_t offset,
+                             uint32_t version,
+                             HashTable table,
+                             read_bucket_fn fn,
+                             HashTable legacy_keys);
+
+// Builds @legacy_keys, which maps the version 1 hash of every filename
+// in @filenames to that filename, so the tables of a version 1 log
+// which were keyed by those hashes can be read.
+//
+// Returns:
+//
+//  - READ_SUCCESS, or MEM_ERR on a memory error.
+static int32_t MakeLegacyKeys(HashTable filenames, HashTable *legacy_keys);
+
+// Reads the length prefixed string at offset @offset of @f into a
+// new string on the heap, returned through @str, which must be freed
+// with FreeLogString.
+//
+// Returns:
+//
+//  - The number of bytes read, and READ_ERROR or MEM_ERR if any occured.
+static int32_t ReadString(FILE *f, uint32_t offset, char **str);
+
+// Helper method to ReadCheckPointLog.
+// Reads in a bucket value which is supposed to be a pointer
+// to a string on the heap.
+static int32_t ReadStringBucket(FILE *f,
+                                uint32_t offset,
+                                uint32_t version,
+                                HashTabVal_t *value);
+
+// Reads in a tree bucket value (of a log of version @version) starting
+// from offset @offset. Creates a tree on the heap, and stores the
+// pointer in @value.
+//
+// Returns;
+//
+//  - The number of bytes read, and READ_ERROR if any occured
+static int32_t ReadTreeBucket(FILE *f,
+                              uint32_t offset,
+                              uint32_t version,
+                              HashTabVal_t *value);
+
+// Reads in the tree written at offset @offset, allocating it on the
+// heap and returning it through @tree. On an error, whatever was read
+// of the tree so far is left in @tree (for the caller to free).
+//
+// Returns:
+//
+//  - The number of bytes read, and READ_ERROR or MEM_ERR if any errors occur.
+static int32_t ReadTree(FILE *f,
+                        uint32_t offset,
+                        uint32_t version,
+                        CpTreePtr *tree);
+
+// Reads the time index written at offset @offset for @tree (see
+// WriteTreeTimes), and gives it to @tree. If it doesn't fit @tree, @tree
+// is left to sort its nodes by time when it needs them.
+//
+// Returns:
+//
+//  - The number of bytes read, and READ_ERROR or MEM_ERR if any errors occur.
+static int32_t ReadTreeTimes(FILE *f, uint32_t offset, CpTreePtr tree);
+
+// Helper method to ReadTree. Reads in the header and name of the tree
+// node at offset @offset, and adds it to @*tree as a child of @parent.
+// If @parent is CPT_NULL_HANDLE, the node is the root, and a new tree
+// is allocated for it and returned through @tree. The header is returned
+// through @header, the handle of the new node through @node, and @f is
+// left at the node's children offsets. Logs older than version 3 didn't
+// store when a checkpoint was made, so the time and size of its file
+// are used instead.
+//
+// Returns:
+//
+//  - The number of bytes read, and READ_ERROR or MEM_ERR if any errors occur.
+static int32_t ReadTreeNode(FILE *f,
+                            uint32_t offset,
+                            uint32_t version,
+                            CpTreePtr *tree,
+                            CpTreeHandle parent,
+                            FileTreeHeader *header,
+                            CpTreeHandle *node);
+
+// This VC system is composed of four hash tables. This method
+// takes care pf writing them (and the key of every bucket), with
+// the assistance of @fn.
+//
+// Returns:
+//
+//  - MEM_ERR: upon a memory ERROR.
+//
+//  - FILE_WRITE_ERR: if an ERROR arises while writing.
+//
+//  - The number of bytes written otherwise.
+static int32_t WriteHashTable(FILE *f,
+                              HashTable table,
+                              uint32_t offset,
+                              write_bucket_fn fn);
+
+// Writes @str to the given file at the given offset, preceded by
+// a StringBucketHeader. DOES NOT INCLUDE NULL TERMINATOR.
+//
+// Returns:
+//
+//  - FILE_WRITE_ERR: if any ERRORs arose while writing.
+//
+//  - The number of bytes written otherwise.
+static int32_t WriteString(FILE *f, uint32_t offset, const char *str);
+
+// Simply writes the given string value to the given file at the
+// given offset.
+//
+// Returns:
+//
+//  - FILE_WRITE_ERR: if any ERRORs arose while writing.
+//
+//  - The number of bytes written otherwise.
+static int32_t WriteStringBucket(FILE *f, uint32_t offset, HashTabVal_t value);
+
+// Writes a bucket value to file f, containing the contents of
+// @value (assumed to be a CpTreePtr).
+//
+// Returns:
+//
+//  - MEM_ERR: on memory ERROR.
+//
+//  - FILE_WRITE_ERR: if an ERROR arose while writing.
+//
+//  - The number of bytes written for the tree.
+static int32_t WriteTreeBucket(FILE *f, uint32_t offset, HashTabVal_t value);
+
+// Writes the subtree of @tree rooted at @curr_node to file @f.
+// A file_treenode is written the following way:
+//
+// [name_len][num_children][time][size][name][children_offsets][  children  ]
+//
+// name_len and num_children are type ssize_t
+// time and size are a FileTreeStamp
+// name is a char array (which omits the null terminating byte)
+// children_offsets is an array of uint32_t values
+//
+// It's impossible to tell anything about the length of children, unless
+// num_children is 0, in which case there will not be any children_offsets
+// or children field written.
+//
+// Returns;
+//
+//  - The number of bytes written, and FILE_WRITE_ERR or MEM_ERR if one occured.
+static int32_t WriteTree(FILE *f,
+                         uint32_t offset,
+                         CpTreePtr tree,
+                         CpTreeHandle curr_node);
+
+// Writes the time index of @tree (see FindCptsInTimeRange) at the
+// current position of @f, which is right after the tree. Each entry is
+// a uint32_t: the handle ReadTree will give the node when the tree is
+// read back in, which isn't the node's handle now.
+//
+// Returns:
+//
+//  - The number of bytes written, and FILE_WRITE_ERR or MEM_ERR if one occured.
+static int32_t WriteTreeTimes(FILE *f, CpTreePtr tree);
+
+// The CpTreeVisitors WriteTree walks the tree with (@state is a
+// TreeWriteState). SizeTreeNode records the number of bytes the subtree
+// rooted at @node will take, and must visit children before parents.
+// WriteTreeNode writes @node itself at @state->offset, and must visit
+// parents before children.
+//
+// Returns:
+//
+//  - CPT_VISIT_CONTINUE, or FILE_WRITE_ERR if any errors occur.
+static int32_t SizeTreeNode(CpTreePtr tree, CpTreeHandle node, void *state);
+static int32_t WriteTreeNode(CpTreePtr tree, CpTreeHandle node, void *state);
+
+// Helper method to ReadLineMap and WriteLineMap. Fills in the header of
+// the map from @parent_cpt to @child_cpt (as it would be now) in @header.
+//
+// Returns:
+//
+//  READ_ERROR: if either checkpoint file is missing.
+//
+//  READ_SUCCESS: if all went well.
+static int32_t MakeLineMapHeader(char *parent_cpt,
+                                 char *child_cpt,
+                                 LineMapHeader *header);
+
+// Helper method to WriteSrcCheckpoint, writes the contents of file @a to
+// file @b, adding each chunk written to @progress.
+//
+// Returns:
+//  - FILE_WRITE_ERR: if any errors occur in the i/o process.
+//
+//  - FILE_WRITE_SUCCESS: if all went well. 
+static int32_t WriteAToB(FILE *a, FILE *b, ProgressPtr progress);
 
 void FileHandlerNullFree(void *val) { }
 
+char *CopyLogString(const char *str) {
+  size_t size = strlen(str) + 1;
+  char *copy = CPMalloc(CP_ALLOC_FILEHANDLER, size);
+
+  if (copy != NULL) {
+    memcpy(copy, str, size);
+  }
+  return copy;
+}
+
+void FreeLogString(HashTabVal_t str) {
+  if (str != NULL) {
+    CPFree(CP_ALLOC_FILEHANDLER, str, strlen(str) + 1);
+  }
+}
+
 int32_t ReadCheckPointLog(CheckPointLogPtr cpt_log) {
   struct stat;
   if (DEBUG) {
@@ -12,10 +244,10 @@ int32_t ReadCheckPointLog(CheckPointLogPtr cpt_log) {
   }
 
   // Allocate space for the hashtables
-  cpt_log->src_filehash_to_filename = MakeHashTable(INITIAL_BUCKET_COUNT);
-  cpt_log->src_filehash_to_cptname  = MakeHashTable(INITIAL_BUCKET_COUNT);
-  cpt_log->cpt_namehash_to_cptfilename = MakeHashTable(INITIAL_BUCKET_COUNT);
-  cpt_log->dir_tree = MakeHashTable(INITIAL_BUCKET_COUNT);
+  cpt_log->src_filehash_to_filename = MakeStrHashTable(INITIAL_BUCKET_COUNT);
+  cpt_log->src_filehash_to_cptname  = MakeStrHashTable(INITIAL_BUCKET_COUNT);
+  cpt_log->cpt_namehash_to_cptfilename = MakeStrHashTable(INITIAL_BUCKET_COUNT);
+  cpt_log->dir_tree = MakeStrHashTable(INITIAL_BUCKET_COUNT);
 
   if (cpt_log->src_filehash_to_filename == NULL ||
       cpt_log->src_filehash_to_cptname  == NULL ||
@@ -24,7 +256,7 @@ int32_t ReadCheckPointLog(CheckPointLogPtr cpt_log) {
     FreeHashTable(cpt_log->src_filehash_to_filename, &FileHandlerNullFree);
     FreeHashTable(cpt_log->src_filehash_to_cptname, &FileHandlerNullFree);
     FreeHashTable(cpt_log->cpt_namehash_to_cptfilename, &FileHandlerNullFree);
-    FreeHashTable(cpt_log->dir_tree, &FreeCpTreeNode);
+    FreeHashTable(cpt_log->dir_tree, &FreeCpTree);
     if (DEBUG) {
       printf("ERROR allocating space for hashables\n");
     }
@@ -49,26 +281,37 @@ int32_t ReadCheckPointLog(CheckPointLogPtr cpt_log) {
   }
   
   if (DEBUG) {
-    fseek(f, 0L, SEEK_END);
-    printf("\t\treading %d bytes in from %s\n", ftell(f), CP_LOG_FILE);
+    StatsFseek(f, 0L, SEEK_END);
+    printf("\t\treading %ld bytes in from %s\n", ftell(f), CP_LOG_FILE);
   }
 
   // Read the header;
   CpLogFileHeader header;
+  HashTable legacy_keys = NULL;
+  uint32_t version;
   int32_t res, offset = 0;
-  if (fseek(f, 0, SEEK_SET) != 0) {
+  uint64_t begin;
+  if (StatsFseek(f, 0, SEEK_SET) != 0) {
     if (DEBUG) {
       printf("\t\tERROR: could not fseek to start of %s\n", CP_LOG_FILE);
     }
     return READ_ERROR;
   }
-  if (fread(&header, sizeof(CpLogFileHeader), 1, f) != 1) {
+  if (StatsFread(&header, sizeof(CpLogFileHeader), 1, f, STATS_IO_META) != 1) {
     if (DEBUG) {
       printf("\t\tERROR: could not fread at start of %s\n", CP_LOG_FILE);
     }
     return READ_ERROR;
   }
-  if (header.magic_number != MAGIC_NUMBER) {
+  if (header.magic_number == MAGIC_NUMBER) {
+    version = CP_LOG_VERSION;
+  } else if (header.magic_number == MAGIC_NUMBER_V3) {
+    version = 3;
+  } else if (header.magic_number == MAGIC_NUMBER_V2) {
+    version = 2;
+  } else if (header.magic_number == MAGIC_NUMBER_V1) {
+    version = 1;
+  } else {
     if (DEBUG) {
       printf("\t\tERROR: corrupted file. Header is %x\n", header.magic_number);
     }
@@ -82,7 +325,14 @@ int32_t ReadCheckPointLog(CheckPointLogPtr cpt_log) {
 
   // read String tables
   offset += sizeof(CpLogFileHeader);
-  res = ReadHashTable(f, offset, cpt_log->src_filehash_to_filename, &ReadStringBucket);
+  begin = TraceBegin(TRACE_READ_TABLE);
+  res = ReadHashTable(f,
+                      offset,
+                      version,
+                      cpt_log->src_filehash_to_filename,
+                      &ReadStringBucket,
+                      NULL);
+  TraceEnd(TRACE_READ_TABLE, begin);
   if (res == READ_ERROR || res == MEM_ERR ) {
     if (DEBUG) {
       printf("\t\terror %d reading src filenames\n", res);
@@ -92,8 +342,28 @@ int32_t ReadCheckPointLog(CheckPointLogPtr cpt_log) {
   if (DEBUG) { printf("\n\t\tsrc_filenames done\n"); }
   offset += header.src_filehash_to_filename_size;
 
-  res = ReadHashTable(f, offset, cpt_log->src_filehash_to_cptname, &ReadStringBucket);
+  // A version 1 log keyed the remaining tables by the hash of a source
+  // filename, so we need to know which filename each of those hashes
+  // came from.
+  if (version == 1) {
+    res = MakeLegacyKeys(cpt_log->src_filehash_to_filename, &legacy_keys);
+    if (res != READ_SUCCESS) {
+      return READ_ERROR;
+    }
+  }
+
+  begin = TraceBegin(TRACE_READ_TABLE);
+  res = ReadHashTable(f,
+                      offset,
+                      version,
+                      cpt_log->src_filehash_to_cptname,
+                      &ReadStringBucket,
+                      legacy_keys);
+  TraceEnd(TRACE_READ_TABLE, begin);
   if (res == READ_ERROR || res == MEM_ERR) {
+    if (legacy_keys != NULL) {
+      FreeHashTable(legacy_keys, &FileHandlerNullFree);
+    }
     if (DEBUG) {
       printf("\t\terror %d reading current cpt names\n", res);
     }
@@ -102,8 +372,18 @@ int32_t ReadCheckPointLog(CheckPointLogPtr cpt_log) {
   if (DEBUG) { printf("\n\t\tsrc cpts done\n"); }
   offset += header.src_filehash_to_cptname_size;
 
-  res = ReadHashTable(f, offset, cpt_log->cpt_namehash_to_cptfilename, &ReadStringBucket);
+  begin = TraceBegin(TRACE_READ_TABLE);
+  res = ReadHashTable(f,
+                      offset,
+                      version,
+                      cpt_log->cpt_namehash_to_cptfilename,
+                      &ReadStringBucket,
+                      NULL);
+  TraceEnd(TRACE_READ_TABLE, begin);
   if (res == READ_ERROR || res == MEM_ERR) {
+    if (legacy_keys != NULL) {
+      FreeHashTable(legacy_keys, &FileHandlerNullFree);
+    }
     return READ_ERROR;
     if (DEBUG) {
       printf("\t\terror %d reading cpt file names\n", res);
@@ -116,7 +396,17 @@ int32_t ReadCheckPointLog(CheckPointLogPtr cpt_log) {
     printf("\t\treading tree table in from disk\n");
   }
   // read tree table
-  res = ReadHashTable(f, offset, cpt_log->dir_tree, &ReadTreeBucket);
+  begin = TraceBegin(TRACE_READ_TABLE);
+  res = ReadHashTable(f,
+                      offset,
+                      version,
+                      cpt_log->dir_tree,
+                      &ReadTreeBucket,
+                      legacy_keys);
+  TraceEnd(TRACE_READ_TABLE, begin);
+  if (legacy_keys != NULL) {
+    FreeHashTable(legacy_keys, &FileHandlerNullFree);
+  }
   if (res == READ_ERROR || res == MEM_ERR) {
     if (DEBUG) {
       printf("\t\terror %d reading dirtree\n", res);
@@ -130,37 +420,81 @@ int32_t ReadCheckPointLog(CheckPointLogPtr cpt_log) {
   return READ_SUCCESS;
 }
 
+static int32_t MakeLegacyKeys(HashTable filenames, HashTable *legacy_keys) {
+  HTIter it;
+  HashTabKV kv, storage;
+  const char *filename;
+  int32_t num_attempts = NUMBER_ATTEMPTS;
+
+  ATTEMPT((*legacy_keys = MakeHashTable(INITIAL_BUCKET_COUNT)), NULL, num_attempts)
+  if (HTReserve(*legacy_keys, HTSize(filenames)) == 0) {
+    FreeHashTable(*legacy_keys, &FileHandlerNullFree);
+    return MEM_ERR;
+  }
+  if ((it = MakeHTIter(filenames)) == NULL) {
+    FreeHashTable(*legacy_keys, &FileHandlerNullFree);
+    return MEM_ERR;
+  }
+
+  while (!HTIterValid(it)) {
+    HTIterStrKey(it, &filename);
+    // The strings are owned by @filenames, and outlive @legacy_keys.
+    kv.key = HashFunc((unsigned char *)filename, strlen(filename));
+    kv.value = (HashTabVal_t)filename;
+    if (HTInsert(*legacy_keys, kv, &storage) == 0) {
+      DiscardHTIter(it);
+      FreeHashTable(*legacy_keys, &FileHandlerNullFree);
+      return MEM_ERR;
+    }
+    HTIncrementIter(it);
+  }
+
+  DiscardHTIter(it);
+  return READ_SUCCESS;
+}
+
 static int32_t ReadHashTable(FILE *f,
                              uint32_t offset,
+                             uint32_t version,
                              HashTable table,
-                             read_bucket_fn fn) {
-  if (fseek (f, offset, SEEK_SET) != 0) {
+                             read_bucket_fn fn,
+                             HashTable legacy_keys) {
+  if (StatsFseek(f, offset, SEEK_SET) != 0) {
     return READ_ERROR;
   }
   if (DEBUG) { printf("\t\t\treading hashtable at offset %x\n", offset);}
   BucketRecListHeader brl_h;
   BucketRec br;
-  uint32_t next_bucketrec_offset = 0, next_bucket_offset = 0, num_attempts;
+  BucketHeader bh;
+  uint32_t next_bucketrec_offset = 0, next_bucket_offset = 0;
   int32_t bytes_read = 0, res;
 
   // Read in the bucket rec list header
-  if (fread(&brl_h, sizeof(BucketRecListHeader), 1, f) != 1) {
+  if (StatsFread(&brl_h, sizeof(BucketRecListHeader), 1, f,
+                 STATS_IO_META) != 1) {
     return READ_ERROR;
   }
   bytes_read += sizeof(BucketRecListHeader);
   next_bucketrec_offset += offset + sizeof(BucketRecListHeader);
 
+  // We know how many elements are coming, so size the table for them
+  // up front instead of growing it along the way.
+  if (HTReserve(table, brl_h.num_bucket_recs) == 0) {
+    return MEM_ERR;
+  }
+
   // Now read in all the bucket rec/buckets
   HashTabKV kv, storage;
+  char *key;
   for (int32_t i = 0; i < brl_h.num_bucket_recs; i++) {
     // Read the next bucket rec
-    if (fseek(f, next_bucketrec_offset, SEEK_SET) != 0) {
+    if (StatsFseek(f, next_bucketrec_offset, SEEK_SET) != 0) {
       if (DEBUG) {
         printf("\t\t\tERROR: could not fseek in ReadHashTable\n");
       }
       return READ_ERROR;
     }
-    if (fread(&br, sizeof(BucketRec), 1, f) != 1) {
+    if (StatsFread(&br, sizeof(BucketRec), 1, f, STATS_IO_META) != 1) {
       if (DEBUG) {
         printf("\t\t\tERROR: could not fread in ReadHashTable\n");
       }
@@ -171,190 +505,324 @@ static int32_t ReadHashTable(FILE *f,
     next_bucket_offset = br.bucket_pos;
     if (DEBUG) {printf("\t\t\treading bucket of size %d at offset %x\n", br.bucket_size, next_bucket_offset);}
 
+    // Read the bucket header, and the key (if it was stored)
+    if (StatsFseek(f, next_bucket_offset, SEEK_SET) != 0 ||
+        StatsFread(&bh, sizeof(BucketHeader), 1, f, STATS_IO_META) != 1) {
+      return READ_ERROR;
+    }
+    bytes_read += sizeof(BucketHeader);
+    next_bucket_offset += sizeof(BucketHeader);
+    key = NULL;
+    if (version >= 2) {
+      res = ReadString(f, next_bucket_offset, &key);
+      if (res == READ_ERROR || res == MEM_ERR) {
+        return READ_ERROR;
+      }
+      bytes_read += res;
+      next_bucket_offset += res;
+    }
+
     // Read the bucket
-    res = fn(f, next_bucket_offset, &kv);
+    res = fn(f, next_bucket_offset, version, &kv.value);
     if (res == READ_ERROR || res == MEM_ERR) {
       if (res == MEM_ERR) {
         if (DEBUG) {
           printf("\t\t\tERROR: mem error arose while reading bucket\n");
         }
       }
+      FreeLogString(key);
       return READ_ERROR;
     }
     bytes_read += res;
-  
-    HTInsert(table, kv, &storage);
+
+    if (version >= 2) {
+      res = HTInsertStr(table, key, kv.value, &storage);
+      FreeLogString(key);  // The table keeps its own copy.
+    } else if (legacy_keys == NULL) {  // The value is the key.
+      res = HTInsertStr(table, kv.value, kv.value, &storage);
+    } else if (HTLookup(legacy_keys, bh.key, &storage) == 1) {
+      res = HTInsertStr(table, storage.value, kv.value, &storage);
+    } else {
+      if (DEBUG) {
+        printf("\t\t\tERROR: no filename for hash %lx\n", bh.key);
+      }
+      return READ_ERROR;
+    }
+    if (res == 0) {
+      return MEM_ERR;
+    }
     next_bucketrec_offset += sizeof(BucketRec);
   }
 
   return bytes_read;
 }
 
-static int32_t ReadStringBucket(FILE *f, uint32_t offset, HashTabKV *kv) {
-  if (fseek (f, offset, SEEK_SET) != 0) {
+static int32_t ReadString(FILE *f, uint32_t offset, char **str) {
+  if (StatsFseek(f, offset, SEEK_SET) != 0) {
     if (DEBUG) {
-      printf("\t\t\tERROR: could not fseek in ReadStringBucket\n");
+      printf("\t\t\tERROR: could not fseek in ReadString\n");
     }
     return READ_ERROR;
   }
-  if (DEBUG) {
-    printf("\t\t\tReading string bucket from offset %x\n", offset);
-  }
-  int32_t bytes_read = 0, num_attempts, res;
-  BucketHeader bh;
+  int32_t num_attempts, res;
   StringBucketHeader sh;
-  char *str;
-  if ((res = fread(&bh, sizeof(BucketHeader), 1, f)) != 1) {
+  if ((res = StatsFread(&sh, sizeof(StringBucketHeader), 1, f,
+                        STATS_IO_META)) != 1) {
     if (DEBUG) {
-      printf("\t\t\tERROR[%d]: could not fread (1) from offset %x "\
-             "in ReadStringBucket\n", res, offset);
+      printf("\t\t\tERROR:[%d] could not fread from offset %x "\
+             "in ReadString\n", res, offset);
     }
     return READ_ERROR;
   }
-  bytes_read += sizeof(BucketHeader);
-  if ((res = fread(&sh, sizeof(StringBucketHeader), 1, f)) != 1) {
-    if (DEBUG) {
-      printf("\t\t\tERROR:[%d] could not fread (2) from offset %x "\
-             "in ReadStringBucket\n", res, offset + sizeof(BucketHeader));
-    }
-    return READ_ERROR;
-  }
-  bytes_read += sizeof(StringBucketHeader);
 
-  // kv.value needs to be a pointer to a string
   num_attempts = NUMBER_ATTEMPTS;
-  ATTEMPT((str = malloc(sizeof(char) * (sh.len + 1))), NULL, num_attempts)
+  ATTEMPT((*str = CPMalloc(CP_ALLOC_FILEHANDLER, sizeof(char) * (sh.len + 1))),
+          NULL,
+          num_attempts)
   
-  if ((res = fread(str, sizeof(char) * sh.len, 1, f)) != 1) {
+  if (sh.len > 0 && (res = StatsFread(*str, sizeof(char) * sh.len, 1, f,
+                                      STATS_IO_META)) != 1) {
     if (DEBUG) {
-      printf("\t\t\tERROR[%d]: could not fread %d bytes from offset %x "\
-             "in ReadStringBucket\n", res, sh.len,
-             offset + sizeof(BucketHeader) + sizeof(StringBucketHeader));
+      printf("\t\t\tERROR[%d]: could not fread %d bytes from offset %zx "\
+             "in ReadString\n", res, sh.len,
+             offset + sizeof(StringBucketHeader));
     }
+    CPFree(CP_ALLOC_FILEHANDLER, *str, sizeof(char) * (sh.len + 1));
+    *str = NULL;
     return READ_ERROR;
   }
+  (*str)[sh.len] = '\0';
 
-  bytes_read += sizeof(char) * sh.len;
-  str[sh.len] = '\0';
-  kv->key = bh.key;
-  kv->value = str;
-
-  return bytes_read;
+  return sizeof(StringBucketHeader) + sizeof(char) * sh.len;
 }
 
-static int32_t ReadTreeBucket(FILE *f, uint32_t offset, HashTabKV *kv) {
-  if (fseek (f, offset, SEEK_SET) != 0) {
-    return READ_ERROR;
-  }
-
-  BucketHeader bh;
-  int32_t bytes_read = 0, res, num_attempts;
-  CpTreeNodePtr node;
-
-  if (fread(&bh, sizeof(BucketHeader), 1, f) != 1) {
-    return READ_ERROR;
+static int32_t ReadStringBucket(FILE *f,
+                                uint32_t offset,
+                                uint32_t version,
+                                HashTabVal_t *value) {
+  if (DEBUG) {
+    printf("\t\t\tReading string bucket from offset %x\n", offset);
   }
-  bytes_read += sizeof(BucketHeader);
-  
-  num_attempts = NUMBER_ATTEMPTS;
-  ATTEMPT((node = malloc(sizeof(CpTreeNode))), NULL, num_attempts)
-  if (DEBUG) { printf("Reading a tree bucket of key %x from %x\n", bh.key, ftell(f)); }
-  res = ReadTreeNode(f, offset + sizeof(BucketHeader), node);
+  char *str;
+  int32_t res = ReadString(f, offset, &str);
   if (res == READ_ERROR || res == MEM_ERR) {
-    return READ_ERROR;
+    return res;
   }
-  node->parent_node = NULL;  // root node
-  
-  bytes_read += res;
 
-  kv->key = bh.key;
-  kv->value = node;
-
-  return bytes_read;
+  // value needs to be a pointer to a string
+  *value = str;
+  return res;
 }
 
-static int32_t ReadTreeNode(FILE *f, uint32_t offset, CpTreeNodePtr curr_node) {
-  if (fseek(f, offset, SEEK_SET) != 0) {
+static int32_t ReadTreeBucket(FILE *f,
+                              uint32_t offset,
+                              uint32_t version,
+                              HashTabVal_t *value) {
+  int32_t res, times_len;
+  CpTreePtr tree = NULL;
+
+  if (DEBUG) { printf("Reading a tree bucket from %x\n", offset); }
+  res = ReadTree(f, offset, version, &tree);
+  if (res == READ_ERROR || res == MEM_ERR) {
+    FreeCpTree(tree);
     return READ_ERROR;
   }
+  if (version >= 4) {
+    times_len = ReadTreeTimes(f, offset + res, tree);
+    if (times_len == READ_ERROR || times_len == MEM_ERR) {
+      FreeCpTree(tree);
+      return READ_ERROR;
+    }
+    res += times_len;
+  }
 
-  int32_t bytes_read = 0, num_attempts, res;
+  *value = tree;
+  return res;
+}
+
+static int32_t ReadTree(FILE *f,
+                        uint32_t offset,
+                        uint32_t version,
+                        CpTreePtr *tree) {
+  int32_t bytes_read = 0, node_len, res = READ_SUCCESS;
+  uint32_t stack_size = 0, stack_capacity = INITIAL_TREE_CAPACITY;
+  uint32_t num_offsets = 0;
+  uint32_t *children_offsets = NULL;
+  TreeReadPos *stack, *new_stack, pos;
   FileTreeHeader header;
-  if (fread(&header, sizeof(FileTreeHeader), 1, f) != 1) {
-    return READ_ERROR;
-  }
-  bytes_read += sizeof(FileTreeHeader);
-  if (DEBUG) { printf("reading treenode with name length %d and %d children from %x\n", header.name_length, header.num_children, ftell(f)); }
-  num_attempts = NUMBER_ATTEMPTS;
-  ATTEMPT((curr_node->cpt_name = malloc(sizeof(char) * (header.name_length + 1))),
-          NULL,
-          num_attempts)
+  CpTreeHandle node;
 
-  if (fread(curr_node->cpt_name, sizeof(char) * header.name_length, 1, f) != 1) {
-    return READ_ERROR;
+  // The nodes still to be read. Instead of recursing into the children
+  // of a node, their positions are pushed here, so reading a deep tree
+  // takes heap memory (at most one entry per node) instead of stack.
+  stack = CPMalloc(CP_ALLOC_FILEHANDLER, sizeof(TreeReadPos) * stack_capacity);
+  if (stack == NULL) {
+    return MEM_ERR;
   }
-  curr_node->cpt_name[header.name_length] = '\0';
+  // The root node has no parent, and is the one to allocate the tree.
+  stack[stack_size++] = (TreeReadPos){offset, CPT_NULL_HANDLE};
 
-  num_attempts = NUMBER_ATTEMPTS;
-  ATTEMPT((curr_node->children = MakeLinkedList()), NULL, num_attempts)
-
-  if (header.num_children > 0) {
-    // Read children
-    res = ReadTreeChildren(f,
-                           offset + sizeof(FileTreeHeader) + header.name_length,
-                           header.num_children,
-                           curr_node);
+  while (stack_size > 0 && res == READ_SUCCESS) {
+    pos = stack[--stack_size];
+    res = ReadTreeNode(f, pos.offset, version, tree, pos.parent, &header, &node);
     if (res == READ_ERROR || res == MEM_ERR) {
-      if(DEBUG) { printf("error reading children\n"); }
-      return READ_ERROR;
+      break;
+    }
+    bytes_read += res;
+    node_len = res;
+    res = READ_SUCCESS;
+    if (header.num_children == 0) {
+      continue;
+    }
+
+    // The children offsets come right after the name.
+    if (header.num_children > num_offsets) {
+      CPFree(CP_ALLOC_FILEHANDLER, children_offsets,
+             sizeof(uint32_t) * num_offsets);
+      num_offsets = header.num_children;
+      children_offsets = CPMalloc(CP_ALLOC_FILEHANDLER,
+                                  sizeof(uint32_t) * num_offsets);
+      if (children_offsets == NULL) {
+        num_offsets = 0;
+        res = MEM_ERR;
+        break;
+      }
+    }
+    if (StatsFread(children_offsets,
+                   sizeof(uint32_t) * header.num_children, 1, f,
+                   STATS_IO_META) != 1) {
+      res = READ_ERROR;
+      break;
+    }
+    bytes_read += sizeof(uint32_t) * header.num_children;
+
+    if (stack_size + header.num_children > stack_capacity) {
+      uint32_t new_capacity = stack_capacity;
+      while (stack_size + header.num_children > new_capacity) {
+        new_capacity *= 2;
+      }
+      new_stack = CPRealloc(CP_ALLOC_FILEHANDLER, stack,
+                            sizeof(TreeReadPos) * stack_capacity,
+                            sizeof(TreeReadPos) * new_capacity);
+      if (new_stack == NULL) {
+        res = MEM_ERR;
+        break;
+      }
+      stack = new_stack;
+      stack_capacity = new_capacity;
+    }
+
+    // Inserting a node makes it the first child of its parent, so the
+    // children are pushed first to last, to be read last to first, which
+    // keeps the order they were written in.
+    uint32_t offsets_pos = pos.offset + node_len;
+    for (uint32_t i = 0; i < header.num_children; i++) {
+      // Each offset is relative to its own spot in the array of children
+      // offsets. View the header for a visual clarification.
+      stack[stack_size++] = (TreeReadPos){
+        offsets_pos + (sizeof(uint32_t) * i) + children_offsets[i],
+        node
+      };
     }
   }
 
+  CPFree(CP_ALLOC_FILEHANDLER, stack, sizeof(TreeReadPos) * stack_capacity);
+  CPFree(CP_ALLOC_FILEHANDLER, children_offsets,
+         sizeof(uint32_t) * num_offsets);
+  if (res == READ_ERROR || res == MEM_ERR) {
+    if (DEBUG) { printf("error[%d] reading tree\n", res); }
+    return res;
+  }
   return bytes_read;
 }
 
-static int32_t ReadTreeChildren(FILE *f,
-                                uint32_t offset,
-                                uint32_t num_children,
-                                CpTreeNodePtr parent) {
-  int32_t bytes_read = 0, res, num_attempts;
-  CpTreeNodePtr curr_child;
-  uint32_t children_offsets[num_children];
-  if (fseek(f, offset, SEEK_SET) != 0) {
+static int32_t ReadTreeTimes(FILE *f, uint32_t offset, CpTreePtr tree) {
+  size_t order_size = sizeof(CpTreeHandle) * tree->num_nodes;
+  CpTreeHandle *order;
+  int32_t res;
+
+  // Every node of a tree which was just read in is live.
+  if (StatsFseek(f, offset, SEEK_SET) != 0) {
     return READ_ERROR;
   }
-  if (fread(&children_offsets, sizeof(int32_t) * num_children, 1, f) != 1) {
+  if ((order = CPMalloc(CP_ALLOC_FILEHANDLER, order_size)) == NULL) {
+    return MEM_ERR;
+  }
+  if (StatsFread(order, order_size, 1, f, STATS_IO_META) != 1) {
+    CPFree(CP_ALLOC_FILEHANDLER, order, order_size);
     return READ_ERROR;
   }
-  bytes_read += sizeof(int32_t) * num_children;
+  res = SetCpTreeTimes(tree, order, tree->num_nodes);
+  CPFree(CP_ALLOC_FILEHANDLER, order, order_size);
+  if (res == MEM_ERR) {
+    return MEM_ERR;
+  }
+  if (res != CREATE_TREE_SUCCESS && DEBUG) {
+    printf("the time index at %x doesn't fit its tree\n", offset);
+  }
+  return order_size;
+}
 
-  for (int i = 0; i < num_children; i++) {
-    // Go to the next child offset
-    if (fseek(f, offset + children_offsets[i], SEEK_SET) != 0) {
-      return READ_ERROR;
-    }
-    if (DEBUG) { printf("reading child from %x\n", ftell(f)); }
-    num_attempts = NUMBER_ATTEMPTS;
-    ATTEMPT((curr_child = malloc(sizeof(CpTreeNode))), NULL, num_attempts)
-    num_attempts = NUMBER_ATTEMPTS;
-    ATTEMPT((curr_child->children = MakeLinkedList()), NULL, num_attempts)
+static int32_t ReadTreeNode(FILE *f,
+                            uint32_t offset,
+                            uint32_t version,
+                            CpTreePtr *tree,
+                            CpTreeHandle parent,
+                            FileTreeHeader *header,
+                            CpTreeHandle *node) {
+  if (StatsFseek(f, offset, SEEK_SET) != 0) {
+    return READ_ERROR;
+  }
 
-    res = ReadTreeNode(f, offset + children_offsets[i], curr_child);
-    if (res == READ_ERROR || res == MEM_ERR) {
-      return READ_ERROR;
-    }
-    bytes_read += res;
+  int32_t res;
+  char *cpt_name;
+  size_t name_size;
+  FileTreeStamp stamp = {0, 0};
+  time_t cpt_time;
+  off_t cpt_size;
+  if (StatsFread(header, sizeof(FileTreeHeader), 1, f, STATS_IO_META) != 1) {
+    return READ_ERROR;
+  }
+  if (version >= 3 &&
+      StatsFread(&stamp, sizeof(FileTreeStamp), 1, f, STATS_IO_META) != 1) {
+    return READ_ERROR;
+  }
+  if (DEBUG) { printf("reading treenode with name length %d and %d children from %x\n", header->name_length, header->num_children, offset); }
+  name_size = sizeof(char) * (header->name_length + 1);
+  if ((cpt_name = CPMalloc(CP_ALLOC_FILEHANDLER, name_size)) == NULL) {
+    return MEM_ERR;
+  }
 
-    curr_child->parent_node = parent;
-    LLAppend(parent->children, curr_child);
+  if (header->name_length > 0 &&
+      StatsFread(cpt_name, sizeof(char) * header->name_length, 1, f,
+                 STATS_IO_META) != 1) {
+    CPFree(CP_ALLOC_FILEHANDLER, cpt_name, name_size);
+    return READ_ERROR;
+  }
+  cpt_name[header->name_length] = '\0';
 
-    // The next "offset" is the next spot in the array of children offsets.
-    // View the header for a visual clarification, but in English - it's the
-    // next spot where we can find where the next child is.
-    offset += sizeof(int32_t);
+  // The tree copies the name into its own pool of names.
+  if (parent == CPT_NULL_HANDLE) {
+    res = CreateCpTree(cpt_name, tree) == CREATE_TREE_SUCCESS ?
+                                                INSERT_NODE_SUCCESS : MEM_ERR;
+    *node = CPT_ROOT_HANDLE;
+  } else {
+    res = InsertCpTreeNode(*tree, parent, cpt_name, node);
+  }
+  if (res == INSERT_NODE_SUCCESS && version < 3 &&
+      StatCheckpoint(cpt_name, &cpt_time, &cpt_size) == READ_SUCCESS) {
+    stamp.time = cpt_time;
+    stamp.size = cpt_size;
+  }
+  CPFree(CP_ALLOC_FILEHANDLER, cpt_name, name_size);
+  if (res != INSERT_NODE_SUCCESS) {
+    return res == MEM_ERR ? MEM_ERR : READ_ERROR;
   }
+  (*tree)->nodes[*node].time = stamp.time;
+  (*tree)->nodes[*node].size = stamp.size;
 
-  return bytes_read;
+  return sizeof(FileTreeHeader) + (version >= 3 ? sizeof(FileTreeStamp) : 0)
+       + header->name_length;
 }
 
 static void ZeroHeader(CpLogFileHeader *h) {
@@ -378,18 +846,19 @@ int32_t WriteCheckPointLog(CheckPointLogPtr cpt_log) {
   // These four size variables are used to store the
   // size of each hashtable when it has been written.
   int32_t offset = 0, src_name, src_cptname, cptname, dirtree;
+  uint64_t begin;
   // Before we advance, we will intentionally corrupt the header
   // so that if we crash while writing this file, nobody thinks
   // the file is valid.
   ZeroHeader(&header);
 
-  if (fseek(f, 0, SEEK_SET) != 0) {
+  if (StatsFseek(f, 0, SEEK_SET) != 0) {
     if (DEBUG) {
       printf("\tERROR: could not seek to beginning of file\n");
     }
     return FILE_WRITE_ERR;
   }
-  if (fwrite(&header, sizeof(CpLogFileHeader), 1, f) != 1) {
+  if (StatsFwrite(&header, sizeof(CpLogFileHeader), 1, f, STATS_IO_META) != 1) {
     if (DEBUG) {
       printf("\tERROR: could not write file header\n");
     }
@@ -397,30 +866,36 @@ int32_t WriteCheckPointLog(CheckPointLogPtr cpt_log) {
   }
   offset += sizeof(CpLogFileHeader);
 
+  begin = TraceBegin(TRACE_WRITE_TABLE);
   src_name = WriteHashTable(f,
                             cpt_log->src_filehash_to_filename,
                             offset,
                             &WriteStringBucket);
+  TraceEnd(TRACE_WRITE_TABLE, begin);
   CHECK_HASHTABLE_LENGTH(src_name, f)  // Checks for writing/mem error
   offset += src_name;
   if (DEBUG) {
     printf("\t\tWrote %d bytes for src_filehash_to_filename\n", src_name);
   }
 
+  begin = TraceBegin(TRACE_WRITE_TABLE);
   src_cptname = WriteHashTable(f,
                                cpt_log->src_filehash_to_cptname,
                                offset,
                                &WriteStringBucket);
+  TraceEnd(TRACE_WRITE_TABLE, begin);
   CHECK_HASHTABLE_LENGTH(src_cptname, f)   
   offset += src_cptname;
   if (DEBUG) {
     printf("\t\tWrote %d bytes for src_filehash_to_cptname\n", src_cptname);
   }
 
+  begin = TraceBegin(TRACE_WRITE_TABLE);
   cptname = WriteHashTable(f,
                            cpt_log->cpt_namehash_to_cptfilename,
                            offset,
                            &WriteStringBucket);
+  TraceEnd(TRACE_WRITE_TABLE, begin);
   CHECK_HASHTABLE_LENGTH(cptname, f);
   offset += cptname;   
   if (DEBUG) {
@@ -430,10 +905,12 @@ int32_t WriteCheckPointLog(CheckPointLogPtr cpt_log) {
   if (DEBUG) {
     printf("\t\tfinished writing (hash->name) hashtables\n");
   }
+  begin = TraceBegin(TRACE_WRITE_TABLE);
   dirtree = WriteHashTable(f,
                            cpt_log->dir_tree,
                            offset,
                            &WriteTreeBucket);
+  TraceEnd(TRACE_WRITE_TABLE, begin);
   CHECK_HASHTABLE_LENGTH(dirtree, f);
   offset += dirtree;
   if (DEBUG) {
@@ -450,10 +927,10 @@ int32_t WriteCheckPointLog(CheckPointLogPtr cpt_log) {
   header.cpt_namehash_to_cptfilename_size = cptname;
   header.dir_tree_size = dirtree;
 
-  if (fseek(f, 0, SEEK_SET) != 0) {
+  if (StatsFseek(f, 0, SEEK_SET) != 0) {
     return FILE_WRITE_ERR;
   }
-  if (fwrite(&header, sizeof(CpLogFileHeader), 1, f) != 1) {
+  if (StatsFwrite(&header, sizeof(CpLogFileHeader), 1, f, STATS_IO_META) != 1) {
     return FILE_WRITE_ERR;
   }              
 
@@ -465,19 +942,22 @@ static int32_t WriteHashTable(FILE *f,
                               HashTable table,
                               uint32_t offset,
                               write_bucket_fn fn) {
-  int32_t res;
+  int32_t res, key_len;
   BucketRecListHeader reclist_header = {HTSize(table)};
   BucketRec br;
+  BucketHeader bh;
   uint32_t next_bucket_rec_offset = offset + sizeof(BucketRecListHeader);
   uint32_t i, next_bucket_offset, num_attempts;
   HTIter it;
   HashTabKV kv;
+  const char *key;
 
   // Write the table header
-  if (fseek(f, offset, SEEK_SET) != 0) {
+  if (StatsFseek(f, offset, SEEK_SET) != 0) {
     return FILE_WRITE_ERR;
   }
-  if (fwrite(&reclist_header, sizeof(BucketRecListHeader), 1, f) != 1) {
+  if (StatsFwrite(&reclist_header, sizeof(BucketRecListHeader), 1, f,
+                  STATS_IO_META) != 1) {
     return FILE_WRITE_ERR;
   }
 
@@ -494,7 +974,7 @@ static int32_t WriteHashTable(FILE *f,
   ATTEMPT((it = MakeHTIter(table)), NULL, num_attempts)
   for (i = 0; i < reclist_header.num_bucket_recs; i ++) {
     num_attempts = 20;
-    if (HTIterKV(it, &kv) == 0) {
+    if (HTIterKV(it, &kv) == 0 || HTIterStrKey(it, &key) == 0) {
       DiscardHTIter(it);
       if (DEBUG) {
         printf("\tERROR: expected more values in ht\n");
@@ -502,8 +982,21 @@ static int32_t WriteHashTable(FILE *f,
       return FILE_WRITE_ERR;
     }
 
+    // Write the bucket header and key
+    bh.key = kv.key;
+    if (StatsFseek(f, next_bucket_offset, SEEK_SET) != 0 ||
+        StatsFwrite(&bh, sizeof(BucketHeader), 1, f, STATS_IO_META) != 1) {
+      DiscardHTIter(it);
+      return FILE_WRITE_ERR;
+    }
+    key_len = WriteString(f, next_bucket_offset + sizeof(BucketHeader), key);
+    if (key_len == FILE_WRITE_ERR) {
+      DiscardHTIter(it);
+      return FILE_WRITE_ERR;
+    }
+
     // Write bucket
-    res = fn(f, next_bucket_offset, kv);
+    res = fn(f, next_bucket_offset + sizeof(BucketHeader) + key_len, kv.value);
 
     if (res == FILE_WRITE_ERR || res == MEM_ERR) {
       DiscardHTIter(it);
@@ -511,19 +1004,19 @@ static int32_t WriteHashTable(FILE *f,
     }
 
     // store the size and location of bucket
-    br.bucket_size = res;
+    br.bucket_size = sizeof(BucketHeader) + key_len + res;
     br.bucket_pos = next_bucket_offset;
-    next_bucket_offset += res;
+    next_bucket_offset += br.bucket_size;
 
     // Write bucket_rec
-    if (fseek(f, next_bucket_rec_offset, SEEK_SET) != 0) {
+    if (StatsFseek(f, next_bucket_rec_offset, SEEK_SET) != 0) {
       DiscardHTIter(it);
       if (DEBUG) {
         printf("\tERROR: fseek failed in WriteHashTable\n");
       }
       return FILE_WRITE_ERR;
     }
-    if (fwrite(&br, sizeof(BucketRec), 1, f) != 1) {
+    if (StatsFwrite(&br, sizeof(BucketRec), 1, f, STATS_IO_META) != 1) {
       DiscardHTIter(it);
       if (DEBUG) {
         printf("\tERROR: fwrite failed in WriteHashTable\n");
@@ -537,170 +1030,226 @@ static int32_t WriteHashTable(FILE *f,
   return next_bucket_offset - offset;
 }
 
-static int32_t WriteStringBucket(FILE *f, uint32_t offset, HashTabKV kv) {
-  if (fseek(f, offset, SEEK_SET) != 0) {
+static int32_t WriteString(FILE *f, uint32_t offset, const char *str) {
+  if (StatsFseek(f, offset, SEEK_SET) != 0) {
     return FILE_WRITE_ERR;
   }
 
-  int32_t len = strlen(kv.value);  // kv value should be pointer to heap string
-  BucketHeader bh = {kv.key};
-  
+  int32_t len = strlen(str);
   StringBucketHeader sh = {len};
-  if (fwrite(&bh, sizeof(bh), 1, f) != 1) {  // write bucket header
-    return FILE_WRITE_ERR;
-  }
-  if (fwrite(&sh, sizeof(StringBucketHeader), 1, f) != 1) {  // write size of str
+  // write size of str
+  if (StatsFwrite(&sh, sizeof(StringBucketHeader), 1, f, STATS_IO_META) != 1) {
     return FILE_WRITE_ERR;
   }
-  if (fwrite(kv.value, len, 1, f) != 1) {  // write string itself
+  // write string itself
+  if (len > 0 && StatsFwrite(str, len, 1, f, STATS_IO_META) != 1) {
     return FILE_WRITE_ERR;
   }
 
-  return sizeof(BucketHeader) + sizeof(StringBucketHeader) + len;
+  return sizeof(StringBucketHeader) + len;
+}
+
+static int32_t WriteStringBucket(FILE *f, uint32_t offset, HashTabVal_t value) {
+  // value should be pointer to heap string
+  return WriteString(f, offset, value);
 }
 
-static int32_t WriteTreeBucket(FILE *f, uint32_t offset, HashTabKV kv) {
-  CpTreeNodePtr curr_node = kv.value;
-  if (curr_node == NULL) {
+static int32_t WriteTreeBucket(FILE *f, uint32_t offset, HashTabVal_t value) {
+  CpTreePtr tree = value;
+  if (tree == NULL || tree->num_nodes == 0) {
     return 0;
   }
 
-  // Before we do anything, let's write the bucket header
-  // (which is just a key) and increment the offset.
-  BucketHeader bh = {kv.key};
-  if (fseek(f, offset, SEEK_SET) != 0) {
+  if (DEBUG) { printf("writing treebucket at %x\n", offset); }
+  int32_t res = WriteTree(f, offset, tree, CPT_ROOT_HANDLE);
+  if (res == FILE_WRITE_ERR || res == MEM_ERR) {
+    return FILE_WRITE_ERR;
+  }
+  int32_t times_len = WriteTreeTimes(f, tree);
+  if (times_len == FILE_WRITE_ERR || times_len == MEM_ERR) {
+    return FILE_WRITE_ERR;
+  }
+  return res + times_len;
+}
+
+static int32_t WriteTree(FILE *f,
+                         uint32_t offset,
+                         CpTreePtr tree,
+                         CpTreeHandle curr_node) {
+  TreeWriteState state = {f, NULL, offset};
+  size_t sizes_size = sizeof(uint32_t) * tree->num_nodes;
+  int32_t res;
+
+  if ((state.sizes = CPMalloc(CP_ALLOC_FILEHANDLER, sizes_size)) == NULL) {
+    return MEM_ERR;
+  }
+
+  // A node's children offsets depend on the size of each of its
+  // children's subtrees, so first work out the size of every subtree
+  // (children before parents)...
+  res = CpTreePostorder(tree, curr_node, &SizeTreeNode, &state);
+  if (res != CPT_WALK_DONE) {
+    CPFree(CP_ALLOC_FILEHANDLER, state.sizes, sizes_size);
+    return FILE_WRITE_ERR;
+  }
+
+  // ...then write every node (parents before children). Since that is
+  // the order the nodes are laid out in, every write carries on where
+  // the last one left off.
+  if (StatsFseek(f, offset, SEEK_SET) != 0) {
     if (DEBUG) {
-      printf("\t\tERROR: could not fseek to offset %d in WriteTreeBucket\n",
-             offset);
+      printf("\t\t\tERROR: could not fseek to offset %d in WriteTree\n", offset);
     }
+    CPFree(CP_ALLOC_FILEHANDLER, state.sizes, sizes_size);
     return FILE_WRITE_ERR;
   }
-  if (DEBUG) { printf("writing treebucket at %x\n", ftell(f)); }
-  if (fwrite(&bh, sizeof(BucketHeader), 1, f) != 1) {
+  res = CpTreePreorder(tree, curr_node, &WriteTreeNode, &state);
+  if (res != CPT_WALK_DONE) {
     if (DEBUG) {
-      printf("\t\tERROR: could not write header in WriteTreeBucket\n");
+      printf("\t\t\tERROR[%d]: while writing tree\n", res);
     }
+    CPFree(CP_ALLOC_FILEHANDLER, state.sizes, sizes_size);
     return FILE_WRITE_ERR;
   }
-  offset += sizeof(BucketHeader);
 
-  int32_t res = WriteTree(f, offset, curr_node);
-  if (res == FILE_WRITE_ERR || res == MEM_ERR) {
-    return FILE_WRITE_ERR;
-  }
-  return sizeof(BucketHeader) + res;
+  // The total amount written for this tree is the amount
+  // written for the current node plus the amount written
+  // for the current nodes children.
+  res = state.sizes[curr_node];
+  CPFree(CP_ALLOC_FILEHANDLER, state.sizes, sizes_size);
+  return res;
 }
 
-static int32_t WriteTree(FILE *f, uint32_t offset, CpTreeNodePtr curr_node) {
-  int32_t child_bytes_written = 0, name_len, num_children, self_content_length;
+static int32_t WriteTreeTimes(FILE *f, CpTreePtr tree) {
+  size_t handles_size = sizeof(CpTreeHandle) * tree->num_nodes;
+  CpTreeHandle *read_as, *stack, node;
+  CPSize_t first, end, stack_size = 0, num_read = 0;
   int32_t res;
-  name_len     = strlen(curr_node->cpt_name) + 1;
-  num_children = LLSize(curr_node->children);
-
-  uint32_t children_offsets[num_children];
 
-  self_content_length = (sizeof(uint32_t) * (2 + num_children))
-                      + (sizeof(char)  * name_len);
+  if (FindCptsInTimeRange(tree, INT64_MIN, INT64_MAX, &first, &end)
+      == MEM_ERR) {
+    return MEM_ERR;
+  }
+  read_as = CPMalloc(CP_ALLOC_FILEHANDLER, handles_size);
+  stack = CPMalloc(CP_ALLOC_FILEHANDLER, handles_size);
+  if (read_as == NULL || stack == NULL) {
+    CPFree(CP_ALLOC_FILEHANDLER, read_as, handles_size);
+    CPFree(CP_ALLOC_FILEHANDLER, stack, handles_size);
+    return MEM_ERR;
+  }
 
-  res = WriteChildren(curr_node,
-                      &children_offsets,
-                      offset + self_content_length,
-                      f);
-  if (res == FILE_WRITE_ERR || res == MEM_ERR) {
-    if (DEBUG) {
-      printf("\t\t\tERROR[%d]: while writing children\n", res);
+  // Walk the tree the way ReadTree does, which hands out handles in the
+  // order it reads the nodes: parents before children, and the children
+  // of a node last to first.
+  stack[stack_size++] = CPT_ROOT_HANDLE;
+  while (stack_size > 0) {
+    node = stack[--stack_size];
+    read_as[node] = num_read++;
+    for (CpTreeHandle child = tree->nodes[node].first_child;
+         child != CPT_NULL_HANDLE;
+         child = tree->nodes[child].next_sibling) {
+      stack[stack_size++] = child;
     }
-    return FILE_WRITE_ERR;
   }
-  child_bytes_written = res;
 
-  // Write self:
-  if (fseek(f, offset, SEEK_SET) != 0) {
+  // The stack is done with, so the entries are put together in it.
+  for (CPSize_t i = 0; i < tree->num_by_time; i++) {
+    stack[i] = read_as[tree->by_time[i].handle];
+  }
+  res = sizeof(CpTreeHandle) * tree->num_by_time;
+  if (StatsFwrite(stack, res, 1, f, STATS_IO_META) != 1) {
     if (DEBUG) {
-      printf("\t\t\tERROR: could not fseek to offset %d in WriteTree\n", offset);
+      printf("\t\t\tERROR: could not write the time index in WriteTreeTimes\n");
     }
-    return FILE_WRITE_ERR;
+    res = FILE_WRITE_ERR;
+  }
+  CPFree(CP_ALLOC_FILEHANDLER, read_as, handles_size);
+  CPFree(CP_ALLOC_FILEHANDLER, stack, handles_size);
+  return res;
+}
+
+static int32_t SizeTreeNode(CpTreePtr tree, CpTreeHandle node, void *state) {
+  uint32_t *sizes = ((TreeWriteState *)state)->sizes;
+  uint32_t num_children = 0, size = 0;
+
+  // The children have all been visited already.
+  for (CpTreeHandle child = tree->nodes[node].first_child;
+       child != CPT_NULL_HANDLE;
+       child = tree->nodes[child].next_sibling) {
+    num_children++;
+    size += sizes[child];
   }
 
-  // Unfortunately, we have to do two (often three) writes since
-  // name and children_offsets are variable length
-  FileTreeHeader header = {name_len, num_children};
+  sizes[node] = size + sizeof(FileTreeHeader) + sizeof(FileTreeStamp)
+              + (sizeof(char) * (strlen(CPT_NAME(tree, node)) + 1))
+              + (sizeof(uint32_t) * num_children);
+  return CPT_VISIT_CONTINUE;
+}
+
+static int32_t WriteTreeNode(CpTreePtr tree, CpTreeHandle node, void *state) {
+  TreeWriteState *ws = state;
+  char *cpt_name = CPT_NAME(tree, node);
+  FileTreeHeader header = {strlen(cpt_name) + 1, CpTreeNumChildren(tree, node)};
+  FileTreeStamp stamp = {tree->nodes[node].time, tree->nodes[node].size};
+
+  if (DEBUG) { printf("\t\t\twriting node %s at %x\n", cpt_name, ws->offset); }
 
   // Write the bookkeeping information.
-  if (fwrite(&header, sizeof(FileTreeHeader), 1, f) != 1) {
+  if (StatsFwrite(&header, sizeof(FileTreeHeader), 1, ws->f,
+                  STATS_IO_META) != 1) {
     if (DEBUG) {
       printf("\t\t\tERROR: could not write header in WriteTree\n");
     }
     return FILE_WRITE_ERR;
   }
-  // Write the name field.
-  if (fwrite(curr_node->cpt_name, sizeof(char) * name_len, 1, f) != 1) {
+  if (StatsFwrite(&stamp, sizeof(FileTreeStamp), 1, ws->f,
+                  STATS_IO_META) != 1) {
     if (DEBUG) {
-      printf("\t\t\tERROR: could not write cpt name in WriteTree\n");
+      printf("\t\t\tERROR: could not write stamp in WriteTree\n");
     }
     return FILE_WRITE_ERR;
   }
-  if (num_children > 0) {
-    // If we have any children, write their offsets.
-    if (fwrite(children_offsets, sizeof(uint32_t) * num_children, 1, f) != 1) {
-      if (DEBUG) {
-        printf("\t\t\tERROR: writing children in WriteTree\n");
-      }
-      return FILE_WRITE_ERR;
-    }
-  }
-
-  // The total amount written for this tree is the amount
-  // written for the current node plus the amount written
-  // for the current nodes children.
-  return self_content_length + child_bytes_written;
-}
-
-static int32_t WriteChildren(CpTreeNodePtr curr_node,
-                             uint32_t *children_offsets,
-                             uint32_t offset,
-                             FILE *f) {
-  if (curr_node == NULL || curr_node->children == NULL) {
+  // Write the name field.
+  if (StatsFwrite(cpt_name, sizeof(char) * header.name_length, 1, ws->f,
+                  STATS_IO_META) != 1) {
     if (DEBUG) {
-      printf("\t\t\tskipping null node/children\n");
+      printf("\t\t\tERROR: could not write cpt name in WriteTree\n");
     }
-    return 0;
-  }
-  LLIter it;
-  uint32_t res,
-           child_bytes_written = 0,
-           num_attempts = 20,
-           num_children = LLSize(curr_node->children);
-  if (num_children == 0) {
-    return 0;
+    return FILE_WRITE_ERR;
   }
-  ATTEMPT((it = LLGetIter(curr_node->children, 0)), NULL, num_attempts)
-  if (DEBUG) { printf("\t\t\twriting Child %s\n", curr_node->cpt_name);  }
-  CpTreeNodePtr curr_child;
-  for (uint32_t i = 0; i < num_children; i++) {
-    children_offsets[i] = ((num_children - (i)) * sizeof(u_int32_t)) + child_bytes_written;
-    LLIterPayload(it, &curr_child);
 
-    res = WriteTree(f, offset + child_bytes_written, curr_child);
-
-    if (res == FILE_WRITE_ERR || res == MEM_ERR) {  // Something went wrong writing the child.
-      LLIterFree(it);
+  // Write the children offsets. Each one is relative to its own spot in
+  // the array, and the children's subtrees come right after the array,
+  // one after the other.
+  uint32_t offsets_pos = ws->offset + sizeof(FileTreeHeader)
+                       + sizeof(FileTreeStamp) + header.name_length;
+  uint32_t child_pos = offsets_pos + (sizeof(uint32_t) * header.num_children);
+  uint32_t i = 0;
+  for (CpTreeHandle child = tree->nodes[node].first_child;
+       child != CPT_NULL_HANDLE;
+       child = tree->nodes[child].next_sibling, i++) {
+    uint32_t child_offset = child_pos - (offsets_pos + (sizeof(uint32_t) * i));
+    if (StatsFwrite(&child_offset, sizeof(uint32_t), 1, ws->f,
+                    STATS_IO_META) != 1) {
       if (DEBUG) {
-        printf("\t\t\tERROR[%d]: could not write child in WriteChildren\n");
+        printf("\t\t\tERROR: writing children in WriteTree\n");
       }
       return FILE_WRITE_ERR;
     }
-
-    child_bytes_written += res;
-    LLIterAdvance(it);
+    child_pos += ws->sizes[child];
   }
-  LLIterFree(it);
 
-  return child_bytes_written;
+  ws->offset = offsets_pos + (sizeof(uint32_t) * header.num_children);
+  return CPT_VISIT_CONTINUE;
 }
 
 int32_t WriteSrcCheckpoint(char *src_filename, char *cpt_name, bool dir) {
   FILE *cpt_file, *src_file;
+  int32_t res;
+  uint64_t begin;
+  double copy_seconds;
+  Progress progress;
+  struct stat st;
   size_t dir_len = strlen(WORKING_DIR), name_len = strlen(cpt_name);
   char cpt_filename[dir_len + name_len + 2];
   strcpy(cpt_filename, WORKING_DIR);
@@ -719,25 +1268,305 @@ int32_t WriteSrcCheckpoint(char *src_filename, char *cpt_name, bool dir) {
     fprintf(stderr,
             "\tERROR opening file %s.\n\tProgram will now be aborted.\n",
             src_filename);
+    fclose(cpt_file);
     return -2;
   }
 
-  return dir ? WriteAToB(src_file, cpt_file) : WriteAToB(cpt_file, src_file);
+  // Both files are closed here (and so flushed), since the new file may
+  // be read again before the program exits (e.g. to index it).
+  copy_seconds = StatsTimerSeconds(STATS_TIMER_COPY);
+  StatsStartTimer(STATS_TIMER_COPY);
+  begin = TraceBegin(TRACE_COPY);
+  ProgressBegin(&progress, dir ? "checkpoint" : "restore", src_filename,
+                "stdio", PROGRESS_UNIT_BYTES,
+                stat(dir ? src_filename : cpt_filename, &st) == 0 ?
+                st.st_size : 0);
+  res = dir ? WriteAToB(src_file, cpt_file, &progress) :
+              WriteAToB(cpt_file, src_file, &progress);
+  ProgressEnd(&progress);
+  if (fclose(src_file) != 0 && !dir) {
+    res = FILE_WRITE_ERR;
+  }
+  if (fclose(cpt_file) != 0 && dir) {
+    res = FILE_WRITE_ERR;
+  }
+  TraceEnd(TRACE_COPY, begin);
+  StatsStopTimer(STATS_TIMER_COPY);
+  MetricsObserve(METRICS_HIST_COPY,
+                 StatsTimerSeconds(STATS_TIMER_COPY) - copy_seconds);
+  MetricsAdd(METRICS_COUNTER_COPY_BYTES, progress.done);
+  return res;
+}
+
+int32_t StatCheckpoint(char *cpt_filename, time_t *time, off_t *size) {
+  size_t dir_len = strlen(WORKING_DIR), name_len = strlen(cpt_filename);
+  char path[dir_len + name_len + 2];
+  struct stat st;
+
+  strcpy(path, WORKING_DIR);
+  path[dir_len] = '/';
+  strcpy(path + dir_len + 1, cpt_filename);
+
+  if (stat(path, &st) != 0) {
+    if (DEBUG) {
+      printf("\tERROR: could not stat checkpoint file %s\n", path);
+    }
+    return READ_ERROR;
+  }
+
+  *time = st.st_mtime;
+  *size = st.st_size;
+  return READ_SUCCESS;
+}
+
+int32_t WriteCheckpoint(char *cpt_filename, const char *data, size_t len) {
+  size_t dir_len = strlen(WORKING_DIR), name_len = strlen(cpt_filename);
+  char path[dir_len + name_len + 2];
+  FILE *cpt_file;
+  int32_t res = FILE_WRITE_SUCCESS;
+  uint64_t begin;
+
+  strcpy(path, WORKING_DIR);
+  path[dir_len] = '/';
+  strcpy(path + dir_len + 1, cpt_filename);
+
+  if ((cpt_file = fopen(path, "wb")) == NULL) {
+    fprintf(stderr, "\tERROR opening file %s.\n", path);
+    return FILE_WRITE_ERR;
+  }
+  StatsStartTimer(STATS_TIMER_COPY);
+  begin = TraceBegin(TRACE_COPY);
+  if (len > 0 && StatsFwrite(data, 1, len, cpt_file, STATS_IO_DATA) != len) {
+    res = FILE_WRITE_ERR;
+  }
+  if (fclose(cpt_file) != 0) {
+    res = FILE_WRITE_ERR;
+  }
+  TraceEnd(TRACE_COPY, begin);
+  StatsStopTimer(STATS_TIMER_COPY);
+  return res;
+}
+
+int32_t RemoveCheckpoint(char *cpt_filename) {
+  size_t dir_len = strlen(WORKING_DIR), name_len = strlen(cpt_filename);
+  char path[dir_len + name_len + 2];
+
+  strcpy(path, WORKING_DIR);
+  path[dir_len] = '/';
+  strcpy(path + dir_len + 1, cpt_filename);
+
+  if (unlink(path) != 0) {
+    if (DEBUG) {
+      printf("\tERROR: could not remove checkpoint file %s\n", path);
+    }
+    return FILE_WRITE_ERR;
+  }
+  return FILE_WRITE_SUCCESS;
+}
+
+static int32_t MakeLineMapHeader(char *parent_cpt,
+                                 char *child_cpt,
+                                 LineMapHeader *header) {
+  time_t parent_time, child_time;
+  off_t parent_size, child_size;
+
+  if (StatCheckpoint(parent_cpt, &parent_time, &parent_size) != READ_SUCCESS ||
+      StatCheckpoint(child_cpt, &child_time, &child_size) != READ_SUCCESS) {
+    return READ_ERROR;
+  }
+
+  memset(header, 0, sizeof(LineMapHeader));
+  header->magic_number = LINE_MAP_MAGIC;
+  header->parent_size = parent_size;
+  header->parent_time = parent_time;
+  header->child_size = child_size;
+  header->child_time = child_time;
+  header->parent_name_len = strlen(parent_cpt);
+  return READ_SUCCESS;
+}
+
+int32_t ReadLineMap(char *parent_cpt, char *child_cpt, LineMapPtr ret) {
+  size_t dir_len = strlen(LINE_MAP_DIR), name_len = strlen(child_cpt);
+  char path[dir_len + name_len + 2];
+  LineMapHeader expected, header;
+  FILE *f;
+
+  if (MakeLineMapHeader(parent_cpt, child_cpt, &expected) != READ_SUCCESS) {
+    return READ_ERROR;
+  }
+
+  strcpy(path, LINE_MAP_DIR);
+  path[dir_len] = '/';
+  strcpy(path + dir_len + 1, child_cpt);
+  if ((f = fopen(path, "rb")) == NULL) {
+    return READ_ERROR;
+  }
+
+  // Everything but the line counts and changes has to match.
+  char parent_name[expected.parent_name_len];
+  if (StatsFread(&header, sizeof(LineMapHeader), 1, f, STATS_IO_META) != 1 ||
+      header.magic_number != expected.magic_number ||
+      header.parent_size != expected.parent_size ||
+      header.parent_time != expected.parent_time ||
+      header.child_size != expected.child_size ||
+      header.child_time != expected.child_time ||
+      header.parent_name_len != expected.parent_name_len ||
+      StatsFread(parent_name, sizeof(char), header.parent_name_len, f,
+                 STATS_IO_META) != header.parent_name_len ||
+      memcmp(parent_name, parent_cpt, header.parent_name_len) != 0) {
+    if (DEBUG) {
+      printf("\tline map of %s is missing or stale\n", child_cpt);
+    }
+    fclose(f);
+    return READ_ERROR;
+  }
+
+  ret->a_lines = header.a_lines;
+  ret->b_lines = header.b_lines;
+  ret->num_changes = header.num_changes;
+  if ((ret->changes = malloc(sizeof(DiffChange) * (header.num_changes + 1))) == NULL) {
+    fclose(f);
+    return MEM_ERR;
+  }
+  if (StatsFread(ret->changes, sizeof(DiffChange), header.num_changes, f,
+                 STATS_IO_META) != header.num_changes) {
+    FreeLineMap(ret);
+    fclose(f);
+    return READ_ERROR;
+  }
+
+  fclose(f);
+  return READ_SUCCESS;
+}
+
+int32_t WriteLineMap(char *parent_cpt, char *child_cpt, LineMapPtr map) {
+  size_t dir_len = strlen(LINE_MAP_DIR), name_len = strlen(child_cpt);
+  char path[dir_len + name_len + 2];
+  LineMapHeader header;
+  FILE *f;
+
+  if (MakeLineMapHeader(parent_cpt, child_cpt, &header) != READ_SUCCESS) {
+    return FILE_WRITE_ERR;
+  }
+  header.a_lines = map->a_lines;
+  header.b_lines = map->b_lines;
+  header.num_changes = map->num_changes;
+
+  // The cache dir is only made once something is cached.
+  if (mkdir(LINE_MAP_DIR, S_IRWXU) != 0 && errno != EEXIST) {
+    return FILE_WRITE_ERR;
+  }
+  strcpy(path, LINE_MAP_DIR);
+  path[dir_len] = '/';
+  strcpy(path + dir_len + 1, child_cpt);
+  if ((f = fopen(path, "wb")) == NULL) {
+    return FILE_WRITE_ERR;
+  }
+
+  if (StatsFwrite(&header, sizeof(LineMapHeader), 1, f, STATS_IO_META) != 1 ||
+      StatsFwrite(parent_cpt, sizeof(char), header.parent_name_len, f,
+                  STATS_IO_META) != header.parent_name_len ||
+      StatsFwrite(map->changes, sizeof(DiffChange), map->num_changes, f,
+                  STATS_IO_META) != map->num_changes) {
+    fclose(f);
+    unlink(path);  // better no map than half of one
+    return FILE_WRITE_ERR;
+  }
+
+  if (fclose(f) != 0) {
+    unlink(path);
+    return FILE_WRITE_ERR;
+  }
+  return FILE_WRITE_SUCCESS;
+}
+
+void RemoveLineMap(char *child_cpt) {
+  size_t dir_len = strlen(LINE_MAP_DIR), name_len = strlen(child_cpt);
+  char path[dir_len + name_len + 2];
+
+  strcpy(path, LINE_MAP_DIR);
+  path[dir_len] = '/';
+  strcpy(path + dir_len + 1, child_cpt);
+  unlink(path);
+}
+
+int32_t MapFile(char *filename, bool cpt, MappedFile *ret) {
+  size_t dir_len = cpt ? strlen(WORKING_DIR) + 1 : 0, name_len = strlen(filename);
+  char path[dir_len + name_len + 1];
+  struct stat st;
+  void *data;
+  int fd;
+
+  if (cpt) {
+    strcpy(path, WORKING_DIR);
+    path[dir_len - 1] = '/';
+  }
+  strcpy(path + dir_len, filename);
+
+  if ((fd = open(path, O_RDONLY)) == -1) {
+    fprintf(stderr, "\tERROR opening file %s.\n", path);
+    return READ_ERROR;
+  }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return READ_ERROR;
+  }
+
+  // An empty file can't be mapped, but there is nothing to read anyway.
+  ret->data = NULL;
+  ret->len = st.st_size;
+  StatsCountBytes(STATS_IO_DATA, ret->len, 0);
+  if (ret->len > 0) {
+    data = mmap(NULL, ret->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      fprintf(stderr, "\tERROR mapping file %s.\n", path);
+      return READ_ERROR;
+    }
+    ret->data = data;
+  }
+
+  close(fd);  // the mapping stays valid without it
+  return READ_SUCCESS;
+}
+
+void UnmapFile(MappedFile *file) {
+  if (file->data != NULL) {
+    munmap((void *)file->data, file->len);
+  }
+  file->data = NULL;
+  file->len = 0;
+}
+
+int32_t WriteSrcFile(char *src_filename, const char *data, size_t len) {
+  FILE *src_file;
+
+  if ((src_file = fopen(src_filename, "wb")) == NULL) {
+    fprintf(stderr, "\tERROR opening file %s.\n", src_filename);
+    return FILE_WRITE_ERR;
+  }
+  if (len > 0 && StatsFwrite(data, 1, len, src_file, STATS_IO_DATA) != len) {
+    fclose(src_file);
+    return FILE_WRITE_ERR;
+  }
+  return fclose(src_file) == 0 ? FILE_WRITE_SUCCESS : FILE_WRITE_ERR;
 }
 
-static int32_t WriteAToB(FILE *a, FILE *b) {
+static int32_t WriteAToB(FILE *a, FILE *b, ProgressPtr progress) {
   char buffer[1024];
   size_t bytes;
 
-  if (fseek(a, 0, SEEK_SET) != 0) {
+  if (StatsFseek(a, 0, SEEK_SET) != 0) {
     return FILE_WRITE_ERR;
   }
-  if (fseek(b, 0, SEEK_SET) != 0) {
+  if (StatsFseek(b, 0, SEEK_SET) != 0) {
     return FILE_WRITE_ERR;
   }
   
-  while (0 < (bytes = fread(buffer, 1, sizeof(buffer), a))) {
-      fwrite(buffer, 1, bytes, b);
+  while (0 < (bytes = StatsFread(buffer, 1, sizeof(buffer), a,
+                                 STATS_IO_DATA))) {
+      StatsFwrite(buffer, 1, bytes, b, STATS_IO_DATA);
+      ProgressAdd(progress, bytes);
   }
 
   return FILE_WRITE_SUCCESS;
@@ -7,16 +7,33 @@
 // every struct used in the entire program.
 
 #include "DataStructs/HashTable.h"
+#include "checkpoint_diff.h"
+#include "checkpoint_progress.h"
 #include "checkpoint_tree.h"
 
 #include <search.h>
 #include <dirent.h>
 #include <errno.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
-
-#define MAGIC_NUMBER 0xCAFEF00D
+#include <sys/types.h>
+#include <time.h>
+
+// The magic number identifies the version of the log file format.
+// Version 1 logs only stored the hash of each bucket's key, while
+// version 2 logs store the key itself after the hash. Version 3 logs
+// also store when each checkpoint was made, and its size. Version 4 logs
+// also store each tree's checkpoints in the order they were made.
+#define MAGIC_NUMBER 0xCAFEF010
+#define MAGIC_NUMBER_V3 0xCAFEF00F
+#define MAGIC_NUMBER_V2 0xCAFEF00E
+#define MAGIC_NUMBER_V1 0xCAFEF00D
+#define CP_LOG_VERSION 4
 
 // THIS VALUE MUST BE NEGATIVE
+// Identifies a file holding a cached LineMap.
+#define LINE_MAP_MAGIC 0xB1A3E001
+
 #define FILE_WRITE_ERR -1
 #define FILE_WRITE_SUCCESS 0
 
@@ -24,30 +41,33 @@
   if (x == MEM_ERR || x == FILE_WRITE_ERR) {\
     fclose(f);\
     return FILE_WRITE_ERR;\
- }
+ }
 
 #pragma pack(push,1)
 
-// WriteHashTable takes a function which will write all the
-// buckets in the given table to a file. Since there are two
+// WriteHashTable takes a function which will write the value of
+// each bucket in the given table to a file. Since there are two
 // types of HashTables, the function needs to be a parameter.
 typedef int32_t (*write_bucket_fn)(FILE *f,
                                    uint32_t offset,
-                                   HashTabKV kv);
+                                   HashTabVal_t value);
 typedef int32_t (*read_bucket_fn)(FILE *f,
                                   uint32_t offset,
-                                  HashTabKV *kv);
+                                  uint32_t version,
+                                  HashTabVal_t *value);
 
 // This is a struct which will hold pointers to all the data structs
-// required to maintain this VC system.
+// required to maintain this VC system. All four tables are string
+// keyed, so two names can never be mistaken for each other just
+// because their hashes collide.
 typedef struct checkpoint_log {
-  // Key: the hash of a source filename.
+  // Key: a source filename.
   // Value: a pointer to a string on the heap (the filename).
   HashTable src_filehash_to_filename;
-  // Key: the hash of a source filename
+  // Key: a source filename
   // Value: a pointer to a string on the heap (the current cp of the file)
   HashTable src_filehash_to_cptname;
-  // Key: the hash of a checkpoint filename (note that the filename
+  // Key: a checkpoint filename (note that the filename
   //      should be IDENTICAL to the checkpoint name)
   // Value: a pointer to the heap which contains the name of the
   //        checkpoint file (i.e. the stored difference)
@@ -55,8 +75,8 @@ typedef struct checkpoint_log {
 
   // This table is by far the most complex. It keeps track
   // of all the checkpoint trees for the entire directory.
-  // Key: the hash of a source filename.
-  // Value: a pointer to a CpTreeNode on the heap.
+  // Key: a source filename.
+  // Value: a pointer to a CpTree on the heap.
   HashTable dir_tree;
 } CheckPointLog, *CheckPointLogPtr;
 
@@ -88,9 +108,10 @@ typedef struct bucket_rec {
 } BucketRec;
 
 // This struct should be written at the 
-// beginning of every bucket.
+// beginning of every bucket. Since version 2, it is followed
+// by a StringBucketHeader and the key itself.
 typedef struct bucket_header {
-  // Used while rehashing.
+  // The hash of the key.
   uint64_t key;
 } BucketHeader;
 
@@ -107,6 +128,49 @@ typedef struct file_tree_header {
   uint32_t num_children;
 } FileTreeHeader;
 
+// Since version 3, written between a node's FileTreeHeader and its name.
+typedef struct file_tree_stamp {
+  int64_t  time;
+  uint64_t size;
+} FileTreeStamp;
+
+// A tree node which is still to be read: where it was written, and the
+// node it is a child of.
+typedef struct tree_read_pos {
+  uint32_t     offset;
+  CpTreeHandle parent;
+} TreeReadPos;
+
+// What WriteTree's visitors share while writing a tree.
+typedef struct tree_write_state {
+  FILE     *f;
+  uint32_t *sizes;   // the number of bytes of the subtree rooted at each node
+  uint32_t  offset;  // where the next node is to be written
+} TreeWriteState;
+
+// Written at the start of a cached LineMap, which is followed by the
+// name of the parent's checkpoint file (without a null terminator), and
+// then the changes. The map is only used if the parent's name, and the
+// size and time of both checkpoint files, are still what they were when
+// it was made.
+typedef struct line_map_header {
+  uint32_t magic_number;
+  uint64_t parent_size;
+  int64_t  parent_time;
+  uint64_t child_size;
+  int64_t  child_time;
+  uint32_t parent_name_len;
+  uint32_t a_lines;
+  uint32_t b_lines;
+  uint32_t num_changes;
+} LineMapHeader;
+
+// The contents of a file, mapped into memory read only.
+typedef struct mapped_file {
+  const char *data;  // NULL if the file is empty
+  size_t      len;
+} MappedFile;
+
 // Loads the stored checkpoints from the bookkeeping dir into 
 // @cpt_log. If there is no file (or the file is empty), nothing 
 // will be added into the tables.
@@ -117,141 +181,116 @@ typedef struct file_tree_header {
 //  - READ_ERROR - if an ERROR occurs, in which case errno should be checked.
 int32_t ReadCheckPointLog(CheckPointLogPtr cpt_log);
 
-// Reads a HashTable in from file @f, starting at offstet @f, into table @table,
-// using function @fn to read buckets in.
+// Writes a copy of the checkpoint Log to disk so that the program
+// will not "forget" all the work it has done.
+int32_t WriteCheckPointLog(CheckPointLogPtr cpt_log);
+
+// Copies @str into a new string on the heap, allocated for the
+// CP_ALLOC_FILEHANDLER site, as every string value of the log's tables
+// is. Returns NULL on a memory error.
+char *CopyLogString(const char *str);
+
+// Frees a string value of the log's tables (e.g. one which was replaced
+// or removed). Its signature matches ValueFreeFnPtr so it can be passed
+// to FreeHashTable. Safe to pass NULL.
+void FreeLogString(HashTabVal_t str);
+
+// Responsible for writing one file to another. If {@dir == true}, will write
+// the contents of @src_filename into a checkpoint file for @cpt_name. Otherwise,
+// will write the contents of @cpt_name into @src_filename.
 //
 // Returns:
 //
-//  - The number of bytes read, and READ_ERROR if any errors occured.
-static int32_t ReadHashTable(FILE *f,
-                             uint32_t offset,
-                             HashTable table,
-                             read_bucket_fn fn);
-
-// Helper method to ReadCheckPointLog.
-// Reads in a Hash table whose values are supposed to be pointers
-// to strings on the heap.
-static int32_t ReadStringBucket(FILE *f, uint32_t offset, HashTabKV *kv);
-
-// Reads in a tree bucket starting from offset @offset. Creates a tree
-// on the heap, and stores the pointer in @kv.value. The key is
-// also read in during this method and stored in @kv.key.
+//  -2: if a reading ERROR occured.
 //
-// Returns;
+//  FILE_WRITE_ERR: if a writing ERROR occured.
 //
-//  - The number of bytes read, and READ_ERROR if any occured
-static int32_t ReadTreeBucket(FILE *f, uint32_t offset, HashTabKV *kv);
+//  FILE_WRITE_SUCCESS: if all went well.
+int32_t WriteSrcCheckpoint(char *src_filename, char *cpt_name, bool dir);
 
-// Reads in a Tree node from offset @offset. @curr_node is assumed to already
-// be a valid pointer to a CpTreeNode, whose fields will be adjust appropriately.
+// Looks up when the checkpoint file @cpt_filename (in the working dir)
+// was written, and how big it is. Since a checkpoint file is never
+// changed once it is written, that is when the checkpoint was created.
 //
 // Returns:
 //
-//  - The number of bytes read, and READ_ERROR if any errors occur.
-static int32_t ReadTreeNode(FILE *f, uint32_t offset, CpTreeNodePtr curr_node);
-
-// Helper method to ReadTreeNode. Reads the children of @parent into
-// its linked list of children, starting from offset, which is assumed
-// to be the beginning of an array of int32_ts which are themselves
-// further offsets from @offset to the children of parent.
-static int32_t ReadTreeChildren(FILE *f,
-                                uint32_t offset,
-                                uint32_t num_children,
-                                CpTreeNodePtr parent);
-
-// Writes a copy of the checkpoint Log to disk so that the program
-// will not "forget" all the work it has done.
-int32_t WriteCheckPointLog(CheckPointLogPtr cpt_log);
+//  READ_ERROR: if the checkpoint file could not be found.
+//
+//  READ_SUCCESS: if all went well, in which case the time and size are
+//  returned through @time and @size.
+int32_t StatCheckpoint(char *cpt_filename, time_t *time, off_t *size);
 
-// This VC system is composed of four hash tables. This method
-// takes care pf writing them, with the assistance of @fn.
+// Writes the @len bytes at @data to the checkpoint file @cpt_filename (in
+// the working dir), as WriteSrcCheckpoint would copy a source file.
 //
 // Returns:
 //
-//  - MEM_ERR: upon a memory ERROR.
-//
-//  - FILE_WRITE_ERR: if an ERROR arises while writing.
+//  FILE_WRITE_ERR: if the file could not be written.
 //
-//  - The number of bytes written otherwise.
-static int32_t WriteHashTable(FILE *f,
-                              HashTable table,
-                              uint32_t offset,
-                              write_bucket_fn fn);
-
-// Simply writes the given string to the given file at the given offset.
-// DOES NOT INCLUDE NULL TERMINATOR.
+//  FILE_WRITE_SUCCESS: if all went well.
+int32_t WriteCheckpoint(char *cpt_filename, const char *data, size_t len);
+
+// Removes the checkpoint file @cpt_filename (in the working dir).
 //
 // Returns:
 //
-//  - FILE_WRITE_ERR: if any ERRORs arose while writing.
+//  FILE_WRITE_ERR: if the file could not be removed.
 //
-//  - The number of chars written otherwise.
-static int32_t WriteStringBucket(FILE *f, uint32_t offset, HashTabKV kv);
+//  FILE_WRITE_SUCCESS: if all went well.
+int32_t RemoveCheckpoint(char *cpt_filename);
 
-// Writes a bucket (including a bucket header) to file f,
-// containing the contents of kv.value (assumed to be a
-// CpTreeNodePtr).
+// Reads the cached LineMap from the checkpoint file @parent_cpt to the
+// checkpoint file @child_cpt into @ret.
 //
 // Returns:
 //
-//  - MEM_ERR: on memory ERROR.
+//  READ_ERROR: if there is no map cached for @child_cpt, or it was made
+//  from a different parent or from different checkpoint files.
 //
-//  - FILE_WRITE_ERR: if an ERROR arose while writing.
+//  MEM_ERR: on a memory error.
 //
-//  - The number of bytes written for curr_node(and it's children).
-static int32_t WriteTreeBucket(FILE *f, uint32_t offset, HashTabKV kv);
+//  READ_SUCCESS: if all went well, in which case the changes of @ret must
+//  be freed with FreeLineMap.
+int32_t ReadLineMap(char *parent_cpt, char *child_cpt, LineMapPtr ret);
 
-// Writes a CpTreeNodePtr to file @f.
-// A file_treenode is written the following way:
+// Caches @map, the LineMap from the checkpoint file @parent_cpt to the
+// checkpoint file @child_cpt, in LINE_MAP_DIR.
 //
-// [name_len][num_children][name][children_offsets][        children         ]
-//
-// name_len and num_children are type ssize_t
-// name is a char array (which omits the null terminating byte)
-// children_offsets is an array of uint32_t values
-//
-// It's impossible to tell anything about the length of children, unless
-// num_children is 0, in which case there will not be any children_offsets
-// or children field written.
+// Returns:
 //
-// Returns;
+//  FILE_WRITE_ERR: if the map could not be written.
 //
-//  - The number of bytes written, and FILE_WRITE_ERR or MEM_ERR if one occured.
-static int32_t WriteTree(FILE *f, uint32_t offset, CpTreeNodePtr curr_node);
+//  FILE_WRITE_SUCCESS: if all went well.
+int32_t WriteLineMap(char *parent_cpt, char *child_cpt, LineMapPtr map);
 
-// Helper method to WriteTree, writes the contents of all of curr_nodes
-// children to file @f, starting at offset @offset
-//
-// Returns:
-//
-//  - The number of bytes written, and FILE_WRITE_ERR if any errors occur.
-static int32_t WriteChildren(CpTreeNodePtr curr_node,
-                             uint32_t *children_offsets,
-                             uint32_t offset,
-                             FILE *f);
+// Removes the LineMap cached for the checkpoint file @child_cpt, if
+// there is one.
+void RemoveLineMap(char *child_cpt);
 
-// Responsible for writing one file to another. If {@dir == true}, will write
-// the contents of @src_filename into a checkpoint file for @cpt_name. Otherwise,
-// will write the contents of @cpt_name into @src_filename.
+// Maps the whole of a file into memory, so that it can be read without
+// copying it. If @cpt is true, @filename is a checkpoint file (in the
+// working dir), and otherwise a source file.
 //
 // Returns:
 //
-//  -2: if a reading ERROR occured.
-//
-//  FILE_WRITE_ERR: if a writing ERROR occured.
+//  READ_ERROR: if the file could not be opened or mapped.
 //
-//  FILE_WRITE_SUCCESS: if all went well.
-int32_t WriteSrcCheckpoint(char *src_filename, char *cpt_name, bool dir);
+//  READ_SUCCESS: if all went well, in which case the mapping is returned
+//  through @ret, and must be released with UnmapFile.
+int32_t MapFile(char *filename, bool cpt, MappedFile *ret);
 
+// Releases a mapping made by MapFile.
+void UnmapFile(MappedFile *file);
 
-// Helper method to WriteSrcCheckpoint, writes the contents of file @a to
-// file @b.
+// Overwrites the source file @src_filename with the @len bytes at @data.
 //
 // Returns:
-//  - FILE_WRITE_ERR: if any errors occur in the i/o process.
 //
-//  - FILE_WRITE_SUCCESS: if all went well. 
-static int32_t WriteAToB(FILE *a, FILE *b);
+//  FILE_WRITE_ERR: if the file could not be written.
+//
+//  FILE_WRITE_SUCCESS: if all went well.
+int32_t WriteSrcFile(char *src_filename, const char *data, size_t len);
+
 #pragma pack(pop)
 
 #endif  // _CHECKPOINT_FILEHANDLER_H_
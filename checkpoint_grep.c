@@ -0,0 +1,451 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "checkpoint_grep.h"
+#include "checkpoint_diff.h"
+#include "checkpoint_trace.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+// The characters which mean something in an extended regex.
+#define GREP_META_CHARS ".[]()*+?{}|^$\\"
+
+// Lowercase letters (and spaces) from the most to the least common in
+// text. The rarest byte of a literal is the one memchr stops at least.
+#define GREP_COMMON_CHARS " etaoinsrhldcumfpgwybvkxjqz"
+
+// The flags every regex is compiled with.
+#define GREP_REGEX_FLAGS (REG_EXTENDED | REG_NOSUB | REG_NEWLINE)
+
+// The number of bytes a job's matches (or a line buffer) make room for
+// to begin with.
+#define GREP_INITIAL_CAPACITY 4096
+
+// What the threads of GrepFiles share. Each thread takes the next job
+// which no thread has taken yet, until there are none left.
+typedef struct grep_work {
+  GrepPatternPtr  pattern;
+  GrepJobPtr      jobs;
+  uint32_t        num_jobs;
+  atomic_uint     next_job;
+} GrepWork;
+
+// What each thread of GrepFiles has to itself.
+typedef struct grep_thread {
+  GrepWork *work;
+  // glibc's regexec takes a lock on the regex it runs, so every thread
+  // but the first compiles a copy of its own.
+  regex_t   regex;
+  regex_t  *regex_ptr;
+  char     *line;            // a copy of the line being matched
+  size_t    line_capacity;
+} GrepThread;
+
+// Finds the longest string which every match of the extended regex
+// @pattern must contain, and copies it to @buf (which must be as long
+// as @pattern). Only strings outside of parentheses are considered, and
+// none at all if the pattern has an alternation outside of them.
+//
+// Returns: the length of the string, 0 if none was found.
+static size_t FindLiteral(const char *pattern, char *buf);
+
+// Helper method to FindLiteral. Skips the bracket expression starting
+// at @pattern[@i].
+//
+// Returns: the index of the closing bracket, or of the end of @pattern.
+static size_t SkipBracket(const char *pattern, size_t i);
+
+// Returns how common @c usually is in text, higher being more common.
+static int32_t ByteRank(unsigned char c);
+
+// The thread function of GrepFiles (see pthread_create). @thread_arg is
+// a GrepThread *.
+static void *RunGrepThread(void *thread_arg);
+
+// Searches the file of @job for the lines matching @pattern, using the
+// regex and line buffer of @thread.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - 0: if all went well.
+static int32_t SearchJob(GrepPatternPtr pattern,
+                         GrepJobPtr job,
+                         GrepThread *thread);
+
+// Returns the first place the literal of @pattern occurs in
+// [@start, @end), or NULL if it doesn't.
+static const char *FindLiteralIn(GrepPatternPtr pattern,
+                                 const char *start,
+                                 const char *end);
+
+// Returns whether the line [@line, @eol) (not counting its newline)
+// matches the regex of @thread, or MEM_ERR on a memory error.
+static int32_t MatchLine(GrepThread *thread, const char *line, const char *eol);
+
+// Appends the line [@line, @eol), which is line @line_num of the file of
+// @job, to the matches of @job.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - 0: if all went well.
+static int32_t AppendMatch(GrepJobPtr job,
+                           uint64_t line_num,
+                           const char *line,
+                           const char *eol);
+
+int32_t CompileGrepPattern(const char *pattern, GrepPatternPtr ret) {
+  size_t len = strlen(pattern);
+  int32_t res;
+  char error[BUFSIZ];
+
+  ret->is_regex = strpbrk(pattern, GREP_META_CHARS) != NULL || len == 0;
+  if ((ret->source = malloc(len + 1)) == NULL) {
+    return MEM_ERR;
+  }
+  strcpy(ret->source, pattern);
+  if ((ret->literal = malloc(len + 1)) == NULL) {
+    free(ret->source);
+    return MEM_ERR;
+  }
+  if (ret->is_regex) {
+    ret->literal_len = FindLiteral(pattern, ret->literal);
+  } else {
+    strcpy(ret->literal, pattern);
+    ret->literal_len = len;
+  }
+  if (ret->literal_len == 0) {
+    free(ret->literal);
+    ret->literal = NULL;
+  }
+
+  if (ret->is_regex &&
+      (res = regcomp(&ret->regex, pattern, GREP_REGEX_FLAGS)) != 0) {
+    regerror(res, &ret->regex, error, sizeof(error));
+    fprintf(stderr, "invalid pattern %s: %s\n", pattern, error);
+    free(ret->literal);
+    free(ret->source);
+    ret->literal = ret->source = NULL;
+    ret->is_regex = false;
+    return res == REG_ESPACE ? MEM_ERR : GREP_ERR;
+  }
+
+  // memchr looks for the byte of the literal least likely to be common.
+  ret->rare = 0;
+  ret->rare_offset = 0;
+  for (size_t i = 0; i < ret->literal_len; i++) {
+    if (i == 0 || ByteRank(ret->literal[i]) < ByteRank(ret->rare)) {
+      ret->rare = ret->literal[i];
+      ret->rare_offset = i;
+    }
+  }
+  return 0;
+}
+
+void FreeGrepPattern(GrepPatternPtr pattern) {
+  if (pattern->is_regex) {
+    regfree(&pattern->regex);
+  }
+  free(pattern->literal);
+  free(pattern->source);
+  pattern->literal = pattern->source = NULL;
+  pattern->is_regex = false;
+}
+
+static size_t FindLiteral(const char *pattern, char *buf) {
+  size_t best_len = 0, run_len = 0, i;
+  int32_t depth = 0;
+  char run[strlen(pattern) + 1];
+
+  for (i = 0; pattern[i] != '\0'; i++) {
+    char c = pattern[i];
+    bool end_run = true;
+
+    if (c == '[') {
+      i = SkipBracket(pattern, i);
+    } else if (c == '\\' && pattern[i + 1] != '\0') {
+      i++;
+      // \. is a literal dot, but \w and the like are classes.
+      if (depth == 0 && strchr(GREP_META_CHARS, pattern[i]) != NULL) {
+        run[run_len++] = pattern[i];
+        end_run = false;
+      }
+    } else if (c == '(') {
+      depth++;
+    } else if (c == ')') {
+      depth -= depth > 0;
+    } else if (depth > 0) {
+      continue;
+    } else if (c == '|') {
+      return 0;  // either side may match, so nothing is certain
+    } else if (c == '*' || c == '?' || c == '{') {
+      run_len -= run_len > 0;  // what came before may not be there at all
+      for (; c == '{' && pattern[i + 1] != '\0' && pattern[i] != '}'; i++) {
+      }
+    } else if (c != '+' && c != '.' && c != '^' && c != '$') {
+      run[run_len++] = c;
+      end_run = false;
+    }
+
+    if (end_run) {
+      if (run_len > best_len) {
+        memcpy(buf, run, run_len);
+        best_len = run_len;
+      }
+      run_len = 0;
+    }
+  }
+
+  if (run_len > best_len) {
+    memcpy(buf, run, run_len);
+    best_len = run_len;
+  }
+  buf[best_len] = '\0';
+  return best_len;
+}
+
+static size_t SkipBracket(const char *pattern, size_t i) {
+  i++;
+  // A ] right after the [ (or [^) is part of the expression.
+  if (pattern[i] == '^') {
+    i++;
+  }
+  if (pattern[i] == ']') {
+    i++;
+  }
+  for (; pattern[i] != '\0' && pattern[i] != ']'; i++) {
+    // Skip classes like [:alpha:], which contain their own ].
+    if (pattern[i] == '[' && (pattern[i + 1] == ':' ||
+                              pattern[i + 1] == '.' ||
+                              pattern[i + 1] == '=')) {
+      char close = pattern[i + 1];
+      for (i += 2; pattern[i] != '\0' &&
+                   !(pattern[i] == close && pattern[i + 1] == ']'); i++) {
+      }
+      if (pattern[i] == '\0') {
+        return i - 1;
+      }
+      i++;
+    }
+  }
+  return pattern[i] == '\0' ? i - 1 : i;
+}
+
+static int32_t ByteRank(unsigned char c) {
+  const char *common = c == '\0' ? NULL : strchr(GREP_COMMON_CHARS, c);
+
+  if (common != NULL) {
+    return 100 - (common - GREP_COMMON_CHARS);
+  }
+  if (isdigit(c)) {
+    return 50;
+  }
+  return isupper(c) ? 40 : 10;
+}
+
+uint64_t GrepFiles(GrepPatternPtr pattern, GrepJobPtr jobs, uint32_t num_jobs) {
+  pthread_t threads[GREP_MAX_THREADS];
+  GrepThread thread_state[GREP_MAX_THREADS];
+  GrepWork work;
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t num_threads = num_cpus > 0 ? num_cpus : 1, started;
+  uint64_t num_matches = 0;
+
+  if (num_jobs == 0) {
+    return 0;
+  }
+  if (num_threads > GREP_MAX_THREADS) {
+    num_threads = GREP_MAX_THREADS;
+  }
+  if (num_threads > num_jobs) {
+    num_threads = num_jobs;
+  }
+
+  work.pattern = pattern;
+  work.jobs = jobs;
+  work.num_jobs = num_jobs;
+  atomic_init(&work.next_job, 0);
+  for (uint32_t i = 0; i < num_jobs; i++) {
+    jobs[i].out = NULL;
+    jobs[i].out_len = jobs[i].out_capacity = 0;
+    jobs[i].num_matches = 0;
+    jobs[i].res = 0;
+  }
+
+  // This thread is the first one. If a thread can't be started (or
+  // compile its regex), the others just take its jobs.
+  for (started = 0; started < num_threads; started++) {
+    GrepThread *thread = &thread_state[started];
+    thread->work = &work;
+    thread->regex_ptr = pattern->is_regex ? &pattern->regex : NULL;
+    thread->line = NULL;
+    thread->line_capacity = 0;
+    if (started == 0) {
+      continue;
+    }
+    if (pattern->is_regex) {
+      if (regcomp(&thread->regex, pattern->source, GREP_REGEX_FLAGS) != 0) {
+        break;
+      }
+      thread->regex_ptr = &thread->regex;
+    }
+    if (pthread_create(&threads[started], NULL, &RunGrepThread, thread) != 0) {
+      if (pattern->is_regex) {
+        regfree(&thread->regex);
+      }
+      break;
+    }
+  }
+
+  RunGrepThread(&thread_state[0]);
+  for (uint32_t i = 1; i < started; i++) {
+    pthread_join(threads[i], NULL);
+    if (pattern->is_regex) {
+      regfree(&thread_state[i].regex);
+    }
+  }
+
+  for (uint32_t i = 0; i < num_jobs; i++) {
+    num_matches += jobs[i].num_matches;
+  }
+  return num_matches;
+}
+
+static void *RunGrepThread(void *thread_arg) {
+  GrepThread *thread = thread_arg;
+  GrepWork *work = thread->work;
+  uint32_t i;
+  uint64_t begin;
+
+  while ((i = atomic_fetch_add(&work->next_job, 1)) < work->num_jobs) {
+    begin = TraceBegin(TRACE_GREP_FILE);
+    work->jobs[i].res = SearchJob(work->pattern, &work->jobs[i], thread);
+    TraceEnd(TRACE_GREP_FILE, begin);
+  }
+  free(thread->line);
+  return NULL;
+}
+
+static int32_t SearchJob(GrepPatternPtr pattern,
+                         GrepJobPtr job,
+                         GrepThread *thread) {
+  const char *pos = job->data, *end = job->data + job->len;
+  const char *counted = job->data, *line, *eol, *hit;
+  uint64_t line_num = 1;
+  int32_t res;
+
+  if (job->len == 0) {
+    return 0;
+  }
+
+  // pos is always at the start of a line.
+  while (pos < end) {
+    if (pattern->literal != NULL) {
+      if ((hit = FindLiteralIn(pattern, pos, end)) == NULL) {
+        break;
+      }
+      for (line = hit; line > pos && line[-1] != '\n'; line--) {
+      }
+    } else {
+      hit = line = pos;
+    }
+    if ((eol = memchr(hit, '\n', end - hit)) == NULL) {
+      eol = end;
+    }
+
+    res = pattern->is_regex ? MatchLine(thread, line, eol) : true;
+    if (res < 0) {
+      return res;
+    } else if (res) {
+      // Lines are only counted up to the ones which match.
+      line_num += CountLines(counted, line - counted);
+      counted = line;
+      if ((res = AppendMatch(job, line_num, line, eol)) < 0) {
+        return res;
+      }
+    }
+    pos = eol == end ? end : eol + 1;
+  }
+  return 0;
+}
+
+static const char *FindLiteralIn(GrepPatternPtr pattern,
+                                 const char *start,
+                                 const char *end) {
+  const char *rare = start + pattern->rare_offset, *candidate;
+
+  while (rare < end &&
+         (rare = memchr(rare, pattern->rare, end - rare)) != NULL) {
+    candidate = rare - pattern->rare_offset;
+    if ((size_t)(end - candidate) >= pattern->literal_len &&
+        memcmp(candidate, pattern->literal, pattern->literal_len) == 0) {
+      return candidate;
+    }
+    rare++;
+  }
+  return NULL;
+}
+
+static int32_t MatchLine(GrepThread *thread, const char *line, const char *eol) {
+  size_t len = eol - line, capacity;
+  char *grown;
+
+  if (len + 1 > thread->line_capacity) {
+    capacity = thread->line_capacity == 0 ? GREP_INITIAL_CAPACITY
+                                          : thread->line_capacity;
+    while (capacity < len + 1) {
+      capacity *= 2;
+    }
+    if ((grown = realloc(thread->line, capacity)) == NULL) {
+      return MEM_ERR;
+    }
+    thread->line = grown;
+    thread->line_capacity = capacity;
+  }
+
+  // regexec needs a string, which a line of a mapped file isn't.
+  memcpy(thread->line, line, len);
+  thread->line[len] = '\0';
+  return regexec(thread->regex_ptr, thread->line, 0, NULL, 0) == 0;
+}
+
+static int32_t AppendMatch(GrepJobPtr job,
+                           uint64_t line_num,
+                           const char *line,
+                           const char *eol) {
+  size_t label_len = strlen(job->label), len = eol - line, capacity;
+  // label:line number:line\n, the line number taking at most 20 digits.
+  size_t needed = job->out_len + label_len + len + 24;
+  char *grown;
+
+  if (needed > job->out_capacity) {
+    capacity = job->out_capacity == 0 ? GREP_INITIAL_CAPACITY : job->out_capacity;
+    while (capacity < needed) {
+      capacity *= 2;
+    }
+    if ((grown = realloc(job->out, capacity)) == NULL) {
+      return MEM_ERR;
+    }
+    job->out = grown;
+    job->out_capacity = capacity;
+  }
+
+  job->out_len += sprintf(job->out + job->out_len, "%s:%lu:",
+                          job->label, (unsigned long)line_num);
+  memcpy(job->out + job->out_len, line, len);
+  job->out_len += len;
+  job->out[job->out_len++] = '\n';
+  job->num_matches++;
+  return 0;
+}
+
+void FreeGrepJob(GrepJobPtr job) {
+  free(job->out);
+  job->out = NULL;
+  job->out_len = job->out_capacity = 0;
+}
@@ -0,0 +1,79 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+
+#ifndef _CHECKPOINT_GREP_H_
+#define _CHECKPOINT_GREP_H_
+// This module searches checkpoint files for the lines which match a
+// pattern (a POSIX extended regular expression), several files at once.
+//
+// Most patterns people search history for are plain strings (a key, a
+// hostname), or contain one. So before any regex is run, the longest
+// string every match must contain is found in the pattern, and files are
+// scanned for that instead: memchr finds each place the rarest byte of
+// the string occurs (glibc's memchr is vectorised, so this runs at close
+// to the speed memory can be read at), and only there is the rest of the
+// string compared. The regex is then only run on the lines the string
+// turns up in, and not at all if the pattern is nothing but the string.
+
+#include "macros.h"
+
+#include <regex.h>
+#include <stdint.h>
+
+#define GREP_ERR -1
+
+// The most threads a search will use, however many cores there are.
+#define GREP_MAX_THREADS 64
+
+// A compiled pattern.
+typedef struct grep_pattern {
+  char          *source;      // what the pattern was compiled from
+  // A string every matching line contains (which is the whole pattern if
+  // is_regex is false), or NULL if there is no such string.
+  char          *literal;
+  size_t         literal_len;
+  // The byte of literal memchr looks for, and where it is in literal.
+  unsigned char  rare;
+  size_t         rare_offset;
+  bool           is_regex;
+  regex_t        regex;       // only compiled if is_regex is true
+} GrepPattern, *GrepPatternPtr;
+
+// A file to be searched, and the lines of it which matched.
+typedef struct grep_job {
+  const char *label;   // what to print before each matching line
+  const char *data;
+  size_t      len;
+  // The matching lines, each printed as label:line number:line.
+  char       *out;
+  size_t      out_len;
+  size_t      out_capacity;
+  uint32_t    num_matches;
+  int32_t     res;     // MEM_ERR if the search ran out of memory, else 0
+} GrepJob, *GrepJobPtr;
+
+// Compiles @pattern into @ret, which must be freed with FreeGrepPattern.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - GREP_ERR: if @pattern isn't a valid regex (a message is printed).
+//
+//  - 0: if all went well.
+int32_t CompileGrepPattern(const char *pattern, GrepPatternPtr ret);
+
+// Frees everything compiled into @pattern (but not @pattern itself).
+void FreeGrepPattern(GrepPatternPtr pattern);
+
+// Searches each of the @num_jobs files of @jobs for the lines matching
+// @pattern, spreading them over as many threads as there are cores (up
+// to GREP_MAX_THREADS). The matches of each job are left in its out, and
+// must be freed with FreeGrepJob.
+//
+// Returns: the total number of matching lines.
+uint64_t GrepFiles(GrepPatternPtr pattern, GrepJobPtr jobs, uint32_t num_jobs);
+
+// Frees the matches of @job (but not @job itself).
+void FreeGrepJob(GrepJobPtr job);
+
+#endif  // _CHECKPOINT_GREP_H_
@@ -0,0 +1,1210 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "checkpoint_index.h"
+#include "checkpoint_progress.h"
+#include "checkpoint_stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// The number of distinct trigrams (each is three bytes).
+#define INDEX_NUM_TRIGRAMS (1 << 24)
+
+// The most bytes the varint of a uint32_t takes.
+#define INDEX_MAX_VARINT 5
+
+// The length of the path of a segment: INDEX_DIR/ and 8 hex digits.
+#define INDEX_PATH_LEN (sizeof(INDEX_DIR) + 9)
+
+// The number of trigrams a segment being written makes room for to
+// begin with.
+#define INDEX_INITIAL_TABLE 4096
+
+// A doc to be written to a new segment.
+typedef struct new_doc {
+  const char *name;
+  IndexDoc    doc;  // everything but where its name goes
+} NewDoc;
+
+// A segment being written. Its posting lists are written as they are
+// added, but its table is only written at the end.
+typedef struct segment_writer {
+  FILE        *f;
+  char         path[INDEX_PATH_LEN];
+  IndexHeader  header;
+  IndexEntry  *table;
+  uint32_t     capacity;
+  uint64_t     postings_len;
+} SegmentWriter;
+
+// The ValueFreeFnPtr of the doc table of a TrigramIndex, whose refs are
+// freed all at once.
+static void IndexNullFree(HashTabVal_t value) { }
+
+// Writes the path of the segment @seq to @path (which must have room for
+// INDEX_PATH_LEN chars).
+static void SegmentPath(uint32_t seq, char *path);
+
+// Returns the number of bytes of the segment @seq (0 if it is missing).
+static uint64_t SegmentSize(uint32_t seq);
+
+// Reads INDEX_MANIFEST into @ret, whose segments must be freed. If there
+// is no manifest (or it can't be read), the index is empty.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - 0: otherwise.
+static int32_t ReadManifest(IndexManifest *ret);
+
+// Replaces INDEX_MANIFEST with @manifest.
+//
+// Returns:
+//
+//  - INDEX_ERR: if it could not be written.
+//
+//  - 0: if all went well.
+static int32_t WriteManifest(IndexManifest *manifest);
+
+// Appends the segment @seq, which indexes @num_docs docs, to @manifest.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - 0: if all went well.
+static int32_t AppendSegmentInfo(IndexManifest *manifest,
+                                 uint32_t seq,
+                                 uint32_t num_docs);
+
+// Removes the segment files which were listed before (the @num_old
+// @old_seqs) or have been written since (numbered from @first_new up to
+// @end_new), but aren't listed in @keep. If @keep is NULL, only those
+// written since are removed.
+static void RemoveUnlisted(IndexManifest *keep,
+                           const uint32_t *old_seqs,
+                           uint32_t num_old,
+                           uint32_t first_new,
+                           uint32_t end_new);
+
+// Looks up the size and time of the checkpoint file @cpt_filename (in
+// the working dir), and stores them in @ret.
+//
+// Returns:
+//
+//  - INDEX_ERR: if the file is missing.
+//
+//  - 0: if all went well.
+static int32_t StatDoc(const char *cpt_filename, IndexDoc *ret);
+
+// Finds every trigram of the checkpoint file @cpt_filename, and returns
+// them in order through @trigrams (which must be freed) and @num. The
+// size and time of the file are stored in @doc.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - INDEX_ERR: if the file could not be read, or isn't worth indexing
+//    (it is bigger than INDEX_MAX_FILE_SIZE, has a NUL byte, or has more
+//    than INDEX_MAX_TRIGRAMS trigrams).
+//
+//  - 0: if all went well.
+static int32_t FindTrigrams(const char *cpt_filename,
+                            IndexDoc *doc,
+                            uint32_t **trigrams,
+                            uint32_t *num);
+
+// Starts writing the segment @seq, which indexes the @num_docs @docs.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - INDEX_ERR: if the segment could not be written.
+//
+//  - 0: if all went well.
+static int32_t BeginSegment(SegmentWriter *writer,
+                            uint32_t seq,
+                            NewDoc *docs,
+                            uint32_t num_docs);
+
+// Adds the posting list of @trigram, which is bigger than every trigram
+// added before it, to the segment of @writer. The list is the @num_ids
+// (sorted) @ids.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - 0: if all went well (write errors are only found by FinishSegment).
+static int32_t AddPostings(SegmentWriter *writer,
+                           uint32_t trigram,
+                           const uint32_t *ids,
+                           uint32_t num_ids);
+
+// Writes the table of the segment of @writer, and closes it. The segment
+// is removed if any of it could not be written.
+//
+// Returns:
+//
+//  - INDEX_ERR: if the segment could not be written.
+//
+//  - 0: if all went well.
+static int32_t FinishSegment(SegmentWriter *writer);
+
+// Gives up on the segment of @writer, and removes it.
+static void AbortSegment(SegmentWriter *writer);
+
+// Merges the @num segments of @manifest from @first on into a single new
+// one (numbered by the manifest's next_seq), which takes their place in
+// @manifest. Only the newest doc of each file is kept, and only if the
+// file hasn't changed since it was indexed, and isn't named in @drop
+// (a string keyed table, or NULL). A segment which can't be read is
+// left out of the merge (so its docs are no longer indexed).
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - INDEX_ERR: if the new segment could not be written, or a segment
+//    turned out to be corrupt.
+//
+//  - 0: if all went well.
+static int32_t MergeSegments(IndexManifest *manifest,
+                             uint32_t first,
+                             uint32_t num,
+                             HashTable drop);
+
+// Returns whether any doc of @segment is named in @drop.
+static bool SegmentHasAny(IndexSegmentPtr segment, HashTable drop);
+
+// Maps the segment @seq into memory, and checks that it holds together.
+//
+// Returns:
+//
+//  - INDEX_ERR: if it could not be mapped, or is corrupt.
+//
+//  - 0: if all went well, in which case it must be unmapped with
+//    UnmapSegment.
+static int32_t MapSegment(uint32_t seq, IndexSegmentPtr ret);
+
+// Releases a segment mapped by MapSegment.
+static void UnmapSegment(IndexSegmentPtr segment);
+
+// Returns the IndexEntry of @trigram in @segment, or NULL if no doc of
+// @segment contains it.
+static const IndexEntry *FindEntry(IndexSegmentPtr segment, uint32_t trigram);
+
+// Decodes the posting list of @entry (of @segment) into @ids, which
+// must have room for the docs of @segment.
+//
+// Returns:
+//
+//  - INDEX_ERR: if the list is corrupt.
+//
+//  - The number of ids otherwise.
+static int64_t DecodePostings(IndexSegmentPtr segment,
+                              const IndexEntry *entry,
+                              uint32_t *ids);
+
+// Keeps only those of the @num_a ids of @a which are also among the
+// @num_b ids of @b (both sorted). Each id of @a is looked for by
+// galloping through @b, so this takes O(num_a log(num_b / num_a)) when
+// @a is much shorter than @b.
+//
+// Returns: the number of ids kept.
+static uint32_t Intersect(uint32_t *a,
+                          uint32_t num_a,
+                          const uint32_t *b,
+                          uint32_t num_b);
+
+// Returns the ref of the checkpoint file @cpt_filename in @index, or NULL
+// if it isn't indexed, or has changed since it was.
+static IndexDocRefPtr FindCurrentRef(TrigramIndexPtr index,
+                                     const char *cpt_filename);
+
+int32_t AddToIndex(char **cpt_filenames,
+                   uint32_t num_files,
+                   uint64_t max_merge_bytes) {
+  IndexManifest manifest;
+  SegmentWriter writer;
+  NewDoc new_doc;
+  Progress progress;
+  uint32_t *trigrams, zero = 0, first_new, num_trigrams;
+  int32_t res;
+
+  if ((res = ReadManifest(&manifest)) < 0) {
+    return res;
+  }
+  first_new = manifest.next_seq;
+  uint32_t num_old = manifest.num_segments, old_seqs[num_old + 1];
+  for (uint32_t i = 0; i < num_old; i++) {
+    old_seqs[i] = manifest.segments[i].seq;
+  }
+
+  // The index dir is only made once something is indexed.
+  if (mkdir(INDEX_DIR, S_IRWXU) != 0 && errno != EEXIST) {
+    free(manifest.segments);
+    return INDEX_ERR;
+  }
+
+  ProgressBegin(&progress, "index", NULL, NULL, PROGRESS_UNIT_FILES,
+                num_files);
+  for (uint32_t i = 0; i < num_files && res >= 0; i++) {
+    res = FindTrigrams(cpt_filenames[i], &new_doc.doc, &trigrams, &num_trigrams);
+    if (res == INDEX_ERR) {
+      res = 0;  // it just won't be indexed
+      ProgressAdd(&progress, 1);
+      continue;
+    } else if (res < 0) {
+      break;
+    }
+
+    // Every trigram of a segment of one doc has the posting list [0].
+    new_doc.name = cpt_filenames[i];
+    if ((res = BeginSegment(&writer, manifest.next_seq, &new_doc, 1)) == 0) {
+      for (uint32_t t = 0; t < num_trigrams && res == 0; t++) {
+        res = AddPostings(&writer, trigrams[t], &zero, 1);
+      }
+      if (res == 0) {
+        res = FinishSegment(&writer);
+      } else {
+        AbortSegment(&writer);
+      }
+    }
+    free(trigrams);
+    if (res == 0) {
+      res = AppendSegmentInfo(&manifest, manifest.next_seq++, 1);
+    }
+
+    // Like a binary counter, merge while the newest two are alike (and
+    // small enough to be rewritten here).
+    while (res == 0 && manifest.num_segments >= 2 &&
+           manifest.segments[manifest.num_segments - 2].num_docs <=
+           manifest.segments[manifest.num_segments - 1].num_docs &&
+           SegmentSize(manifest.segments[manifest.num_segments - 2].seq) +
+           SegmentSize(manifest.segments[manifest.num_segments - 1].seq) <=
+           max_merge_bytes) {
+      res = MergeSegments(&manifest, manifest.num_segments - 2, 2, NULL);
+    }
+    ProgressAdd(&progress, 1);
+  }
+  ProgressEnd(&progress);
+
+  if (res == 0) {
+    res = WriteManifest(&manifest);
+  }
+  // If the manifest wasn't replaced, what was written is of no use.
+  RemoveUnlisted(res == 0 ? &manifest : NULL,
+                 old_seqs, num_old, first_new, manifest.next_seq);
+  free(manifest.segments);
+  return res;
+}
+
+int32_t CompactIndex(void) {
+  IndexManifest manifest;
+  int32_t res;
+
+  if ((res = ReadManifest(&manifest)) < 0) {
+    return res;
+  }
+  if (manifest.num_segments == 0) {
+    free(manifest.segments);
+    return 0;
+  }
+
+  uint32_t num_old = manifest.num_segments, old_seqs[num_old];
+  uint32_t first_new = manifest.next_seq;
+  for (uint32_t i = 0; i < num_old; i++) {
+    old_seqs[i] = manifest.segments[i].seq;
+  }
+
+  if ((res = MergeSegments(&manifest, 0, manifest.num_segments, NULL)) == 0) {
+    res = WriteManifest(&manifest);
+  }
+  RemoveUnlisted(res == 0 ? &manifest : NULL,
+                 old_seqs, num_old, first_new, manifest.next_seq);
+  free(manifest.segments);
+  return res;
+}
+
+int32_t RemoveFromIndex(char **cpt_filenames, uint32_t num_files) {
+  IndexManifest manifest;
+  IndexSegment segment;
+  HashTable drop;
+  HashTabKV storage;
+  bool changed = false, has;
+  int32_t res;
+
+  if (num_files == 0) {
+    return 0;
+  }
+  if ((res = ReadManifest(&manifest)) < 0) {
+    return res;
+  }
+  if (manifest.num_segments == 0) {
+    free(manifest.segments);
+    return 0;
+  }
+  if ((drop = MakeStrHashTable(INITIAL_BUCKET_COUNT)) == NULL) {
+    free(manifest.segments);
+    return MEM_ERR;
+  }
+  for (uint32_t i = 0; i < num_files && res == 0; i++) {
+    if (HTInsertStr(drop, cpt_filenames[i], NULL, &storage) == 0) {
+      res = MEM_ERR;
+    }
+  }
+
+  uint32_t num_old = manifest.num_segments, old_seqs[num_old];
+  uint32_t first_new = manifest.next_seq;
+  for (uint32_t i = 0; i < num_old; i++) {
+    old_seqs[i] = manifest.segments[i].seq;
+  }
+
+  // Only the segments with a doc to drop are rewritten, each in place.
+  for (uint32_t s = 0; s < manifest.num_segments && res == 0; s++) {
+    if (MapSegment(manifest.segments[s].seq, &segment) != 0) {
+      continue;
+    }
+    has = SegmentHasAny(&segment, drop);
+    UnmapSegment(&segment);
+    if (has) {
+      res = MergeSegments(&manifest, s, 1, drop);
+      changed = true;
+    }
+  }
+
+  if (res == 0 && changed) {
+    res = WriteManifest(&manifest);
+  }
+  if (changed) {
+    RemoveUnlisted(res == 0 ? &manifest : NULL,
+                   old_seqs, num_old, first_new, manifest.next_seq);
+  }
+  FreeHashTable(drop, &IndexNullFree);
+  free(manifest.segments);
+  return res;
+}
+
+int32_t OpenIndex(TrigramIndexPtr ret) {
+  HashTabKV storage;
+  uint32_t num_refs = 0;
+  int32_t res;
+
+  ret->segments = NULL;
+  ret->num_segments = 0;
+  ret->refs = NULL;
+  ret->first_refs = NULL;
+  if ((ret->docs = MakeStrHashTable(INITIAL_BUCKET_COUNT)) == NULL) {
+    ret->manifest.segments = NULL;
+    return MEM_ERR;
+  }
+  if ((res = ReadManifest(&ret->manifest)) < 0) {
+    CloseIndex(ret);
+    return res;
+  }
+
+  uint32_t max_segments = ret->manifest.num_segments + 1;
+  if ((ret->segments = malloc(sizeof(IndexSegment) * max_segments)) == NULL ||
+      (ret->first_refs = malloc(sizeof(uint32_t) * max_segments)) == NULL) {
+    CloseIndex(ret);
+    return MEM_ERR;
+  }
+  for (uint32_t i = 0; i < ret->manifest.num_segments; i++) {
+    if (MapSegment(ret->manifest.segments[i].seq,
+                   &ret->segments[ret->num_segments]) == 0) {
+      ret->first_refs[ret->num_segments] = num_refs;
+      num_refs += ret->segments[ret->num_segments].header->num_docs;
+      ret->num_segments++;
+    }
+  }
+
+  if ((ret->refs = malloc(sizeof(IndexDocRef) * (num_refs + 1))) == NULL) {
+    CloseIndex(ret);
+    return MEM_ERR;
+  }
+
+  // Newer segments come later, so their refs replace older ones.
+  for (uint32_t s = 0; s < ret->num_segments; s++) {
+    IndexSegmentPtr segment = &ret->segments[s];
+    for (uint32_t d = 0; d < segment->header->num_docs; d++) {
+      const IndexDoc *doc = &segment->docs[d];
+      IndexDocRefPtr ref = &ret->refs[ret->first_refs[s] + d];
+      char name[doc->name_len + 1];
+
+      memcpy(name, segment->names + doc->name_offset, doc->name_len);
+      name[doc->name_len] = '\0';
+      ref->doc = doc;
+      ref->candidate = true;
+      if (HTInsertStr(ret->docs, name, ref, &storage) == 0) {
+        CloseIndex(ret);
+        return MEM_ERR;
+      }
+    }
+  }
+  return 0;
+}
+
+int32_t FindIndexCandidates(TrigramIndexPtr index,
+                            const char *literal,
+                            size_t len) {
+  uint32_t num_trigrams = 0, *trigrams, *ids, *other;
+  const IndexEntry *entry;
+  int64_t num_ids;
+
+  // No trigram which was indexed spans a newline.
+  if ((trigrams = malloc(sizeof(uint32_t) * (len + 1))) == NULL) {
+    return MEM_ERR;
+  }
+  for (size_t i = 0; i + INDEX_MIN_LITERAL <= len; i++) {
+    if (memchr(literal + i, '\n', INDEX_MIN_LITERAL) == NULL) {
+      trigrams[num_trigrams++] = (uint32_t)(unsigned char)literal[i] << 16 |
+                                 (uint32_t)(unsigned char)literal[i + 1] << 8 |
+                                 (uint32_t)(unsigned char)literal[i + 2];
+    }
+  }
+
+  // Without a trigram to look up, nothing can be ruled out.
+  for (uint32_t s = 0; s < index->num_segments; s++) {
+    for (uint32_t d = 0; d < index->segments[s].header->num_docs; d++) {
+      index->refs[index->first_refs[s] + d].candidate = num_trigrams == 0;
+    }
+  }
+  if (num_trigrams == 0) {
+    free(trigrams);
+    return 0;
+  }
+
+  for (uint32_t s = 0; s < index->num_segments; s++) {
+    IndexSegmentPtr segment = &index->segments[s];
+    uint32_t num_docs = segment->header->num_docs;
+    const IndexEntry *shortest = NULL;
+    bool missing = false;
+
+    // Start from the shortest posting list, so the others are only
+    // galloped through.
+    for (uint32_t t = 0; t < num_trigrams && !missing; t++) {
+      if ((entry = FindEntry(segment, trigrams[t])) == NULL) {
+        missing = true;
+      } else if (shortest == NULL || entry->num_docs < shortest->num_docs) {
+        shortest = entry;
+      }
+    }
+    if (missing || num_docs == 0) {
+      continue;  // no doc of this segment has every trigram
+    }
+
+    if ((ids = malloc(sizeof(uint32_t) * num_docs * 2)) == NULL) {
+      free(trigrams);
+      return MEM_ERR;
+    }
+    other = ids + num_docs;
+    num_ids = shortest == NULL ? 0 : DecodePostings(segment, shortest, ids);
+    for (uint32_t t = 0; t < num_trigrams && num_ids > 0; t++) {
+      entry = FindEntry(segment, trigrams[t]);
+      if (entry != shortest) {
+        int64_t num_other = DecodePostings(segment, entry, other);
+        num_ids = num_other < 0 ? num_other
+                                : Intersect(ids, num_ids, other, num_other);
+      }
+    }
+
+    if (num_ids < 0) {  // a corrupt segment can't rule anything out
+      for (uint32_t d = 0; d < num_docs; d++) {
+        index->refs[index->first_refs[s] + d].candidate = true;
+      }
+    }
+    for (int64_t i = 0; i < num_ids; i++) {
+      index->refs[index->first_refs[s] + ids[i]].candidate = true;
+    }
+    free(ids);
+  }
+
+  free(trigrams);
+  return 0;
+}
+
+bool IndexCovers(TrigramIndexPtr index, const char *cpt_filename) {
+  return FindCurrentRef(index, cpt_filename) != NULL;
+}
+
+bool IndexRulesOut(TrigramIndexPtr index, const char *cpt_filename) {
+  IndexDocRefPtr ref = FindCurrentRef(index, cpt_filename);
+  return ref != NULL && !ref->candidate;
+}
+
+void CloseIndex(TrigramIndexPtr index) {
+  for (uint32_t i = 0; i < index->num_segments; i++) {
+    UnmapSegment(&index->segments[i]);
+  }
+  if (index->docs != NULL) {
+    FreeHashTable(index->docs, &IndexNullFree);
+  }
+  free(index->manifest.segments);
+  free(index->segments);
+  free(index->refs);
+  free(index->first_refs);
+  index->docs = NULL;
+  index->manifest.segments = NULL;
+  index->segments = NULL;
+  index->refs = NULL;
+  index->first_refs = NULL;
+  index->num_segments = 0;
+}
+
+static IndexDocRefPtr FindCurrentRef(TrigramIndexPtr index,
+                                     const char *cpt_filename) {
+  HashTabKV storage;
+  IndexDocRefPtr ref;
+  IndexDoc now;
+
+  if (HTLookupStr(index->docs, cpt_filename, &storage) != 1) {
+    return NULL;
+  }
+  ref = storage.value;
+  if (StatDoc(cpt_filename, &now) != 0 ||
+      now.size != ref->doc->size ||
+      now.time_sec != ref->doc->time_sec ||
+      now.time_nsec != ref->doc->time_nsec) {
+    return NULL;
+  }
+  return ref;
+}
+
+static void SegmentPath(uint32_t seq, char *path) {
+  sprintf(path, "%s/%08x", INDEX_DIR, seq);
+}
+
+static uint64_t SegmentSize(uint32_t seq) {
+  char path[INDEX_PATH_LEN];
+  struct stat st;
+
+  SegmentPath(seq, path);
+  return stat(path, &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+static int32_t ReadManifest(IndexManifest *ret) {
+  IndexManifestHeader header;
+  FILE *f;
+
+  ret->num_segments = 0;
+  ret->next_seq = 0;
+  ret->segments = NULL;
+  if ((f = fopen(INDEX_MANIFEST, "rb")) == NULL) {
+    return 0;  // nothing has been indexed yet
+  }
+
+  if (StatsFread(&header, sizeof(IndexManifestHeader), 1, f,
+                 STATS_IO_META) != 1 ||
+      header.magic_number != INDEX_MANIFEST_MAGIC) {
+    fclose(f);
+    return 0;
+  }
+  if ((ret->segments = malloc(sizeof(IndexSegmentInfo) *
+                              ((size_t)header.num_segments + 1))) == NULL) {
+    fclose(f);
+    return MEM_ERR;
+  }
+  if (StatsFread(ret->segments, sizeof(IndexSegmentInfo), header.num_segments,
+                 f, STATS_IO_META) != header.num_segments) {
+    fclose(f);
+    return 0;  // as if empty, but keep the room
+  }
+
+  fclose(f);
+  ret->num_segments = header.num_segments;
+  ret->next_seq = header.next_seq;
+  return 0;
+}
+
+static int32_t WriteManifest(IndexManifest *manifest) {
+  const char *new_path = INDEX_MANIFEST ".new";
+  IndexManifestHeader header = { INDEX_MANIFEST_MAGIC,
+                                 manifest->num_segments,
+                                 manifest->next_seq };
+  FILE *f;
+
+  if ((f = fopen(new_path, "wb")) == NULL) {
+    return INDEX_ERR;
+  }
+  if (StatsFwrite(&header, sizeof(IndexManifestHeader), 1, f,
+                  STATS_IO_META) != 1 ||
+      (manifest->num_segments > 0 &&
+       StatsFwrite(manifest->segments, sizeof(IndexSegmentInfo),
+                   manifest->num_segments, f,
+                   STATS_IO_META) != manifest->num_segments)) {
+    fclose(f);
+    unlink(new_path);
+    return INDEX_ERR;
+  }
+  if (fclose(f) != 0 || rename(new_path, INDEX_MANIFEST) != 0) {
+    unlink(new_path);
+    return INDEX_ERR;
+  }
+  return 0;
+}
+
+static int32_t AppendSegmentInfo(IndexManifest *manifest,
+                                 uint32_t seq,
+                                 uint32_t num_docs) {
+  IndexSegmentInfo *segments = realloc(manifest->segments,
+                                       sizeof(IndexSegmentInfo) *
+                                       (manifest->num_segments + 1));
+  if (segments == NULL) {
+    return MEM_ERR;
+  }
+  manifest->segments = segments;
+  manifest->segments[manifest->num_segments].seq = seq;
+  manifest->segments[manifest->num_segments].num_docs = num_docs;
+  manifest->num_segments++;
+  return 0;
+}
+
+static void RemoveUnlisted(IndexManifest *keep,
+                           const uint32_t *old_seqs,
+                           uint32_t num_old,
+                           uint32_t first_new,
+                           uint32_t end_new) {
+  char path[INDEX_PATH_LEN];
+
+  // The old segments, and then every one written since.
+  for (uint64_t i = 0; i < num_old + (uint64_t)(end_new - first_new); i++) {
+    uint32_t seq = i < num_old ? old_seqs[i] : first_new + (i - num_old);
+    bool listed = keep == NULL && i < num_old;
+
+    for (uint32_t j = 0; keep != NULL && j < keep->num_segments && !listed; j++) {
+      listed = keep->segments[j].seq == seq;
+    }
+    if (!listed) {
+      SegmentPath(seq, path);
+      unlink(path);
+    }
+  }
+}
+
+static int32_t StatDoc(const char *cpt_filename, IndexDoc *ret) {
+  size_t dir_len = strlen(WORKING_DIR);
+  char path[dir_len + strlen(cpt_filename) + 2];
+  struct stat st;
+
+  sprintf(path, "%s/%s", WORKING_DIR, cpt_filename);
+  if (stat(path, &st) != 0) {
+    return INDEX_ERR;
+  }
+  ret->size = st.st_size;
+  ret->time_sec = st.st_mtim.tv_sec;
+  ret->time_nsec = st.st_mtim.tv_nsec;
+  return 0;
+}
+
+static int32_t FindTrigrams(const char *cpt_filename,
+                            IndexDoc *doc,
+                            uint32_t **trigrams,
+                            uint32_t *num) {
+  size_t dir_len = strlen(WORKING_DIR);
+  char path[dir_len + strlen(cpt_filename) + 2];
+  const unsigned char *data = NULL;
+  uint64_t *seen, bit;
+  struct stat st;
+  uint32_t trigram = 0, run = 0, n = 0;
+  int fd;
+
+  sprintf(path, "%s/%s", WORKING_DIR, cpt_filename);
+  if ((fd = open(path, O_RDONLY)) == -1) {
+    return INDEX_ERR;
+  }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return INDEX_ERR;
+  }
+  doc->size = st.st_size;
+  doc->time_sec = st.st_mtim.tv_sec;
+  doc->time_nsec = st.st_mtim.tv_nsec;
+  if (st.st_size > INDEX_MAX_FILE_SIZE) {
+    close(fd);
+    return INDEX_ERR;
+  }
+  if (st.st_size > 0 &&
+      (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+    close(fd);
+    return INDEX_ERR;
+  }
+  close(fd);
+  StatsCountBytes(STATS_IO_DATA, st.st_size, 0);
+
+  // One bit for every possible trigram, so that the trigrams come out
+  // in order, once each.
+  if ((seen = calloc(INDEX_NUM_TRIGRAMS / 64, sizeof(uint64_t))) == NULL) {
+    if (data != NULL) {
+      munmap((void *)data, st.st_size);
+    }
+    return MEM_ERR;
+  }
+  // A binary file, or one with too many trigrams, is given up on as soon
+  // as that is found.
+  for (off_t i = 0; i < st.st_size && n <= INDEX_MAX_TRIGRAMS; i++) {
+    if (data[i] == '\0') {
+      n = INDEX_MAX_TRIGRAMS + 1;
+      break;
+    } else if (data[i] == '\n') {
+      run = 0;
+      continue;
+    }
+    trigram = (trigram << 8 | data[i]) & (INDEX_NUM_TRIGRAMS - 1);
+    if (run < INDEX_MIN_LITERAL) {
+      run++;
+    }
+    bit = (uint64_t)1 << (trigram & 63);
+    if (run == INDEX_MIN_LITERAL && (seen[trigram >> 6] & bit) == 0) {
+      seen[trigram >> 6] |= bit;
+      n++;
+    }
+  }
+  if (data != NULL) {
+    munmap((void *)data, st.st_size);
+  }
+  if (n > INDEX_MAX_TRIGRAMS) {
+    free(seen);
+    return INDEX_ERR;
+  }
+
+  if ((*trigrams = malloc(sizeof(uint32_t) * (n + 1))) == NULL) {
+    free(seen);
+    return MEM_ERR;
+  }
+  *num = 0;
+  for (uint32_t w = 0; w < INDEX_NUM_TRIGRAMS / 64; w++) {
+    for (uint64_t bits = seen[w]; bits != 0; bits &= bits - 1) {
+      (*trigrams)[(*num)++] = w * 64 + __builtin_ctzll(bits);
+    }
+  }
+  free(seen);
+  return 0;
+}
+
+static int32_t BeginSegment(SegmentWriter *writer,
+                            uint32_t seq,
+                            NewDoc *docs,
+                            uint32_t num_docs) {
+  IndexDoc doc;
+  uint64_t names_len = 0;
+
+  SegmentPath(seq, writer->path);
+  writer->table = NULL;
+  writer->capacity = 0;
+  writer->postings_len = 0;
+  memset(&writer->header, 0, sizeof(IndexHeader));
+  writer->header.magic_number = INDEX_MAGIC;
+  writer->header.num_docs = num_docs;
+
+  if ((writer->f = fopen(writer->path, "wb")) == NULL) {
+    return INDEX_ERR;
+  }
+
+  // The header is written again once the table is.
+  StatsFwrite(&writer->header, sizeof(IndexHeader), 1, writer->f,
+              STATS_IO_META);
+  for (uint32_t i = 0; i < num_docs; i++) {
+    doc = docs[i].doc;
+    doc.name_offset = names_len;
+    doc.name_len = strlen(docs[i].name);
+    names_len += doc.name_len;
+    StatsFwrite(&doc, sizeof(IndexDoc), 1, writer->f, STATS_IO_META);
+  }
+  for (uint32_t i = 0; i < num_docs; i++) {
+    StatsFwrite(docs[i].name, sizeof(char), strlen(docs[i].name), writer->f,
+                STATS_IO_META);
+  }
+  if (names_len > UINT32_MAX) {
+    AbortSegment(writer);
+    return INDEX_ERR;
+  }
+
+  writer->header.names_len = names_len;
+  writer->header.postings_offset = sizeof(IndexHeader) +
+                                   (uint64_t)num_docs * sizeof(IndexDoc) +
+                                   names_len;
+  return 0;
+}
+
+static int32_t AddPostings(SegmentWriter *writer,
+                           uint32_t trigram,
+                           const uint32_t *ids,
+                           uint32_t num_ids) {
+  unsigned char varint[INDEX_MAX_VARINT];
+  IndexEntry *table;
+
+  if (writer->header.num_trigrams == writer->capacity) {
+    uint32_t capacity = writer->capacity == 0 ? INDEX_INITIAL_TABLE
+                                              : writer->capacity * 2;
+    if ((table = realloc(writer->table, sizeof(IndexEntry) * capacity)) == NULL) {
+      return MEM_ERR;
+    }
+    writer->table = table;
+    writer->capacity = capacity;
+  }
+  writer->table[writer->header.num_trigrams].trigram = trigram;
+  writer->table[writer->header.num_trigrams].num_docs = num_ids;
+  writer->table[writer->header.num_trigrams].offset = writer->postings_len;
+  writer->header.num_trigrams++;
+
+  // The first id as is, then the gap to each of the others.
+  for (uint32_t i = 0; i < num_ids; i++) {
+    uint32_t value = i == 0 ? ids[0] : ids[i] - ids[i - 1], len = 0;
+    do {
+      varint[len++] = (value & 0x7F) | (value > 0x7F ? 0x80 : 0);
+      value >>= 7;
+    } while (value != 0);
+    StatsFwrite(varint, sizeof(unsigned char), len, writer->f, STATS_IO_META);
+    writer->postings_len += len;
+  }
+  return 0;
+}
+
+static int32_t FinishSegment(SegmentWriter *writer) {
+  writer->header.table_offset = writer->header.postings_offset +
+                                writer->postings_len;
+  if (writer->header.num_trigrams > 0) {
+    StatsFwrite(writer->table, sizeof(IndexEntry), writer->header.num_trigrams,
+           writer->f, STATS_IO_META);
+  }
+
+  if (ferror(writer->f) ||
+      StatsFseek(writer->f, 0, SEEK_SET) != 0 ||
+      StatsFwrite(&writer->header, sizeof(IndexHeader), 1, writer->f,
+                  STATS_IO_META) != 1) {
+    AbortSegment(writer);
+    return INDEX_ERR;
+  }
+  free(writer->table);
+  writer->table = NULL;
+  if (fclose(writer->f) != 0) {
+    unlink(writer->path);
+    return INDEX_ERR;
+  }
+  return 0;
+}
+
+static void AbortSegment(SegmentWriter *writer) {
+  fclose(writer->f);
+  unlink(writer->path);
+  free(writer->table);
+  writer->table = NULL;
+}
+
+static int32_t MergeSegments(IndexManifest *manifest,
+                             uint32_t first,
+                             uint32_t num,
+                             HashTable drop) {
+  uint32_t num_segments = num, num_mapped = 0;
+  IndexSegment segments[num_segments];
+  uint32_t positions[num_segments], first_ids[num_segments];
+  uint32_t total_docs = 0, max_docs = 0, num_kept = 0;
+  uint32_t *remap = NULL, *ids = NULL, *out = NULL;
+  NewDoc *kept = NULL;
+  HashTable newest = NULL;
+  HashTabKV storage;
+  SegmentWriter writer;
+  int32_t res = 0;
+
+  for (uint32_t i = 0; i < num_segments; i++) {
+    if (MapSegment(manifest->segments[first + i].seq, &segments[num_mapped]) == 0) {
+      first_ids[num_mapped] = total_docs;
+      total_docs += segments[num_mapped].header->num_docs;
+      if (segments[num_mapped].header->num_docs > max_docs) {
+        max_docs = segments[num_mapped].header->num_docs;
+      }
+      positions[num_mapped] = 0;
+      num_mapped++;
+    }
+  }
+
+  if ((newest = MakeStrHashTable(INITIAL_BUCKET_COUNT)) == NULL ||
+      (remap = malloc(sizeof(uint32_t) * (total_docs + 1))) == NULL ||
+      (kept = malloc(sizeof(NewDoc) * (total_docs + 1))) == NULL ||
+      (ids = malloc(sizeof(uint32_t) * (max_docs + 1))) == NULL ||
+      (out = malloc(sizeof(uint32_t) * (total_docs + 1))) == NULL) {
+    res = MEM_ERR;
+  }
+
+  // Find the newest doc of each file...
+  for (uint32_t s = 0; s < num_mapped && res == 0; s++) {
+    for (uint32_t d = 0; d < segments[s].header->num_docs && res == 0; d++) {
+      const IndexDoc *doc = &segments[s].docs[d];
+      char name[doc->name_len + 1];
+      memcpy(name, segments[s].names + doc->name_offset, doc->name_len);
+      name[doc->name_len] = '\0';
+      if (HTInsertStr(newest, name, (HashTabVal_t)doc, &storage) == 0) {
+        res = MEM_ERR;
+      }
+    }
+  }
+
+  // ...and keep it if its file is still as it was, numbering the docs
+  // kept in order.
+  for (uint32_t s = 0; s < num_mapped && res == 0; s++) {
+    for (uint32_t d = 0; d < segments[s].header->num_docs && res == 0; d++) {
+      const IndexDoc *doc = &segments[s].docs[d];
+      char *name = malloc(doc->name_len + 1);
+      IndexDoc now;
+
+      if (name == NULL) {
+        res = MEM_ERR;
+        break;
+      }
+      memcpy(name, segments[s].names + doc->name_offset, doc->name_len);
+      name[doc->name_len] = '\0';
+      remap[first_ids[s] + d] = UINT32_MAX;
+      if ((drop == NULL || HTLookupStr(drop, name, &storage) != 1) &&
+          HTLookupStr(newest, name, &storage) == 1 && storage.value == doc &&
+          StatDoc(name, &now) == 0 && now.size == doc->size &&
+          now.time_sec == doc->time_sec && now.time_nsec == doc->time_nsec) {
+        remap[first_ids[s] + d] = num_kept;
+        kept[num_kept].name = name;
+        kept[num_kept].doc = *doc;
+        num_kept++;
+      } else {
+        free(name);
+      }
+    }
+  }
+
+  if (res == 0) {
+    res = BeginSegment(&writer, manifest->next_seq, kept, num_kept);
+  }
+
+  // Go through the tables of all the segments at once, in order of
+  // trigram. Since the docs of older segments were numbered first, the
+  // lists of a trigram come out in order by just appending them.
+  while (res == 0) {
+    uint32_t trigram = UINT32_MAX, num_out = 0;
+    bool any = false;
+
+    for (uint32_t s = 0; s < num_mapped; s++) {
+      if (positions[s] < segments[s].header->num_trigrams &&
+          (!any || segments[s].table[positions[s]].trigram < trigram)) {
+        trigram = segments[s].table[positions[s]].trigram;
+        any = true;
+      }
+    }
+    if (!any) {
+      res = FinishSegment(&writer);
+      break;
+    }
+
+    for (uint32_t s = 0; s < num_mapped && res == 0; s++) {
+      if (positions[s] < segments[s].header->num_trigrams &&
+          segments[s].table[positions[s]].trigram == trigram) {
+        int64_t num_ids = DecodePostings(&segments[s],
+                                         &segments[s].table[positions[s]],
+                                         ids);
+        if (num_ids < 0) {
+          res = INDEX_ERR;
+        }
+        for (int64_t i = 0; i < num_ids; i++) {
+          if (remap[first_ids[s] + ids[i]] != UINT32_MAX) {
+            out[num_out++] = remap[first_ids[s] + ids[i]];
+          }
+        }
+        positions[s]++;
+      }
+    }
+    if (res == 0 && num_out > 0) {
+      res = AddPostings(&writer, trigram, out, num_out);
+    }
+    if (res != 0) {
+      AbortSegment(&writer);
+    }
+  }
+
+  if (res == 0) {
+    manifest->segments[first].seq = manifest->next_seq++;
+    manifest->segments[first].num_docs = num_kept;
+    memmove(&manifest->segments[first + 1], &manifest->segments[first + num],
+            sizeof(IndexSegmentInfo) * (manifest->num_segments - first - num));
+    manifest->num_segments -= num - 1;
+  }
+
+  for (uint32_t i = 0; i < num_kept; i++) {
+    free((char *)kept[i].name);
+  }
+  for (uint32_t s = 0; s < num_mapped; s++) {
+    UnmapSegment(&segments[s]);
+  }
+  if (newest != NULL) {
+    FreeHashTable(newest, &IndexNullFree);
+  }
+  free(remap);
+  free(kept);
+  free(ids);
+  free(out);
+  return res;
+}
+
+static bool SegmentHasAny(IndexSegmentPtr segment, HashTable drop) {
+  HashTabKV storage;
+
+  for (uint32_t d = 0; d < segment->header->num_docs; d++) {
+    const IndexDoc *doc = &segment->docs[d];
+    char name[doc->name_len + 1];
+
+    memcpy(name, segment->names + doc->name_offset, doc->name_len);
+    name[doc->name_len] = '\0';
+    if (HTLookupStr(drop, name, &storage) == 1) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static int32_t MapSegment(uint32_t seq, IndexSegmentPtr ret) {
+  char path[INDEX_PATH_LEN];
+  const IndexHeader *header;
+  struct stat st;
+  void *data;
+  int fd;
+
+  SegmentPath(seq, path);
+  if ((fd = open(path, O_RDONLY)) == -1) {
+    return INDEX_ERR;
+  }
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(IndexHeader)) {
+    close(fd);
+    return INDEX_ERR;
+  }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  StatsCountBytes(STATS_IO_META, st.st_size, 0);
+  if (data == MAP_FAILED) {
+    return INDEX_ERR;
+  }
+  ret->data = data;
+  ret->len = st.st_size;
+
+  // Everything has to be where the header says it is.
+  header = data;
+  uint64_t docs_end = sizeof(IndexHeader) +
+                      (uint64_t)header->num_docs * sizeof(IndexDoc);
+  if (header->magic_number != INDEX_MAGIC ||
+      docs_end + header->names_len != header->postings_offset ||
+      header->postings_offset > header->table_offset ||
+      header->table_offset > ret->len ||
+      (ret->len - header->table_offset) / sizeof(IndexEntry)
+                                          != header->num_trigrams ||
+      (ret->len - header->table_offset) % sizeof(IndexEntry) != 0) {
+    UnmapSegment(ret);
+    return INDEX_ERR;
+  }
+  ret->header = header;
+  ret->docs = (const IndexDoc *)(ret->data + sizeof(IndexHeader));
+  ret->names = ret->data + docs_end;
+  ret->postings = (const unsigned char *)ret->data + header->postings_offset;
+  ret->table = (const IndexEntry *)(ret->data + header->table_offset);
+
+  for (uint32_t d = 0; d < header->num_docs; d++) {
+    if ((uint64_t)ret->docs[d].name_offset + ret->docs[d].name_len
+                                                    > header->names_len) {
+      UnmapSegment(ret);
+      return INDEX_ERR;
+    }
+  }
+  return 0;
+}
+
+static void UnmapSegment(IndexSegmentPtr segment) {
+  munmap((void *)segment->data, segment->len);
+  segment->data = NULL;
+  segment->len = 0;
+}
+
+static const IndexEntry *FindEntry(IndexSegmentPtr segment, uint32_t trigram) {
+  uint32_t lo = 0, hi = segment->header->num_trigrams;
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (segment->table[mid].trigram < trigram) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo < segment->header->num_trigrams &&
+      segment->table[lo].trigram == trigram) {
+    return &segment->table[lo];
+  }
+  return NULL;
+}
+
+static int64_t DecodePostings(IndexSegmentPtr segment,
+                              const IndexEntry *entry,
+                              uint32_t *ids) {
+  uint64_t postings_len = segment->header->table_offset -
+                          segment->header->postings_offset;
+  const unsigned char *p, *end = segment->postings + postings_len;
+  uint32_t id = 0;
+
+  if (entry->num_docs > segment->header->num_docs ||
+      entry->offset > postings_len) {
+    return INDEX_ERR;
+  }
+
+  p = segment->postings + entry->offset;
+  for (uint32_t i = 0; i < entry->num_docs; i++) {
+    uint64_t value = 0;
+    uint32_t shift = 0;
+    do {
+      if (p == end || shift >= 7 * INDEX_MAX_VARINT) {
+        return INDEX_ERR;
+      }
+      value |= (uint64_t)(*p & 0x7F) << shift;
+      shift += 7;
+    } while (*p++ & 0x80);
+
+    // Ids only go up, and can't be past the last doc.
+    if ((i > 0 && value == 0) || value >= segment->header->num_docs - id) {
+      return INDEX_ERR;
+    }
+    id += value;
+    ids[i] = id;
+  }
+  return entry->num_docs;
+}
+
+static uint32_t Intersect(uint32_t *a,
+                          uint32_t num_a,
+                          const uint32_t *b,
+                          uint32_t num_b) {
+  uint32_t kept = 0, j = 0;
+
+  for (uint32_t i = 0; i < num_a && j < num_b; i++) {
+    // Gallop to a stretch of b which ends past a[i]...
+    uint32_t lo = j, step = 1, hi;
+    while (lo + step < num_b && b[lo + step] < a[i]) {
+      lo += step;
+      step *= 2;
+    }
+    hi = lo + step < num_b ? lo + step : num_b;
+
+    // ...then find the first id of it which isn't before a[i].
+    while (lo < hi) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      if (b[mid] < a[i]) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    j = lo;
+    if (j < num_b && b[j] == a[i]) {
+      a[kept++] = a[i];
+    }
+  }
+  return kept;
+}
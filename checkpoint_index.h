@@ -0,0 +1,215 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+
+#ifndef _CHECKPOINT_INDEX_H_
+#define _CHECKPOINT_INDEX_H_
+// This module keeps an index of which checkpoint files contain which
+// trigrams (runs of three bytes on one line), so that a search for a
+// string only has to read the files which contain every trigram of it.
+//
+// The index is split into segments, each of which indexes some of the
+// checkpoint files (its docs). For every trigram, a segment stores its
+// posting list: the (sorted) ids of the docs which contain it, stored as
+// varint deltas. Indexing a checkpoint file writes a segment for just
+// that file, and then, like a binary counter, the newest two segments
+// are merged for as long as the older has no more docs than the newer.
+// So N checkpoints are indexed by O(log N) segments, and each doc has
+// only been rewritten O(log N) times. The list of segments is kept in
+// INDEX_MANIFEST, which is replaced in one go (by renaming a new one
+// over it) once the segments it lists have been written.
+//
+// A file bigger than INDEX_MAX_FILE_SIZE, with a NUL byte (a binary
+// one), or with more than INDEX_MAX_TRIGRAMS distinct trigrams isn't
+// indexed at all: the posting lists of such a file would be huge, and
+// it would rarely be ruled out anyway. Making a checkpoint indexes it
+// right away, but only merges segments of up to INDEX_CREATE_MERGE_BYTES
+// between them, leaving the bigger merges to the index command, which
+// merges every segment into one.
+//
+// Every doc is recorded along with the size and time of its checkpoint
+// file, and is only trusted while they still match (checkpoint names can
+// be reused once pruned). A file which isn't indexed, or has changed
+// since, is searched anyway, so the index only ever saves work. Where a
+// file is indexed by more than one segment, the newest one is used.
+
+#include "DataStructs/HashTable.h"
+#include "macros.h"
+
+#include <stdint.h>
+
+#define INDEX_ERR -1
+
+#define INDEX_MAGIC 0x7A16F001
+#define INDEX_MANIFEST_MAGIC 0x7A16F0F0
+
+// The list of segments, kept in INDEX_DIR along with the segments.
+#define INDEX_MANIFEST INDEX_DIR "/manifest"
+
+// The shortest string the index can look up.
+#define INDEX_MIN_LITERAL 3
+
+// The files which are worth indexing (the same limits as codesearch's).
+#define INDEX_MAX_FILE_SIZE (1 << 30)
+#define INDEX_MAX_TRIGRAMS  20000
+
+// The most bytes of segments making a checkpoint merges at once.
+#define INDEX_CREATE_MERGE_BYTES (1 << 24)
+
+#pragma pack(push,1)
+
+// Written at the start of a segment, which is followed by its docs, the
+// names of its docs, the posting lists, and last the IndexEntry of every
+// trigram, in order.
+typedef struct index_header {
+  uint32_t magic_number;
+  uint32_t num_docs;
+  uint32_t num_trigrams;
+  uint32_t names_len;
+  uint64_t postings_offset;
+  uint64_t table_offset;
+} IndexHeader;
+
+// A checkpoint file indexed by a segment, as it was when it was indexed.
+typedef struct index_doc {
+  uint32_t name_offset;  // where its name is among the names
+  uint32_t name_len;
+  uint64_t size;
+  int64_t  time_sec;
+  int64_t  time_nsec;
+} IndexDoc;
+
+// Where the posting list of a trigram is in a segment.
+typedef struct index_entry {
+  uint32_t trigram;
+  uint32_t num_docs;  // the length of the list
+  uint64_t offset;    // where the list starts, from postings_offset
+} IndexEntry;
+
+// Written at the start of INDEX_MANIFEST, which is followed by the
+// IndexSegmentInfo of every segment, oldest first.
+typedef struct index_manifest_header {
+  uint32_t magic_number;
+  uint32_t num_segments;
+  uint32_t next_seq;      // the number the next segment will be given
+} IndexManifestHeader;
+
+typedef struct index_segment_info {
+  uint32_t seq;       // segments are stored as INDEX_DIR/<seq in hex>
+  uint32_t num_docs;
+} IndexSegmentInfo;
+
+#pragma pack(pop)
+
+// The list of segments, read into memory.
+typedef struct index_manifest {
+  uint32_t          num_segments;
+  uint32_t          next_seq;
+  IndexSegmentInfo *segments;
+} IndexManifest;
+
+// A segment, mapped into memory.
+typedef struct index_segment {
+  const char          *data;
+  size_t               len;
+  const IndexHeader   *header;
+  const IndexDoc      *docs;
+  const char          *names;
+  const unsigned char *postings;
+  const IndexEntry    *table;
+} IndexSegment, *IndexSegmentPtr;
+
+// What the index knows of a checkpoint file.
+typedef struct index_doc_ref {
+  const IndexDoc *doc;
+  bool            candidate;  // whether it may contain what was looked up
+} IndexDocRef, *IndexDocRefPtr;
+
+// The index, opened for looking things up.
+typedef struct trigram_index {
+  IndexManifest   manifest;
+  IndexSegment   *segments;    // the ones which could be mapped
+  uint32_t        num_segments;
+  // The ref of every doc of every segment, those of each segment in a
+  // run starting at first_refs[segment].
+  IndexDocRefPtr  refs;
+  uint32_t       *first_refs;
+  HashTable       docs;        // the name of each file to its newest ref
+} TrigramIndex, *TrigramIndexPtr;
+
+// Indexes the @num_files checkpoint files @cpt_filenames (in the working
+// dir), each in a segment of its own, merging segments as it goes, as
+// long as the two merged have no more than @max_merge_bytes between
+// them. A file which can't be read, or isn't worth indexing, is skipped.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - INDEX_ERR: if the index could not be written.
+//
+//  - 0: if all went well.
+int32_t AddToIndex(char **cpt_filenames,
+                   uint32_t num_files,
+                   uint64_t max_merge_bytes);
+
+// Merges every segment of the index into one, leaving out the docs
+// which have since been removed, changed or indexed again.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - INDEX_ERR: if the index could not be written.
+//
+//  - 0: if all went well.
+int32_t CompactIndex(void);
+
+// Drops the docs of the @num_files checkpoint files @cpt_filenames from
+// the index, for when their checkpoints are removed. Only the segments
+// which index any of them are rewritten.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - INDEX_ERR: if the index could not be written.
+//
+//  - 0: if all went well.
+int32_t RemoveFromIndex(char **cpt_filenames, uint32_t num_files);
+
+// Opens the index (which is empty if none has been written yet) into
+// @ret, which must be closed with CloseIndex. Segments which can't be
+// read are left out.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - 0: if all went well.
+int32_t OpenIndex(TrigramIndexPtr ret);
+
+// Works out which docs of @index contain every trigram of the @len bytes
+// at @literal, and so may contain @literal. If @len is less than
+// INDEX_MIN_LITERAL, every doc may.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - 0: if all went well.
+int32_t FindIndexCandidates(TrigramIndexPtr index,
+                            const char *literal,
+                            size_t len);
+
+// Returns whether the checkpoint file @cpt_filename is indexed by
+// @index, and hasn't changed since.
+bool IndexCovers(TrigramIndexPtr index, const char *cpt_filename);
+
+// Returns whether the last call to FindIndexCandidates rules out the
+// checkpoint file @cpt_filename (which it can only do if @index covers
+// it).
+bool IndexRulesOut(TrigramIndexPtr index, const char *cpt_filename);
+
+// Frees everything in @index (but not @index itself).
+void CloseIndex(TrigramIndexPtr index);
+
+#endif  // _CHECKPOINT_INDEX_H_
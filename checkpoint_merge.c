@@ -0,0 +1,258 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+
+#include "checkpoint_merge.h"
+
+// The number of bytes a MergeResult makes room for to begin with.
+#define MERGE_INITIAL_CAPACITY 4096
+
+// Helper method to MergeFiles. Merges the changes of @a and @b which
+// overlap the first change not yet merged (of either side), along with
+// the unchanged lines before them, into @ret.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - 0: if all went well.
+static int32_t MergeNextChanges(MergeSidePtr a,
+                                MergeSidePtr b,
+                                MergeResultPtr ret);
+
+// Helper method to MergeNextChanges. Takes every change of @side which
+// starts at or before the line @*hi of the base, moving @*hi to the end
+// of the last one taken if it is further on. @*end is the index of the
+// first change of @side not taken yet, and is moved past those taken.
+//
+// Returns: whether any change was taken.
+static bool TakeChanges(MergeSidePtr side, uint32_t *end, uint32_t *hi);
+
+// Helper method to MergeNextChanges. Works out which lines of @side the
+// lines [@lo, @hi) of the base became, given that the changes of @side
+// from @side->next to @end are all of those within them. Moves the
+// merge of @side up to the start of those lines, and returns where they
+// are in @side->data through @start and @stop.
+static void FindSideLines(MergeSidePtr side,
+                          uint32_t end,
+                          uint32_t lo,
+                          uint32_t hi,
+                          size_t *start,
+                          size_t *stop);
+
+// Moves the merge of @side forward to the line @line (or to the end of
+// @side, if it has fewer lines), and returns where that line starts.
+static size_t SeekLine(MergeSidePtr side, uint32_t line);
+
+// Appends the @len bytes at @data to @ret, making room for them if need
+// be. If @newline is true, a newline is added after them unless they
+// are empty or already end with one.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - 0: if all went well.
+static int32_t Append(MergeResultPtr ret,
+                      const char *data,
+                      size_t len,
+                      bool newline);
+
+// Appends a conflict marker made of MERGE_MARKER_LEN @c's, followed by
+// @name (if it isn't NULL), to @ret.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - 0: if all went well.
+static int32_t AppendMarker(MergeResultPtr ret, char c, const char *name);
+
+int32_t MergeFiles(const char *base,
+                   size_t base_len,
+                   const char *a_name,
+                   const char *a,
+                   size_t a_len,
+                   const char *b_name,
+                   const char *b,
+                   size_t b_len,
+                   MergeResultPtr ret) {
+  MergeSide sides[2] = {
+    { a_name, a, a_len, { 0, 0, 0, NULL }, 0, 0, 0, 0 },
+    { b_name, b, b_len, { 0, 0, 0, NULL }, 0, 0, 0, 0 }
+  };
+  int32_t res;
+  size_t start;
+
+  ret->data = NULL;
+  ret->len = ret->capacity = 0;
+  ret->num_conflicts = 0;
+
+  if ((res = DiffLineMap(base, base_len, a, a_len, &sides[0].map)) < 0) {
+    return res;
+  }
+  if ((res = DiffLineMap(base, base_len, b, b_len, &sides[1].map)) < 0) {
+    FreeLineMap(&sides[0].map);
+    return res;
+  }
+
+  while (res >= 0 && (sides[0].next < sides[0].map.num_changes ||
+                      sides[1].next < sides[1].map.num_changes)) {
+    res = MergeNextChanges(&sides[0], &sides[1], ret);
+  }
+
+  // Whatever is left after the last change is the same in all three.
+  if (res >= 0) {
+    start = SeekLine(&sides[0], sides[0].line);
+    res = Append(ret, a + start, a_len - start, false);
+  }
+
+  FreeLineMap(&sides[0].map);
+  FreeLineMap(&sides[1].map);
+  if (res < 0) {
+    FreeMergeResult(ret);
+    return res;
+  }
+  return ret->num_conflicts;
+}
+
+static int32_t MergeNextChanges(MergeSidePtr a,
+                                MergeSidePtr b,
+                                MergeResultPtr ret) {
+  uint32_t a_end = a->next, b_end = b->next, lo = UINT32_MAX, hi;
+  size_t a_start, a_stop, b_start, b_stop, start;
+  int32_t res;
+
+  if (a->next < a->map.num_changes) {
+    lo = a->map.changes[a->next].a_start;
+  }
+  if (b->next < b->map.num_changes && b->map.changes[b->next].a_start < lo) {
+    lo = b->map.changes[b->next].a_start;
+  }
+
+  // Keep taking changes of either side until neither has one which
+  // overlaps (or touches) the lines [lo, hi) of the base taken so far.
+  hi = lo;
+  while (TakeChanges(a, &a_end, &hi) | TakeChanges(b, &b_end, &hi)) {
+  }
+
+  // The lines before lo are the same in all three, so copy them from a.
+  start = SeekLine(a, a->line);
+  FindSideLines(a, a_end, lo, hi, &a_start, &a_stop);
+  if ((res = Append(ret, a->data + start, a_start - start, false)) < 0) {
+    return res;
+  }
+  FindSideLines(b, b_end, lo, hi, &b_start, &b_stop);
+
+  if (b_end == b->next) {  // only a changed these lines
+    res = Append(ret, a->data + a_start, a_stop - a_start, false);
+  } else if (a_end == a->next ||  // only b did, or both the same way
+             (a_stop - a_start == b_stop - b_start &&
+              memcmp(a->data + a_start, b->data + b_start, a_stop - a_start) == 0)) {
+    res = Append(ret, b->data + b_start, b_stop - b_start, false);
+  } else {
+    ret->num_conflicts++;
+    if ((res = AppendMarker(ret, '<', a->name)) < 0 ||
+        (res = Append(ret, a->data + a_start, a_stop - a_start, true)) < 0 ||
+        (res = AppendMarker(ret, '=', NULL)) < 0 ||
+        (res = Append(ret, b->data + b_start, b_stop - b_start, true)) < 0 ||
+        (res = AppendMarker(ret, '>', b->name)) < 0) {
+      return res;
+    }
+  }
+
+  a->next = a_end;
+  b->next = b_end;
+  return res;
+}
+
+static bool TakeChanges(MergeSidePtr side, uint32_t *end, uint32_t *hi) {
+  bool taken = false;
+
+  while (*end < side->map.num_changes &&
+         side->map.changes[*end].a_start <= *hi) {
+    DiffChangePtr change = &side->map.changes[*end];
+    if (change->a_start + change->a_len > *hi) {
+      *hi = change->a_start + change->a_len;
+    }
+    (*end)++;
+    taken = true;
+  }
+  return taken;
+}
+
+static void FindSideLines(MergeSidePtr side,
+                          uint32_t end,
+                          uint32_t lo,
+                          uint32_t hi,
+                          size_t *start,
+                          size_t *stop) {
+  int64_t offset = side->offset;
+
+  // The lines before the first change are carried over one for one.
+  *start = SeekLine(side, (uint32_t)(lo + offset));
+  for (uint32_t i = side->next; i < end; i++) {
+    offset += (int64_t)side->map.changes[i].b_len - side->map.changes[i].a_len;
+  }
+  *stop = SeekLine(side, (uint32_t)(hi + offset));
+  side->offset = offset;
+}
+
+static size_t SeekLine(MergeSidePtr side, uint32_t line) {
+  const char *nl;
+
+  while (side->line < line && side->pos < side->len) {
+    nl = memchr(side->data + side->pos, '\n', side->len - side->pos);
+    side->pos = nl == NULL ? side->len : (size_t)(nl - side->data) + 1;
+    side->line++;
+  }
+  return side->pos;
+}
+
+static int32_t Append(MergeResultPtr ret,
+                      const char *data,
+                      size_t len,
+                      bool newline) {
+  size_t needed = ret->len + len + 1, capacity;
+  char *grown;
+
+  if (needed > ret->capacity) {
+    capacity = ret->capacity == 0 ? MERGE_INITIAL_CAPACITY : ret->capacity;
+    while (capacity < needed) {
+      capacity *= 2;
+    }
+    if ((grown = realloc(ret->data, capacity)) == NULL) {
+      return MEM_ERR;
+    }
+    ret->data = grown;
+    ret->capacity = capacity;
+  }
+
+  if (len > 0) {
+    memcpy(ret->data + ret->len, data, len);
+    ret->len += len;
+    if (newline && data[len - 1] != '\n') {
+      ret->data[ret->len++] = '\n';
+    }
+  }
+  return 0;
+}
+
+static int32_t AppendMarker(MergeResultPtr ret, char c, const char *name) {
+  size_t name_len = name == NULL ? 0 : strlen(name);
+  char marker[MERGE_MARKER_LEN + name_len + 3];
+
+  memset(marker, c, MERGE_MARKER_LEN);
+  if (name == NULL) {
+    marker[MERGE_MARKER_LEN] = '\n';
+    return Append(ret, marker, MERGE_MARKER_LEN + 1, false);
+  }
+  marker[MERGE_MARKER_LEN] = ' ';
+  memcpy(marker + MERGE_MARKER_LEN + 1, name, name_len);
+  marker[MERGE_MARKER_LEN + name_len + 1] = '\n';
+  return Append(ret, marker, MERGE_MARKER_LEN + name_len + 2, false);
+}
+
+void FreeMergeResult(MergeResultPtr result) {
+  free(result->data);
+  result->data = NULL;
+  result->len = result->capacity = 0;
+}
@@ -0,0 +1,75 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+
+#ifndef _CHECKPOINT_MERGE_H_
+#define _CHECKPOINT_MERGE_H_
+// This module merges two versions of a file (a and b) which were both
+// made from a common base. What changed from the base to each of them is
+// found with DiffLineMap (see checkpoint_diff.h), so the merge takes
+// linear space, however big the files are.
+//
+// The changes of both sides are then walked in order of where they are
+// in the base. A change which no change of the other side overlaps (or
+// touches) is taken as it is. Where changes of both sides overlap, they
+// are taken once if both sides made the same change, and otherwise both
+// versions are kept between conflict markers:
+//
+//  <<<<<<< a
+//  the lines of a
+//  =======
+//  the lines of b
+//  >>>>>>> b
+
+#include "checkpoint_diff.h"
+
+#define MERGE_ERR -1
+
+// The length of each conflict marker (not counting the name after it).
+#define MERGE_MARKER_LEN 7
+
+// One side of a merge, along with how far the merge has got through it.
+typedef struct merge_side {
+  const char *name;    // what to call the side in conflict markers
+  const char *data;
+  size_t      len;
+  LineMap     map;     // what changed from the base to this side
+  uint32_t    next;    // the first change of map not yet merged
+  // Outside of changes, line i of the base is line i + offset of this
+  // side (for the lines after the changes merged so far).
+  int64_t     offset;
+  uint32_t    line;    // the line the merge has got up to
+  size_t      pos;     // where that line starts
+} MergeSide, *MergeSidePtr;
+
+// The merged file, built up in memory.
+typedef struct merge_result {
+  char     *data;
+  size_t    len;
+  size_t    capacity;
+  uint32_t  num_conflicts;
+} MergeResult, *MergeResultPtr;
+
+// Merges the @a_len bytes at @a (called @a_name) and the @b_len bytes at
+// @b (called @b_name), which were both made from the @base_len bytes at
+// @base, into @ret. The data of @ret must be freed with FreeMergeResult.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - DIFF_ERR: if any of the files has more lines than can be diffed.
+//
+//  - The number of conflicts otherwise.
+int32_t MergeFiles(const char *base,
+                   size_t base_len,
+                   const char *a_name,
+                   const char *a,
+                   size_t a_len,
+                   const char *b_name,
+                   const char *b,
+                   size_t b_len,
+                   MergeResultPtr ret);
+
+// Frees the data of @result (but not @result itself).
+void FreeMergeResult(MergeResultPtr result);
+
+#endif  // _CHECKPOINT_MERGE_H_
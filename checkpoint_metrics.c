@@ -0,0 +1,516 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "checkpoint_metrics.h"
+#include "checkpoint_stats.h"
+#include "DataStructs/HashTable.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// The longest name (with its labels) of a sample. A longer line of the
+// metrics file is left out when it is read.
+#define METRICS_MAX_KEY 256
+
+// The families of metrics, in the order they are written.
+#define FAMILY_RUNS     0
+#define FAMILY_HISTS    1  // one for each histogram
+#define FAMILY_COUNTERS (FAMILY_HISTS + METRICS_NUM_HISTS)  // one for each
+                                                            // counter
+#define FAMILY_GAUGES   (FAMILY_COUNTERS + METRICS_NUM_COUNTERS)  // one for
+                                            // each gauge of checkpoint_stats
+#define NUM_FAMILIES    (FAMILY_GAUGES + STATS_NUM_GAUGES)
+
+// A family of metrics: one metric, or the series of one histogram.
+typedef struct metrics_family {
+  const char *name;
+  const char *type;  // "counter", "histogram" or "gauge"
+  const char *help;
+} MetricsFamily;
+
+// One sample: a series, and its value.
+typedef struct metrics_sample {
+  int32_t family;
+  bool    written;  // has it been written already?
+  double  value;
+  char    key[METRICS_MAX_KEY];  // the name and labels of the series
+} MetricsSample;
+
+typedef struct sample_list {
+  MetricsSample *samples;
+  uint32_t       num_samples;
+  uint32_t       capacity;
+} SampleList;
+
+// Exports the metrics of the run to where METRICS_ENV says. Matches
+// atexit.
+static void Export(void);
+
+// Adds the samples of the run to @list.
+//
+// Returns:
+//
+//  - METRICS_ERR: on a memory error.
+//
+//  - 0: if all went well.
+static int32_t CollectRun(SampleList *list);
+
+// Adds a sample of @family and @value to @list, whose key is made from
+// @format as printf would. A key too long for METRICS_MAX_KEY is cut
+// short.
+//
+// Returns:
+//
+//  - METRICS_ERR: on a memory error.
+//
+//  - 0: if all went well.
+static int32_t AddSample(SampleList *list,
+                         int32_t family,
+                         double value,
+                         const char *format, ...);
+
+// Adds every sample of the metrics file @path (which may not exist yet)
+// to @list, but for those of no family this module knows.
+//
+// Returns:
+//
+//  - METRICS_ERR: if the file exists, but could not be read.
+//
+//  - 0: if all went well.
+static int32_t ReadSamples(const char *path, SampleList *list);
+
+// Returns the family of the series @key, or -1 if it is of none.
+static int32_t FamilyOf(const char *key);
+
+// Writes the samples of @old and @run to @f, family by family. A sample
+// of @run with the same key as one of @old is added to it (or replaces
+// it, if it is a gauge).
+//
+// Returns:
+//
+//  - METRICS_ERR: on a memory error.
+//
+//  - 0: if all went well.
+static int32_t WriteSamples(FILE *f, SampleList *old, SampleList *run);
+
+// Adds the samples of @run to those of the metrics file @path, under a
+// lock, replacing the file with a new one.
+//
+// Returns:
+//
+//  - METRICS_ERR: if the file could not be locked, read or written.
+//
+//  - 0: if all went well.
+static int32_t AddToFile(const char *path, SampleList *run);
+
+// Writes the samples of @run to the Unix socket @socket_path.
+//
+// Returns:
+//
+//  - METRICS_ERR: if the socket could not be connected to or written.
+//
+//  - 0: if all went well.
+static int32_t SendToSocket(const char *socket_path, SampleList *run);
+
+// Returns the bucket of a histogram which counts @seconds.
+static int32_t BucketOf(double seconds);
+
+// Returns the upper bound (the le) of @bucket, in seconds.
+static double BucketBound(int32_t bucket);
+
+// Matches ValueFreeFnPtr, for a table whose values aren't pointers.
+static void MetricsNullFree(void *value) { }
+
+static const MetricsFamily families[NUM_FAMILIES] = {
+  { "cpt_runs_total", "counter", "Runs of Checkpoint, by command and result." },
+  { "cpt_command_duration_seconds", "histogram",
+    "Time spent running the command itself." },
+  { "cpt_log_load_duration_seconds", "histogram",
+    "Time spent reading the checkpoint log." },
+  { "cpt_log_save_duration_seconds", "histogram",
+    "Time spent writing the checkpoint log back." },
+  { "cpt_copy_duration_seconds", "histogram",
+    "Time spent copying between a source file and a checkpoint file." },
+  { "cpt_copy_bytes_total", "counter",
+    "Bytes copied between source files and checkpoint files." },
+  { "cpt_log_files", "gauge", "Source files tracked by the log." },
+  { "cpt_log_checkpoint_names", "gauge", "Checkpoint names known to the log." },
+  { "cpt_log_table_resizes", "gauge",
+    "Times the tables of the log have grown while it was read." },
+  { "cpt_log_tree_nodes", "gauge", "Nodes of all checkpoint trees." },
+  { "cpt_log_live_tree_nodes", "gauge",
+    "Nodes of all checkpoint trees which haven't been pruned." }
+};
+
+// Set by MetricsSetup (the command stays NULL unless METRICS_ENV is set).
+static const char *command_name = NULL;
+static const char *metrics_path = NULL;
+static bool succeeded = false;
+
+// The number of durations counted by each bucket of each histogram (the
+// last is +Inf only, so it isn't cumulative), their sums, and the
+// counters.
+static _Atomic uint64_t buckets[METRICS_NUM_HISTS][METRICS_NUM_BUCKETS + 1];
+static _Atomic uint64_t sum_ns[METRICS_NUM_HISTS];
+static _Atomic uint64_t counters[METRICS_NUM_COUNTERS];
+
+int32_t MetricsSetup(const char *command) {
+  const char *path = getenv(METRICS_ENV);
+
+  if (path == NULL || path[0] == '\0') {
+    return 0;
+  }
+  if (atexit(&Export) != 0) {
+    return METRICS_ERR;
+  }
+  metrics_path = path;
+  command_name = command;
+  return 0;
+}
+
+bool MetricsEnabled(void) {
+  return command_name != NULL;
+}
+
+void MetricsObserve(int32_t hist, double seconds) {
+  if (command_name == NULL) {
+    return;
+  }
+  atomic_fetch_add_explicit(&buckets[hist][BucketOf(seconds)], 1,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&sum_ns[hist],
+                            seconds > 0 ? (uint64_t)(seconds * 1e9) : 0,
+                            memory_order_relaxed);
+}
+
+void MetricsAdd(int32_t counter, uint64_t amount) {
+  if (command_name != NULL) {
+    atomic_fetch_add_explicit(&counters[counter], amount,
+                              memory_order_relaxed);
+  }
+}
+
+void MetricsSucceeded(void) {
+  succeeded = true;
+}
+
+static void Export(void) {
+  size_t prefix_len = strlen(METRICS_SOCKET_PREFIX);
+  SampleList run = { NULL, 0, 0 };
+  int32_t res;
+
+  if ((res = CollectRun(&run)) == 0) {
+    if (strncmp(metrics_path, METRICS_SOCKET_PREFIX, prefix_len) == 0) {
+      res = SendToSocket(metrics_path + prefix_len, &run);
+    } else {
+      res = AddToFile(metrics_path, &run);
+    }
+  }
+  if (res != 0) {
+    fprintf(stderr, "could not write metrics to %s\n", metrics_path);
+  }
+  free(run.samples);
+}
+
+static int32_t CollectRun(SampleList *list) {
+  const MetricsFamily *family;
+  uint64_t count;
+
+  if (AddSample(list, FAMILY_RUNS, 1,
+                "%s{command=\"%s\",result=\"%s\"}", families[FAMILY_RUNS].name,
+                command_name, succeeded ? "ok" : "error") != 0) {
+    return METRICS_ERR;
+  }
+
+  // Only the histograms which counted something this run are written, but
+  // each of those with every bucket, so a series has the same buckets in
+  // every run.
+  for (int32_t h = 0; h < METRICS_NUM_HISTS; h++) {
+    family = &families[FAMILY_HISTS + h];
+    count = 0;
+    for (int32_t i = 0; i <= METRICS_NUM_BUCKETS; i++) {
+      count += atomic_load_explicit(&buckets[h][i], memory_order_relaxed);
+    }
+    if (count == 0) {
+      continue;
+    }
+
+    count = 0;
+    for (int32_t i = 0; i < METRICS_NUM_BUCKETS; i++) {
+      count += atomic_load_explicit(&buckets[h][i], memory_order_relaxed);
+      if (AddSample(list, FAMILY_HISTS + h, count,
+                    "%s_bucket{command=\"%s\",le=\"%.6g\"}", family->name,
+                    command_name, BucketBound(i)) != 0) {
+        return METRICS_ERR;
+      }
+    }
+    count += atomic_load_explicit(&buckets[h][METRICS_NUM_BUCKETS],
+                                  memory_order_relaxed);
+    if (AddSample(list, FAMILY_HISTS + h, count,
+                  "%s_bucket{command=\"%s\",le=\"+Inf\"}", family->name,
+                  command_name) != 0 ||
+        AddSample(list, FAMILY_HISTS + h,
+                  atomic_load_explicit(&sum_ns[h], memory_order_relaxed) / 1e9,
+                  "%s_sum{command=\"%s\"}", family->name, command_name) != 0 ||
+        AddSample(list, FAMILY_HISTS + h, count,
+                  "%s_count{command=\"%s\"}", family->name,
+                  command_name) != 0) {
+      return METRICS_ERR;
+    }
+  }
+
+  for (int32_t c = 0; c < METRICS_NUM_COUNTERS; c++) {
+    if (AddSample(list, FAMILY_COUNTERS + c,
+                  atomic_load_explicit(&counters[c], memory_order_relaxed),
+                  "%s{command=\"%s\"}", families[FAMILY_COUNTERS + c].name,
+                  command_name) != 0) {
+      return METRICS_ERR;
+    }
+  }
+
+  // The gauges are only known to be of the whole log after a run which
+  // got to the end.
+  for (int32_t g = 0; g < STATS_NUM_GAUGES && succeeded; g++) {
+    if (AddSample(list, FAMILY_GAUGES + g, StatsGauge(g), "%s",
+                  families[FAMILY_GAUGES + g].name) != 0) {
+      return METRICS_ERR;
+    }
+  }
+  return 0;
+}
+
+static int32_t AddSample(SampleList *list,
+                         int32_t family,
+                         double value,
+                         const char *format, ...) {
+  MetricsSample *sample;
+  va_list args;
+
+  if (list->num_samples == list->capacity) {
+    uint32_t capacity = list->capacity == 0 ? 128 : list->capacity * 2;
+    sample = realloc(list->samples, sizeof(MetricsSample) * capacity);
+    if (sample == NULL) {
+      return METRICS_ERR;
+    }
+    list->samples = sample;
+    list->capacity = capacity;
+  }
+
+  sample = &list->samples[list->num_samples++];
+  sample->family = family;
+  sample->written = false;
+  sample->value = value;
+  va_start(args, format);
+  vsnprintf(sample->key, sizeof(sample->key), format, args);
+  va_end(args);
+  return 0;
+}
+
+static int32_t ReadSamples(const char *path, SampleList *list) {
+  char line[METRICS_MAX_KEY + 64], *value;
+  int32_t family, res = 0;
+  bool too_long = false;
+  FILE *f;
+
+  if ((f = fopen(path, "r")) == NULL) {
+    return errno == ENOENT ? 0 : METRICS_ERR;
+  }
+
+  while (res == 0 && fgets(line, sizeof(line), f) != NULL) {
+    // The rest of a line too long for the buffer is skipped along with it.
+    bool skip = too_long;
+    too_long = strchr(line, '\n') == NULL && !feof(f);
+    if (skip || too_long || line[0] == '#' ||
+        (value = strrchr(line, ' ')) == NULL) {
+      continue;
+    }
+    *value++ = '\0';
+    if ((family = FamilyOf(line)) >= 0) {
+      res = AddSample(list, family, strtod(value, NULL), "%s", line);
+    }
+  }
+
+  if (ferror(f)) {
+    res = METRICS_ERR;
+  }
+  fclose(f);
+  return res;
+}
+
+static int32_t FamilyOf(const char *key) {
+  const char *suffixes[] = { "_bucket", "_sum", "_count" };
+  size_t len = strcspn(key, "{"), name_len;
+
+  for (int32_t f = 0; f < NUM_FAMILIES; f++) {
+    name_len = strlen(families[f].name);
+    if (len < name_len || strncmp(key, families[f].name, name_len) != 0) {
+      continue;
+    }
+    if (len == name_len) {
+      return f;
+    }
+    for (uint32_t s = 0; s < 3 && strcmp(families[f].type, "histogram") == 0;
+         s++) {
+      if (len - name_len == strlen(suffixes[s]) &&
+          strncmp(key + name_len, suffixes[s], len - name_len) == 0) {
+        return f;
+      }
+    }
+  }
+  return -1;
+}
+
+static int32_t WriteSamples(FILE *f, SampleList *old, SampleList *run) {
+  HashTable keys;
+  HashTabKV kv;
+  MetricsSample *sample;
+  double value;
+
+  // The samples of the run, by key (each value is an index into @run).
+  if ((keys = MakeStrHashTable(INITIAL_BUCKET_COUNT)) == NULL) {
+    return METRICS_ERR;
+  }
+  for (uint32_t i = 0; i < run->num_samples; i++) {
+    if (HTInsertStr(keys, run->samples[i].key, (HashTabVal_t)(uintptr_t)i,
+                    &kv) == 0) {
+      FreeHashTable(keys, &MetricsNullFree);
+      return METRICS_ERR;
+    }
+  }
+
+  for (int32_t family = 0; family < NUM_FAMILIES; family++) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s %s\n",
+            families[family].name, families[family].help,
+            families[family].name, families[family].type);
+
+    for (uint32_t i = 0; i < old->num_samples; i++) {
+      if (old->samples[i].family != family) {
+        continue;
+      }
+      value = old->samples[i].value;
+      if (HTLookupStr(keys, old->samples[i].key, &kv) == 1) {
+        sample = &run->samples[(uintptr_t)kv.value];
+        value = strcmp(families[family].type, "gauge") == 0 ?
+                sample->value : value + sample->value;
+        sample->written = true;
+      }
+      fprintf(f, "%s %.17g\n", old->samples[i].key, value);
+    }
+
+    for (uint32_t i = 0; i < run->num_samples; i++) {
+      sample = &run->samples[i];
+      if (sample->family == family && !sample->written) {
+        fprintf(f, "%s %.17g\n", sample->key, sample->value);
+      }
+    }
+  }
+
+  FreeHashTable(keys, &MetricsNullFree);
+  return 0;
+}
+
+static int32_t AddToFile(const char *path, SampleList *run) {
+  size_t len = strlen(path);
+  char lock_path[len + sizeof(METRICS_LOCK_SUFFIX)], tmp_path[len + 5];
+  SampleList old = { NULL, 0, 0 };
+  struct flock lock;
+  int32_t res;
+  int lock_fd;
+  FILE *f;
+
+  snprintf(lock_path, sizeof(lock_path), "%s%s", path, METRICS_LOCK_SUFFIX);
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  if ((lock_fd = open(lock_path, O_RDWR | O_CREAT, 0644)) < 0) {
+    return METRICS_ERR;
+  }
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  while ((res = fcntl(lock_fd, F_SETLKW, &lock)) == -1 && errno == EINTR) { }
+  if (res == -1) {
+    close(lock_fd);
+    return METRICS_ERR;
+  }
+
+  // Renaming the new file over the old one means the file is never seen
+  // half written.
+  if ((res = ReadSamples(path, &old)) == 0) {
+    if ((f = fopen(tmp_path, "w")) == NULL) {
+      res = METRICS_ERR;
+    } else {
+      res = WriteSamples(f, &old, run);
+      if (fclose(f) != 0 || res != 0 || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        res = METRICS_ERR;
+      }
+    }
+  }
+
+  free(old.samples);
+  close(lock_fd);  // which lets go of the lock
+  return res;
+}
+
+static int32_t SendToSocket(const char *socket_path, SampleList *run) {
+  SampleList old = { NULL, 0, 0 };
+  struct sockaddr_un addr;
+  int32_t res;
+  int fd;
+  FILE *f;
+
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    return METRICS_ERR;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    return METRICS_ERR;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      (f = fdopen(fd, "w")) == NULL) {
+    close(fd);
+    return METRICS_ERR;
+  }
+  res = WriteSamples(f, &old, run);
+  return fclose(f) == 0 ? res : METRICS_ERR;
+}
+
+static int32_t BucketOf(double seconds) {
+  uint64_t bits;
+  int32_t exp;
+
+  if (!(seconds > 0)) {
+    return 0;
+  }
+  // The exponent of the double says which power of two it is in, and the
+  // top METRICS_SUB_BITS of its mantissa which part of it.
+  memcpy(&bits, &seconds, sizeof(bits));
+  exp = (int32_t)((bits >> 52) & 0x7ff) - 1023;
+  if (exp < METRICS_MIN_EXP) {
+    return 0;
+  }
+  if (exp >= METRICS_MAX_EXP) {
+    return METRICS_NUM_BUCKETS;
+  }
+  return (exp - METRICS_MIN_EXP) * METRICS_SUB_BUCKETS +
+         (int32_t)((bits >> (52 - METRICS_SUB_BITS)) &
+                   (METRICS_SUB_BUCKETS - 1));
+}
+
+static double BucketBound(int32_t bucket) {
+  int32_t next = bucket + 1;  // whose lower bound is the upper one of this
+  uint64_t bits;
+  double bound;
+
+  bits = (uint64_t)(METRICS_MIN_EXP + next / METRICS_SUB_BUCKETS + 1023) << 52 |
+         (uint64_t)(next % METRICS_SUB_BUCKETS) << (52 - METRICS_SUB_BITS);
+  memcpy(&bound, &bits, sizeof(bound));
+  return bound;
+}
@@ -0,0 +1,105 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+
+#ifndef _CHECKPOINT_METRICS_H_
+#define _CHECKPOINT_METRICS_H_
+// This module exports metrics of runs of the program in Prometheus's
+// text format, so that a directory whose checkpoints are made by a
+// script or a cron job can be watched like any other service.
+//
+// Each run is labelled with its command, and counts towards:
+//
+//   cpt_runs_total{command,result}        runs, by whether they succeeded
+//   cpt_command_duration_seconds{command} the command itself
+//   cpt_log_load_duration_seconds{command} reading the log (Setup)
+//   cpt_log_save_duration_seconds{command} writing the log back
+//   cpt_copy_duration_seconds{command}    each copy between a source file
+//                                         and a checkpoint file
+//   cpt_copy_bytes_total{command}         bytes copied by those copies
+//
+// where the durations are histograms, and the size of the log after the
+// last successful run is given by the gauges cpt_log_files,
+// cpt_log_checkpoint_names, cpt_log_table_resizes, cpt_log_tree_nodes
+// and cpt_log_live_tree_nodes. The p99 latency of each command is then
+//
+//   histogram_quantile(0.99,
+//     sum by (command, le) (rate(cpt_command_duration_seconds_bucket[5m])))
+//
+// The buckets of the histograms are like those of an HDR histogram:
+// every power of two from 2^METRICS_MIN_EXP to 2^METRICS_MAX_EXP seconds
+// is split into METRICS_SUB_BUCKETS, so a quantile is never off by more
+// than 1 / METRICS_SUB_BUCKETS of itself, and the bucket of a duration
+// is found from the bits of its double without any math. The buckets
+// and counters are atomics, so they can be added to by any thread
+// without a lock.
+//
+// If the environment variable METRICS_ENV names a file (e.g. one in the
+// node exporter's textfile directory), the metrics of each run are added
+// to those already in the file when the program exits, so that its
+// counters keep counting from run to run. The file is replaced whole (by
+// renaming a new one over it) under a lock on METRICS_LOCK_SUFFIX, so it
+// is never seen half written, and runs at the same time don't lose each
+// other's counts. If METRICS_ENV is METRICS_SOCKET_PREFIX followed by the
+// path of a Unix socket, the metrics of each run are instead written to
+// the socket, for whatever listens there to add up.
+//
+// Unless METRICS_ENV is set, nothing is recorded.
+
+#include "macros.h"
+
+#include <stdint.h>
+
+#define METRICS_ERR -1
+
+#define METRICS_ENV           "CPT_METRICS"
+#define METRICS_SOCKET_PREFIX "unix:"
+#define METRICS_LOCK_SUFFIX   ".lock"
+
+// The histograms.
+#define METRICS_HIST_COMMAND  0
+#define METRICS_HIST_LOG_LOAD 1
+#define METRICS_HIST_LOG_SAVE 2
+#define METRICS_HIST_COPY     3
+#define METRICS_NUM_HISTS     4
+
+// The counters (but for runs, which are counted on their own).
+#define METRICS_COUNTER_COPY_BYTES 0
+#define METRICS_NUM_COUNTERS       1
+
+// The buckets of a histogram: METRICS_SUB_BUCKETS for each power of two
+// from 2^METRICS_MIN_EXP (about 1us) up to 2^METRICS_MAX_EXP (about 17
+// minutes) seconds. A shorter duration is counted in the first bucket,
+// and a longer one only in +Inf.
+#define METRICS_MIN_EXP     -20
+#define METRICS_MAX_EXP     10
+#define METRICS_SUB_BITS    2
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_NUM_BUCKETS \
+  ((METRICS_MAX_EXP - METRICS_MIN_EXP) * METRICS_SUB_BUCKETS)
+
+// Starts recording the metrics of this run of @command, if METRICS_ENV
+// is set, and arranges for them to be exported when the program exits.
+// Until it is called, or if METRICS_ENV isn't set, the functions below
+// do nothing.
+//
+// Returns:
+//
+//  - METRICS_ERR: if that could not be arranged.
+//
+//  - 0: if all went well (or METRICS_ENV isn't set).
+int32_t MetricsSetup(const char *command);
+
+// Returns true if metrics are being recorded.
+bool MetricsEnabled(void);
+
+// Adds @seconds to the histogram @hist.
+void MetricsObserve(int32_t hist, double seconds);
+
+// Adds @amount to @counter.
+void MetricsAdd(int32_t counter, uint64_t amount);
+
+// Marks the run as successful, and the gauges of checkpoint_stats.h as
+// set to the size of the log after it. A run which exits without calling
+// it is counted as failed.
+void MetricsSucceeded(void);
+
+#endif  // _CHECKPOINT_METRICS_H_
@@ -0,0 +1,248 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "checkpoint_progress.h"
+#include "checkpoint_stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+
+// The longest report written (a longer one is cut short).
+#define PROGRESS_MAX_LINE 1024
+
+// Reports @progress, as of @now, to stderr and the file descriptor of
+// PROGRESS_FD_ENV (whichever are set up). @finished says if it is the
+// last report of the task.
+static void Report(ProgressPtr progress, double now, bool finished);
+
+// Appends to @buf, which holds @*len chars out of PROGRESS_MAX_LINE, as
+// printf would, and adds what was appended to @*len.
+static void Append(char *buf, size_t *len, const char *format, ...);
+
+// Appends @str to @buf (like Append) as a JSON string, or null if @str
+// is NULL.
+static void AppendJsonString(char *buf, size_t *len, const char *str);
+
+// Appends @amount of @unit (like Append), e.g. "1.5 GB" or "12 files".
+static void AppendAmount(char *buf, size_t *len, double amount, int32_t unit);
+
+// Appends @seconds (like Append), e.g. "1h05m", "3m20s" or "12s".
+static void AppendDuration(char *buf, size_t *len, double seconds);
+
+// Writes the @len chars of @buf to @fd, however many writes that takes.
+static void WriteAll(int fd, const char *buf, size_t len);
+
+static const char *unit_names[] = { "bytes", "files" };
+
+// Set (once) by ProgressSetup.
+static bool reporting = false;  // is anything reported at all?
+static bool human = false;      // are reports written to stderr?
+static bool human_tty = false;  // is stderr a terminal?
+static int  json_fd = -1;       // where JSON reports go, or -1
+
+int32_t ProgressSetup(bool to_stderr) {
+  const char *fd_str = getenv(PROGRESS_FD_ENV);
+  char *end;
+  long fd;
+
+  human = to_stderr;
+  human_tty = to_stderr && isatty(STDERR_FILENO);
+  if (fd_str != NULL && fd_str[0] != '\0') {
+    errno = 0;
+    fd = strtol(fd_str, &end, 10);
+    if (errno != 0 || *end != '\0' || fd < 0 || fd > INT32_MAX ||
+        fcntl(fd, F_GETFD) == -1) {
+      reporting = human;
+      return PROGRESS_ERR;
+    }
+    json_fd = fd;
+  }
+  reporting = human || json_fd != -1;
+  return 0;
+}
+
+void ProgressBegin(ProgressPtr progress,
+                   const char *task,
+                   const char *name,
+                   const char *engine,
+                   int32_t unit,
+                   uint64_t total) {
+  progress->task = task;
+  progress->name = name;
+  progress->engine = engine;
+  progress->unit = unit;
+  progress->total = total;
+  progress->done = 0;
+  progress->start = reporting ? StatsNow() : 0;
+  progress->last = progress->start;
+  progress->shown = false;
+}
+
+void ProgressAdd(ProgressPtr progress, uint64_t amount) {
+  double now;
+
+  progress->done += amount;
+  if (!reporting || (now = StatsNow()) - progress->last < PROGRESS_INTERVAL) {
+    return;
+  }
+  Report(progress, now, false);
+}
+
+void ProgressEnd(ProgressPtr progress) {
+  if (reporting && progress->shown) {
+    Report(progress, StatsNow(), true);
+  }
+}
+
+static void Report(ProgressPtr progress, double now, bool finished) {
+  char buf[PROGRESS_MAX_LINE];
+  size_t len;
+  double elapsed = now - progress->start;
+  double rate = elapsed > 0 ? progress->done / elapsed : 0;
+  double eta = -1;  // if it can't be told
+
+  if (progress->total > 0 && rate > 0) {
+    eta = progress->done >= progress->total ? 0 :
+          (progress->total - progress->done) / rate;
+  }
+  progress->shown = true;
+  progress->last = now;
+
+  if (human) {
+    // On a terminal, every report of a task overwrites the last one.
+    len = 0;
+    Append(buf, &len, "%s%s", human_tty ? "\r" : "", progress->task);
+    if (progress->name != NULL) {
+      Append(buf, &len, " %s", progress->name);
+    }
+    if (progress->engine != NULL) {
+      Append(buf, &len, " [%s]", progress->engine);
+    }
+    Append(buf, &len, ": ");
+    AppendAmount(buf, &len, progress->done, progress->unit);
+    if (progress->total > 0) {
+      Append(buf, &len, " of ");
+      AppendAmount(buf, &len, progress->total, progress->unit);
+      Append(buf, &len, " (%.0f%%)", 100.0 * progress->done / progress->total);
+    }
+    Append(buf, &len, ", ");
+    AppendAmount(buf, &len, rate, progress->unit);
+    Append(buf, &len, "/s");
+    if (finished) {
+      Append(buf, &len, ", took ");
+      AppendDuration(buf, &len, elapsed);
+    } else if (eta >= 0) {
+      Append(buf, &len, ", ETA ");
+      AppendDuration(buf, &len, eta);
+    }
+    Append(buf, &len, "%s", human_tty ? "\033[K" : "\n");
+    if (human_tty && finished) {
+      Append(buf, &len, "\n");
+    }
+    WriteAll(STDERR_FILENO, buf, len);
+  }
+
+  if (json_fd != -1) {
+    len = 0;
+    Append(buf, &len, "{\"task\":");
+    AppendJsonString(buf, &len, progress->task);
+    Append(buf, &len, ",\"name\":");
+    AppendJsonString(buf, &len, progress->name);
+    Append(buf, &len, ",\"engine\":");
+    AppendJsonString(buf, &len, progress->engine);
+    Append(buf, &len, ",\"unit\":\"%s\",\"done\":%lu,\"total\":",
+           unit_names[progress->unit], progress->done);
+    Append(buf, &len, progress->total > 0 ? "%lu" : "null", progress->total);
+    Append(buf, &len, ",\"elapsed\":%.3f,\"rate\":%.1f,\"eta\":", elapsed,
+           rate);
+    Append(buf, &len, eta >= 0 ? "%.3f" : "null", eta);
+    Append(buf, &len, ",\"finished\":%s}", finished ? "true" : "false");
+    // A line is only useful whole, so one which was cut short isn't
+    // written at all.
+    if (len < PROGRESS_MAX_LINE - 1) {
+      Append(buf, &len, "\n");
+      WriteAll(json_fd, buf, len);
+    }
+  }
+}
+
+static void Append(char *buf, size_t *len, const char *format, ...) {
+  va_list args;
+  int res;
+
+  if (*len >= PROGRESS_MAX_LINE - 1) {
+    return;
+  }
+  va_start(args, format);
+  res = vsnprintf(buf + *len, PROGRESS_MAX_LINE - *len, format, args);
+  va_end(args);
+  if (res > 0) {
+    *len += res;
+    if (*len > PROGRESS_MAX_LINE - 1) {
+      *len = PROGRESS_MAX_LINE - 1;
+    }
+  }
+}
+
+static void AppendJsonString(char *buf, size_t *len, const char *str) {
+  if (str == NULL) {
+    Append(buf, len, "null");
+    return;
+  }
+  Append(buf, len, "\"");
+  for (; *str != '\0'; str++) {
+    if (*str == '"' || *str == '\\') {
+      Append(buf, len, "\\%c", *str);
+    } else if ((unsigned char)*str < 0x20) {
+      Append(buf, len, "\\u%04x", (unsigned char)*str);
+    } else {
+      Append(buf, len, "%c", *str);
+    }
+  }
+  Append(buf, len, "\"");
+}
+
+static void AppendAmount(char *buf, size_t *len, double amount, int32_t unit) {
+  static const char *suffixes[] = { "B", "KB", "MB", "GB", "TB" };
+  int32_t i = 0;
+
+  if (unit == PROGRESS_UNIT_FILES) {
+    Append(buf, len, amount == (uint64_t)amount || amount >= 100 ?
+                     "%.0f files" : "%.1f files", amount);
+    return;
+  }
+  while (amount >= 1024 && i < 4) {
+    amount /= 1024;
+    i++;
+  }
+  Append(buf, len, i == 0 ? "%.0f %s" : "%.1f %s", amount, suffixes[i]);
+}
+
+static void AppendDuration(char *buf, size_t *len, double seconds) {
+  uint64_t s = seconds + 0.5;
+
+  if (s >= 3600) {
+    Append(buf, len, "%luh%02lum", s / 3600, s / 60 % 60);
+  } else if (s >= 60) {
+    Append(buf, len, "%lum%02lus", s / 60, s % 60);
+  } else {
+    Append(buf, len, "%lus", s);
+  }
+}
+
+static void WriteAll(int fd, const char *buf, size_t len) {
+  ssize_t res;
+
+  while (len > 0) {
+    if ((res = write(fd, buf, len)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    buf += res;
+    len -= res;
+  }
+}
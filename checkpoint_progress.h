@@ -0,0 +1,86 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+
+#ifndef _CHECKPOINT_PROGRESS_H_
+#define _CHECKPOINT_PROGRESS_H_
+// This module reports how far along a long task is (copying a big file
+// into or out of a checkpoint, or indexing or searching many checkpoint
+// files): how much has been done out of how much, how fast, and how long
+// the rest should take, so that a slow run can be told from a stuck one.
+//
+// A task is a Progress, which the code doing the task starts with
+// ProgressBegin, adds to with ProgressAdd as it goes, and finishes with
+// ProgressEnd. Reports are made at most once every PROGRESS_INTERVAL
+// seconds (and a task which takes less than that isn't reported at all),
+// so a task can add to its Progress as often as it likes.
+//
+// With --progress, reports are written to stderr for people to read, on
+// a single line which is rewritten if stderr is a terminal. If the
+// environment variable PROGRESS_FD_ENV names an open file descriptor,
+// they are also written to it as JSON, one object per line, for other
+// programs to read:
+//
+//   {"task":"checkpoint","name":"big.img","engine":"stdio","unit":"bytes",
+//    "done":1048576,"total":4194304,"elapsed":0.25,"rate":4194304.0,
+//    "eta":0.75,"finished":false}
+//
+// where total and eta are null if the size of the task isn't known.
+// Unless either is asked for, ProgressAdd only adds to a counter.
+
+#include "macros.h"
+
+#include <stdint.h>
+
+#define PROGRESS_ERR -1
+
+#define PROGRESS_FD_ENV "CPT_PROGRESS_FD"
+
+// The fewest seconds between two reports of a task.
+#define PROGRESS_INTERVAL 0.25
+
+// What a task counts.
+#define PROGRESS_UNIT_BYTES 0
+#define PROGRESS_UNIT_FILES 1
+
+// A task whose progress is reported.
+typedef struct progress {
+  const char *task;    // what is being done, e.g. "restore"
+  const char *name;    // what it is being done to, or NULL
+  const char *engine;  // what is doing it, or NULL
+  int32_t     unit;    // one of PROGRESS_UNIT_*
+  uint64_t    total;   // how much there is to do, or 0 if not known
+  uint64_t    done;    // how much has been done so far
+  double      start;   // when the task began (see StatsNow)
+  double      last;    // when it was last reported (or began)
+  bool        shown;   // has it been reported yet?
+} Progress, *ProgressPtr;
+
+// Sets up reporting: to stderr if @human is true, and to the file
+// descriptor in PROGRESS_FD_ENV, if it is set.
+//
+// Returns:
+//
+//  - PROGRESS_ERR: if PROGRESS_FD_ENV is set, but isn't an open file
+//    descriptor (reports are still written to stderr if @human is true).
+//
+//  - 0: if all went well.
+int32_t ProgressSetup(bool human);
+
+// Begins the task @progress, the @task of @name (which may be NULL) by
+// @engine (which may be NULL), which has @total of @unit to do (or 0 if
+// it isn't known). The strings must outlive the task.
+void ProgressBegin(ProgressPtr progress,
+                   const char *task,
+                   const char *name,
+                   const char *engine,
+                   int32_t unit,
+                   uint64_t total);
+
+// Adds @amount to what has been done of @progress, and reports it if it
+// has been PROGRESS_INTERVAL seconds since it was last reported.
+void ProgressAdd(ProgressPtr progress, uint64_t amount);
+
+// Finishes @progress, and reports it one last time if it has been
+// reported before.
+void ProgressEnd(ProgressPtr progress);
+
+#endif  // _CHECKPOINT_PROGRESS_H_
@@ -0,0 +1,88 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "checkpoint_record.h"
+#include "DataStructs/HashTable.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// Returns true if @arg is kept as it is in a recorded line: a number, or
+// an option made of letters (and dashes).
+static bool KeepArg(const char *arg);
+
+int32_t RecordCommand(const char *command, int32_t num_args, char **args) {
+  const char *path = getenv(RECORD_ENV), *salt = getenv(RECORD_SALT_ENV);
+  char line[RECORD_MAX_LINE];
+  struct timespec now;
+  struct stat st;
+  size_t salt_len;
+  int64_t size = -1;
+  int32_t len, res;
+  int fd;
+
+  if (path == NULL || path[0] == '\0') {
+    return 0;
+  }
+  // No salt is the same as an empty one.
+  if (salt == NULL) {
+    salt = "";
+  }
+  salt_len = strlen(salt);
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  if (num_args > 0 && stat(args[0], &st) == 0 && S_ISREG(st.st_mode)) {
+    size = st.st_size;
+  }
+  len = snprintf(line, sizeof(line), "%ld.%06ld,%s,%ld", (long)now.tv_sec,
+                 now.tv_nsec / 1000, command, size);
+
+  for (int32_t i = 0; i < num_args; i++) {
+    if (KeepArg(args[i])) {
+      res = snprintf(line + len, sizeof(line) - len, ",%s", args[i]);
+    } else {
+      size_t arg_len = strlen(args[i]);
+      char salted[salt_len + arg_len + 1];
+      memcpy(salted, salt, salt_len);
+      memcpy(salted + salt_len, args[i], arg_len + 1);
+      res = snprintf(line + len, sizeof(line) - len, ",%s%016lx",
+                     RECORD_TOKEN_PREFIX,
+                     (unsigned long)HashStr(salted, salt_len + arg_len));
+    }
+    // An argument which doesn't fit is left out, along with the rest.
+    if (res < 0 || (size_t)(len + res) >= sizeof(line) - 1) {
+      line[len] = '\0';
+      break;
+    }
+    len += res;
+  }
+  line[len++] = '\n';
+
+  if ((fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0) {
+    return RECORD_ERR;
+  }
+  while ((res = write(fd, line, len)) < 0 && errno == EINTR) { }
+  if (close(fd) != 0 || res != len) {
+    return RECORD_ERR;
+  }
+  return 0;
+}
+
+static bool KeepArg(const char *arg) {
+  bool option = arg[0] == '-' && arg[1] == '-';
+  const char *c = option ? arg + 2 : arg;
+
+  if (*c == '\0') {
+    return false;
+  }
+  for (; *c != '\0'; c++) {
+    if (option ? !(islower((unsigned char)*c) || *c == '-') :
+                 !isdigit((unsigned char)*c)) {
+      return false;
+    }
+  }
+  return true;
+}
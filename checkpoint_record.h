@@ -0,0 +1,53 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+
+#ifndef _CHECKPOINT_RECORD_H_
+#define _CHECKPOINT_RECORD_H_
+// This module records the commands run in a directory, so that a slow
+// mix of them can be replayed somewhere else (see Bench/bench_replay.c)
+// without giving away what the files and checkpoints were called.
+//
+// If the environment variable RECORD_ENV names a file, every run of a
+// valid command appends a line to it:
+//
+//   <time>,<command>,<size>[,<argument>]...
+//
+// where time is the seconds since the epoch the run began at, and size
+// is the number of bytes of the file named by the first argument (the
+// source file of most commands), or -1 if there is no such file. Each
+// argument which is a number or an option (like "--at") is kept as it
+// is. Every other one (a file or checkpoint name, a pattern, a time) is
+// replaced by RECORD_TOKEN_PREFIX and the hash of it in hex, so the
+// same name always gives the same token, and a token can be used as a
+// name. The hash isn't a cryptographic one: if the names could be
+// guessed, set RECORD_SALT_ENV to a secret, which is hashed along with
+// each of them.
+//
+// A line is written with a single write to a file opened for appending,
+// so the runs of many processes at once don't mix up each other's lines.
+
+#include "macros.h"
+
+#include <stdint.h>
+
+#define RECORD_ERR -1
+
+#define RECORD_ENV      "CPT_RECORD"
+#define RECORD_SALT_ENV "CPT_RECORD_SALT"
+
+#define RECORD_TOKEN_PREFIX "x"
+
+// The longest line recorded (the arguments which don't fit are left out).
+#define RECORD_MAX_LINE 1024
+
+// If RECORD_ENV is set, appends the line of a run of @command, with the
+// @num_args arguments @args (those after the command), to the file it
+// names.
+//
+// Returns:
+//
+//  - RECORD_ERR: if the file could not be written.
+//
+//  - 0: if all went well (or there is no such file).
+int32_t RecordCommand(const char *command, int32_t num_args, char **args);
+
+#endif  // _CHECKPOINT_RECORD_H_
@@ -0,0 +1,166 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "checkpoint_stats.h"
+#include "DataStructs/Allocator.h"
+
+#include <time.h>
+
+// Prints every timer, counter and gauge to stderr. Matches atexit.
+static void PrintSummary(void);
+
+static const char *timer_names[STATS_NUM_TIMERS] = {
+  "setup", "command", "write log", "find checkpoint", "copy data"
+};
+
+static const char *io_names[STATS_NUM_IO] = { "metadata", "data" };
+
+static const char *gauge_names[STATS_NUM_GAUGES] = {
+  "files tracked", "checkpoint names", "table resizes", "tree nodes",
+  "live tree nodes"
+};
+
+static const char *site_names[CP_ALLOC_NUM_SITES] = {
+  "linked lists", "hash tables", "trees", "file handler"
+};
+
+// When each timer was last started, the seconds it has counted so far,
+// and how many times it has been started.
+static double   timer_start[STATS_NUM_TIMERS];
+static double   timer_seconds[STATS_NUM_TIMERS];
+static uint64_t timer_calls[STATS_NUM_TIMERS];
+
+static uint64_t bytes_read[STATS_NUM_IO];
+static uint64_t bytes_written[STATS_NUM_IO];
+static uint64_t num_freads, num_fwrites, num_fseeks;
+
+static uint64_t gauges[STATS_NUM_GAUGES];
+
+// What each site of Allocator.h allocates, once StatsPrintAtExit has set
+// them up (NULL until then, or if they could not be made).
+static CPCountingAllocator counters[CP_ALLOC_NUM_SITES];
+
+void StatsStartTimer(int32_t timer) {
+  timer_start[timer] = StatsNow();
+  timer_calls[timer]++;
+}
+
+void StatsStopTimer(int32_t timer) {
+  timer_seconds[timer] += StatsNow() - timer_start[timer];
+}
+
+double StatsTimerSeconds(int32_t timer) {
+  return timer_seconds[timer];
+}
+
+double StatsNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+size_t StatsFread(void *ptr, size_t size, size_t num, FILE *f, int32_t io) {
+  size_t res = fread(ptr, size, num, f);
+  num_freads++;
+  bytes_read[io] += res * size;
+  return res;
+}
+
+size_t StatsFwrite(const void *ptr,
+                   size_t size,
+                   size_t num,
+                   FILE *f,
+                   int32_t io) {
+  size_t res = fwrite(ptr, size, num, f);
+  num_fwrites++;
+  bytes_written[io] += res * size;
+  return res;
+}
+
+int StatsFseek(FILE *f, long offset, int whence) {
+  num_fseeks++;
+  return fseek(f, offset, whence);
+}
+
+void StatsCountBytes(int32_t io, uint64_t read, uint64_t written) {
+  bytes_read[io] += read;
+  bytes_written[io] += written;
+}
+
+void StatsSetGauge(int32_t gauge, uint64_t value) {
+  gauges[gauge] = value;
+}
+
+uint64_t StatsGauge(int32_t gauge) {
+  return gauges[gauge];
+}
+
+int32_t StatsPrintAtExit(void) {
+  for (int32_t i = 0; i < CP_ALLOC_NUM_SITES; i++) {
+    if ((counters[i] = MakeCountingAllocator(CPGetAllocator(i))) == NULL) {
+      return STATS_ERR;
+    }
+    CPSetAllocator(i, CountingAllocatorBase(counters[i]));
+  }
+  return atexit(&PrintSummary) == 0 ? 0 : STATS_ERR;
+}
+
+int32_t StatsAppendPhaseTimes(const char *command) {
+  const char *path = getenv(STATS_PHASE_TIMES_ENV);
+  FILE *f;
+
+  if (path == NULL || path[0] == '\0') {
+    return 0;
+  }
+  if ((f = fopen(path, "a")) == NULL) {
+    return STATS_ERR;
+  }
+  fprintf(f, "%s", command);
+  for (int32_t i = 0; i < STATS_NUM_PHASES; i++) {
+    fprintf(f, ",%.9f", timer_seconds[i]);
+  }
+  fprintf(f, "\n");
+  return fclose(f) == 0 ? 0 : STATS_ERR;
+}
+
+static void PrintSummary(void) {
+  double total = 0;
+
+  // Whatever the command printed comes first.
+  fflush(stdout);
+  for (int32_t i = 0; i < STATS_NUM_PHASES; i++) {
+    total += timer_seconds[i];
+  }
+  fprintf(stderr, "\n--- stats ---\n");
+  for (int32_t i = 0; i < STATS_NUM_TIMERS; i++) {
+    fprintf(stderr, "%s%-16s %10.3f ms", i < STATS_NUM_PHASES ? "" : "  ",
+            timer_names[i], timer_seconds[i] * 1e3);
+    if (i >= STATS_NUM_PHASES) {
+      fprintf(stderr, "  (%lu calls)\n", timer_calls[i]);
+    } else {
+      fprintf(stderr, "  %5.1f%%\n",
+              total > 0 ? timer_seconds[i] / total * 100 : 0);
+    }
+  }
+  for (int32_t i = 0; i < STATS_NUM_IO; i++) {
+    fprintf(stderr, "%-8s read %12lu bytes, written %12lu bytes\n",
+            io_names[i], bytes_read[i], bytes_written[i]);
+  }
+  fprintf(stderr, "calls    fread %lu, fwrite %lu, fseek %lu\n",
+          num_freads, num_fwrites, num_fseeks);
+  for (int32_t i = 0; i < STATS_NUM_GAUGES; i++) {
+    fprintf(stderr, "%-16s %12lu\n", gauge_names[i], gauges[i]);
+  }
+
+  // The log has been freed by now, so whatever is still live was leaked.
+  fprintf(stderr, "%-16s %9s %9s %9s %12s %12s %10s\n", "allocations",
+          "allocs", "resizes", "frees", "bytes", "peak bytes", "live");
+  for (int32_t i = 0; i < CP_ALLOC_NUM_SITES && counters[i] != NULL; i++) {
+    CPAllocCounts counts;
+    CountingAllocatorCounts(counters[i], &counts);
+    fprintf(stderr, "  %-14s %9lu %9lu %9lu %12lu %12lu %10lu\n",
+            site_names[i], counts.allocs, counts.resizes, counts.frees,
+            counts.bytes, counts.peak_bytes, counts.live_bytes);
+  }
+}
@@ -0,0 +1,111 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+
+#ifndef _CHECKPOINT_STATS_H_
+#define _CHECKPOINT_STATS_H_
+// This module keeps track of where a run of the program spends its time
+// and what it reads and writes, so that a slow run can be explained
+// without a DEBUG build.
+//
+// Timers add up the time spent in the phases of a run (reading the log
+// in Setup, the command itself, and writing the log back), and in a few
+// parts of them which may be slow. The times are taken from the
+// monotonic clock, so changes to the system time don't skew them.
+// Counters add up the bytes read and written, and the calls to fread,
+// fwrite and fseek made to do so, which the file handling code makes
+// through StatsFread, StatsFwrite and StatsFseek. Gauges record how big
+// the log is (its tables and trees), as set by the caller. With --stats,
+// every site of DataStructs/Allocator.h also allocates through a counting
+// allocator, which counts its allocations, bytes and peak memory.
+//
+// With --stats, a summary of all of them is printed when the program
+// exits. If the environment variable STATS_PHASE_TIMES_ENV names a file,
+// a line of the phase times is appended to it at the end of every
+// successful run, which is how the benchmark (Bench/bench_cli.c) finds
+// out where each run's time went.
+
+#include "macros.h"
+
+#include <stdint.h>
+
+#define STATS_ERR -1
+
+// The timers. The first STATS_NUM_PHASES are the phases of a run, in
+// the order they happen. The others are timed within them.
+#define STATS_PHASE_SETUP    0
+#define STATS_PHASE_COMMAND  1
+#define STATS_PHASE_WRITE    2  // not run by read only commands
+#define STATS_NUM_PHASES     3
+#define STATS_TIMER_FIND_CPT 3  // looking up checkpoints by name
+#define STATS_TIMER_COPY     4  // copying between source and checkpoint files
+#define STATS_NUM_TIMERS     5
+
+// What is being read or written.
+#define STATS_IO_META 0  // the log, line maps and the trigram index
+#define STATS_IO_DATA 1  // source and checkpoint files
+#define STATS_NUM_IO  2
+
+// The gauges.
+#define STATS_GAUGE_FILES      0  // source files tracked
+#define STATS_GAUGE_CPT_NAMES  1  // checkpoint names known
+#define STATS_GAUGE_RESIZES    2  // times the tables of the log have grown
+#define STATS_GAUGE_NODES      3  // nodes of all checkpoint trees
+#define STATS_GAUGE_LIVE_NODES 4  // of which not pruned
+#define STATS_NUM_GAUGES       5
+
+#define STATS_PHASE_TIMES_ENV "CPT_PHASE_TIMES"
+
+// Starts (or stops) @timer. A timer may be started more than once, in
+// which case the times are added up.
+void StatsStartTimer(int32_t timer);
+void StatsStopTimer(int32_t timer);
+
+// Returns the seconds counted by @timer so far.
+double StatsTimerSeconds(int32_t timer);
+
+// Returns the seconds since some fixed point in the past, from the
+// monotonic clock.
+double StatsNow(void);
+
+// fread, fwrite and fseek, which also count the call, and the bytes
+// read or written as @io.
+size_t StatsFread(void *ptr, size_t size, size_t num, FILE *f, int32_t io);
+size_t StatsFwrite(const void *ptr,
+                   size_t size,
+                   size_t num,
+                   FILE *f,
+                   int32_t io);
+int StatsFseek(FILE *f, long offset, int whence);
+
+// Counts @read bytes read and @written bytes written as @io, by some
+// other means than the above (e.g. mapping a file).
+void StatsCountBytes(int32_t io, uint64_t read, uint64_t written);
+
+// Sets @gauge to @value.
+void StatsSetGauge(int32_t gauge, uint64_t value);
+
+// Returns the value of @gauge (0 if it has never been set).
+uint64_t StatsGauge(int32_t gauge);
+
+// Makes the program print a summary of every timer, counter and gauge
+// to stderr when it exits. Also starts counting what each site of
+// Allocator.h allocates, so it must be called before any of them has
+// allocated anything.
+//
+// Returns:
+//
+//  - STATS_ERR: if that could not be arranged.
+//
+//  - 0: if all went well.
+int32_t StatsPrintAtExit(void);
+
+// If STATS_PHASE_TIMES_ENV is set, appends a line to the file it names:
+// @command, then the seconds spent in each phase, comma separated.
+//
+// Returns:
+//
+//  - STATS_ERR: if the file could not be written.
+//
+//  - 0: if all went well (or there is no such file).
+int32_t StatsAppendPhaseTimes(const char *command);
+
+#endif  // _CHECKPOINT_STATS_H_
@@ -0,0 +1,555 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+
+#include "checkpoint_succinct.h"
+
+// What FwdSearch and BwdSearch return if there is no such position.
+#define SUCCINCT_NOT_FOUND UINT64_MAX
+
+// A name and the node it belongs to, to be sorted by name.
+typedef struct name_ref {
+  const char *name;
+  uint32_t    node;
+} NameRef;
+
+// Helper method to CreateSuccinctCpTree. Walks @tree in preorder,
+// writing the parentheses of every live node into @ret->bits, and the
+// handle of each node into @order (in the order they are numbered).
+// Sets @ret->num_nodes.
+static void WriteParens(CpTreePtr tree, SuccinctCpTreePtr ret, CpTreeHandle *order);
+
+// Helper method to CreateSuccinctCpTree. Fills in @ret->ranks and the
+// range min-max tree @ret->mins from @ret->bits.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - CREATE_TREE_SUCCESS: if all went well.
+static int32_t IndexParens(SuccinctCpTreePtr ret);
+
+// Helper method to CreateSuccinctCpTree. Sorts the names of the nodes
+// of @tree (whose handles are in @order) and front codes them into
+// @ret, along with the bit packed ids.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - CREATE_TREE_SUCCESS: if all went well.
+static int32_t WriteNames(CpTreePtr tree, SuccinctCpTreePtr ret, CpTreeHandle *order);
+
+// Compares two NameRefs by name. Matches qsort.
+static int CompareNameRefs(const void *a, const void *b);
+
+// Allocates @array, with room for @len numbers of up to @max_value, all 0.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - CREATE_TREE_SUCCESS: if all went well.
+static int32_t MakePackedArray(PackedArray *array, uint32_t len, uint32_t max_value);
+
+// Sets (or gets) the @i-th number of @array, which must not have been
+// set before.
+static void PackedArraySet(PackedArray *array, uint32_t i, uint32_t value);
+static uint32_t PackedArrayGet(const PackedArray *array, uint32_t i);
+
+// Returns the bit at @pos of the parentheses of @tree.
+static bool BitAt(SuccinctCpTreePtr tree, uint64_t pos);
+
+// Returns the number of 1s before @pos in the parentheses of @tree.
+static uint32_t Rank1(SuccinctCpTreePtr tree, uint64_t pos);
+
+// Returns the position of the 1 bit of @node (the @node-th 1, from 0).
+static uint64_t Select1(SuccinctCpTreePtr tree, uint32_t node);
+
+// Returns the excess (1s minus 0s) before @pos.
+static int64_t Excess(SuccinctCpTreePtr tree, uint64_t pos);
+
+// Returns the first position after @start (or the last before it, for
+// BwdSearch) at which the excess is at most @target, or
+// SUCCINCT_NOT_FOUND if there is none.
+static uint64_t FwdSearch(SuccinctCpTreePtr tree, uint64_t start, int64_t target);
+static uint64_t BwdSearch(SuccinctCpTreePtr tree, uint64_t start, int64_t target);
+
+// Writes @value to @out as a varint (7 bits a byte, lowest first).
+//
+// Returns: the number of bytes written.
+static uint32_t PutVarint(unsigned char *out, uint32_t value);
+
+// Reads a varint at @*in into @value, moving @*in past it.
+static void GetVarint(const unsigned char **in, uint32_t *value);
+
+// Decodes the names of bucket @bucket of @tree into @name one by one,
+// stopping after the @last-th (from 0), or once the name is @stop or
+// comes after it if @stop isn't NULL.
+//
+// Returns: the index within the bucket of the last name decoded.
+static uint32_t DecodeBucket(SuccinctCpTreePtr tree,
+                             uint32_t bucket,
+                             uint32_t last,
+                             const char *stop,
+                             char *name);
+
+int32_t CreateSuccinctCpTree(CpTreePtr tree, SuccinctCpTreePtr *ret) {
+  SuccinctCpTreePtr new_tree;
+  CpTreeHandle *order;
+  int32_t num_attempts = NUMBER_ATTEMPTS;
+
+  ATTEMPT((new_tree = calloc(1, sizeof(SuccinctCpTree))), NULL, num_attempts)
+
+  // There are at most as many live nodes as there are nodes.
+  new_tree->num_words = (2 * (uint64_t)tree->num_nodes + 63) / 64;
+  new_tree->bits = calloc(new_tree->num_words + 1, sizeof(uint64_t));
+  order = malloc(sizeof(CpTreeHandle) * tree->num_nodes);
+  if (new_tree->bits == NULL || order == NULL) {
+    free(order);
+    FreeSuccinctCpTree(new_tree);
+    return MEM_ERR;
+  }
+
+  WriteParens(tree, new_tree, order);
+  new_tree->num_words = (2 * (uint64_t)new_tree->num_nodes + 63) / 64;
+  if (IndexParens(new_tree) != CREATE_TREE_SUCCESS ||
+      WriteNames(tree, new_tree, order) != CREATE_TREE_SUCCESS) {
+    free(order);
+    FreeSuccinctCpTree(new_tree);
+    return MEM_ERR;
+  }
+
+  free(order);
+  *ret = new_tree;
+  return CREATE_TREE_SUCCESS;
+}
+
+static void WriteParens(CpTreePtr tree, SuccinctCpTreePtr ret, CpTreeHandle *order) {
+  CpTreeHandle node = CPT_ROOT_HANDLE;
+  uint64_t pos = 0;
+
+  // Like CpTreePreorder, but a 0 is written each time the walk leaves a
+  // node (once all of its children are done).
+  ret->num_nodes = 0;
+  while (true) {
+    ret->bits[pos / 64] |= (uint64_t)1 << (pos % 64);
+    pos++;
+    order[ret->num_nodes++] = node;
+    if (tree->nodes[node].first_child != CPT_NULL_HANDLE) {
+      node = tree->nodes[node].first_child;
+      continue;
+    }
+
+    pos++;  // leave the leaf
+    while (node != CPT_ROOT_HANDLE &&
+           tree->nodes[node].next_sibling == CPT_NULL_HANDLE) {
+      node = tree->nodes[node].parent;
+      pos++;  // and every ancestor it was the last child of
+    }
+    if (node == CPT_ROOT_HANDLE) {
+      return;
+    }
+    node = tree->nodes[node].next_sibling;
+  }
+}
+
+static int32_t IndexParens(SuccinctCpTreePtr ret) {
+  uint64_t end = 2 * (uint64_t)ret->num_nodes;
+  uint32_t num_supers = ret->num_words / SUCCINCT_SUPER_WORDS + 1, rank = 0;
+  uint32_t num_used_leaves = end / 64 + 1;
+  int64_t excess = 0;
+
+  if ((ret->ranks = malloc(sizeof(uint32_t) * num_supers)) == NULL) {
+    return MEM_ERR;
+  }
+  for (uint32_t w = 0; w < num_supers * SUCCINCT_SUPER_WORDS; w++) {
+    if (w % SUCCINCT_SUPER_WORDS == 0) {
+      ret->ranks[w / SUCCINCT_SUPER_WORDS] = rank;
+    }
+    if (w < ret->num_words) {
+      rank += __builtin_popcountll(ret->bits[w]);
+    }
+  }
+
+  // Leaves which hold no positions (past the end) never match a search.
+  ret->num_leaves = 1;
+  while (ret->num_leaves < num_used_leaves) {
+    ret->num_leaves *= 2;
+  }
+  if ((ret->mins = malloc(sizeof(int32_t) * 2 * ret->num_leaves)) == NULL) {
+    return MEM_ERR;
+  }
+  for (uint32_t i = 0; i < 2 * ret->num_leaves; i++) {
+    ret->mins[i] = INT32_MAX;
+  }
+  for (uint64_t pos = 0; pos <= end; pos++) {
+    int32_t *leaf = &ret->mins[ret->num_leaves + pos / 64];
+    if (excess < *leaf) {
+      *leaf = excess;
+    }
+    if (pos < end) {
+      excess += BitAt(ret, pos) ? 1 : -1;
+    }
+  }
+  for (uint32_t i = ret->num_leaves - 1; i > 0; i--) {
+    ret->mins[i] = ret->mins[2 * i] < ret->mins[2 * i + 1] ?
+                   ret->mins[2 * i] : ret->mins[2 * i + 1];
+  }
+  return CREATE_TREE_SUCCESS;
+}
+
+static int32_t WriteNames(CpTreePtr tree, SuccinctCpTreePtr ret, CpTreeHandle *order) {
+  NameRef *refs;
+  size_t bound = 0, pos = 0;
+  uint32_t n = ret->num_nodes, len, shared, i;
+  const char *prev = "";
+
+  if ((refs = malloc(sizeof(NameRef) * n)) == NULL) {
+    return MEM_ERR;
+  }
+  for (i = 0; i < n; i++) {
+    refs[i].name = CPT_NAME(tree, order[i]);
+    refs[i].node = i;
+    len = strlen(refs[i].name);
+    ret->max_name_len = len > ret->max_name_len ? len : ret->max_name_len;
+    bound += len + 10;  // two varints take at most 10 bytes
+  }
+  qsort(refs, n, sizeof(NameRef), &CompareNameRefs);
+
+  ret->num_buckets = (n + SUCCINCT_BUCKET_SIZE - 1) / SUCCINCT_BUCKET_SIZE;
+  ret->names = malloc(bound);
+  ret->bucket_offsets = malloc(sizeof(uint64_t) * ret->num_buckets);
+  if (ret->names == NULL || ret->bucket_offsets == NULL ||
+      MakePackedArray(&ret->name_to_node, n, n - 1) != CREATE_TREE_SUCCESS ||
+      MakePackedArray(&ret->node_to_name, n, n - 1) != CREATE_TREE_SUCCESS) {
+    free(refs);
+    return MEM_ERR;
+  }
+
+  for (i = 0; i < n; i++) {
+    len = strlen(refs[i].name);
+    if (i % SUCCINCT_BUCKET_SIZE == 0) {
+      ret->bucket_offsets[i / SUCCINCT_BUCKET_SIZE] = pos;
+      shared = 0;
+    } else {
+      for (shared = 0; prev[shared] != '\0' && prev[shared] == refs[i].name[shared];
+           shared++) {
+      }
+      pos += PutVarint(ret->names + pos, shared);
+    }
+    pos += PutVarint(ret->names + pos, len - shared);
+    memcpy(ret->names + pos, refs[i].name + shared, len - shared);
+    pos += len - shared;
+    prev = refs[i].name;
+
+    PackedArraySet(&ret->name_to_node, i, refs[i].node);
+    PackedArraySet(&ret->node_to_name, refs[i].node, i);
+  }
+
+  // Give back what front coding saved.
+  unsigned char *shrunk = realloc(ret->names, pos > 0 ? pos : 1);
+  if (shrunk != NULL) {
+    ret->names = shrunk;
+  }
+  ret->names_len = pos;
+  free(refs);
+  return CREATE_TREE_SUCCESS;
+}
+
+static int CompareNameRefs(const void *a, const void *b) {
+  return strcmp(((const NameRef *)a)->name, ((const NameRef *)b)->name);
+}
+
+static int32_t MakePackedArray(PackedArray *array, uint32_t len, uint32_t max_value) {
+  array->width = 1;
+  while (array->width < 32 && (max_value >> array->width) != 0) {
+    array->width++;
+  }
+  // One word more than needed, so a number may always spill over.
+  array->words = calloc(((uint64_t)len * array->width) / 64 + 2, sizeof(uint64_t));
+  return array->words == NULL ? MEM_ERR : CREATE_TREE_SUCCESS;
+}
+
+static void PackedArraySet(PackedArray *array, uint32_t i, uint32_t value) {
+  uint64_t bit = (uint64_t)i * array->width;
+  uint32_t offset = bit % 64;
+
+  array->words[bit / 64] |= (uint64_t)value << offset;
+  if (offset + array->width > 64) {
+    array->words[bit / 64 + 1] |= (uint64_t)value >> (64 - offset);
+  }
+}
+
+static uint32_t PackedArrayGet(const PackedArray *array, uint32_t i) {
+  uint64_t bit = (uint64_t)i * array->width, value;
+  uint32_t offset = bit % 64;
+
+  value = array->words[bit / 64] >> offset;
+  if (offset + array->width > 64) {
+    value |= array->words[bit / 64 + 1] << (64 - offset);
+  }
+  return value & (((uint64_t)1 << array->width) - 1);
+}
+
+static bool BitAt(SuccinctCpTreePtr tree, uint64_t pos) {
+  return (tree->bits[pos / 64] >> (pos % 64)) & 1;
+}
+
+static uint32_t Rank1(SuccinctCpTreePtr tree, uint64_t pos) {
+  uint64_t word = pos / 64;
+  uint32_t rank = tree->ranks[word / SUCCINCT_SUPER_WORDS];
+
+  for (uint64_t w = word - word % SUCCINCT_SUPER_WORDS; w < word; w++) {
+    rank += __builtin_popcountll(tree->bits[w]);
+  }
+  if (pos % 64 != 0) {
+    rank += __builtin_popcountll(tree->bits[word] &
+                                 (((uint64_t)1 << (pos % 64)) - 1));
+  }
+  return rank;
+}
+
+static uint64_t Select1(SuccinctCpTreePtr tree, uint32_t node) {
+  uint32_t lo = 0, hi = tree->num_words / SUCCINCT_SUPER_WORDS, mid, left, count;
+  uint64_t w, bits;
+
+  // The last run of words with fewer 1s before it than node + 1...
+  while (lo < hi) {
+    mid = lo + (hi - lo + 1) / 2;
+    if (tree->ranks[mid] <= node) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+
+  // ...then the word within it...
+  left = node - tree->ranks[lo];
+  for (w = (uint64_t)lo * SUCCINCT_SUPER_WORDS;
+       (count = __builtin_popcountll(tree->bits[w])) <= left;
+       w++) {
+    left -= count;
+  }
+
+  // ...then the bit within that.
+  bits = tree->bits[w];
+  while (left-- > 0) {
+    bits &= bits - 1;
+  }
+  return w * 64 + __builtin_ctzll(bits);
+}
+
+static int64_t Excess(SuccinctCpTreePtr tree, uint64_t pos) {
+  return 2 * (int64_t)Rank1(tree, pos) - (int64_t)pos;
+}
+
+static uint64_t FwdSearch(SuccinctCpTreePtr tree, uint64_t start, int64_t target) {
+  uint64_t end = 2 * (uint64_t)tree->num_nodes, pos = start;
+  int64_t excess = Excess(tree, start);
+  uint32_t v;
+
+  // The rest of the word start is in...
+  while ((pos + 1) % 64 != 0) {
+    if (pos >= end) {
+      return SUCCINCT_NOT_FOUND;
+    }
+    excess += BitAt(tree, pos++) ? 1 : -1;
+    if (excess <= target) {
+      return pos;
+    }
+  }
+
+  // ...then the first word further on whose smallest excess is low
+  // enough: up the tree until a right sibling has one, then down it,
+  // keeping as far left as possible.
+  if ((pos + 1) / 64 >= tree->num_leaves) {
+    return SUCCINCT_NOT_FOUND;
+  }
+  v = tree->num_leaves + (pos + 1) / 64;
+  if (tree->mins[v] > target) {
+    while (v % 2 != 0 || tree->mins[v + 1] > target) {
+      if ((v /= 2) <= 1) {
+        return SUCCINCT_NOT_FOUND;
+      }
+    }
+    for (v++; v < tree->num_leaves; ) {
+      v = tree->mins[2 * v] <= target ? 2 * v : 2 * v + 1;
+    }
+  }
+
+  pos = (uint64_t)(v - tree->num_leaves) * 64;
+  excess = Excess(tree, pos);
+  while (excess > target) {
+    excess += BitAt(tree, pos++) ? 1 : -1;
+  }
+  return pos;
+}
+
+static uint64_t BwdSearch(SuccinctCpTreePtr tree, uint64_t start, int64_t target) {
+  uint64_t pos = start;
+  int64_t excess = Excess(tree, start);
+  uint32_t v;
+
+  // Back to the start of the word start is in...
+  while (pos % 64 != 0) {
+    excess -= BitAt(tree, --pos) ? 1 : -1;
+    if (excess <= target) {
+      return pos;
+    }
+  }
+
+  // ...then the first word further back whose smallest excess is low
+  // enough, keeping as far right as possible on the way down.
+  if (pos == 0) {
+    return SUCCINCT_NOT_FOUND;
+  }
+  v = tree->num_leaves + pos / 64 - 1;
+  if (tree->mins[v] > target) {
+    while (v % 2 != 1 || tree->mins[v - 1] > target) {
+      if ((v /= 2) <= 1) {
+        return SUCCINCT_NOT_FOUND;
+      }
+    }
+    for (v--; v < tree->num_leaves; ) {
+      v = tree->mins[2 * v + 1] <= target ? 2 * v + 1 : 2 * v;
+    }
+  }
+
+  pos = (uint64_t)(v - tree->num_leaves + 1) * 64;
+  excess = Excess(tree, pos);
+  do {
+    excess -= BitAt(tree, --pos) ? 1 : -1;
+  } while (excess > target);
+  return pos;
+}
+
+uint32_t SuccinctParent(SuccinctCpTreePtr tree, uint32_t node) {
+  if (node == 0) {
+    return SUCCINCT_NULL;
+  }
+
+  // The parent opened where the excess was last one less than it is
+  // where node opens.
+  uint64_t pos = Select1(tree, node);
+  return Rank1(tree, BwdSearch(tree, pos, Excess(tree, pos) - 1));
+}
+
+uint32_t SuccinctFirstChild(SuccinctCpTreePtr tree, uint32_t node) {
+  uint64_t pos = Select1(tree, node);
+  return BitAt(tree, pos + 1) ? node + 1 : SUCCINCT_NULL;
+}
+
+uint32_t SuccinctNextSibling(SuccinctCpTreePtr tree, uint32_t node) {
+  // The subtree of node ends where the excess drops back to what it was
+  // where node opened. If another node opens there, it is the sibling.
+  uint64_t pos = Select1(tree, node);
+  pos = FwdSearch(tree, pos, Excess(tree, pos));
+  if (pos >= 2 * (uint64_t)tree->num_nodes || !BitAt(tree, pos)) {
+    return SUCCINCT_NULL;
+  }
+  return Rank1(tree, pos);
+}
+
+uint32_t SuccinctDepth(SuccinctCpTreePtr tree, uint32_t node) {
+  return Excess(tree, Select1(tree, node));
+}
+
+int32_t SuccinctFindCpt(SuccinctCpTreePtr tree,
+                        const char *cpt_name,
+                        uint32_t *ret) {
+  char name[tree->max_name_len + 1];
+  uint32_t lo = 0, hi = tree->num_buckets, mid, last;
+
+  // The last bucket whose first name doesn't come after cpt_name...
+  while (hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    DecodeBucket(tree, mid, 0, NULL, name);
+    if (strcmp(name, cpt_name) <= 0) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+
+  // ...holds cpt_name, if any does.
+  last = DecodeBucket(tree, lo, SUCCINCT_BUCKET_SIZE - 1, cpt_name, name);
+  if (strcmp(name, cpt_name) != 0) {
+    return FIND_CPT_ABSENT;
+  }
+  *ret = PackedArrayGet(&tree->name_to_node, lo * SUCCINCT_BUCKET_SIZE + last);
+  return FIND_CPT_SUCCESS;
+}
+
+uint32_t SuccinctCptName(SuccinctCpTreePtr tree, uint32_t node, char *name) {
+  uint32_t i = PackedArrayGet(&tree->node_to_name, node);
+  DecodeBucket(tree, i / SUCCINCT_BUCKET_SIZE, i % SUCCINCT_BUCKET_SIZE, NULL, name);
+  return strlen(name);
+}
+
+static uint32_t DecodeBucket(SuccinctCpTreePtr tree,
+                             uint32_t bucket,
+                             uint32_t last,
+                             const char *stop,
+                             char *name) {
+  const unsigned char *in = tree->names + tree->bucket_offsets[bucket];
+  uint32_t shared = 0, len, i, first = bucket * SUCCINCT_BUCKET_SIZE;
+
+  for (i = 0; ; i++) {
+    if (i > 0) {
+      GetVarint(&in, &shared);
+    }
+    GetVarint(&in, &len);
+    memcpy(name + shared, in, len);
+    name[shared + len] = '\0';
+    in += len;
+
+    if (i == last || first + i + 1 == tree->num_nodes ||
+        (stop != NULL && strcmp(name, stop) >= 0)) {
+      return i;
+    }
+  }
+}
+
+static uint32_t PutVarint(unsigned char *out, uint32_t value) {
+  uint32_t len = 0;
+  do {
+    out[len++] = (value & 0x7F) | (value > 0x7F ? 0x80 : 0);
+    value >>= 7;
+  } while (value != 0);
+  return len;
+}
+
+static void GetVarint(const unsigned char **in, uint32_t *value) {
+  uint32_t shift = 0;
+  *value = 0;
+  do {
+    *value |= (uint32_t)(**in & 0x7F) << shift;
+    shift += 7;
+  } while (*(*in)++ & 0x80);
+}
+
+size_t SuccinctCpTreeBytes(SuccinctCpTreePtr tree) {
+  uint32_t n = tree->num_nodes;
+  return sizeof(SuccinctCpTree) +
+         sizeof(uint64_t) * (tree->num_words + 1) +
+         sizeof(uint32_t) * (tree->num_words / SUCCINCT_SUPER_WORDS + 1) +
+         sizeof(int32_t) * 2 * tree->num_leaves +
+         tree->names_len +
+         sizeof(uint64_t) * tree->num_buckets +
+         sizeof(uint64_t) * 2 * (((uint64_t)n * tree->name_to_node.width) / 64 + 2);
+}
+
+void FreeSuccinctCpTree(void *tree) {
+  SuccinctCpTreePtr to_free = (SuccinctCpTreePtr)tree;
+  if (to_free == NULL) {
+    return;
+  }
+
+  free(to_free->bits);
+  free(to_free->ranks);
+  free(to_free->mins);
+  free(to_free->names);
+  free(to_free->bucket_offsets);
+  free(to_free->name_to_node.words);
+  free(to_free->node_to_name.words);
+  free(to_free);
+}
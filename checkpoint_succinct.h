@@ -0,0 +1,122 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+
+#ifndef _CHECKPOINT_SUCCINCT_H_
+#define _CHECKPOINT_SUCCINCT_H_
+// This module packs a CpTree into a read only form which takes a few
+// bytes per checkpoint (plus its name, front coded), for histories too
+// big to keep as CpTreeNodes.
+//
+// The shape of the tree is kept as balanced parentheses: a preorder
+// walk writes a 1 bit on entering a node and a 0 bit on leaving it, so
+// n nodes take 2n bits. A node is numbered by its place in the walk (the
+// root is 0), and is found at the position of the 1 bit it wrote.
+// Counting the 1s before a position (rank) and finding the n-th 1
+// (select) turn numbers into positions and back. The depth of a node is
+// the number of 1s minus the number of 0s before it (its excess), and
+// its parent and the end of its subtree are the closest positions, back
+// or forward, at which the excess drops below its own. A tree of the
+// smallest excess of every 64 bits (a range min-max tree) finds those
+// in O(log n) steps.
+//
+// The names are sorted and stored in buckets of SUCCINCT_BUCKET_SIZE.
+// The first name of a bucket is kept whole, and each of the others as
+// the length of the prefix it shares with the one before, followed by
+// the rest of it. Finding a name is a binary search over the first
+// names of the buckets, then a scan of one bucket. Ids (which node has
+// each name, and which name each node has) are bit packed, using only
+// as many bits as the largest id needs.
+
+#include "checkpoint_tree.h"
+
+#include <stdint.h>
+
+// The number of words of parentheses each entry of ranks counts the 1s
+// before.
+#define SUCCINCT_SUPER_WORDS 8
+
+// The number of names in each bucket of the dictionary.
+#define SUCCINCT_BUCKET_SIZE 16
+
+// Used in place of a node where there is none (e.g. the parent of the
+// root).
+#define SUCCINCT_NULL UINT32_MAX
+
+// An array of numbers which are each stored in @width bits.
+typedef struct packed_array {
+  uint64_t *words;
+  uint32_t  width;
+} PackedArray;
+
+// A CpTree, packed.
+typedef struct succinct_cpt_tree {
+  uint32_t       num_nodes;
+  // The parentheses: 2 * num_nodes bits, the first in the lowest bit of
+  // bits[0].
+  uint64_t      *bits;
+  uint32_t       num_words;
+  // The number of 1s before every run of SUCCINCT_SUPER_WORDS words.
+  uint32_t      *ranks;
+  // The range min-max tree, as an implicit binary tree (the children of
+  // mins[i] are mins[2i] and mins[2i + 1]). The leaves, from
+  // mins[num_leaves], each hold the smallest excess before any of the
+  // bits of one word (and leaf 2 * num_nodes / 64 also the excess at the
+  // very end, which is 0).
+  int32_t       *mins;
+  uint32_t       num_leaves;
+  // The front coded names, sorted, and where each bucket starts.
+  unsigned char *names;
+  size_t         names_len;
+  uint64_t      *bucket_offsets;
+  uint32_t       num_buckets;
+  uint32_t       max_name_len;
+  PackedArray    name_to_node;  // the node with the n-th name, in order
+  PackedArray    node_to_name;  // where the name of each node is, in order
+} SuccinctCpTree, *SuccinctCpTreePtr;
+
+// Packs the live nodes of @tree into a new SuccinctCpTree on the heap,
+// returned through @ret. The children of each node keep the order they
+// are linked in.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - CREATE_TREE_SUCCESS: if all went well.
+int32_t CreateSuccinctCpTree(CpTreePtr tree, SuccinctCpTreePtr *ret);
+
+// Returns the parent of @node, or SUCCINCT_NULL for the root.
+uint32_t SuccinctParent(SuccinctCpTreePtr tree, uint32_t node);
+
+// Returns the first child of @node, or SUCCINCT_NULL if it has none.
+uint32_t SuccinctFirstChild(SuccinctCpTreePtr tree, uint32_t node);
+
+// Returns the next sibling of @node, or SUCCINCT_NULL if it has none.
+uint32_t SuccinctNextSibling(SuccinctCpTreePtr tree, uint32_t node);
+
+// Returns the number of steps from the root to @node.
+uint32_t SuccinctDepth(SuccinctCpTreePtr tree, uint32_t node);
+
+// Finds the node named @cpt_name, returned through @ret.
+//
+// Returns:
+//
+//  - FIND_CPT_SUCCESS: if there is such a node.
+//
+//  - FIND_CPT_ABSENT: if there isn't.
+int32_t SuccinctFindCpt(SuccinctCpTreePtr tree,
+                        const char *cpt_name,
+                        uint32_t *ret);
+
+// Writes the (null terminated) name of @node into @name, which must
+// have room for @tree->max_name_len + 1 chars.
+//
+// Returns: the length of the name.
+uint32_t SuccinctCptName(SuccinctCpTreePtr tree, uint32_t node, char *name);
+
+// Returns the number of bytes @tree takes on the heap.
+size_t SuccinctCpTreeBytes(SuccinctCpTreePtr tree);
+
+// Frees @tree and everything in it. Safe to pass NULL.
+void FreeSuccinctCpTree(void *tree);
+
+#endif  // _CHECKPOINT_SUCCINCT_H_
@@ -0,0 +1,254 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "checkpoint_trace.h"
+#include "DataStructs/HashTable.h"
+
+#include <stdatomic.h>
+#include <time.h>
+
+// The longest line WriteTrace writes for an event, and how many bytes
+// of them it gathers before writing them out.
+#define TRACE_MAX_LINE 256
+#define TRACE_BUF_SIZE (1 << 16)
+
+// One traced event. The times are nanoseconds on the monotonic clock.
+typedef struct trace_event {
+  uint64_t begin;
+  uint64_t end;
+  int32_t  event;
+} TraceEvent;
+
+// The events of one thread.
+typedef struct trace_ring {
+  struct trace_ring *next;        // the ring added before this one
+  uint32_t           tid;         // 1 for the first thread to trace, etc.
+  uint64_t           calls[TRACE_NUM_EVENTS];  // of TraceBegin, by event
+  uint32_t           skip[TRACE_NUM_EVENTS];   // until the next sample
+  uint64_t           num_events;  // recorded so far, of which the ring
+                                  // keeps the last TRACE_RING_SIZE
+  TraceEvent         events[TRACE_RING_SIZE];
+} TraceRing;
+
+// Returns the nanoseconds since some fixed point in the past, from the
+// monotonic clock.
+static uint64_t TraceNow(void);
+
+// Returns the ring of the calling thread, which is made (and added to
+// the list of rings) the first time the thread asks for it, or NULL on
+// a memory error.
+static TraceRing *ThreadRing(void);
+
+// TraceBegin and TraceEnd for the HashTable operation @op. Match
+// HTTraceBeginFnPtr and HTTraceEndFnPtr.
+static uint64_t TraceHTBegin(int32_t op);
+static void TraceHTEnd(int32_t op, uint64_t begin);
+
+// Writes the events of every ring to the trace file. Matches atexit.
+static void WriteTrace(void);
+
+// Writes @ns nanoseconds to @buf as microseconds, with 3 decimals (and
+// no null terminator).
+//
+// Returns: the end of what was written.
+static char *FormatMicros(char *buf, uint64_t ns);
+
+static const char *event_names[TRACE_NUM_EVENTS] = {
+  "setup", "command", "write log", "read table", "write table",
+  "insert", "lookup", "remove", "resize", "find checkpoint", "preorder",
+  "postorder", "lca", "copy", "grep file"
+};
+
+static const char *event_cats[TRACE_NUM_EVENTS] = {
+  "phase", "phase", "phase", "log", "log", "hashtable", "hashtable",
+  "hashtable", "hashtable", "tree", "tree", "tree", "tree", "io", "grep"
+};
+
+static const bool event_sampled[TRACE_NUM_EVENTS] = {
+  false, false, false, false, false, true, true, true, false, true, true,
+  true, true, false, false
+};
+
+// Set (once) by TraceSetup, before any other thread is started.
+static bool        tracing = false;
+static const char *trace_path;
+static uint64_t    trace_start;
+static uint32_t    sample_every = TRACE_DEFAULT_SAMPLE;
+
+// The list of rings, newest first, and the number of them.
+static _Atomic(TraceRing *) rings = NULL;
+static atomic_uint          num_rings = 0;
+
+static _Thread_local TraceRing *thread_ring = NULL;
+
+int32_t TraceSetup(void) {
+  const char *path = getenv(TRACE_ENV);
+  const char *sample = getenv(TRACE_SAMPLE_ENV);
+
+  if (path == NULL || path[0] == '\0') {
+    return 0;
+  }
+  if (sample != NULL && atoi(sample) > 0) {
+    sample_every = atoi(sample);
+  }
+  if (atexit(&WriteTrace) != 0) {
+    return TRACE_ERR;
+  }
+  trace_path = path;
+  trace_start = TraceNow();
+  tracing = true;
+  HTSetTraceHooks(&TraceHTBegin, &TraceHTEnd);
+  return 0;
+}
+
+uint64_t TraceBegin(int32_t event) {
+  TraceRing *ring;
+
+  if (!tracing || (ring = ThreadRing()) == NULL) {
+    return 0;
+  }
+  ring->calls[event]++;
+  if (event_sampled[event]) {
+    if (ring->skip[event] > 0) {
+      ring->skip[event]--;
+      return 0;
+    }
+    ring->skip[event] = sample_every - 1;
+  }
+  return TraceNow();
+}
+
+void TraceEnd(int32_t event, uint64_t begin) {
+  TraceRing *ring;
+  TraceEvent *e;
+
+  if (begin == 0 || (ring = ThreadRing()) == NULL) {
+    return;
+  }
+  e = &ring->events[ring->num_events & (TRACE_RING_SIZE - 1)];
+  e->begin = begin;
+  e->end = TraceNow();
+  e->event = event;
+  ring->num_events++;
+}
+
+static uint64_t TraceNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static TraceRing *ThreadRing(void) {
+  TraceRing *ring = thread_ring;
+
+  if (ring != NULL) {
+    return ring;
+  }
+  if ((ring = malloc(sizeof(TraceRing))) == NULL) {
+    return NULL;
+  }
+  ring->tid = atomic_fetch_add(&num_rings, 1) + 1;
+  memset(ring->calls, 0, sizeof(ring->calls));
+  memset(ring->skip, 0, sizeof(ring->skip));
+  ring->num_events = 0;
+  ring->next = atomic_load(&rings);
+  while (!atomic_compare_exchange_weak(&rings, &ring->next, ring)) { }
+  thread_ring = ring;
+  return ring;
+}
+
+static uint64_t TraceHTBegin(int32_t op) {
+  return TraceBegin(TRACE_HT_INSERT + op);
+}
+
+static void TraceHTEnd(int32_t op, uint64_t begin) {
+  TraceEnd(TRACE_HT_INSERT + op, begin);
+}
+
+static void WriteTrace(void) {
+  FILE *f;
+  bool first = true;
+  uint64_t dropped = 0, calls[TRACE_NUM_EVENTS] = {0};
+  int pid = getpid();
+  static char buf[TRACE_BUF_SIZE];
+  char suffix[TRACE_MAX_LINE], *pos = buf;
+
+  if ((f = fopen(trace_path, "w")) == NULL) {
+    if (DEBUG) {
+      printf("ERROR: could not open trace file %s\n", trace_path);
+    }
+    return;
+  }
+
+  // Every thread's events are written oldest first, after an event
+  // which names the thread. The rings were only ever written by threads
+  // which have been joined, so none of them changes while it is read.
+  // There may be a lot of events, so they are formatted by hand (which
+  // is several times faster than fprintf), and written a buffer at a time.
+  fprintf(f, "{\"traceEvents\":[\n");
+  for (TraceRing *ring = atomic_load(&rings); ring != NULL; ring = ring->next) {
+    uint64_t i = 0;
+    if (ring->num_events > TRACE_RING_SIZE) {
+      i = ring->num_events - TRACE_RING_SIZE;
+      dropped += i;
+    }
+    for (int32_t j = 0; j < TRACE_NUM_EVENTS; j++) {
+      calls[j] += ring->calls[j];
+    }
+    fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+            first ? "" : ",\n", pid, ring->tid, ring->tid);
+    first = false;
+    snprintf(suffix, sizeof(suffix), ",\"pid\":%d,\"tid\":%u}",
+             pid, ring->tid);
+    for (; i < ring->num_events; i++) {
+      TraceEvent *e = &ring->events[i & (TRACE_RING_SIZE - 1)];
+      if (pos - buf > TRACE_BUF_SIZE - TRACE_MAX_LINE) {
+        fwrite(buf, sizeof(char), pos - buf, f);
+        pos = buf;
+      }
+      pos = stpcpy(pos, ",\n{\"name\":\"");
+      pos = stpcpy(pos, event_names[e->event]);
+      pos = stpcpy(pos, "\",\"cat\":\"");
+      pos = stpcpy(pos, event_cats[e->event]);
+      pos = stpcpy(pos, "\",\"ph\":\"X\",\"ts\":");
+      pos = FormatMicros(pos, e->begin - trace_start);
+      pos = stpcpy(pos, ",\"dur\":");
+      pos = FormatMicros(pos, e->end - e->begin);
+      pos = stpcpy(pos, suffix);
+    }
+    fwrite(buf, sizeof(char), pos - buf, f);
+    pos = buf;
+  }
+
+  // How many events there were of each kind, recorded or not.
+  fprintf(f, "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{"
+          "\"dropped_events\":%lu,\"sample_every\":%u",
+          dropped, sample_every);
+  for (int32_t j = 0; j < TRACE_NUM_EVENTS; j++) {
+    fprintf(f, ",\"%s\":%lu", event_names[j], calls[j]);
+  }
+  fprintf(f, "}}\n");
+  if (fclose(f) != 0 && DEBUG) {
+    printf("ERROR: could not write trace file %s\n", trace_path);
+  }
+}
+
+static char *FormatMicros(char *buf, uint64_t ns) {
+  char digits[20];
+  int32_t len = 0;
+
+  // The digits come out backwards, with the point after the first 3.
+  do {
+    digits[len++] = '0' + ns % 10;
+    ns /= 10;
+  } while (ns > 0 || len < 4);
+  while (len > 0) {
+    *buf++ = digits[--len];
+    if (len == 3) {
+      *buf++ = '.';
+    }
+  }
+  return buf;
+}
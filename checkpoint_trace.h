@@ -0,0 +1,91 @@
+// Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
+
+#ifndef _CHECKPOINT_TRACE_H_
+#define _CHECKPOINT_TRACE_H_
+// This module records a timeline of what a run of the program did, so
+// that a slow part of one long run can be found, which the totals of
+// --stats (checkpoint_stats.h) can't show.
+//
+// An event is something which took some time: a section of reading or
+// writing the log, one operation on a hash table, a walk of a tree, or
+// a copy of a file. Code which wants an event traced calls TraceBegin
+// before it and TraceEnd after it, with the event's number.
+//
+// Reading the clock twice costs about as much as a small operation on a
+// hash table or a walk of a small tree, which there can be thousands of
+// in a run. So only one of every TRACE_DEFAULT_SAMPLE of those (or of
+// the number in the environment variable TRACE_SAMPLE_ENV) is recorded,
+// for each thread, though all of them are counted. Every other event is
+// recorded whenever it happens.
+//
+// Each thread records its events in a ring buffer of its own, which
+// keeps the last TRACE_RING_SIZE of them. Since only its thread writes
+// to a ring, no locks are taken; a thread's ring is only added to the
+// list of rings (with a compare and swap) the first time it records
+// anything. When the program exits, the events of every ring are written
+// to the file named by the environment variable TRACE_ENV, in Chrome's
+// trace event format (load it at chrome://tracing, or in Perfetto).
+//
+// Unless TRACE_ENV is set, nothing is recorded: TraceBegin returns 0
+// without reading the clock, and TraceEnd then does nothing. Otherwise,
+// recording an event takes about 100ns and writing it out at the end
+// about as long again, and an event which isn't sampled costs a few ns.
+// Besides a fixed cost of writing the file (a fraction of a ms), that
+// is well under 1% of a run over a big log.
+
+#include "macros.h"
+
+#include <stdint.h>
+
+#define TRACE_ERR -1
+
+#define TRACE_ENV        "CPT_TRACE"
+#define TRACE_SAMPLE_ENV "CPT_TRACE_SAMPLE"
+
+// Of the events which are sampled, the number there are for each one
+// recorded (unless TRACE_SAMPLE_ENV says otherwise).
+#define TRACE_DEFAULT_SAMPLE 16
+
+// The number of events each thread keeps (a power of two).
+#define TRACE_RING_SIZE (1 << 16)
+
+// The events.
+#define TRACE_SETUP        0  // the phases of a run (see checkpoint_stats.h)
+#define TRACE_COMMAND      1
+#define TRACE_WRITE_LOG    2
+#define TRACE_READ_TABLE   3  // reading one table of the log
+#define TRACE_WRITE_TABLE  4  // writing one table of the log
+#define TRACE_HT_INSERT    5  // the operations of HashTable.h (sampled,
+#define TRACE_HT_LOOKUP    6  // but for resizes)
+#define TRACE_HT_REMOVE    7
+#define TRACE_HT_RESIZE    8
+#define TRACE_FIND_CPT     9  // the walks of checkpoint_tree.h (sampled)
+#define TRACE_PREORDER    10
+#define TRACE_POSTORDER   11
+#define TRACE_LCA         12
+#define TRACE_COPY        13  // copying between source and checkpoint files
+#define TRACE_GREP_FILE   14  // searching one file
+#define TRACE_NUM_EVENTS  15
+
+// If TRACE_ENV is set, starts tracing, and makes the program write the
+// trace to the file it names when it exits. Also traces the operations
+// of every HashTable (see HTSetTraceHooks).
+//
+// Returns:
+//
+//  - TRACE_ERR: if TRACE_ENV is set, but tracing could not be started.
+//
+//  - 0: if all went well (or TRACE_ENV isn't set).
+int32_t TraceSetup(void);
+
+// Counts @event, which is about to happen.
+//
+// Returns: when it begins, to be passed to TraceEnd once it is done, or
+// 0 if it isn't to be recorded (or the program isn't tracing).
+uint64_t TraceBegin(int32_t event);
+
+// Records that @event, which began at @begin (from TraceBegin), has
+// ended. Does nothing if @begin is 0.
+void TraceEnd(int32_t event, uint64_t begin);
+
+#endif  // _CHECKPOINT_TRACE_H_
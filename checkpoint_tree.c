@@ -1,135 +1,731 @@
 // Copyright 2019, Pieter Benjamin, pieter0benjamin@gmail.com
 
 #include "checkpoint_tree.h"
+#include "DataStructs/Allocator.h"
+#include "checkpoint_stats.h"
+#include "checkpoint_trace.h"
 
-int32_t CreateCpTreeNode(char *cpt_name,
-                         CpTreeNodePtr parent_node,
-                         CpTreeNodePtr *ret) {
-  CpTreeNodePtr new_node;
+// Makes sure @tree has room for one more node, and @name_len more
+// characters (including the null terminator) in its names pool.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error
+//
+//  - CREATE_TREE_SUCCESS: if there is enough room.
+static int32_t ReserveCpTreeNode(CpTreePtr tree, uint32_t name_len);
+
+// Sets the depth and jump pointer of the node @handle from those of
+// its parent. Matches CpTreeVisitor, so that the jump pointers of a
+// whole subtree can be reset with a preorder walk.
+//
+// Returns:
+//
+//  - CPT_VISIT_CONTINUE: always.
+static int32_t SetCpTreeJump(CpTreePtr tree, CpTreeHandle handle, void *arg);
+
+// Marks the node @handle as pruned. Matches CpTreeVisitor.
+//
+// Returns:
+//
+//  - CPT_VISIT_CONTINUE: always.
+static int32_t MarkPruned(CpTreePtr tree, CpTreeHandle handle, void *arg);
+
+// Returns the link which points at the node @handle: either the
+// first_child of its parent, or the next_sibling of its previous sibling.
+// @handle must not be the root.
+static CpTreeHandle *LinkToCpTreeNode(CpTreePtr tree, CpTreeHandle handle);
+
+// Checks that @handle is a live node of @tree, other than the root.
+static bool CanPrune(CpTreePtr tree, CpTreeHandle handle);
+
+// Does the work of FindCpt, which times it.
+static int32_t ScanForCpt(CpTreePtr tree, char *cpt_name, CpTreeHandle *ret);
+
+// Do the work of CpTreePreorder and CpTreePostorder, which trace them.
+static int32_t WalkPreorder(CpTreePtr tree,
+                            CpTreeHandle root,
+                            CpTreeVisitor visit,
+                            void *arg);
+static int32_t WalkPostorder(CpTreePtr tree,
+                             CpTreeHandle root,
+                             CpTreeVisitor visit,
+                             void *arg);
+
+// Sorts the live nodes of @tree by time into @tree->by_time, unless
+// they already are.
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - CREATE_TREE_SUCCESS: if @tree->by_time is ready.
+static int32_t SortCpTreeByTime(CpTreePtr tree);
+
+// Compares two CpTreeTimes, by time and then by handle. Matches qsort.
+static int CompareCpTreeTimes(const void *a, const void *b);
+
+// Returns the number of entries of @tree->by_time made at or before
+// @time, which is where the first one made after @time is.
+static CPSize_t CountMadeBy(CpTreePtr tree, int64_t time);
+
+// Adds the node @handle, which was just inserted, to the time index of
+// @tree (if it has one), after the others made at the same time. If
+// there is no memory for it, the index is dropped instead.
+static void IndexCpTreeNode(CpTreePtr tree, CpTreeHandle handle);
+
+// Moves the node @handle, which was made at @old_time until it was just
+// stamped, to its new place in the time index of @tree (if it has one),
+// after the others made at the same time.
+static void ReindexCpTreeNode(CpTreePtr tree,
+                              CpTreeHandle handle,
+                              int64_t old_time);
+
+// Drops the time index of @tree, which no longer matches its nodes.
+static void DropCpTreeTimes(CpTreePtr tree);
+
+// Returns the first node a postorder walk of the subtree rooted at
+// @node visits, which is found by following first children to a leaf.
+static CpTreeHandle FirstPostorder(CpTreePtr tree, CpTreeHandle node);
+
+int32_t CreateCpTree(char *root_name, CpTreePtr *ret) {
+  CpTreePtr new_tree;
+  CpTreeHandle root;
 
   int32_t num_attempts = NUMBER_ATTEMPTS;
-  ATTEMPT((new_node = malloc(sizeof(CpTreeNode))), NULL, num_attempts)
-  num_attempts = NUMBER_ATTEMPTS;
-  ATTEMPT((new_node->cpt_name = malloc(sizeof(char) * (strlen(cpt_name) + 1))), NULL, num_attempts)
-  num_attempts = NUMBER_ATTEMPTS;
-  ATTEMPT((new_node->children = MakeLinkedList()), NULL, num_attempts)
-
-  new_node->parent_node = parent_node;
-  strcpy(new_node->cpt_name, cpt_name);
-  
-  *ret = new_node;
+  ATTEMPT((new_tree = CPMalloc(CP_ALLOC_TREE, sizeof(CpTree))), NULL,
+          num_attempts)
+  new_tree->node_capacity = INITIAL_TREE_CAPACITY;
+  new_tree->names_capacity = INITIAL_TREE_CAPACITY * INITIAL_NAME_BYTES_PER_NODE;
+  new_tree->num_nodes = 0;
+  new_tree->names_len = 0;
+  new_tree->by_time = NULL;
+  new_tree->num_by_time = 0;
+
+  new_tree->nodes = CPMalloc(CP_ALLOC_TREE,
+                             sizeof(CpTreeNode) * new_tree->node_capacity);
+  new_tree->names = CPMalloc(CP_ALLOC_TREE,
+                             sizeof(char) * new_tree->names_capacity);
+  if (new_tree->nodes == NULL || new_tree->names == NULL) {
+    FreeCpTree(new_tree);
+    return MEM_ERR;
+  }
+
+  // The root is simply a node without a parent.
+  if (InsertCpTreeNode(new_tree, CPT_NULL_HANDLE, root_name, &root)
+                                                      != INSERT_NODE_SUCCESS) {
+    FreeCpTree(new_tree);
+    return MEM_ERR;
+  }
+
+  *ret = new_tree;
   return CREATE_TREE_SUCCESS;
 }
 
-int32_t InsertCpTreeNode(CpTreeNodePtr cpt_node, CpTreeNodePtr to_insert) {
-  if (cpt_node == NULL) {
-    if (DEBUG) {
-      printf("Error, given a null node to insert into\n");
+static int32_t ReserveCpTreeNode(CpTreePtr tree, uint32_t name_len) {
+  int32_t num_attempts;
+
+  // Both arrays grow geometrically, so inserting n nodes
+  // only ever costs O(log n) reallocations.
+  if (tree->num_nodes == tree->node_capacity) {
+    CpTreeNode *new_nodes;
+    size_t size = sizeof(CpTreeNode) * tree->node_capacity;
+    num_attempts = NUMBER_ATTEMPTS;
+    ATTEMPT((new_nodes = CPRealloc(CP_ALLOC_TREE, tree->nodes, size, size * 2)),
+            NULL,
+            num_attempts)
+    tree->nodes = new_nodes;
+    tree->node_capacity *= 2;
+  }
+
+  if (tree->names_len + name_len > tree->names_capacity) {
+    char *new_names;
+    uint32_t new_capacity = tree->names_capacity * 2;
+    while (tree->names_len + name_len > new_capacity) {
+      new_capacity *= 2;
     }
-    return INSERT_NODE_ERROR;
+    num_attempts = NUMBER_ATTEMPTS;
+    ATTEMPT((new_names = CPRealloc(CP_ALLOC_TREE, tree->names,
+                                   sizeof(char) * tree->names_capacity,
+                                   sizeof(char) * new_capacity)),
+            NULL,
+            num_attempts)
+    tree->names = new_names;
+    tree->names_capacity = new_capacity;
   }
 
-  if (cpt_node->children == NULL) {
+  return CREATE_TREE_SUCCESS;
+}
+
+int32_t InsertCpTreeNode(CpTreePtr tree,
+                         CpTreeHandle parent,
+                         char *cpt_name,
+                         CpTreeHandle *ret) {
+  if (tree == NULL) {
     if (DEBUG) {
-      printf("Error, node %s at %x has null children field\n",
-             cpt_node->cpt_name,
-             (unsigned int)cpt_node);
+      printf("Error, given a null tree to insert into\n");
     }
     return INSERT_NODE_ERROR;
   }
-  
-  if (!LLPush(cpt_node->children, (LinkedListPayload)(to_insert))) {
+
+  // Only the root may be inserted without a parent.
+  if ((parent == CPT_NULL_HANDLE && tree->num_nodes != 0) ||
+      (parent != CPT_NULL_HANDLE && (parent >= tree->num_nodes ||
+                                     CPT_IS_PRUNED(tree, parent)))) {
     if (DEBUG) {
-      printf("Error pushing checkpoint  %s to %s\n",
-             cpt_node->cpt_name,
-             to_insert->cpt_name);
+      printf("Error, %u is not a valid parent for checkpoint %s\n",
+             parent,
+             cpt_name);
     }
     return INSERT_NODE_ERROR;
   }
 
+  uint32_t name_len = strlen(cpt_name) + 1;
+  if (ReserveCpTreeNode(tree, name_len) != CREATE_TREE_SUCCESS) {
+    return MEM_ERR;
+  }
+
+  CpTreeHandle handle = tree->num_nodes;
+  CpTreeNodePtr node = &tree->nodes[handle];
+  node->parent = parent;
+  node->first_child = CPT_NULL_HANDLE;
+  node->next_sibling = CPT_NULL_HANDLE;
+  node->name_offset = tree->names_len;
+  node->time = 0;
+  node->size = 0;
+  memcpy(tree->names + tree->names_len, cpt_name, name_len);
+  tree->names_len += name_len;
+  tree->num_nodes++;
+
+  if (parent != CPT_NULL_HANDLE) {
+    // New children go to the front of their parent's list of children.
+    node->next_sibling = tree->nodes[parent].first_child;
+    tree->nodes[parent].first_child = handle;
+  }
+  SetCpTreeJump(tree, handle, NULL);
+  IndexCpTreeNode(tree, handle);
+
+  *ret = handle;
   return INSERT_NODE_SUCCESS;
 }
 
-int32_t FindCpt(CpTreeNodePtr curr_node, char *cpt_name, CpTreeNodePtr *ret) {
-  if (curr_node == NULL) {  // We can be quite certain cpt_name is not here!
+static int32_t SetCpTreeJump(CpTreePtr tree, CpTreeHandle handle, void *arg) {
+  CpTreeNodePtr node = &tree->nodes[handle];
+  if (node->parent == CPT_NULL_HANDLE) {
+    node->depth = 0;
+    node->jump = handle;
+    return CPT_VISIT_CONTINUE;
+  }
+
+  // If the parent's jump and its jump's jump cover the same distance,
+  // this node can jump over both at once. Otherwise, it jumps to its
+  // parent, starting a new run of short jumps.
+  CpTreeNodePtr p = &tree->nodes[node->parent];
+  CpTreeNodePtr j = &tree->nodes[p->jump];
+  node->depth = p->depth + 1;
+  if (p->depth - j->depth == j->depth - tree->nodes[j->jump].depth) {
+    node->jump = j->jump;
+  } else {
+    node->jump = node->parent;
+  }
+  return CPT_VISIT_CONTINUE;
+}
+
+int32_t FindCpt(CpTreePtr tree, char *cpt_name, CpTreeHandle *ret) {
+  int32_t res;
+  uint64_t begin = TraceBegin(TRACE_FIND_CPT);
+
+  StatsStartTimer(STATS_TIMER_FIND_CPT);
+  res = ScanForCpt(tree, cpt_name, ret);
+  StatsStopTimer(STATS_TIMER_FIND_CPT);
+  TraceEnd(TRACE_FIND_CPT, begin);
+  return res;
+}
+
+static int32_t ScanForCpt(CpTreePtr tree, char *cpt_name, CpTreeHandle *ret) {
+  if (tree == NULL) {  // We can be quite certain cpt_name is not here!
     return FIND_CPT_ABSENT;
   }
 
-  if (curr_node->cpt_name == NULL) {  // This should never occur.
+  if (tree->nodes == NULL || tree->names == NULL) {  // This should never occur.
     if (DEBUG) {
-      printf("Error, cpt_node at address %x has no name field\n",
-             (unsigned int)curr_node);
+      printf("Error, tree at address %p has no nodes\n", (void *)tree);
     }
     return FIND_CPT_ERROR;
   }
 
-  if (DEBUG) { printf("here: "); printf("%s\n", curr_node->cpt_name); }
-  if (strcmp(curr_node->cpt_name, cpt_name) == 0) {  // The cpt we're looking for is here!
-    if (DEBUG) {
-      printf("\t\tSuccess! cpt_name %s found at address %x\n",
-             cpt_name,
-             (unsigned int)curr_node);
+  // Every node is in the array, so there is no need to walk the tree.
+  // Just check every node in the order they are stored.
+  for (CpTreeHandle i = 0; i < tree->num_nodes; i++) {
+    if (!CPT_IS_PRUNED(tree, i) && strcmp(CPT_NAME(tree, i), cpt_name) == 0) {
+      if (DEBUG) {
+        printf("\t\tSuccess! cpt_name %s found at handle %u\n", cpt_name, i);
+      }
+
+      *ret = i;
+      return FIND_CPT_SUCCESS;
+    }
+  }
+
+  // We checked every node. The cpt must not have been created before.
+  return FIND_CPT_ABSENT;
+}
+
+void SetCpTreeNodeStamp(CpTreePtr tree,
+                        CpTreeHandle handle,
+                        int64_t time,
+                        uint64_t size) {
+  int64_t old_time = tree->nodes[handle].time;
+
+  tree->nodes[handle].time = time;
+  tree->nodes[handle].size = size;
+  ReindexCpTreeNode(tree, handle, old_time);
+}
+
+int32_t FindCptAtTime(CpTreePtr tree, int64_t time, CpTreeHandle *ret) {
+  CPSize_t num_made;
+
+  if (SortCpTreeByTime(tree) != CREATE_TREE_SUCCESS) {
+    return MEM_ERR;
+  }
+  if ((num_made = CountMadeBy(tree, time)) == 0) {
+    return FIND_CPT_ABSENT;
+  }
+  *ret = tree->by_time[num_made - 1].handle;
+  return FIND_CPT_SUCCESS;
+}
+
+int32_t FindCptsInTimeRange(CpTreePtr tree,
+                            int64_t since,
+                            int64_t until,
+                            CPSize_t *first,
+                            CPSize_t *end) {
+  if (SortCpTreeByTime(tree) != CREATE_TREE_SUCCESS) {
+    return MEM_ERR;
+  }
+  *first = since == INT64_MIN ? 0 : CountMadeBy(tree, since - 1);
+  *end = CountMadeBy(tree, until);
+  if (*end < *first) {  // since is after until
+    *end = *first;
+  }
+  return *first == *end ? FIND_CPT_ABSENT : FIND_CPT_SUCCESS;
+}
+
+int32_t SetCpTreeTimes(CpTreePtr tree, CpTreeHandle *order, CPSize_t num) {
+  CPSize_t num_live = 0;
+  uint8_t *seen;
+  CpTreeHandle h;
+
+  DropCpTreeTimes(tree);
+  for (h = 0; h < tree->num_nodes; h++) {
+    num_live += !CPT_IS_PRUNED(tree, h);
+  }
+  if (num != num_live) {
+    return FIND_CPT_ERROR;
+  }
+  if ((seen = CPCalloc(CP_ALLOC_TREE, tree->num_nodes, sizeof(uint8_t))) == NULL) {
+    return MEM_ERR;
+  }
+  tree->by_time = CPMalloc(CP_ALLOC_TREE, sizeof(CpTreeTime) * num);
+  if (tree->by_time == NULL) {
+    CPFree(CP_ALLOC_TREE, seen, sizeof(uint8_t) * tree->num_nodes);
+    return MEM_ERR;
+  }
+  tree->num_by_time = num;
+
+  // Each node has to be live and in @order once, and no older than the
+  // one before it.
+  for (CPSize_t i = 0; i < num; i++) {
+    h = order[i];
+    if (h >= tree->num_nodes || CPT_IS_PRUNED(tree, h) || seen[h] ||
+        (i > 0 && tree->nodes[h].time < tree->by_time[i - 1].time)) {
+      if (DEBUG) { printf("Error, entry %u of the time index is %u\n", i, h); }
+      CPFree(CP_ALLOC_TREE, seen, sizeof(uint8_t) * tree->num_nodes);
+      DropCpTreeTimes(tree);
+      return FIND_CPT_ERROR;
+    }
+    seen[h] = 1;
+    tree->by_time[i] = (CpTreeTime){tree->nodes[h].time, h};
+  }
+  CPFree(CP_ALLOC_TREE, seen, sizeof(uint8_t) * tree->num_nodes);
+  return CREATE_TREE_SUCCESS;
+}
+
+static int32_t SortCpTreeByTime(CpTreePtr tree) {
+  if (tree->by_time != NULL) {
+    return CREATE_TREE_SUCCESS;
+  }
+
+  // The index is made exactly as big as the number of live nodes, so
+  // that DropCpTreeTimes knows how big it is.
+  tree->num_by_time = 0;
+  for (CpTreeHandle h = 0; h < tree->num_nodes; h++) {
+    tree->num_by_time += !CPT_IS_PRUNED(tree, h);
+  }
+  tree->by_time = CPMalloc(CP_ALLOC_TREE,
+                           sizeof(CpTreeTime) * tree->num_by_time);
+  if (tree->by_time == NULL) {
+    tree->num_by_time = 0;
+    return MEM_ERR;
+  }
+  tree->num_by_time = 0;
+  for (CpTreeHandle h = 0; h < tree->num_nodes; h++) {
+    if (!CPT_IS_PRUNED(tree, h)) {
+      tree->by_time[tree->num_by_time++] = (CpTreeTime){tree->nodes[h].time, h};
     }
+  }
+  qsort(tree->by_time, tree->num_by_time, sizeof(CpTreeTime), &CompareCpTreeTimes);
+  return CREATE_TREE_SUCCESS;
+}
 
-    *ret = curr_node;
-    return FIND_CPT_SUCCESS;
+static int CompareCpTreeTimes(const void *a, const void *b) {
+  const CpTreeTime *x = a, *y = b;
+  if (x->time != y->time) {
+    return x->time < y->time ? -1 : 1;
   }
+  return (x->handle > y->handle) - (x->handle < y->handle);
+}
 
-  // At this point, we know that this is a valid node, but not the one we want.
-  // This means we must now search through all the children of this node.
-  // We will use a simple DFS to perform this search.
+static CPSize_t CountMadeBy(CpTreePtr tree, int64_t time) {
+  CPSize_t lo = 0, hi = tree->num_by_time, mid;
 
-  if (curr_node->children == NULL) {  // This should never occur.
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (tree->by_time[mid].time <= time) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static void IndexCpTreeNode(CpTreePtr tree, CpTreeHandle handle) {
+  CpTreeTime *new_by_time;
+  CPSize_t pos;
+
+  if (tree->by_time == NULL) {
+    return;
+  }
+  new_by_time = CPRealloc(CP_ALLOC_TREE, tree->by_time,
+                          sizeof(CpTreeTime) * tree->num_by_time,
+                          sizeof(CpTreeTime) * (tree->num_by_time + 1));
+  if (new_by_time == NULL) {
+    DropCpTreeTimes(tree);
+    return;
+  }
+  tree->by_time = new_by_time;
+  pos = CountMadeBy(tree, tree->nodes[handle].time);
+  memmove(tree->by_time + pos + 1, tree->by_time + pos,
+          sizeof(CpTreeTime) * (tree->num_by_time - pos));
+  tree->by_time[pos] = (CpTreeTime){tree->nodes[handle].time, handle};
+  tree->num_by_time++;
+}
+
+static void ReindexCpTreeNode(CpTreePtr tree,
+                              CpTreeHandle handle,
+                              int64_t old_time) {
+  CpTreeTime entry = {tree->nodes[handle].time, handle};
+  CPSize_t from, end, to;
+
+  if (tree->by_time == NULL) {
+    return;
+  }
+
+  // The node is among the ones made at @old_time, which are next to
+  // each other.
+  from = old_time == INT64_MIN ? 0 : CountMadeBy(tree, old_time - 1);
+  end = CountMadeBy(tree, old_time);
+  while (from < end && tree->by_time[from].handle != handle) {
+    from++;
+  }
+  if (from == end) {  // e.g. the node was pruned
+    DropCpTreeTimes(tree);
+    return;
+  }
+
+  // Shift the entries between where it was and where it goes by one.
+  to = CountMadeBy(tree, entry.time);
+  if (to > from) {
+    to--;
+    memmove(tree->by_time + from, tree->by_time + from + 1,
+            sizeof(CpTreeTime) * (to - from));
+  } else {
+    memmove(tree->by_time + to + 1, tree->by_time + to,
+            sizeof(CpTreeTime) * (from - to));
+  }
+  tree->by_time[to] = entry;
+}
+
+static void DropCpTreeTimes(CpTreePtr tree) {
+  CPFree(CP_ALLOC_TREE, tree->by_time, sizeof(CpTreeTime) * tree->num_by_time);
+  tree->by_time = NULL;
+  tree->num_by_time = 0;
+}
+
+CpTreeHandle CpTreeAncestor(CpTreePtr tree, CpTreeHandle handle, uint32_t n) {
+  if (n > tree->nodes[handle].depth) {
+    return CPT_NULL_HANDLE;
+  }
+
+  // Take the jump whenever it doesn't overshoot, and a single step up
+  // otherwise.
+  uint32_t depth = tree->nodes[handle].depth - n;
+  while (tree->nodes[handle].depth > depth) {
+    CpTreeHandle jump = tree->nodes[handle].jump;
+    handle = tree->nodes[jump].depth >= depth ? jump : tree->nodes[handle].parent;
+  }
+  return handle;
+}
+
+CpTreeHandle CpTreeLCA(CpTreePtr tree, CpTreeHandle a, CpTreeHandle b) {
+  uint64_t begin = TraceBegin(TRACE_LCA);
+
+  // Bring the deeper of the two up to the depth of the other...
+  if (tree->nodes[a].depth > tree->nodes[b].depth) {
+    a = CpTreeAncestor(tree, a, tree->nodes[a].depth - tree->nodes[b].depth);
+  } else {
+    b = CpTreeAncestor(tree, b, tree->nodes[b].depth - tree->nodes[a].depth);
+  }
+
+  // ...then climb both at once. Nodes at the same depth have jump
+  // pointers of the same length, so the two stay level. A jump is only
+  // taken if it lands below the common ancestor (on different nodes).
+  while (a != b) {
+    if (tree->nodes[a].jump != tree->nodes[b].jump) {
+      a = tree->nodes[a].jump;
+      b = tree->nodes[b].jump;
+    } else {
+      a = tree->nodes[a].parent;
+      b = tree->nodes[b].parent;
+    }
+  }
+  TraceEnd(TRACE_LCA, begin);
+  return a;
+}
+
+static CpTreeHandle *LinkToCpTreeNode(CpTreePtr tree, CpTreeHandle handle) {
+  CpTreeHandle *link = &tree->nodes[tree->nodes[handle].parent].first_child;
+  while (*link != handle) {
+    link = &tree->nodes[*link].next_sibling;
+  }
+  return link;
+}
+
+static bool CanPrune(CpTreePtr tree, CpTreeHandle handle) {
+  if (tree == NULL || handle == CPT_ROOT_HANDLE || handle >= tree->num_nodes ||
+      CPT_IS_PRUNED(tree, handle)) {
     if (DEBUG) {
-      printf("error: curr node %s at %x has null children field\n",
-             curr_node->cpt_name,
-             (unsigned int)curr_node);
+      printf("Error, %u is not a node which can be pruned\n", handle);
     }
-    return FIND_CPT_ERROR;
+    return false;
   }
+  return true;
+}
 
-  LLIter children_iter;
-  uint32_t num_attempts = NUMBER_ATTEMPTS;
-  ATTEMPT((children_iter = LLGetIter(curr_node->children, 0)),
-          NULL,
-          num_attempts)
-  
-  CpTreeNodePtr curr_child;
-  uint32_t num_children_unchecked = LLSize(curr_node->children);
+static int32_t MarkPruned(CpTreePtr tree, CpTreeHandle handle, void *arg) {
+  tree->nodes[handle].jump = CPT_NULL_HANDLE;
+  return CPT_VISIT_CONTINUE;
+}
+
+int32_t PruneCpTreeNode(CpTreePtr tree, CpTreeHandle handle) {
+  if (!CanPrune(tree, handle)) {
+    return PRUNE_NODE_ERROR;
+  }
+
+  // Once it is unlinked, no walk from the root can reach the subtree,
+  // but FindCpt scans the whole array, so every node in it is marked.
+  CpTreeHandle *link = LinkToCpTreeNode(tree, handle);
+  *link = tree->nodes[handle].next_sibling;
+  CpTreePostorder(tree, handle, &MarkPruned, NULL);
+  DropCpTreeTimes(tree);
+  return PRUNE_NODE_SUCCESS;
+}
+
+int32_t SquashCpTreeNode(CpTreePtr tree, CpTreeHandle handle) {
+  if (!CanPrune(tree, handle)) {
+    return PRUNE_NODE_ERROR;
+  }
+
+  CpTreeNodePtr node = &tree->nodes[handle];
+  CpTreeHandle *link = LinkToCpTreeNode(tree, handle);
+  CpTreeHandle child, last = CPT_NULL_HANDLE;
+
+  // Splice the children into the parent's list where the node was.
+  // Their handles are still bigger than their new parent's.
+  for (child = node->first_child;
+       child != CPT_NULL_HANDLE;
+       child = tree->nodes[child].next_sibling) {
+    tree->nodes[child].parent = node->parent;
+    last = child;
+  }
+  if (last == CPT_NULL_HANDLE) {
+    *link = node->next_sibling;
+  } else {
+    *link = node->first_child;
+    tree->nodes[last].next_sibling = node->next_sibling;
+
+    // Everything below the node is now one step shallower, so its jump
+    // pointers have to be reset, parents before children.
+    for (child = node->first_child;
+         child != node->next_sibling;
+         child = tree->nodes[child].next_sibling) {
+      CpTreePreorder(tree, child, &SetCpTreeJump, NULL);
+    }
+  }
+
+  node->first_child = CPT_NULL_HANDLE;
+  node->next_sibling = CPT_NULL_HANDLE;
+  MarkPruned(tree, handle, NULL);
+  DropCpTreeTimes(tree);
+  return PRUNE_NODE_SUCCESS;
+}
+
+CPSize_t CpTreeNumChildren(CpTreePtr tree, CpTreeHandle handle) {
+  CPSize_t num_children = 0;
+  for (CpTreeHandle child = tree->nodes[handle].first_child;
+       child != CPT_NULL_HANDLE;
+       child = tree->nodes[child].next_sibling) {
+    num_children++;
+  }
+  return num_children;
+}
+
+CPSize_t CpTreeStatsBucket(uint64_t value) {
+  CPSize_t bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+  return bucket < CPT_STATS_BUCKETS ? bucket : CPT_STATS_BUCKETS - 1;
+}
+
+void AddCpTreeStats(CpTreePtr tree, CpTreeStats *stats) {
+  stats->num_trees++;
+  stats->num_nodes += tree->num_nodes;
+  for (CpTreeHandle i = 0; i < tree->num_nodes; i++) {
+    uint32_t depth = tree->nodes[i].depth;
+    CPSize_t num_children, name_len;
+
+    if (CPT_IS_PRUNED(tree, i)) {
+      continue;
+    }
+    num_children = CpTreeNumChildren(tree, i);
+    name_len = strlen(CPT_NAME(tree, i));
+
+    stats->live_nodes++;
+    stats->total_depth += depth;
+    stats->total_children += num_children;
+    stats->total_name_len += name_len;
+    if (num_children == 0) {
+      stats->leaves++;
+    }
+    if (depth > stats->max_depth) {
+      stats->max_depth = depth;
+    }
+    if (num_children > stats->max_children) {
+      stats->max_children = num_children;
+    }
+    if (name_len > stats->max_name_len) {
+      stats->max_name_len = name_len;
+    }
+    stats->depths[CpTreeStatsBucket(depth)]++;
+    stats->children[CpTreeStatsBucket(num_children)]++;
+    stats->name_lens[CpTreeStatsBucket(name_len)]++;
+  }
+}
+
+int32_t CpTreePreorder(CpTreePtr tree,
+                       CpTreeHandle root,
+                       CpTreeVisitor visit,
+                       void *arg) {
+  uint64_t begin = TraceBegin(TRACE_PREORDER);
+  int32_t res = WalkPreorder(tree, root, visit, arg);
+  TraceEnd(TRACE_PREORDER, begin);
+  return res;
+}
+
+static int32_t WalkPreorder(CpTreePtr tree,
+                            CpTreeHandle root,
+                            CpTreeVisitor visit,
+                            void *arg) {
+  CpTreeHandle node = root;
   int32_t res;
-  while (num_children_unchecked > 0) {
-    LLIterPayload(children_iter, (LinkedListPayload)(&curr_child));
-    res = FindCpt(curr_child, cpt_name, ret);
 
-    if (res == FIND_CPT_SUCCESS) {
-      LLIterFree(children_iter);
-      return FIND_CPT_SUCCESS;
-    } else if (res == FIND_CPT_ERROR) {
-      LLIterFree(children_iter);
-      return FIND_CPT_ERROR;
+  while (true) {
+    if ((res = visit(tree, node, arg)) != CPT_VISIT_CONTINUE) {
+      return res == CPT_VISIT_STOP ? CPT_WALK_STOPPED : res;
     }
-    
-    LLIterAdvance(children_iter);
-    num_children_unchecked--;
+
+    // Children come right after their parent...
+    if (tree->nodes[node].first_child != CPT_NULL_HANDLE) {
+      node = tree->nodes[node].first_child;
+      continue;
+    }
+
+    // ...and once a subtree is done, the walk carries on with the next
+    // sibling of the closest ancestor which has one (but never leaves
+    // the subtree rooted at @root).
+    while (node != root && tree->nodes[node].next_sibling == CPT_NULL_HANDLE) {
+      node = tree->nodes[node].parent;
+    }
+    if (node == root) {
+      return CPT_WALK_DONE;
+    }
+    node = tree->nodes[node].next_sibling;
   }
+}
 
-  LLIterFree(children_iter);
+static CpTreeHandle FirstPostorder(CpTreePtr tree, CpTreeHandle node) {
+  while (tree->nodes[node].first_child != CPT_NULL_HANDLE) {
+    node = tree->nodes[node].first_child;
+  }
+  return node;
+}
 
-  // We checked the current node, and all it's children. The cpt
-  // must not have been created before.
-  return FIND_CPT_ABSENT;
+int32_t CpTreePostorder(CpTreePtr tree,
+                        CpTreeHandle root,
+                        CpTreeVisitor visit,
+                        void *arg) {
+  uint64_t begin = TraceBegin(TRACE_POSTORDER);
+  int32_t res = WalkPostorder(tree, root, visit, arg);
+  TraceEnd(TRACE_POSTORDER, begin);
+  return res;
 }
 
-int32_t FreeCpTreeNode(CpTreeNodePtr curr_node) {
-  if (curr_node == NULL) {
-    return TREE_FREE_OK;
+static int32_t WalkPostorder(CpTreePtr tree,
+                             CpTreeHandle root,
+                             CpTreeVisitor visit,
+                             void *arg) {
+  CpTreeHandle node = FirstPostorder(tree, root);
+  int32_t res;
+
+  while (true) {
+    if ((res = visit(tree, node, arg)) != CPT_VISIT_CONTINUE) {
+      return res == CPT_VISIT_STOP ? CPT_WALK_STOPPED : res;
+    }
+    if (node == root) {
+      return CPT_WALK_DONE;
+    }
+
+    // Once a node is done, so is the subtree rooted at it. Its next
+    // sibling's subtree comes next, and once there are no more siblings,
+    // the parent.
+    if (tree->nodes[node].next_sibling != CPT_NULL_HANDLE) {
+      node = FirstPostorder(tree, tree->nodes[node].next_sibling);
+    } else {
+      node = tree->nodes[node].parent;
+    }
   }
+}
 
-  free(curr_node->cpt_name);
-  if (curr_node->children != NULL) {  // free this nodes children
-    FreeLinkedList(curr_node->children, &FreeCpTreeNode);
+void FreeCpTree(void *tree) {
+  CpTreePtr to_free = (CpTreePtr)tree;
+  if (to_free == NULL) {
+    return;
   }
 
-  free(curr_node);
-  return TREE_FREE_OK;
+  // Every node and name lives in one of these two arrays.
+  CPFree(CP_ALLOC_TREE, to_free->nodes,
+         sizeof(CpTreeNode) * to_free->node_capacity);
+  CPFree(CP_ALLOC_TREE, to_free->names,
+         sizeof(char) * to_free->names_capacity);
+  DropCpTreeTimes(to_free);
+  CPFree(CP_ALLOC_TREE, to_free, sizeof(CpTree));
 }
@@ -6,6 +6,8 @@
 #include "DataStructs/LinkedList.h"
 #include "macros.h"
 
+#include <stdint.h>
+
 #define CREATE_TREE_SUCCESS 0
 
 #define INSERT_NODE_SUCCESS 0
@@ -17,38 +19,135 @@
 
 #define TREE_FREE_OK 0
 
+#define PRUNE_NODE_SUCCESS 0
+#define PRUNE_NODE_ERROR -1
+
+// What a CpTreeVisitor returns to keep walking, or to stop the walk
+// early. Any negative value also stops the walk, and is passed along
+// as an error.
+#define CPT_VISIT_CONTINUE 0
+#define CPT_VISIT_STOP     1
+
+// What a walk returns if every node was visited, or if a visitor
+// stopped it early.
+#define CPT_WALK_DONE    0
+#define CPT_WALK_STOPPED 1
+
+// Number of node slots (and name bytes per slot) to initialize a tree with.
+#define INITIAL_TREE_CAPACITY 8
+#define INITIAL_NAME_BYTES_PER_NODE 16
+
+// A handle is the index of a node in its tree's node array. Handles are
+// only meaningful for the tree they came from, and stay valid for as long
+// as the tree does (the arrays may move when they grow, handles do not).
+typedef uint32_t CpTreeHandle;
+
+// Used in place of a handle when there is no node (e.g. the parent of
+// the root, or the next sibling of the last child).
+#define CPT_NULL_HANDLE ((CpTreeHandle)UINT32_MAX)
+
+// The root is always the first node stored in a tree.
+#define CPT_ROOT_HANDLE ((CpTreeHandle)0)
+
+// A single checkpoint. Rather than holding pointers to its parent and
+// a LinkedList of children, a node only stores the handles of its
+// parent, its first child and its next sibling. The children of a node
+// are found by following next_sibling from first_child.
+//
+// Every node also stores its depth and a jump pointer to one of its
+// ancestors. The jump pointers are chosen so that the ancestors reached
+// by following them are spaced like the digits of a skew binary number,
+// which makes finding the n-th ancestor of a node, or the lowest common
+// ancestor of two nodes, take O(log depth) steps rather than O(depth).
+// A node's jump pointer only depends on its parent's, so it is set on
+// insert, and only changes if one of the node's ancestors is squashed.
+//
+// Pruning a node doesn't move any other node in the array (so handles
+// stay valid). The node is unlinked from the tree and marked as pruned
+// instead, and is left out the next time the tree is written to disk.
+typedef struct cpt_tree_node {
+  // The parent of this node, or CPT_NULL_HANDLE for the root.
+  CpTreeHandle parent;
+  // The most recently inserted child of this node, or CPT_NULL_HANDLE.
+  CpTreeHandle first_child;
+  // The next child of this node's parent, or CPT_NULL_HANDLE.
+  CpTreeHandle next_sibling;
+  // Offset of this checkpoint's (null terminated) name in the names pool.
+  uint32_t name_offset;
+  // The number of steps from the root to this node.
+  uint32_t depth;
+  // An ancestor of this node (the parent, or further up), the root
+  // itself for the root, or CPT_NULL_HANDLE if the node was pruned.
+  CpTreeHandle jump;
+  // When this checkpoint was made (in seconds since the epoch), and the
+  // number of bytes stored for it. Both are 0 if they aren't known.
+  int64_t  time;
+  uint64_t size;
+} CpTreeNode, *CpTreeNodePtr;
+
+// An entry of a tree's time index.
+typedef struct cpt_tree_time {
+  int64_t      time;
+  CpTreeHandle handle;
+} CpTreeTime;
+
 // This struct will maintain the relationship between all the
-// checkpoints known in the current directory. It will have to
+// checkpoints known for a single source file. It will have to
 // be loaded from/written to disk every time an instance
 // of the checkpoint  program is run.
+//
+// Every node of the tree lives in one contiguous array, and every
+// name lives in one contiguous pool of characters, so walking a tree
+// never has to chase pointers from one heap block to the next.
 typedef struct cpt_tree {
-  // A pointer to the parent of this subtree.
-  // The (absolute) root parent should be NULL.
-  struct cpt_tree *parent_node;
-  // A pointer to a string on the heap storing
-  // the name of this checkpoint.
-  char *cpt_name;
-  // A pointer to a llhead struct on the heap. This
-  // Linkedlist is composed of pointers on the heap
-  // to other cpt_tree structs which represent any
-  // checkpoints created after the current cp "cpt_name".
-  LinkedList children;
-} CpTreeNode, *CpTreeNodePtr;
+  // The array of nodes. nodes[CPT_ROOT_HANDLE] is the root.
+  CpTreeNode *nodes;
+  CPSize_t    num_nodes;
+  CPSize_t    node_capacity;
+  // The null terminated names of all nodes, back to back.
+  char       *names;
+  uint32_t    names_len;
+  uint32_t    names_capacity;
+  // Every live node, ordered by when it was made (and then by when it
+  // was added), so the checkpoints made at a given time are found by
+  // binary search. The log stores it, so a tree which was read in has it
+  // already. Otherwise it is NULL until it is first needed. Inserting or
+  // stamping a node keeps it up to date, while pruning or squashing one
+  // drops it.
+  CpTreeTime *by_time;
+  CPSize_t    num_by_time;
+} CpTree, *CpTreePtr;
+
+// A function called on each node of a walk over a tree, along with
+// whatever @arg the walk was given.
+//
+// Returns:
+//
+//  - CPT_VISIT_CONTINUE: to carry on with the walk.
+//
+//  - CPT_VISIT_STOP: to end the walk without visiting any more nodes.
+//
+//  - A negative error code, which ends the walk and is returned by it.
+typedef int32_t (*CpTreeVisitor)(CpTreePtr tree, CpTreeHandle node, void *arg);
+
+// Returns the name of the node @handle in @tree.
+#define CPT_NAME(tree, handle) ((tree)->names + (tree)->nodes[(handle)].name_offset)
 
-// Assigns cpt_name and parent_tree to their corresponding fields
-// (without checking if the addresses are valid) and attempts to
-// allocate a LinkedList on the heap for the children field.
+// Is the node @handle of @tree no longer part of it?
+#define CPT_IS_PRUNED(tree, handle) ((tree)->nodes[(handle)].jump == CPT_NULL_HANDLE)
+
+// Allocates a tree on the heap whose root is a checkpoint named @root_name.
 //
 // Returns:
 //
 //  - MEM_ERR: on a memory error
 //
-//  - CREATE_TREE_SUCCESS: if allocation was successful.
-int32_t CreateCpTreeNode(char *cpt_name,
-                     CpTreeNodePtr parent_node,
-                     CpTreeNodePtr *ret);
+//  - CREATE_TREE_SUCCESS: if allocation was successful, in which case
+//    the new tree is returned through @ret.
+int32_t CreateCpTree(char *root_name, CpTreePtr *ret);
 
-// Inserts a checkpoint  node into the given node.
+// Adds a checkpoint named @cpt_name to @tree as the first child of
+// @parent. The handle of the new node is returned through @ret.
 //
 // Returns:
 //
@@ -56,31 +155,179 @@ int32_t CreateCpTreeNode(char *cpt_name,
 //
 // - INSERT_NODE_SUCCESS: if insert was successfull.
 //
-// - INSERT_NODE_ERROR: if something went wrong.
-int32_t InsertCpTreeNode(CpTreeNodePtr cpt_node, CpTreeNodePtr to_insert);
+// - INSERT_NODE_ERROR: if @parent is not a (live) node of @tree.
+int32_t InsertCpTreeNode(CpTreePtr tree,
+                         CpTreeHandle parent,
+                         char *cpt_name,
+                         CpTreeHandle *ret);
 
 // Attempts to find the checkpoint  with the name @cpt_name
-// in the tree @cpt_tree. If successful, a pointer to the struct
-// containing the same name will be returned through @ret.
-// Returns:
+// in the tree @tree. If successful, the handle of the node
+// with the same name will be returned through @ret.
+// Since every node is stored in the same array, this is a single
+// linear scan over the array rather than a walk of the tree.
+// Pruned nodes are skipped.
 //
-//  - MEM_ERR: if any memory errors occur while searching.
+// Returns:
 //
-//  - FIND_CPT_SUCCESS: if a CpTreeNode was found with a matching cpt_name
+//  - FIND_CPT_SUCCESS: if a node was found with a matching name
 //
-//  - FIND_CPT_ABSENT: if the search determined there is no CpTreeNode
-//                      below (and including) cpt_tre with a matching name.
+//  - FIND_CPT_ABSENT: if there is no node in @tree with a matching name.
 //
 //  - FIND_CPT_ERROR: when a generic error occurs while searching.
-int32_t FindCpt(CpTreeNodePtr cpt_tree, char *cpt_name, CpTreeNodePtr *ret);
+int32_t FindCpt(CpTreePtr tree, char *cpt_name, CpTreeHandle *ret);
+
+// Records that the node @handle of @tree was made at @time (in seconds
+// since the epoch), and that @size bytes are stored for it.
+void SetCpTreeNodeStamp(CpTreePtr tree,
+                        CpTreeHandle handle,
+                        int64_t time,
+                        uint64_t size);
+
+// Finds the newest live node of @tree which was made at or before @time.
+// Takes O(log n), unless @tree has no time index (see CpTree), in which
+// case its nodes are first sorted by time, which takes O(n log n).
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - FIND_CPT_SUCCESS: if there is such a node, whose handle is returned
+//    through @ret.
+//
+//  - FIND_CPT_ABSENT: if every node of @tree was made after @time.
+int32_t FindCptAtTime(CpTreePtr tree, int64_t time, CpTreeHandle *ret);
 
-// Frees a given node and all it's children.
+// Finds the live nodes of @tree which were made from @since to @until
+// (both included). They are @tree->by_time[@*first] up to (but not
+// including) @tree->by_time[@*end], oldest first. Takes O(log n), once
+// the nodes are sorted (see FindCptAtTime).
 //
 // Returns:
 //
-//  - MEM_ERROR: on a memory error
+//  - MEM_ERR: on a memory error.
 //
-//  - TREE_FREE_OK: if all went well
-int32_t FreeCpTreeNode(CpTreeNodePtr curr_node);
+//  - FIND_CPT_SUCCESS: if there are any such nodes.
+//
+//  - FIND_CPT_ABSENT: if there are none (@*first == @*end).
+int32_t FindCptsInTimeRange(CpTreePtr tree,
+                            int64_t since,
+                            int64_t until,
+                            CPSize_t *first,
+                            CPSize_t *end);
+
+// Sets the time index of @tree to the @num handles of @order, which is
+// every live node of @tree, oldest first (as the log stores them). This
+// takes O(n), where sorting the nodes would take O(n log n).
+//
+// Returns:
+//
+//  - MEM_ERR: on a memory error.
+//
+//  - FIND_CPT_ERROR: if @order isn't every live node of @tree, oldest
+//    first. @tree is then left without a time index.
+//
+//  - CREATE_TREE_SUCCESS: otherwise.
+int32_t SetCpTreeTimes(CpTreePtr tree, CpTreeHandle *order, CPSize_t num);
+
+// Returns the ancestor @n steps up from the node @handle (so @handle
+// itself if @n is 0, its parent if @n is 1, ...), or CPT_NULL_HANDLE
+// if the node is less than @n steps from the root. Takes O(log depth).
+CpTreeHandle CpTreeAncestor(CpTreePtr tree, CpTreeHandle handle, uint32_t n);
+
+// Returns the lowest common ancestor of the nodes @a and @b: the
+// deepest node which is an ancestor of (or the same as) both. Takes
+// O(log depth).
+CpTreeHandle CpTreeLCA(CpTreePtr tree, CpTreeHandle a, CpTreeHandle b);
+
+// Removes the subtree rooted at the node @handle from @tree. Takes
+// O(size of the subtree + number of siblings of @handle).
+//
+// Returns:
+//
+//  - PRUNE_NODE_ERROR: if @handle is the root, or not a (live) node of
+//    @tree.
+//
+//  - PRUNE_NODE_SUCCESS: if the subtree was pruned.
+int32_t PruneCpTreeNode(CpTreePtr tree, CpTreeHandle handle);
+
+// Removes only the node @handle from @tree. Its children take its
+// place among the children of its parent, in the same order. Takes
+// O(size of the subtree + number of siblings of @handle), since every
+// node below @handle moves one step closer to the root.
+//
+// Returns:
+//
+//  - PRUNE_NODE_ERROR: if @handle is the root, or not a (live) node of
+//    @tree.
+//
+//  - PRUNE_NODE_SUCCESS: if the node was squashed.
+int32_t SquashCpTreeNode(CpTreePtr tree, CpTreeHandle handle);
+
+// Returns the number of children of the node @handle.
+CPSize_t CpTreeNumChildren(CpTreePtr tree, CpTreeHandle handle);
+
+// The number of buckets of each histogram of CpTreeStats. Bucket 0 counts
+// the nodes whose value is 0, and bucket i > 0 those whose value is from
+// 2^(i-1) up to (but not including) 2^i. The last bucket also counts
+// everything bigger.
+#define CPT_STATS_BUCKETS 24
+
+// The shape of one or more trees (see AddCpTreeStats). Only live nodes
+// are counted, but for num_nodes.
+typedef struct cpt_tree_stats {
+  CPSize_t num_trees;
+  CPSize_t num_nodes;       // # of slots in the node arrays (pruned or not)
+  CPSize_t live_nodes;
+  CPSize_t leaves;
+  uint64_t total_depth;     // of every node
+  uint32_t max_depth;
+  uint64_t total_children;  // of every node
+  CPSize_t max_children;
+  uint64_t total_name_len;
+  CPSize_t max_name_len;
+  // Histograms of the depths, numbers of children and name lengths of
+  // the nodes.
+  CPSize_t depths[CPT_STATS_BUCKETS];
+  CPSize_t children[CPT_STATS_BUCKETS];
+  CPSize_t name_lens[CPT_STATS_BUCKETS];
+} CpTreeStats;
+
+// Returns the bucket of the histograms of CpTreeStats which counts @value.
+CPSize_t CpTreeStatsBucket(uint64_t value);
+
+// Adds the shape of @tree to @stats, which should be zeroed before the
+// first tree is added to it. Takes O(# of nodes).
+void AddCpTreeStats(CpTreePtr tree, CpTreeStats *stats);
+
+// Walks the subtree of @tree rooted at @root, calling @visit on each
+// node. A preorder walk visits a node before its children, a postorder
+// walk after them. Either way, children are visited in the order they
+// are linked in (newest first).
+//
+// Neither walk recurses or keeps a stack: they find their way around
+// using the parent, first_child and next_sibling links of each node, so
+// they take O(n) time and O(1) memory however deep the tree is.
+//
+// Returns:
+//
+//  - CPT_WALK_DONE: if every node was visited.
+//
+//  - CPT_WALK_STOPPED: if @visit stopped the walk early.
+//
+//  - The error returned by @visit, if it returned one.
+int32_t CpTreePreorder(CpTreePtr tree,
+                       CpTreeHandle root,
+                       CpTreeVisitor visit,
+                       void *arg);
+int32_t CpTreePostorder(CpTreePtr tree,
+                        CpTreeHandle root,
+                        CpTreeVisitor visit,
+                        void *arg);
+
+// Frees a given tree and all of its nodes. Safe to pass NULL.
+// The signature matches ValueFreeFnPtr so trees can be stored
+// directly as HashTable values.
+void FreeCpTree(void *tree);
 
 #endif  // _CHECKPOINT_TREE_H_
@@ -17,9 +17,11 @@
 
 // ********************************
 // TAKE CARE THAT THE DIRS MATCH
-// IN THE NEXT TWO MACROS
+// IN THE NEXT FOUR MACROS
 #define WORKING_DIR "./.cpt_"
 #define CP_LOG_FILE "./.cpt_/CpLog"
+#define LINE_MAP_DIR "./.cpt_/.blame"
+#define INDEX_DIR "./.cpt_/.trigram"
 // ********************************
 
 // Number of times to try again on an out-of-mem err